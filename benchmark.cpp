@@ -0,0 +1,1273 @@
+#include "robot_diagrams_0.0.hpp"
+#include "counting_new.hpp"
+#include "deflate.hpp"
+#include "mapped_file.hpp"
+#include "raster.hpp"
+#include "robot_chain.hpp"
+#include "robot_ik.hpp"
+#include "robot_kinematics.hpp"
+#include "robot_loops.hpp"
+#include "robot_parser.hpp"
+#include "robot_tree.hpp"
+#include "robot_workspace.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <new>
+
+#include <glob.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+// Micro-benchmarks for the diagram pipeline.
+//
+// Usage: ./benchmark [section ...] [--json <file>] [--baseline <file>] [--tolerance <percent>]
+// With no sections every section is run.  The 'suite' section (make bench)
+// times each stage of the pipeline on synthetic robots of 10 to 1000000
+// elements; --json saves its results, and --baseline compares them with
+// results saved earlier, failing if any stage got more than --tolerance
+// (20 by default) percent slower or allocates more.
+
+double now_seconds()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Keeps the optimizer from discarding benchmark results.
+volatile size_t g_sink = 0;
+
+// The original simple_svg serializers, which built a std::stringstream for
+// every attribute (and for every color, stroke and font); kept here as the
+// baseline for the 'svg' section.
+namespace legacy
+{
+
+std::string color(int r, int g, int b)
+{
+  std::stringstream ss;
+  ss << "rgb(" << r << "," << g << "," << b << ")";
+  return ss.str();
+}
+
+std::string fill(const std::string& color)
+{
+  std::stringstream ss;
+  ss << svg::attribute("fill", color);
+  return ss.str();
+}
+
+std::string stroke(double width, const std::string& color)
+{
+  std::stringstream ss;
+  ss << svg::attribute("stroke-width", width) << svg::attribute("stroke", color);
+  return ss.str();
+}
+
+std::string font(double size, const std::string& family)
+{
+  std::stringstream ss;
+  ss << svg::attribute("font-size", size) << svg::attribute("font-family", family);
+  return ss.str();
+}
+
+std::string line(const Point& a, const Point& b, const Layout& layout)
+{
+  std::stringstream ss;
+  ss << svg::elemStart("line") << svg::attribute("x1", translateX(a.x, layout))
+     << svg::attribute("y1", translateY(a.y, layout))
+     << svg::attribute("x2", translateX(b.x, layout))
+     << svg::attribute("y2", translateY(b.y, layout))
+     << stroke(0.5, color(0, 0, 0)) << svg::emptyElemEnd();
+  return ss.str();
+}
+
+std::string circle(const Point& c, double radius, const Layout& layout)
+{
+  std::stringstream ss;
+  ss << svg::elemStart("circle") << svg::attribute("cx", translateX(c.x, layout))
+     << svg::attribute("cy", translateY(c.y, layout))
+     << svg::attribute("r", translateScale(radius, layout)) << fill("none")
+     << stroke(0.5, color(0, 0, 0)) << svg::emptyElemEnd();
+  return ss.str();
+}
+
+std::string arc(const Point& center, double start_angle, double end_angle, double radius, const Layout& layout)
+{
+  std::stringstream path;
+  double scale_radius = translateScale(radius, layout);
+  Point arc_start(center.x + scale_radius * cos(start_angle),
+                  center.y + scale_radius * sin(start_angle));
+  Point arc_end(center.x + scale_radius * cos(end_angle),
+                center.y + scale_radius * sin(end_angle));
+  bool large_angle = (end_angle - start_angle) > M_PI;
+  bool sweep = (end_angle - start_angle) > 0;
+  path << "M" << translateX(arc_start.x, layout) << "," <<
+                 translateY(arc_start.y, layout) << " " <<
+                 "A" << scale_radius << "," << scale_radius << " 0 " <<
+                 (large_angle ? "1" : "0") << "," <<
+                 (sweep ? "0" : "1") << " " <<
+                 translateX(arc_end.x, layout) << "," <<
+                 translateY(arc_end.y, layout);
+  std::stringstream ss;
+  ss << svg::elemStart("path") << svg::attribute("d", path.str())
+     << fill("none") << stroke(0.5, color(0, 0, 0)) << svg::emptyElemEnd();
+  return ss.str();
+}
+
+// generate_robots' original line parser: a stringstream split into a vector
+// of strings per line, strtod, and a separate 'new' per element.  Only the
+// element types bench_parse generates are handled.
+bool parse_line(rob_diag::Robot& robot, const std::string& line)
+{
+  std::stringstream ss(line);
+  std::istream_iterator<std::string> begin(ss);
+  std::istream_iterator<std::string> end;
+  std::vector<std::string> words(begin, end);
+  if (words.empty())
+    return false;
+  double value = words.size() > 1 ? std::strtod(words[1].c_str(), NULL) : 0;
+  if (words[0] == "base")
+    robot.elements_.push_back(new rob_diag::Base());
+  else if (words[0] == "rjoint")
+    robot.elements_.push_back(words.size() == 3 ? new rob_diag::RJoint(value, 4, words[2]) : new rob_diag::RJoint(value));
+  else if (words[0] == "link")
+    robot.elements_.push_back(words.size() == 3 ? new rob_diag::Link(value, words[2]) : new rob_diag::Link(value));
+  else if (words[0] == "frames")
+    robot.elements_.push_back(new rob_diag::Frames());
+  else if (words[0] == "vector")
+    robot.elements_.push_back(new rob_diag::Vector(value));
+  else if (words[0] == "point")
+    robot.elements_.push_back(new rob_diag::RobPoint());
+  else if (words[0] == "pjoint")
+    robot.elements_.push_back(new rob_diag::PJoint());
+  else if (words[0] == "effector")
+    robot.elements_.push_back(new rob_diag::EndEffector());
+  else
+    return false;
+  return true;
+}
+
+std::string text(const Point& origin, const std::string& content, const Layout& layout)
+{
+  std::stringstream ss;
+  ss << svg::elemStart("text") << svg::attribute("x", translateX(origin.x, layout))
+     << svg::attribute("y", translateY(origin.y, layout))
+     << fill(color(0, 0, 0)) << font(12, "Verdana")
+     << ">" << content << svg::elemEnd("text");
+  return ss.str();
+}
+
+}
+
+// Points spread over a typical diagram, with "ugly" coordinates like the
+// ones measure() produces.
+Point bench_point(int i)
+{
+  return Point(10.0 + (i % 997) * 0.7071067811865476, 12.5 + (i % 991) * 1.3090169943749474);
+}
+
+void report(const char* name, int count, double legacy_time, double new_time)
+{
+  std::printf("%-8s %9.1f ns/shape (stringstream) %9.1f ns/shape (Writer) %6.2fx\n",
+              name, legacy_time * 1e9 / count, new_time * 1e9 / count, legacy_time / new_time);
+}
+
+// Serializes the shapes RobotElement::draw emits, with the old per-attribute
+// stringstream code and with the Writer, into a document body.
+void bench_svg()
+{
+  const int count = 200000;
+  Layout layout(Dimensions(800, 600), Layout::BottomLeft);
+  Stroke stroke(0.5, Color::Black);
+  Fill fill(Color::Transparent);
+  Fill text_fill(Color::Black);
+
+  std::printf("== svg: %d shapes each\n", count);
+
+  // Line
+  {
+    double start = now_seconds();
+    std::string body;
+    for (int i = 0; i < count; ++i)
+      body += legacy::line(bench_point(i), bench_point(i + 1), layout);
+    double legacy_time = now_seconds() - start;
+    g_sink += body.size();
+
+    start = now_seconds();
+    svg::Writer out;
+    for (int i = 0; i < count; ++i)
+      Line(bench_point(i), bench_point(i + 1), stroke).write(out, layout);
+    double new_time = now_seconds() - start;
+    g_sink += out.size();
+    report("Line", count, legacy_time, new_time);
+  }
+
+  // Circle
+  {
+    double start = now_seconds();
+    std::string body;
+    for (int i = 0; i < count; ++i)
+      body += legacy::circle(bench_point(i), 4, layout);
+    double legacy_time = now_seconds() - start;
+    g_sink += body.size();
+
+    start = now_seconds();
+    svg::Writer out;
+    for (int i = 0; i < count; ++i)
+      Circle(bench_point(i), 8, fill, stroke).write(out, layout);
+    double new_time = now_seconds() - start;
+    g_sink += out.size();
+    report("Circle", count, legacy_time, new_time);
+  }
+
+  // Arc
+  {
+    double start = now_seconds();
+    std::string body;
+    for (int i = 0; i < count; ++i)
+      body += legacy::arc(bench_point(i), 0.1 * (i % 7), 0.35 * (i % 5), 8, layout);
+    double legacy_time = now_seconds() - start;
+    g_sink += body.size();
+
+    start = now_seconds();
+    svg::Writer out;
+    for (int i = 0; i < count; ++i)
+      Arc(bench_point(i), 0.1 * (i % 7), 0.35 * (i % 5), 8, stroke).write(out, layout);
+    double new_time = now_seconds() - start;
+    g_sink += out.size();
+    report("Arc", count, legacy_time, new_time);
+  }
+
+  // Text
+  {
+    std::string label("theta_1");
+    double start = now_seconds();
+    std::string body;
+    for (int i = 0; i < count; ++i)
+      body += legacy::text(bench_point(i), label, layout);
+    double legacy_time = now_seconds() - start;
+    g_sink += body.size();
+
+    start = now_seconds();
+    svg::Writer out;
+    for (int i = 0; i < count; ++i)
+      Text(bench_point(i), label, text_fill).write(out, layout);
+    double new_time = now_seconds() - start;
+    g_sink += out.size();
+    report("Text", count, legacy_time, new_time);
+  }
+}
+
+// A long chain mixing every element type.
+void build_chain(rob_diag::Robot& robot, int count)
+{
+  for (int i = 0; i < count; ++i)
+  {
+    switch (i % 8)
+    {
+      case 0: robot.elements_.push_back(new rob_diag::Base()); break;
+      case 1: robot.elements_.push_back(new rob_diag::RJoint(0.1 * (i % 13), 4, i % 3 ? "" : "q")); break;
+      case 2: robot.elements_.push_back(new rob_diag::Link(20 + i % 7)); break;
+      case 3: robot.elements_.push_back(new rob_diag::Frames()); break;
+      case 4: robot.elements_.push_back(new rob_diag::PJoint()); break;
+      case 5: robot.elements_.push_back(new rob_diag::Vector(15, "v")); break;
+      case 6: robot.elements_.push_back(new rob_diag::RobPoint()); break;
+      case 7: robot.elements_.push_back(new rob_diag::EndEffector()); break;
+    }
+  }
+}
+
+// Measures a long chain through the virtual RobotElement interface and
+// through FlatChain.
+void bench_chain()
+{
+  const int count = 100000;
+  const int reps = 20;
+  rob_diag::Robot robot;
+  build_chain(robot, count);
+  rob_diag::FlatChain chain;
+  chain.assign(robot);
+
+  std::printf("== chain: %d elements, %d measure passes each\n", count, reps);
+  double start = now_seconds();
+  rob_diag::Rect bounds;
+  for (int r = 0; r < reps; ++r)
+    bounds = robot.compute_dimensions();
+  double robot_time = now_seconds() - start;
+  g_sink += (size_t)bounds.right_;
+
+  start = now_seconds();
+  rob_diag::Rect flat_bounds;
+  for (int r = 0; r < reps; ++r)
+    flat_bounds = chain.compute_dimensions();
+  double flat_time = now_seconds() - start;
+  g_sink += (size_t)flat_bounds.right_;
+
+  std::printf("measure  %9.1f ns/element (Robot) %9.1f ns/element (FlatChain) %6.2fx%s\n",
+              robot_time * 1e9 / count / reps, flat_time * 1e9 / count / reps,
+              robot_time / flat_time,
+              bounds.left_ == flat_bounds.left_ && bounds.top_ == flat_bounds.top_ ? "" : " (MISMATCH)");
+
+  for (size_t i = 0; i < robot.elements_.size(); ++i)
+    delete robot.elements_[i];
+}
+
+// A gripper-like tree: a short arm with 'branches' long fingers hanging off
+// its end.
+void build_tree(rob_diag::Robot& robot, int branches, int branch_length)
+{
+  robot.elements_.push_back(new rob_diag::Base());
+  robot.elements_.push_back(new rob_diag::RJoint(0.5));
+  robot.elements_.push_back(new rob_diag::Link(100));
+  size_t palm = robot.elements_.size() - 1;
+  for (int b = 0; b < branches; ++b)
+  {
+    robot.attach(new rob_diag::RJoint(-0.8 + 1.6 * b / branches), palm);
+    build_chain(robot, branch_length - 1);
+  }
+}
+
+// Measures and draws a big tree on one thread and on a pool with a worker
+// per CPU (parallel_compute_dimensions and parallel_draw_at).
+void bench_tree()
+{
+  const int branches = 32;
+  const int branch_length = 8192;
+  const int reps = 5;
+  rob_diag::Robot robot;
+  build_tree(robot, branches, branch_length);
+  rob_diag::WorkPool pool(sysconf(_SC_NPROCESSORS_ONLN));
+  std::printf("== tree: %d branches of %d elements, %u workers\n", branches, branch_length, pool.size());
+
+  double start = now_seconds();
+  rob_diag::Rect bounds;
+  for (int r = 0; r < reps; ++r)
+    bounds = robot.compute_dimensions();
+  double serial_time = (now_seconds() - start) / reps;
+  start = now_seconds();
+  rob_diag::Rect parallel_bounds;
+  for (int r = 0; r < reps; ++r)
+    parallel_bounds = rob_diag::parallel_compute_dimensions(robot, &pool);
+  double parallel_time = (now_seconds() - start) / reps;
+  std::printf("measure  %9.2f ms (serial) %9.2f ms (pool) %6.2fx%s\n", serial_time * 1e3, parallel_time * 1e3,
+              serial_time / parallel_time,
+              bounds.left_ == parallel_bounds.left_ && bounds.top_ == parallel_bounds.top_ ? "" : " (MISMATCH)");
+
+  svg::Dimensions size(bounds.right_ - bounds.left_ + 20, bounds.top_ - bounds.bottom_ + 20);
+  rob_diag::Pose origin(10 - bounds.left_, 10 - bounds.bottom_, 0);
+  std::string serial, parallel;
+  start = now_seconds();
+  for (int r = 0; r < reps; ++r)
+  {
+    Document doc("", svg::Layout(size, svg::Layout::BottomLeft));
+    robot.draw_at(doc, origin);
+    serial = doc.toString();
+  }
+  serial_time = (now_seconds() - start) / reps;
+  start = now_seconds();
+  for (int r = 0; r < reps; ++r)
+  {
+    Document doc("", svg::Layout(size, svg::Layout::BottomLeft));
+    rob_diag::parallel_draw_at(robot, doc, origin, &pool);
+    parallel = doc.toString();
+  }
+  parallel_time = (now_seconds() - start) / reps;
+  std::printf("draw     %9.2f ms (serial) %9.2f ms (pool) %6.2fx%s\n", serial_time * 1e3, parallel_time * 1e3,
+              serial_time / parallel_time, serial == parallel ? "" : " (MISMATCH)");
+
+  for (size_t i = 0; i < robot.elements_.size(); ++i)
+    delete robot.elements_[i];
+}
+
+// Closes the loop of a four-bar linkage for every frame of a full turn of
+// its crank, starting each frame from the last frame's solution (as
+// generate_robots --trajectory does) and from the same guess every time.
+void bench_loops()
+{
+  const int frames = 20000;
+  rob_diag::Robot robot;
+  rob_diag::RJoint* crank = new rob_diag::RJoint(1.2);
+  rob_diag::RJoint* coupler = new rob_diag::RJoint(-0.8);
+  rob_diag::RJoint* rocker = new rob_diag::RJoint(1.6);
+  coupler->passive_ = true;
+  rocker->passive_ = true;
+  robot.elements_.push_back(crank);
+  robot.elements_.push_back(new rob_diag::Link(40));
+  robot.elements_.push_back(coupler);
+  robot.elements_.push_back(new rob_diag::Link(100));
+  robot.attach(new rob_diag::Link(80), rob_diag::RobotElement::origin);
+  robot.elements_.push_back(rocker);
+  robot.elements_.push_back(new rob_diag::Link(70));
+  robot.closures_.push_back(rob_diag::LoopClosure(3, 6));
+  rob_diag::LoopSolver solver;
+  solver.assign(robot);
+  std::vector<double> guess;
+  solver.get_values(robot, guess);
+  std::printf("== loops: four-bar linkage, %d frames\n", frames);
+
+  for (int warm = 1; warm >= 0; --warm)
+  {
+    solver.set_values(robot, guess);
+    long iterations = 0;
+    int open = 0;
+    double worst = 0;
+    double start = now_seconds();
+    for (int f = 0; f < frames; ++f)
+    {
+      crank->set_theta(1.2 + 2 * M_PI * f / frames);
+      if (!warm)
+        solver.set_values(robot, guess);
+      if (!solver.solve(robot))
+        ++open;
+      iterations += solver.iterations();
+      worst = std::max(worst, solver.residual());
+    }
+    double time = now_seconds() - start;
+    std::printf("%s  %9.2f us/frame %6.2f steps/frame, %d open, worst miss %.2g\n", warm ? "warm" : "cold",
+                time / frames * 1e6, (double)iterations / frames, open, worst);
+  }
+
+  for (size_t i = 0; i < robot.elements_.size(); ++i)
+    delete robot.elements_[i];
+}
+
+// Solves a 3R arm and a 7R arm for a grid of target poses (taken row by
+// row, alternating direction) with IkSolver::solve_batch: the 3R arm in
+// closed form and by iteration, and each by iteration from the same start
+// every time rather than from the last answer.
+void bench_ik()
+{
+  const int side = 100;
+  std::vector<rob_diag::Pose> poses;
+  for (int row = 0; row < side; ++row)
+    for (int column = 0; column < side; ++column)
+    {
+      int x = row % 2 == 0 ? column : side - 1 - column;
+      poses.push_back(rob_diag::Pose(-90 + 180.0 * x / side, 10 + 80.0 * row / side, M_PI / 2));
+    }
+  std::printf("== ik: %d target poses\n", (int)poses.size());
+
+  for (int joints = 3; joints <= 7; joints += 4)
+  {
+    rob_diag::Robot robot;
+    for (int j = 0; j < joints; ++j)
+    {
+      robot.elements_.push_back(new rob_diag::RJoint(0.3));
+      robot.elements_.push_back(new rob_diag::Link(j + 1 < joints ? 180.0 / joints : 15));
+    }
+    robot.targets_.push_back(rob_diag::PoseTarget(robot.elements_.size() - 1, 0, 0, 0, true));
+    for (int mode = 0; mode < 3; ++mode)
+    {
+      // 0: closed form (3R only), 1: iteration, warm, 2: iteration, cold.
+      if (mode == 0 && joints != 3)
+        continue;
+      rob_diag::IkSolver solver;
+      solver.assign(robot);
+      solver.closed_form_ = mode == 0;
+      std::vector<double> start(joints, 0.3), values;
+      std::vector<bool> reached;
+      solver.set_values(robot, start);
+      size_t count = 0;
+      double begin = now_seconds();
+      if (mode < 2)
+        count = solver.solve_batch(robot, poses, values, reached);
+      else
+      {
+        std::vector<rob_diag::Pose> one(1, rob_diag::Pose(0, 0, 0));
+        for (size_t k = 0; k < poses.size(); ++k)
+        {
+          solver.set_values(robot, start);
+          one[0] = poses[k];
+          count += solver.solve_batch(robot, one, values, reached);
+        }
+      }
+      double time = now_seconds() - begin;
+      std::printf("%dR %-6s %8.2f us/pose, %zu/%zu reached\n", joints,
+                  mode == 0 ? "closed" : mode == 1 ? "warm" : "cold", time / poses.size() * 1e6, count,
+                  poses.size());
+    }
+    for (size_t i = 0; i < robot.elements_.size(); ++i)
+      delete robot.elements_[i];
+  }
+}
+
+// Forward kinematics of a 6 joint arm for many configurations: one at a
+// time through Robot::compute_dimensions, and batched through Kinematics in
+// double and float precision.
+void bench_fk()
+{
+  rob_diag::Robot robot;
+  robot.elements_.push_back(new rob_diag::Base());
+  for (int i = 0; i < 3; ++i)
+  {
+    robot.elements_.push_back(new rob_diag::RJoint(0.3));
+    robot.elements_.push_back(new rob_diag::Frames());
+    robot.elements_.push_back(new rob_diag::Link(100 - 20 * i));
+  }
+  robot.elements_.push_back(new rob_diag::EndEffector());
+  rob_diag::Kinematics kinematics(robot);
+  const size_t num_joints = kinematics.num_joints();
+  const size_t count = 1000000;
+  const size_t scalar_count = 20000;
+
+  std::vector<double> joints(count * num_joints);
+  std::vector<float> joints_f(count * num_joints);
+  for (size_t i = 0; i < joints.size(); ++i)
+  {
+    joints[i] = (i % num_joints) % 2 == 0 ? std::sin(i * 0.001) * 3 : 50 + (i % 37);
+    joints_f[i] = (float)joints[i];
+  }
+  std::vector<rob_diag::Pose> ends(count, rob_diag::Pose(0,0,0));
+  std::vector<rob_diag::Pose> ends_f(count, rob_diag::Pose(0,0,0));
+
+  std::printf("== fk: %d joints, %d elements\n", (int)num_joints, (int)robot.elements_.size());
+  double start = now_seconds();
+  for (size_t m = 0; m < scalar_count; ++m)
+  {
+    for (size_t j = 0; j < num_joints; ++j)
+    {
+      const rob_diag::Kinematics::Joint& joint = kinematics.joints()[j];
+      rob_diag::RobotElement* element = robot.elements_[joint.element_];
+      if (joint.type_ == rob_diag::RJointType)
+        ((rob_diag::RJoint*)element)->set_theta(joints[m * num_joints + j]);
+      else
+        ((rob_diag::Link*)element)->set_length(joints[m * num_joints + j]);
+    }
+    robot.update_dimensions();
+    g_sink += (size_t)robot.end_pose().x_;
+  }
+  double scalar_time = (now_seconds() - start) / scalar_count;
+
+  start = now_seconds();
+  kinematics.forward(&joints[0], count, &ends[0]);
+  double batch_time = (now_seconds() - start) / count;
+
+  start = now_seconds();
+  kinematics.forward(&joints_f[0], count, &ends_f[0]);
+  double float_time = (now_seconds() - start) / count;
+
+  double max_error = 0;
+  for (size_t m = 0; m < count; ++m)
+    max_error = std::max(max_error, std::max(std::fabs(ends[m].x_ - ends_f[m].x_), std::fabs(ends[m].y_ - ends_f[m].y_)));
+
+  std::printf("measure  %9.1f ns/config\n", scalar_time * 1e9);
+  std::printf("double   %9.1f ns/config %6.2fx\n", batch_time * 1e9, scalar_time / batch_time);
+  std::printf("float    %9.1f ns/config %6.2fx (max position error %.3g px)\n",
+              float_time * 1e9, scalar_time / float_time, max_error);
+
+  for (size_t i = 0; i < robot.elements_.size(); ++i)
+    delete robot.elements_[i];
+}
+
+// Parses a generated multi-megabyte .robot file with the original
+// line-by-line parser and with RobotParser.
+void bench_parse()
+{
+  std::string text;
+  char line[64];
+  const int count = 400000;
+  text += "base\n";
+  for (int i = 0; i < count; ++i)
+  {
+    switch (i % 6)
+    {
+      case 0: std::snprintf(line, sizeof(line), "rjoint %.6g q%d\n", 0.001 * (i % 997), i % 100); break;
+      case 1: std::snprintf(line, sizeof(line), "link %.6g\n", 10 + 0.37 * (i % 31)); break;
+      case 2: std::snprintf(line, sizeof(line), "rjoint %.6g\n", -0.002 * (i % 991)); break;
+      case 3: std::snprintf(line, sizeof(line), "link %.6g L%d\n", 5 + 0.11 * (i % 17), i % 10); break;
+      case 4: std::snprintf(line, sizeof(line), "frames\n"); break;
+      case 5: std::snprintf(line, sizeof(line), "vector %.6g\n", 3.5 + (i % 7)); break;
+    }
+    text += line;
+  }
+  text += "effector\n";
+  const int reps = 5;
+
+  std::printf("== parse: %d lines, %.1f MB\n", count + 2, text.size() / 1e6);
+  double start = now_seconds();
+  for (int r = 0; r < reps; ++r)
+  {
+    rob_diag::Robot robot;
+    std::istringstream in(text);
+    std::string line;
+    while (getline(in, line))
+      legacy::parse_line(robot, line);
+    g_sink += robot.elements_.size();
+    for (size_t i = 0; i < robot.elements_.size(); ++i)
+      delete robot.elements_[i];
+  }
+  double legacy_time = (now_seconds() - start) / reps;
+
+  // One arena and robot across repetitions, as generate_robots reuses them
+  // across files.
+  rob_diag::Robot robot;
+  rob_diag::Arena arena;
+  std::ostringstream err;
+  start = now_seconds();
+  bool good = true;
+  for (int r = 0; r < reps; ++r)
+  {
+    rob_diag::DiagramOptions options;
+    rob_diag::RobotParser parser("bench.robot", err);
+    good = parser.parse(text.data(), text.size(), robot, arena, options) && good;
+    g_sink += robot.elements_.size();
+    robot.elements_.clear();
+    arena.reset();
+  }
+  double parser_time = (now_seconds() - start) / reps;
+
+  std::printf("parse    %9.1f MB/s (split + strtod) %9.1f MB/s (RobotParser) %6.2fx%s\n",
+              text.size() / legacy_time / 1e6, text.size() / parser_time / 1e6,
+              legacy_time / parser_time, good ? "" : " (PARSE ERROR)");
+}
+
+// Counts the bytes and lines (one per element) written through it.
+class CountingSink : public svg::Sink
+{
+public:
+  CountingSink() : size_(0), lines_(0) {}
+  bool write(const char* data, size_t size)
+  {
+    size_ += size;
+    lines_ += std::count(data, data + size, '\n');
+    return true;
+  }
+  size_t size_, lines_;
+};
+
+// Draws a long chain 'reps' times, either with every element in full
+// (Robot::draw_at) or with shared glyphs (Robot::draw_symbols_at), and with
+// or without line batching.  Returns the time per document.
+double time_chain_svg(rob_diag::Robot& robot, int reps, bool symbols, bool paths, CountingSink& sink)
+{
+  rob_diag::Rect bounds = robot.compute_dimensions();
+  Layout layout(Dimensions(bounds.right_ - bounds.left_ + 20, bounds.top_ - bounds.bottom_ + 20),
+                Layout::BottomLeft);
+  rob_diag::Pose origin(-bounds.left_ + 10, -bounds.bottom_ + 10, 0);
+  double start = now_seconds();
+  for (int r = 0; r < reps; ++r)
+  {
+    sink = CountingSink();
+    Document doc(sink, layout);
+    doc.setLineBatching(paths);
+    if (symbols)
+      robot.draw_symbols_at(doc, origin);
+    else
+      robot.draw_at(doc, origin);
+    doc.save();
+  }
+  return (now_seconds() - start) / reps;
+}
+
+void report_svg(const char* name, const CountingSink& base, double base_time, const CountingSink& sink,
+                double time)
+{
+  std::printf("%-12s %9.1f KB %7lu elements %7.2f ms   %5.2fx smaller %5.2fx fewer %5.2fx faster\n",
+              name, sink.size_ / 1024.0, (unsigned long)sink.lines_, time * 1e3,
+              (double)base.size_ / sink.size_, (double)base.lines_ / sink.lines_, base_time / time);
+}
+
+// Output size, element count and serialization time of a long chain with
+// shared glyphs (--symbols) and batched lines (--paths), against drawing
+// every element in full.
+void bench_output(bool symbols, bool paths)
+{
+  const int count = 20000;
+  const int reps = 10;
+  rob_diag::Robot robot;
+  build_chain(robot, count);
+
+  std::printf("== %s: %d elements, %d documents each\n", symbols ? "symbols" : "paths", count, reps);
+  CountingSink base, sink;
+  double base_time = time_chain_svg(robot, reps, false, false, base);
+  report_svg("draw_at", base, base_time, base, base_time);
+  if (symbols)
+  {
+    double time = time_chain_svg(robot, reps, true, false, sink);
+    report_svg("symbols", base, base_time, sink, time);
+  }
+  if (paths)
+  {
+    double time = time_chain_svg(robot, reps, false, true, sink);
+    report_svg("paths", base, base_time, sink, time);
+  }
+  double time = time_chain_svg(robot, reps, true, true, sink);
+  report_svg("both", base, base_time, sink, time);
+
+  for (size_t i = 0; i < robot.elements_.size(); ++i)
+    delete robot.elements_[i];
+}
+
+// Counts the bytes written through it on their way to another sink.
+class CountingFilter : public svg::Sink
+{
+public:
+  CountingFilter(svg::Sink& next) : next_(next), size_(0) {}
+  bool write(const char* data, size_t size)
+  {
+    size_ += size;
+    return next_.write(data, size);
+  }
+  svg::Sink& next_;
+  size_t size_;
+};
+
+// Writing a long chain to a file as plain SVG and gzipped at a few levels
+// (--svgz): time per document, throughput in SVG bytes, and bytes written.
+void bench_svgz()
+{
+  const int count = 20000;
+  const int reps = 5;
+  rob_diag::Robot robot;
+  build_chain(robot, count);
+  rob_diag::Rect bounds = robot.compute_dimensions();
+  Layout layout(Dimensions(bounds.right_ - bounds.left_ + 20, bounds.top_ - bounds.bottom_ + 20),
+                Layout::BottomLeft);
+  rob_diag::Pose origin(-bounds.left_ + 10, -bounds.bottom_ + 10, 0);
+  char path[] = "/tmp/benchmark_svgz_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0)
+  {
+    std::printf("== svgz: unable to create a temporary file\n");
+    return;
+  }
+  close(fd);
+
+  std::printf("== svgz: %d elements, %d documents each, written to %s\n", count, reps, path);
+  const int levels[] = { -1, 0, 1, 6, 9 };
+  double plain_time = 0;
+  for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); ++l)
+  {
+    size_t svg_size = 0, written = 0;
+    double start = now_seconds();
+    for (int r = 0; r < reps; ++r)
+    {
+      svg::FileSink file(path);
+      CountingFilter to_file(file);
+      rob_diag::GzipSink* gzip = levels[l] >= 0 ? new rob_diag::GzipSink(to_file, levels[l]) : NULL;
+      CountingFilter svg(gzip ? (svg::Sink&)*gzip : to_file);
+      Document doc(svg, layout);
+      robot.draw_at(doc, origin);
+      doc.save();
+      if (gzip)
+        gzip->finish();
+      delete gzip;
+      svg_size = svg.size_;
+      written = to_file.size_;
+    }
+    double time = (now_seconds() - start) / reps;
+    if (levels[l] < 0)
+      plain_time = time;
+    char name[16];
+    std::snprintf(name, sizeof(name), levels[l] < 0 ? "svg" : "svgz -%d", levels[l]);
+    std::printf("%-10s %8.2f ms %7.1f MB/s %9.1f KB written %6.2fx smaller %6.2fx the time\n", name,
+                time * 1e3, svg_size / time / 1e6, written / 1024.0, (double)svg_size / written,
+                time / plain_time);
+  }
+  unlink(path);
+
+  for (size_t i = 0; i < robot.elements_.size(); ++i)
+    delete robot.elements_[i];
+}
+
+// A diagram from robots/, as generate_robots loads it.
+struct Diagram
+{
+  rob_diag::Robot robot_;
+  rob_diag::Arena arena_;
+  rob_diag::Workspace workspace_;
+  bool has_workspace_;
+};
+
+// Parses robots/*.robot (and computes their workspaces), skipping any that
+// don't parse.
+std::vector<Diagram*> load_diagrams()
+{
+  glob_t found;
+  std::vector<Diagram*> diagrams;
+  if (glob("robots/*.robot", 0, NULL, &found) == 0)
+  {
+    for (size_t i = 0; i < found.gl_pathc; ++i)
+    {
+      rob_diag::MappedFile file;
+      std::ostringstream err;
+      rob_diag::DiagramOptions options;
+      Diagram* diagram = new Diagram;
+      rob_diag::RobotParser parser(found.gl_pathv[i], err);
+      if (!file.open(found.gl_pathv[i]) ||
+          !parser.parse(file.data(), file.size(), diagram->robot_, diagram->arena_, options))
+      {
+        diagram->robot_.elements_.clear();
+        delete diagram;
+        continue;
+      }
+      diagram->has_workspace_ = options.workspace_samples_ > 0;
+      if (diagram->has_workspace_)
+        diagram->workspace_.compute(diagram->robot_, options.workspace_samples_, options.workspace_cell_);
+      diagrams.push_back(diagram);
+    }
+    globfree(&found);
+  }
+  return diagrams;
+}
+
+void delete_diagrams(std::vector<Diagram*>& diagrams)
+{
+  // The arenas destroy the elements.
+  for (size_t i = 0; i < diagrams.size(); ++i)
+  {
+    diagrams[i]->robot_.elements_.clear();
+    delete diagrams[i];
+  }
+  diagrams.clear();
+}
+
+// Total output size of the diagrams in robots/*.robot (drawn as
+// generate_robots draws them) with each combination of the drawing options
+// that change it, against the default output.
+void bench_size()
+{
+  std::vector<Diagram*> diagrams = load_diagrams();
+
+  std::printf("== size: %lu diagrams in robots/\n", (unsigned long)diagrams.size());
+  if (diagrams.empty())
+    return;
+  struct Setting
+  {
+    const char* name_;
+    int decimals_;
+    bool relative_, symbols_, paths_;
+  };
+  const Setting settings[] = {
+    { "default", -1, false, false, false },
+    { "precision 0.01", 2, false, false, false },
+    { "relative 0.01", 2, true, false, false },
+    { "paths", -1, false, false, true },
+    { "paths 0.01", 2, false, false, true },
+    { "paths rel 0.01", 2, true, false, true },
+    { "all 0.01", 2, true, true, true },
+  };
+  size_t base = 0;
+  for (size_t s = 0; s < sizeof(settings) / sizeof(settings[0]); ++s)
+  {
+    CountingSink sink;
+    for (size_t i = 0; i < diagrams.size(); ++i)
+    {
+      rob_diag::Robot& robot = diagrams[i]->robot_;
+      rob_diag::Rect bounds = robot.compute_dimensions();
+      Layout layout(Dimensions(bounds.right_ - bounds.left_ + 20, bounds.top_ - bounds.bottom_ + 20),
+                    Layout::BottomLeft);
+      rob_diag::Pose origin(-bounds.left_ + 10, -bounds.bottom_ + 10, 0);
+      Document doc(sink, layout);
+      doc.setLineBatching(settings[s].paths_);
+      doc.setPrecision(settings[s].decimals_);
+      doc.setRelativePaths(settings[s].relative_);
+      if (diagrams[i]->has_workspace_)
+        diagrams[i]->workspace_.draw_at(doc, origin);
+      if (settings[s].symbols_)
+        robot.draw_symbols_at(doc, origin);
+      else
+        robot.draw_at(doc, origin);
+      doc.save();
+    }
+    if (s == 0)
+      base = sink.size_;
+    std::printf("%-16s %9lu bytes %5.2fx smaller\n", settings[s].name_, (unsigned long)sink.size_,
+                (double)base / sink.size_);
+  }
+  delete_diagrams(diagrams);
+}
+
+// Thumbnails of robots/*.robot (--png, --ppm) at a few scales: the time to
+// draw them into a Raster and to encode it, per diagram.
+void bench_raster()
+{
+  std::vector<Diagram*> diagrams = load_diagrams();
+  const int reps = 20;
+  std::printf("== raster: %lu diagrams in robots/, %d times each\n", (unsigned long)diagrams.size(), reps);
+  if (diagrams.empty())
+    return;
+  const double scales[] = { 0.25, 1, 4 };
+  rob_diag::Raster raster(1, 1);
+  for (size_t s = 0; s < sizeof(scales) / sizeof(scales[0]); ++s)
+  {
+    double draw_time = 0, png_time = 0, ppm_time = 0;
+    size_t pixels = 0, png_size = 0;
+    for (size_t i = 0; i < diagrams.size(); ++i)
+    {
+      rob_diag::Robot& robot = diagrams[i]->robot_;
+      rob_diag::Rect bounds = robot.compute_dimensions();
+      if (diagrams[i]->has_workspace_)
+        bounds.extend(diagrams[i]->workspace_.bounds());
+      Dimensions dimensions((bounds.right_ - bounds.left_ + 20) * scales[s],
+                            (bounds.top_ - bounds.bottom_ + 20) * scales[s]);
+      rob_diag::Pose origin(-bounds.left_ + 10, -bounds.bottom_ + 10, 0);
+      double start = now_seconds();
+      for (int r = 0; r < reps; ++r)
+      {
+        raster.resize((int)std::ceil(dimensions.width), (int)std::ceil(dimensions.height));
+        Document doc(raster, Layout(dimensions, Layout::BottomLeft, scales[s]));
+        if (diagrams[i]->has_workspace_)
+          diagrams[i]->workspace_.draw_at(doc, origin);
+        robot.draw_at(doc, origin);
+      }
+      double drawn = now_seconds();
+      CountingSink sink;
+      for (int r = 0; r < reps; ++r)
+      {
+        sink = CountingSink();
+        raster.write_png(sink);
+      }
+      double encoded = now_seconds();
+      png_size += sink.size_;
+      for (int r = 0; r < reps; ++r)
+        raster.write_ppm(sink);
+      draw_time += drawn - start;
+      png_time += encoded - drawn;
+      ppm_time += now_seconds() - encoded;
+      pixels += (size_t)raster.width() * raster.height();
+    }
+    double n = (double)diagrams.size() * reps;
+    std::printf("scale %-5g %9.1f Kpixels %8.3f ms draw %8.3f ms png %8.3f ms ppm %7.1f Mpixels/s %6.1f KB png\n",
+                scales[s], pixels / 1e3 / diagrams.size(), draw_time / n * 1e3, png_time / n * 1e3,
+                ppm_time / n * 1e3, pixels * reps / draw_time / 1e6, png_size / 1024.0 / diagrams.size());
+  }
+  delete_diagrams(diagrams);
+}
+
+// .robot text for a chain of 'count' elements, mixing every element type
+// (with a label on some), as a user might write it.
+std::string synthetic_robot(int count)
+{
+  std::string text;
+  char line[64];
+  for (int i = 0; i < count; ++i)
+  {
+    switch (i % 8)
+    {
+      case 0: std::snprintf(line, sizeof(line), i % 16 ? "base\n" : "base %d\n", 20 + i % 5); break;
+      case 1: std::snprintf(line, sizeof(line), i % 3 ? "rjoint %.6g\n" : "rjoint %.6g q%d\n", 0.01 * (i % 97), i % 10); break;
+      case 2: std::snprintf(line, sizeof(line), i % 5 ? "link %.6g\n" : "link %.6g L%d\n", 20 + 0.37 * (i % 31), i % 10); break;
+      case 3: std::snprintf(line, sizeof(line), "pjoint\n"); break;
+      case 4: std::snprintf(line, sizeof(line), "frames\n"); break;
+      case 5: std::snprintf(line, sizeof(line), i % 2 ? "vector %.6g\n" : "vector %.6g v\n", 10.0 + (i % 7)); break;
+      case 6: std::snprintf(line, sizeof(line), i % 4 ? "point\n" : "point p%d\n", i % 10); break;
+      case 7: std::snprintf(line, sizeof(line), "effector\n"); break;
+    }
+    text += line;
+  }
+  return text;
+}
+
+// Peak resident set size of the process so far, in KB.
+long peak_rss_kb()
+{
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+// One stage of the pipeline at one size.
+struct SuiteResult
+{
+  std::string stage_;
+  int elements_;
+  int reps_;
+  // Per repetition.
+  double seconds_;
+  double bytes_;
+  double allocations_;
+  long peak_rss_kb_;
+};
+
+// Times 'reps' runs of a stage, counting the allocations they make (see
+// counting_new.hpp; the stages run on this thread, and arena blocks come from
+// malloc, so aren't counted).
+class StageTimer
+{
+public:
+  StageTimer(const char* stage, int elements, int reps)
+    : start_(now_seconds()), allocations_(rob_diag::thread_allocations())
+  {
+    result_.stage_ = stage;
+    result_.elements_ = elements;
+    result_.reps_ = reps;
+    result_.bytes_ = 0;
+  }
+  // 'bytes' read or written by each repetition, for the throughput.
+  SuiteResult stop(double bytes = 0)
+  {
+    result_.seconds_ = (now_seconds() - start_) / result_.reps_;
+    result_.allocations_ = (double)(rob_diag::thread_allocations() - allocations_) / result_.reps_;
+    result_.bytes_ = bytes;
+    result_.peak_rss_kb_ = peak_rss_kb();
+    return result_;
+  }
+private:
+  double start_;
+  unsigned long long allocations_;
+  SuiteResult result_;
+};
+
+// The value following "<key>": in a line of saved suite results.
+bool json_value(const std::string& line, const char* key, std::string& value)
+{
+  std::string quoted = std::string("\"") + key + "\": ";
+  size_t pos = line.find(quoted);
+  if (pos == std::string::npos)
+    return false;
+  pos += quoted.size();
+  if (line[pos] == '"')
+  {
+    size_t end = line.find('"', pos + 1);
+    value = line.substr(pos + 1, end == std::string::npos ? std::string::npos : end - pos - 1);
+  }
+  else
+    value = line.substr(pos, line.find_first_of(",}", pos) - pos);
+  return true;
+}
+
+// Reads results written by write_suite_json.
+bool read_suite_json(const char* filename, std::vector<SuiteResult>& results)
+{
+  std::ifstream in(filename);
+  if (!in)
+    return false;
+  std::string line, stage, elements, seconds, allocations;
+  while (std::getline(in, line))
+  {
+    if (!json_value(line, "stage", stage) || !json_value(line, "elements", elements) ||
+        !json_value(line, "seconds", seconds) || !json_value(line, "allocations", allocations))
+      continue;
+    SuiteResult result;
+    result.stage_ = stage;
+    result.elements_ = std::atoi(elements.c_str());
+    result.seconds_ = std::strtod(seconds.c_str(), NULL);
+    result.allocations_ = std::strtod(allocations.c_str(), NULL);
+    results.push_back(result);
+  }
+  return true;
+}
+
+// One result per line, so that a baseline can be read back (and diffed)
+// line by line.
+bool write_suite_json(const char* filename, const std::vector<SuiteResult>& results)
+{
+  FILE* out = std::fopen(filename, "w");
+  if (!out)
+    return false;
+  std::fprintf(out, "{\"benchmark\": \"suite\", \"results\": [\n");
+  for (size_t i = 0; i < results.size(); ++i)
+  {
+    const SuiteResult& r = results[i];
+    std::fprintf(out, "  {\"stage\": \"%s\", \"elements\": %d, \"reps\": %d, \"seconds\": %.6e, "
+                 "\"elements_per_second\": %.6e, \"bytes_per_second\": %.6e, \"allocations\": %.1f, "
+                 "\"peak_rss_kb\": %ld}%s\n",
+                 r.stage_.c_str(), r.elements_, r.reps_, r.seconds_, r.elements_ / r.seconds_,
+                 r.bytes_ / r.seconds_, r.allocations_, r.peak_rss_kb_, i + 1 < results.size() ? "," : "");
+  }
+  std::fprintf(out, "]}\n");
+  return std::fclose(out) == 0;
+}
+
+// Each stage of turning .robot text into an SVG file, timed separately on
+// chains of 10 to 1000000 elements: parsing (RobotParser, which adds the
+// elements), measuring (compute_dimensions), drawing into an in-memory
+// Document (draw_at), Document::toString, Document::save of that document,
+// and drawing straight to a file through a streaming Document as
+// generate_robots does.  Smaller robots are repeated, so that each stage
+// handles about as many elements at every size.  Returns false if a stage
+// regressed against the baseline, if one is given.
+bool bench_suite(const char* json_file, const char* baseline_file, double tolerance)
+{
+  char path[] = "/tmp/benchmark_suite_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0)
+  {
+    std::printf("== suite: unable to create a temporary file\n");
+    return false;
+  }
+  close(fd);
+
+  std::printf("== suite: stages per robot, saving to %s\n", path);
+  std::printf("%-8s %8s %7s %12s %12s %10s %12s %10s\n", "stage", "elements", "reps", "us/robot",
+              "Melements/s", "MB/s", "allocs/robot", "peak MB");
+  std::vector<SuiteResult> results;
+  for (int count = 10; count <= 1000000; count *= 10)
+  {
+    std::string text = synthetic_robot(count);
+    int reps = std::max(1, 2000000 / count);
+    rob_diag::Robot robot;
+    rob_diag::Arena arena;
+    std::ostringstream err;
+    rob_diag::Rect bounds;
+
+    StageTimer parse("parse", count, reps);
+    for (int r = 0; r < reps; ++r)
+    {
+      robot.elements_.clear();
+      robot.invalidate();
+      arena.reset();
+      rob_diag::DiagramOptions options;
+      rob_diag::RobotParser parser("suite.robot", err);
+      parser.parse(text.data(), text.size(), robot, arena, options);
+    }
+    results.push_back(parse.stop(text.size()));
+
+    StageTimer measure("measure", count, reps);
+    for (int r = 0; r < reps; ++r)
+      bounds = robot.compute_dimensions();
+    results.push_back(measure.stop());
+    g_sink += (size_t)bounds.right_;
+
+    Layout layout(Dimensions(bounds.right_ - bounds.left_ + 20, bounds.top_ - bounds.bottom_ + 20),
+                  Layout::BottomLeft);
+    rob_diag::Pose origin(-bounds.left_ + 10, -bounds.bottom_ + 10, 0);
+    // The big stages hold a whole SVG in memory; fewer repetitions.
+    int draw_reps = std::max(1, reps / 10);
+    Document* doc = NULL;
+    StageTimer draw("draw", count, draw_reps);
+    for (int r = 0; r < draw_reps; ++r)
+    {
+      delete doc;
+      doc = new Document(path, layout);
+      robot.draw_at(*doc, origin);
+    }
+    results.push_back(draw.stop());
+
+    size_t size = 0;
+    StageTimer to_string("toString", count, draw_reps);
+    for (int r = 0; r < draw_reps; ++r)
+      size = doc->toString().size();
+    results.push_back(to_string.stop(size));
+
+    StageTimer save("save", count, draw_reps);
+    for (int r = 0; r < draw_reps; ++r)
+      doc->save();
+    results.push_back(save.stop(size));
+    delete doc;
+
+    StageTimer stream("stream", count, draw_reps);
+    for (int r = 0; r < draw_reps; ++r)
+    {
+      svg::FileSink file(path);
+      Document streamed(file, layout);
+      robot.draw_at(streamed, origin);
+      streamed.save();
+    }
+    results.push_back(stream.stop(size));
+
+    robot.elements_.clear();
+    for (size_t i = results.size() - 6; i < results.size(); ++i)
+    {
+      const SuiteResult& r = results[i];
+      std::printf("%-8s %8d %7d %12.2f %12.2f %10.1f %12.1f %10.1f\n", r.stage_.c_str(), r.elements_, r.reps_,
+                  r.seconds_ * 1e6, r.elements_ / r.seconds_ / 1e6, r.bytes_ / r.seconds_ / 1e6, r.allocations_,
+                  r.peak_rss_kb_ / 1024.0);
+    }
+  }
+  unlink(path);
+
+  if (json_file)
+  {
+    if (write_suite_json(json_file, results))
+      std::printf("Saved results to %s\n", json_file);
+    else
+      std::printf("Unable to write %s\n", json_file);
+  }
+  if (!baseline_file)
+    return true;
+  std::vector<SuiteResult> baseline;
+  if (!read_suite_json(baseline_file, baseline))
+  {
+    std::printf("Unable to read %s\n", baseline_file);
+    return false;
+  }
+  std::printf("== suite: against %s (tolerance %g%%)\n", baseline_file, tolerance);
+  int regressions = 0;
+  for (size_t i = 0; i < results.size(); ++i)
+  {
+    const SuiteResult& r = results[i];
+    for (size_t j = 0; j < baseline.size(); ++j)
+    {
+      const SuiteResult& b = baseline[j];
+      if (b.stage_ != r.stage_ || b.elements_ != r.elements_)
+        continue;
+      double ratio = r.seconds_ / b.seconds_;
+      bool slower = ratio > 1 + tolerance / 100;
+      bool allocates = r.allocations_ > b.allocations_ + 0.5;
+      if (slower || allocates)
+        ++regressions;
+      std::printf("%-8s %8d %7.2fx the time %10.1f allocs (was %.1f)%s\n", r.stage_.c_str(), r.elements_,
+                  ratio, r.allocations_, b.allocations_,
+                  slower ? " SLOWER" : allocates ? " MORE ALLOCATIONS" : "");
+    }
+  }
+  std::printf("%d regression%s\n", regressions, regressions == 1 ? "" : "s");
+  return regressions == 0;
+}
+
+bool wants(const std::vector<std::string>& sections, const char* section)
+{
+  return sections.empty() || std::find(sections.begin(), sections.end(), section) != sections.end();
+}
+
+int main(int argc, char** argv)
+{
+  std::vector<std::string> sections;
+  const char* json_file = NULL;
+  const char* baseline_file = NULL;
+  double tolerance = 20;
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string arg(argv[i]);
+    if (arg == "--json" && i + 1 < argc)
+      json_file = argv[++i];
+    else if (arg == "--baseline" && i + 1 < argc)
+      baseline_file = argv[++i];
+    else if (arg == "--tolerance" && i + 1 < argc)
+      tolerance = std::atof(argv[++i]);
+    else
+      sections.push_back(arg);
+  }
+  bool good = true;
+  if (wants(sections, "svg"))
+    bench_svg();
+  if (wants(sections, "chain"))
+    bench_chain();
+  if (wants(sections, "tree"))
+    bench_tree();
+  if (wants(sections, "loops"))
+    bench_loops();
+  if (wants(sections, "ik"))
+    bench_ik();
+  if (wants(sections, "fk"))
+    bench_fk();
+  if (wants(sections, "parse"))
+    bench_parse();
+  if (wants(sections, "symbols"))
+    bench_output(true, false);
+  if (wants(sections, "paths"))
+    bench_output(false, true);
+  if (wants(sections, "size"))
+    bench_size();
+  if (wants(sections, "svgz"))
+    bench_svgz();
+  if (wants(sections, "raster"))
+    bench_raster();
+  if (wants(sections, "suite"))
+    good = bench_suite(json_file, baseline_file, tolerance);
+  return good ? 0 : 1;
+}
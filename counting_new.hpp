@@ -0,0 +1,64 @@
+#ifndef COUNTING_NEW_HPP
+#define COUNTING_NEW_HPP
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+namespace rob_diag
+{
+
+// Operator new calls made by this thread so far, in a program that includes
+// this file (see below).
+inline unsigned long long& thread_allocations()
+{
+  static __thread unsigned long long count = 0;
+  return count;
+}
+
+}
+
+// Replaces the global operator new and delete with ones that count every
+// allocation, per thread; that's cheap enough to leave on.  These are the
+// replacement functions themselves, not declarations, so include this file
+// in one source file of a program (the one with main), and only in programs
+// that want their allocations counted.
+void* operator new(size_t size)
+{
+  ++rob_diag::thread_allocations();
+  void* memory = std::malloc(size ? size : 1);
+  if (!memory)
+    throw std::bad_alloc();
+  return memory;
+}
+void* operator new[](size_t size)
+{
+  return operator new(size);
+}
+// Every form of operator delete frees through here, out of line: where the
+// compiler inlines std::free into a delete of memory it saw come from
+// operator new, it warns (-Wmismatched-new-delete).
+static __attribute__((noinline)) void counted_free(void* memory)
+{
+  std::free(memory);
+}
+void operator delete(void* memory) throw()
+{
+  counted_free(memory);
+}
+void operator delete[](void* memory) throw()
+{
+  counted_free(memory);
+}
+// The sized forms (C++14) would otherwise be the library's, which might not
+// free with std::free.
+void operator delete(void* memory, size_t) throw()
+{
+  counted_free(memory);
+}
+void operator delete[](void* memory, size_t) throw()
+{
+  counted_free(memory);
+}
+
+#endif
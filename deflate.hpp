@@ -0,0 +1,806 @@
+#ifndef DEFLATE_HPP
+#define DEFLATE_HPP
+
+#include "simple_svg_1.0.0.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+namespace rob_diag
+{
+
+// CRC-32 (the IEEE polynomial), as gzip and PNG use it.
+class Crc32
+{
+public:
+  Crc32()
+    : crc_(0xffffffffU)
+  {}
+  void operator()(const char* data, size_t size)
+  {
+    const uint32_t (*table)[256] = Table::get().entries_;
+    const unsigned char* p = (const unsigned char*)data;
+    uint32_t crc = crc_;
+    // Eight bytes at a time ("slicing by 8"); little endian only.
+    for (; size >= 8 && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__; p += 8, size -= 8)
+    {
+      uint32_t low, high;
+      std::memcpy(&low, p, 4);
+      std::memcpy(&high, p + 4, 4);
+      low ^= crc;
+      crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^ table[5][(low >> 16) & 0xff] ^
+            table[4][low >> 24] ^ table[3][high & 0xff] ^ table[2][(high >> 8) & 0xff] ^
+            table[1][(high >> 16) & 0xff] ^ table[0][high >> 24];
+    }
+    for (; size > 0; ++p, --size)
+      crc = table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+    crc_ = crc;
+  }
+  uint32_t value() const { return crc_ ^ 0xffffffffU; }
+private:
+  struct Table
+  {
+    Table()
+    {
+      for (uint32_t n = 0; n < 256; ++n)
+      {
+        uint32_t c = n;
+        for (int k = 0; k < 8; ++k)
+          c = c & 1 ? 0xedb88320U ^ (c >> 1) : c >> 1;
+        entries_[0][n] = c;
+      }
+      for (int t = 1; t < 8; ++t)
+        for (int n = 0; n < 256; ++n)
+          entries_[t][n] = (entries_[t - 1][n] >> 8) ^ entries_[0][entries_[t - 1][n] & 0xff];
+    }
+    static const Table& get()
+    {
+      static const Table table;
+      return table;
+    }
+    uint32_t entries_[8][256];
+  };
+  uint32_t crc_;
+};
+
+// Adler-32, the checksum that ends a zlib stream (RFC 1950), as in PNG.
+class Adler32
+{
+public:
+  Adler32()
+    : a_(1), b_(0)
+  {}
+  void operator()(const char* data, size_t size)
+  {
+    const unsigned char* p = (const unsigned char*)data;
+    while (size > 0)
+    {
+      // The most bytes before the sums can overflow 32 bits.
+      size_t n = std::min<size_t>(size, 5552);
+      size -= n;
+      for (; n > 0; --n)
+      {
+        a_ += *p++;
+        b_ += a_;
+      }
+      a_ %= 65521;
+      b_ %= 65521;
+    }
+  }
+  uint32_t value() const { return (b_ << 16) | a_; }
+private:
+  uint32_t a_, b_;
+};
+
+// A streaming DEFLATE (RFC 1951) compressor: LZ77 over a 32 KB window with
+// hash chains, and for each block of up to 16K symbols whichever of dynamic
+// Huffman codes, the fixed codes or a stored copy is smallest.  Input can be
+// fed in pieces of any size; only the window and the current block are
+// held.  The levels follow zlib's: 0 only stores, 1 to 3 take the first good
+// match, 4 to 9 also try the next position before taking one (lazy
+// matching) and search ever longer hash chains.
+//
+// For example:
+//   Deflater deflater(6);
+//   std::string out;
+//   deflater.compress(data, size, out);  // as often as needed
+//   deflater.finish(out);                // 'out' is a complete stream
+class Deflater
+{
+public:
+  explicit Deflater(int level = 6)
+    : window_(2 * window_size), head_(hash_size), prev_(window_size), literals_(max_symbols),
+      distances_(max_symbols), out_(NULL), bits_(0), num_bits_(0)
+  {
+    // Longest chain to search, and the lengths after which to search less,
+    // to stop looking for a better match at the next position, and to stop
+    // searching; as in zlib's table.
+    static const Config configs[10] = {
+      { 0, 0, 0, 0 },         { 4, 4, 8, 4 },          { 4, 5, 16, 8 },
+      { 4, 6, 32, 32 },       { 4, 4, 16, 16 },        { 8, 16, 32, 32 },
+      { 8, 16, 128, 128 },    { 8, 32, 128, 256 },     { 32, 128, 258, 1024 },
+      { 32, 258, 258, 4096 },
+    };
+    level_ = std::min(std::max(level, 0), 9);
+    config_ = configs[level_];
+    reset();
+  }
+
+  int level() const { return level_; }
+
+  // Starts a new stream.
+  void reset()
+  {
+    // prev_ is only ever read for positions written since.
+    std::fill(head_.begin(), head_.end(), 0);
+    end_ = pos_ = 0;
+    block_start_ = emitted_ = 0;
+    match_available_ = false;
+    prev_length_ = min_match - 1;
+    prev_distance_ = 0;
+    start_block();
+    bits_ = 0;
+    num_bits_ = 0;
+  }
+
+  // Compresses 'size' more bytes, appending the output that is ready to 'out'.
+  void compress(const char* data, size_t size, std::string& out)
+  {
+    out_ = &out;
+    while (size > 0)
+    {
+      if (end_ == window_.size())
+        slide();
+      size_t n = std::min(size, window_.size() - end_);
+      std::memcpy(&window_[end_], data, n);
+      end_ += n;
+      data += n;
+      size -= n;
+      process(false);
+    }
+    out_ = NULL;
+  }
+
+  // Compresses whatever is left, and ends the stream.
+  void finish(std::string& out)
+  {
+    out_ = &out;
+    process(true);
+    if (match_available_)
+    {
+      literal(pos_ - 1);
+      match_available_ = false;
+    }
+    flush_block(true);
+    if (num_bits_ > 0)
+      put_bits(0, (64 - num_bits_) % 8);
+    flush_bits();
+    out_ = NULL;
+  }
+
+private:
+  Deflater(const Deflater&);
+  Deflater& operator=(const Deflater&);
+
+  enum
+  {
+    window_size = 32768,
+    hash_bits = 15,
+    hash_size = 1 << hash_bits,
+    min_match = 3,
+    max_match = 258,
+    // Input kept ahead of the current position, so that a match can be as
+    // long as it may be.
+    min_lookahead = max_match + min_match + 1,
+    max_symbols = 16384,
+    num_literals = 286,
+    num_distances = 30,
+    num_lengths = 19,
+    // A 3 byte match this far back costs more than 3 literals.
+    too_far = 4096
+  };
+
+  struct Config
+  {
+    int good_length_, max_lazy_, nice_length_, max_chain_;
+  };
+
+  // Fixed codes, and length and distance codes with their extra bits.
+  struct Tables
+  {
+    Tables()
+    {
+      static const int length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                            2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+      static const int distance_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+                                              6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+      int base = 3;
+      for (int code = 0; code < 29; ++code)
+      {
+        length_base_[code] = code == 28 ? 258 : base;
+        length_extra_[code] = length_extra[code];
+        for (int i = 0; i < (1 << length_extra[code]) && base + i <= 258; ++i)
+          length_code_[base + i] = code;
+        base += 1 << length_extra[code];
+      }
+      length_code_[258] = 28;
+      base = 1;
+      for (int code = 0; code < 30; ++code)
+      {
+        distance_base_[code] = base;
+        distance_extra_[code] = distance_extra[code];
+        base += 1 << distance_extra[code];
+      }
+      for (int i = 0; i < 288; ++i)
+        fixed_literal_lengths_[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+      for (int i = 0; i < 32; ++i)
+        fixed_distance_lengths_[i] = 5;
+      make_codes(fixed_literal_lengths_, 288, fixed_literal_codes_);
+      make_codes(fixed_distance_lengths_, 32, fixed_distance_codes_);
+    }
+    static const Tables& get()
+    {
+      static const Tables tables;
+      return tables;
+    }
+    int distance_code(int distance) const
+    {
+      // Codes 2n and 2n+1 start at 2^n + 1 and 3 * 2^(n-1) + 1.
+      if (distance <= 4)
+        return distance - 1;
+      int d = distance - 1;
+      int n = 31 - __builtin_clz(d);
+      return 2 * n + ((d >> (n - 1)) & 1);
+    }
+    int length_code_[259];
+    int length_base_[29], length_extra_[29];
+    int distance_base_[30], distance_extra_[30];
+    unsigned char fixed_literal_lengths_[288], fixed_distance_lengths_[32];
+    uint16_t fixed_literal_codes_[288], fixed_distance_codes_[32];
+  };
+
+  // Canonical Huffman codes for the given code lengths, bit reversed, since
+  // DEFLATE packs codes starting with their most significant bit.
+  static void make_codes(const unsigned char* lengths, int count, uint16_t* codes)
+  {
+    int length_counts[16] = { 0 };
+    for (int i = 0; i < count; ++i)
+      ++length_counts[lengths[i]];
+    length_counts[0] = 0;
+    int next[16];
+    int code = 0;
+    for (int bits = 1; bits < 16; ++bits)
+    {
+      code = (code + length_counts[bits - 1]) << 1;
+      next[bits] = code;
+    }
+    for (int i = 0; i < count; ++i)
+    {
+      int length = lengths[i];
+      if (length == 0)
+      {
+        codes[i] = 0;
+        continue;
+      }
+      int c = next[length]++, reversed = 0;
+      for (int b = 0; b < length; ++b, c >>= 1)
+        reversed = (reversed << 1) | (c & 1);
+      codes[i] = (uint16_t)reversed;
+    }
+  }
+
+  // Huffman code lengths of at most 'limit' bits for 'count' symbols with
+  // the given frequencies.  At least two symbols get codes, as some decoders
+  // reject a code of one.  When the tree would be too deep, the frequencies
+  // are flattened and it is built again.
+  static void make_lengths(const uint32_t* frequencies, int count, int limit, unsigned char* lengths)
+  {
+    std::vector<uint32_t> weights(frequencies, frequencies + count);
+    int used = 0;
+    for (int i = 0; i < count; ++i)
+      used += weights[i] > 0;
+    for (int i = 0; i < count && used < 2; ++i)
+    {
+      if (weights[i] == 0)
+      {
+        weights[i] = 1;
+        ++used;
+      }
+    }
+    std::vector<std::pair<uint32_t, int> > leaves;
+    std::vector<uint32_t> weight(2 * used);
+    std::vector<int> parent(2 * used), depth(2 * used);
+    while (true)
+    {
+      leaves.clear();
+      for (int i = 0; i < count; ++i)
+        if (weights[i] > 0)
+          leaves.push_back(std::make_pair(weights[i], i));
+      std::sort(leaves.begin(), leaves.end());
+      // Two queues: the sorted leaves, and the internal nodes, which are made
+      // in order of weight.
+      for (int i = 0; i < used; ++i)
+        weight[i] = leaves[i].first;
+      int leaf = 0, node = used, next = used;
+      for (; next < 2 * used - 1; ++next)
+      {
+        int children[2];
+        for (int c = 0; c < 2; ++c)
+          children[c] = node >= next || (leaf < used && weight[leaf] <= weight[node]) ? leaf++ : node++;
+        weight[next] = weight[children[0]] + weight[children[1]];
+        parent[children[0]] = parent[children[1]] = next;
+      }
+      int root = 2 * used - 2, deepest = 0;
+      depth[root] = 0;
+      for (int i = root - 1; i >= 0; --i)
+      {
+        depth[i] = depth[parent[i]] + 1;
+        deepest = std::max(deepest, depth[i]);
+      }
+      if (deepest <= limit)
+        break;
+      for (int i = 0; i < count; ++i)
+        if (weights[i] > 0)
+          weights[i] = (weights[i] >> 1) | 1;
+    }
+    std::fill(lengths, lengths + count, 0);
+    for (int i = 0; i < used; ++i)
+      lengths[leaves[i].second] = (unsigned char)depth[i];
+  }
+
+  void put_bits(uint32_t value, int count)
+  {
+    bits_ |= (uint64_t)value << num_bits_;
+    num_bits_ += count;
+    if (num_bits_ >= 32)
+    {
+      char bytes[4] = { (char)bits_, (char)(bits_ >> 8), (char)(bits_ >> 16), (char)(bits_ >> 24) };
+      out_->append(bytes, 4);
+      bits_ >>= 32;
+      num_bits_ -= 32;
+    }
+  }
+  // Writes out all whole bytes.
+  void flush_bits()
+  {
+    for (; num_bits_ >= 8; num_bits_ -= 8, bits_ >>= 8)
+      out_->push_back((char)bits_);
+  }
+
+  // Drops the older half of the window once the buffer is full.
+  void slide()
+  {
+    std::memmove(&window_[0], &window_[window_size], window_size);
+    end_ -= window_size;
+    pos_ -= window_size;
+    block_start_ -= window_size;
+    emitted_ -= window_size;
+    for (size_t i = 0; i < head_.size(); ++i)
+      head_[i] = head_[i] >= window_size ? head_[i] - window_size : 0;
+    for (size_t i = 0; i < prev_.size(); ++i)
+      prev_[i] = prev_[i] >= window_size ? prev_[i] - window_size : 0;
+  }
+
+  uint32_t hash(size_t pos) const
+  {
+    const unsigned char* p = &window_[pos];
+    uint32_t bytes = p[0] | (p[1] << 8) | (p[2] << 16);
+    return (bytes * 2654435761U) >> (32 - hash_bits);
+  }
+  // Adds the string at 'pos' to its hash chain, and returns the previous
+  // string with the same hash (0 for none).
+  size_t insert(size_t pos)
+  {
+    uint32_t h = hash(pos);
+    size_t candidate = head_[h];
+    prev_[pos % window_size] = (uint16_t)candidate;
+    head_[h] = (uint16_t)pos;
+    return candidate;
+  }
+
+  // The longest match for the string at 'pos_' that is longer than
+  // 'best_length', following the hash chain from 'candidate'.  Returns
+  // 'best_length' if there is none.
+  int longest_match(size_t candidate, int best_length, int& distance) const
+  {
+    int chain = config_.max_chain_;
+    if (prev_length_ >= config_.good_length_)
+      chain >>= 2;
+    int max_length = (int)std::min<size_t>(max_match, end_ - pos_);
+    int nice = std::min(config_.nice_length_, max_length);
+    if (best_length >= max_length)
+      return best_length;
+    size_t limit = pos_ > window_size ? pos_ - window_size : 0;
+    const unsigned char* scan = &window_[pos_];
+    while (true)
+    {
+      const unsigned char* match = &window_[candidate];
+      if (match[best_length] == scan[best_length] && match[0] == scan[0] && match[1] == scan[1])
+      {
+        // Eight bytes at a time, then the rest.
+        int length = 2;
+        while (length + 8 <= max_length)
+        {
+          uint64_t a, b;
+          std::memcpy(&a, match + length, 8);
+          std::memcpy(&b, scan + length, 8);
+          if (a != b)
+          {
+            length += __builtin_ctzll(a ^ b) / 8;
+            break;
+          }
+          length += 8;
+        }
+        while (length < max_length && match[length] == scan[length])
+          ++length;
+        if (length > best_length)
+        {
+          best_length = length;
+          distance = (int)(pos_ - candidate);
+          if (length >= nice)
+            break;
+        }
+      }
+      size_t next = prev_[candidate % window_size];
+      if (next == 0 || next >= candidate || next < limit || --chain <= 0)
+        break;
+      candidate = next;
+    }
+    return best_length;
+  }
+
+  // Finds the first match at 'pos_' worth taking, or 0.
+  int find_match(int best_length, int& distance)
+  {
+    if (level_ == 0 || end_ - pos_ < min_match)
+      return 0;
+    size_t candidate = insert(pos_);
+    if (candidate == 0 || pos_ - candidate > window_size)
+      return 0;
+    int length = longest_match(candidate, best_length, distance);
+    if (length <= best_length || (length == min_match && distance > too_far))
+      return 0;
+    return length;
+  }
+
+  void literal(size_t pos)
+  {
+    unsigned char c = window_[pos];
+    literals_[symbols_] = c;
+    distances_[symbols_] = 0;
+    ++symbols_;
+    ++literal_counts_[c];
+    emitted_ = pos + 1;
+    if (symbols_ == max_symbols)
+      flush_block(false);
+  }
+  void match(size_t pos, int length, int distance)
+  {
+    const Tables& tables = Tables::get();
+    literals_[symbols_] = (uint16_t)length;
+    distances_[symbols_] = (uint16_t)distance;
+    ++symbols_;
+    ++literal_counts_[257 + tables.length_code_[length]];
+    ++distance_counts_[tables.distance_code(distance)];
+    emitted_ = pos + length;
+    if (symbols_ == max_symbols)
+      flush_block(false);
+  }
+
+  // Turns the input into symbols; unless 'flush', stops while a full match
+  // could still be cut short by input yet to come.
+  void process(bool flush)
+  {
+    if (level_ == 0)
+    {
+      // Stored blocks of up to half the window, so that a block's input is
+      // still at hand when it is written.
+      while ((long)end_ - block_start_ >= window_size)
+      {
+        emitted_ = block_start_ + window_size;
+        flush_block(false);
+      }
+      pos_ = emitted_ = end_;
+      return;
+    }
+    while (flush ? pos_ < end_ : end_ - pos_ >= (size_t)min_lookahead)
+    {
+      if (config_.max_lazy_ == 0 || level_ < 4)
+      {
+        // Take the first match.
+        int distance = 0;
+        int length = find_match(min_match - 1, distance);
+        if (length == 0)
+        {
+          literal(pos_);
+          ++pos_;
+          continue;
+        }
+        match(pos_, length, distance);
+        size_t end = pos_ + length;
+        // Long matches aren't indexed, for speed.
+        if (length <= config_.max_lazy_)
+          for (++pos_; pos_ < end; ++pos_)
+            if (end_ - pos_ >= min_match)
+              insert(pos_);
+        pos_ = end;
+        continue;
+      }
+
+      // Lazy matching: a match found at pos_ - 1 is only taken if the one at
+      // pos_ isn't longer.
+      int distance = 0;
+      int length = prev_length_ < config_.max_lazy_ ? find_match(prev_length_, distance) : 0;
+      if (length == 0 && prev_length_ >= config_.max_lazy_ && end_ - pos_ >= min_match)
+        insert(pos_);
+      if (prev_length_ >= min_match && length <= prev_length_)
+      {
+        size_t start = pos_ - 1;
+        size_t end = start + prev_length_;
+        match(start, prev_length_, prev_distance_);
+        for (++pos_; pos_ < end; ++pos_)
+          if (end_ - pos_ >= min_match)
+            insert(pos_);
+        pos_ = end;
+        match_available_ = false;
+        prev_length_ = min_match - 1;
+        continue;
+      }
+      if (match_available_)
+        literal(pos_ - 1);
+      match_available_ = true;
+      prev_length_ = length == 0 ? min_match - 1 : length;
+      prev_distance_ = distance;
+      ++pos_;
+    }
+  }
+
+  void start_block()
+  {
+    symbols_ = 0;
+    std::fill(literal_counts_, literal_counts_ + num_literals, 0);
+    std::fill(distance_counts_, distance_counts_ + num_distances, 0);
+  }
+
+  // Writes the symbols so far as one block, in whichever form is smallest.
+  void flush_block(bool last)
+  {
+    if (symbols_ == 0 && (long)emitted_ == block_start_ && !last)
+      return;
+    const Tables& tables = Tables::get();
+    literal_counts_[256] = 1;
+
+    unsigned char literal_lengths[num_literals], distance_lengths[num_distances];
+    make_lengths(literal_counts_, num_literals, 15, literal_lengths);
+    make_lengths(distance_counts_, num_distances, 15, distance_lengths);
+    int num_literal_codes = num_literals, num_distance_codes = num_distances;
+    while (num_literal_codes > 257 && literal_lengths[num_literal_codes - 1] == 0)
+      --num_literal_codes;
+    while (num_distance_codes > 1 && distance_lengths[num_distance_codes - 1] == 0)
+      --num_distance_codes;
+
+    // The code lengths of both, run length encoded (symbols 16 to 18).
+    unsigned char all_lengths[num_literals + num_distances];
+    std::copy(literal_lengths, literal_lengths + num_literal_codes, all_lengths);
+    std::copy(distance_lengths, distance_lengths + num_distance_codes, all_lengths + num_literal_codes);
+    int num_all = num_literal_codes + num_distance_codes;
+    unsigned char runs[num_literals + num_distances], run_extras[num_literals + num_distances];
+    int num_runs = 0;
+    uint32_t length_counts[num_lengths] = { 0 };
+    for (int i = 0; i < num_all;)
+    {
+      int value = all_lengths[i], run = 1;
+      while (i + run < num_all && all_lengths[i + run] == value)
+        ++run;
+      if (value == 0 && run >= 3)
+      {
+        run = std::min(run, 138);
+        runs[num_runs] = run >= 11 ? 18 : 17;
+        run_extras[num_runs++] = (unsigned char)(run >= 11 ? run - 11 : run - 3);
+      }
+      else if (value != 0 && run >= 4)
+      {
+        run = std::min(run, 7);
+        runs[num_runs] = (unsigned char)value;
+        run_extras[num_runs++] = 0;
+        runs[num_runs] = 16;
+        run_extras[num_runs++] = (unsigned char)(run - 4);
+      }
+      else
+      {
+        run = 1;
+        runs[num_runs] = (unsigned char)value;
+        run_extras[num_runs++] = 0;
+      }
+      i += run;
+    }
+    for (int i = 0; i < num_runs; ++i)
+      ++length_counts[runs[i]];
+    unsigned char length_lengths[num_lengths];
+    make_lengths(length_counts, num_lengths, 7, length_lengths);
+    static const int order[num_lengths] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    int num_length_codes = num_lengths;
+    while (num_length_codes > 4 && length_lengths[order[num_length_codes - 1]] == 0)
+      --num_length_codes;
+
+    // Sizes in bits.
+    uint64_t extra = 0, dynamic = 0, fixed = 0;
+    for (int i = 0; i < 29; ++i)
+      extra += (uint64_t)literal_counts_[257 + i] * tables.length_extra_[i];
+    for (int i = 0; i < num_distances; ++i)
+    {
+      extra += (uint64_t)distance_counts_[i] * tables.distance_extra_[i];
+      dynamic += (uint64_t)distance_counts_[i] * distance_lengths[i];
+      fixed += (uint64_t)distance_counts_[i] * 5;
+    }
+    for (int i = 0; i < num_literals; ++i)
+    {
+      dynamic += (uint64_t)literal_counts_[i] * literal_lengths[i];
+      fixed += (uint64_t)literal_counts_[i] * tables.fixed_literal_lengths_[i];
+    }
+    dynamic += 3 + 14 + 3 * num_length_codes + extra;
+    fixed += 3 + extra;
+    for (int i = 0; i < num_lengths; ++i)
+      dynamic += (uint64_t)length_counts[i] * length_lengths[i];
+    dynamic += 2 * length_counts[16] + 3 * length_counts[17] + 7 * length_counts[18];
+    size_t raw = emitted_ - block_start_;
+    // Stored blocks hold up to 64 KB, and the input has to be still at hand.
+    bool can_store = block_start_ >= 0 && raw <= 65535;
+    uint64_t stored = can_store ? 3 + 7 + 32 + 8 * (uint64_t)raw : ~(uint64_t)0;
+
+    if (can_store && (level_ == 0 || stored <= std::min(dynamic, fixed)))
+    {
+      put_bits(last ? 1 : 0, 3);
+      if (num_bits_ % 8)
+        put_bits(0, 8 - num_bits_ % 8);
+      put_bits((uint32_t)raw, 16);
+      put_bits((uint32_t)raw ^ 0xffff, 16);
+      flush_bits();
+      out_->append((const char*)&window_[block_start_], raw);
+    }
+    else if (fixed <= dynamic)
+    {
+      put_bits(last ? 3 : 2, 3);
+      write_symbols(tables.fixed_literal_lengths_, tables.fixed_literal_codes_,
+                    tables.fixed_distance_lengths_, tables.fixed_distance_codes_);
+    }
+    else
+    {
+      uint16_t literal_codes[num_literals], distance_codes[num_distances], length_codes[num_lengths];
+      make_codes(literal_lengths, num_literals, literal_codes);
+      make_codes(distance_lengths, num_distances, distance_codes);
+      make_codes(length_lengths, num_lengths, length_codes);
+      put_bits(last ? 5 : 4, 3);
+      put_bits(num_literal_codes - 257, 5);
+      put_bits(num_distance_codes - 1, 5);
+      put_bits(num_length_codes - 4, 4);
+      for (int i = 0; i < num_length_codes; ++i)
+        put_bits(length_lengths[order[i]], 3);
+      static const int run_extra_bits[3] = { 2, 3, 7 };
+      for (int i = 0; i < num_runs; ++i)
+      {
+        put_bits(length_codes[runs[i]], length_lengths[runs[i]]);
+        if (runs[i] >= 16)
+          put_bits(run_extras[i], run_extra_bits[runs[i] - 16]);
+      }
+      write_symbols(literal_lengths, literal_codes, distance_lengths, distance_codes);
+    }
+    block_start_ = emitted_;
+    start_block();
+  }
+
+  void write_symbols(const unsigned char* literal_lengths, const uint16_t* literal_codes,
+                     const unsigned char* distance_lengths, const uint16_t* distance_codes)
+  {
+    const Tables& tables = Tables::get();
+    for (size_t i = 0; i < symbols_; ++i)
+    {
+      int value = literals_[i];
+      if (distances_[i] == 0)
+      {
+        put_bits(literal_codes[value], literal_lengths[value]);
+        continue;
+      }
+      int code = tables.length_code_[value];
+      put_bits(literal_codes[257 + code], literal_lengths[257 + code]);
+      put_bits(value - tables.length_base_[code], tables.length_extra_[code]);
+      int distance = distances_[i];
+      code = tables.distance_code(distance);
+      put_bits(distance_codes[code], distance_lengths[code]);
+      put_bits(distance - tables.distance_base_[code], tables.distance_extra_[code]);
+    }
+    put_bits(literal_codes[256], literal_lengths[256]);
+  }
+
+  int level_;
+  Config config_;
+  // Input: the last window_size bytes before 'pos_' (the dictionary), and
+  // what has been read ahead of it up to 'end_'.
+  std::vector<unsigned char> window_;
+  size_t end_, pos_;
+  // Hash chains: the latest position of each hash, and for each position
+  // the one before it with the same hash.  0 ends a chain.
+  std::vector<uint16_t> head_, prev_;
+  // Lazy matching state: a match (or literal) pending at pos_ - 1.
+  bool match_available_;
+  int prev_length_, prev_distance_;
+  // The current block: its symbols (a literal, or a length and distance),
+  // their frequencies, and the input it covers (block_start_ is negative
+  // once that has left the window).
+  std::vector<uint16_t> literals_, distances_;
+  size_t symbols_;
+  uint32_t literal_counts_[num_literals], distance_counts_[num_distances];
+  long block_start_;
+  size_t emitted_;
+  // Output.
+  std::string* out_;
+  uint64_t bits_;
+  int num_bits_;
+};
+
+// Gzip-compresses (RFC 1952) everything written through it into another
+// sink, as it is written; for .svgz files.  finish() has to be called after
+// the last write.
+//
+// For example:
+//   svg::FileSink file("robot.svgz");
+//   GzipSink gzip(file, 6);
+//   svg::Document doc(gzip, layout);
+//   ...
+//   bool good = doc.save() && gzip.finish();
+class GzipSink : public svg::Sink
+{
+public:
+  explicit GzipSink(svg::Sink& sink, int level = 6)
+    : sink_(sink), deflater_(level), size_(0), good_(true)
+  {
+    // Magic, deflate, no flags or time, the level, unknown OS.
+    const char header[10] = { '\x1f', '\x8b', 8, 0, 0, 0, 0, 0, (char)(level >= 9 ? 2 : level <= 1 ? 4 : 0),
+                              '\xff' };
+    buffer_.assign(header, sizeof(header));
+  }
+  bool write(const char* data, size_t size)
+  {
+    crc_(data, size);
+    size_ += size;
+    deflater_.compress(data, size, buffer_);
+    if (buffer_.size() >= 64 * 1024)
+      pass_on();
+    return good_;
+  }
+  bool finish()
+  {
+    deflater_.finish(buffer_);
+    uint32_t trailer[2] = { crc_.value(), (uint32_t)size_ };
+    for (int i = 0; i < 2; ++i)
+      for (int b = 0; b < 4; ++b)
+        buffer_.push_back((char)(trailer[i] >> (8 * b)));
+    pass_on();
+    return good_;
+  }
+private:
+  GzipSink(const GzipSink&);
+  GzipSink& operator=(const GzipSink&);
+
+  void pass_on()
+  {
+    if (good_ && !buffer_.empty())
+      good_ = sink_.write(buffer_.data(), buffer_.size());
+    buffer_.clear();
+  }
+
+  svg::Sink& sink_;
+  Deflater deflater_;
+  Crc32 crc_;
+  uint64_t size_;
+  std::string buffer_;
+  bool good_;
+};
+
+}
+
+#endif
@@ -0,0 +1,161 @@
+#ifndef FILE_WATCHER_HPP
+#define FILE_WATCHER_HPP
+
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace rob_diag
+{
+
+// Reports files that have been written, using inotify.  Directories are
+// watched rather than files, because most editors save by writing a new file
+// and renaming it over the old one, which a watch on the old file would miss;
+// a watched file is a directory watch that only reports that one name.
+//
+// For example:
+//   FileWatcher watcher;
+//   watcher.add("robots", error);
+//   std::vector<std::string> changed;
+//   while (watcher.wait(changed, 25))
+//     ... // 'changed' holds e.g. "robots/fig_1.robot"
+class FileWatcher
+{
+public:
+  FileWatcher()
+    : fd_(inotify_init1(IN_CLOEXEC)), buffer_(64 * 1024 / sizeof(long))
+  {}
+  ~FileWatcher()
+  {
+    if (fd_ >= 0)
+      ::close(fd_);
+  }
+
+  // Watches a directory (every file in it) or a single file.  On failure,
+  // returns false and sets 'error'.
+  bool add(const std::string& path, std::string& error)
+  {
+    if (fd_ < 0)
+    {
+      error = std::string("Unable to start inotify: ") + std::strerror(errno);
+      return false;
+    }
+    struct stat st;
+    bool is_directory = ::stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    std::string directory = path, name;
+    if (!is_directory)
+    {
+      size_t slash = path.rfind('/');
+      directory = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+      name = slash == std::string::npos ? path : path.substr(slash + 1);
+    }
+    int wd = inotify_add_watch(fd_, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (wd < 0)
+    {
+      error = "Unable to watch " + directory + ": " + std::strerror(errno);
+      return false;
+    }
+    // Two paths to one directory share a watch; the first path names it.
+    bool is_new = watches_.find(wd) == watches_.end();
+    Watch& watch = watches_[wd];
+    if (is_new && directory != ".")
+      watch.prefix_ = directory[directory.size() - 1] == '/' ? directory : directory + "/";
+    if (is_directory)
+      watch.all_ = true;
+    else
+      watch.names_.insert(name);
+    return true;
+  }
+
+  // Blocks until at least one watched file has been written, then waits for
+  // the burst of writes to settle (no events for 'quiet_ms' milliseconds),
+  // so that a file saved in several steps, or a whole checkout, is only
+  // reported once.  'changed' gets the paths, sorted and without duplicates.
+  // Returns false on errors.
+  bool wait(std::vector<std::string>& changed, int quiet_ms)
+  {
+    changed_.clear();
+    while (changed_.empty())
+    {
+      if (!read_events(-1))
+        return false;
+    }
+    while (true)
+    {
+      pollfd p;
+      p.fd = fd_;
+      p.events = POLLIN;
+      int ready = ::poll(&p, 1, quiet_ms);
+      if (ready < 0 && errno == EINTR)
+        continue;
+      if (ready < 0)
+        return false;
+      if (ready == 0)
+        break;
+      if (!read_events(0))
+        return false;
+    }
+    changed.assign(changed_.begin(), changed_.end());
+    return true;
+  }
+
+private:
+  FileWatcher(const FileWatcher&);
+  FileWatcher& operator=(const FileWatcher&);
+
+  struct Watch
+  {
+    Watch() : all_(false) {}
+    std::string prefix_;
+    bool all_;
+    std::set<std::string> names_;
+  };
+
+  // Reads one batch of events ('timeout_ms' as for poll), adding the
+  // interesting ones to 'changed_'.
+  bool read_events(int timeout_ms)
+  {
+    pollfd p;
+    p.fd = fd_;
+    p.events = POLLIN;
+    int ready = ::poll(&p, 1, timeout_ms);
+    if (ready < 0)
+      return errno == EINTR;
+    if (ready == 0)
+      return true;
+    const char* events = (const char*)&buffer_[0];
+    ssize_t got = ::read(fd_, &buffer_[0], buffer_.size() * sizeof(long));
+    if (got < 0)
+      return errno == EINTR || errno == EAGAIN;
+    for (ssize_t pos = 0; pos < got;)
+    {
+      const inotify_event* event = (const inotify_event*)(events + pos);
+      pos += sizeof(inotify_event) + event->len;
+      std::map<int, Watch>::const_iterator watch = watches_.find(event->wd);
+      if (watch == watches_.end() || event->len == 0 || (event->mask & IN_ISDIR))
+        continue;
+      std::string name(event->name);
+      if (watch->second.all_ || watch->second.names_.count(name))
+        changed_.insert(watch->second.prefix_ + name);
+    }
+    return true;
+  }
+
+  int fd_;
+  std::map<int, Watch> watches_;
+  // Events are read into this; it is aligned for inotify_event.
+  std::vector<long> buffer_;
+  std::set<std::string> changed_;
+};
+
+}
+
+#endif
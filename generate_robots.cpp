@@ -1,297 +1,1400 @@
 #include "robot_diagrams_0.0.hpp"
+#include "counting_new.hpp"
+#include "deflate.hpp"
+#include "raster.hpp"
+#include "file_watcher.hpp"
+#include "mapped_file.hpp"
+#include "robot_arena.hpp"
+#include "robot_atlas.hpp"
+#include "robot_binary.hpp"
+#include "robot_ik.hpp"
+#include "robot_loops.hpp"
+#include "robot_parser.hpp"
+#include "render_cache.hpp"
+#include "render_server.hpp"
+#include "robot_stats.hpp"
+#include "robot_tree.hpp"
+#include "robot_workspace.hpp"
+#include "work_pool.hpp"
 
 #include <iostream>
 #include <fstream>
-#include <iterator>
 #include <string>
 #include <vector>
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <algorithm>
+#include <cmath>
+#include <set>
 
-std::vector<std::string> split(std::string s)
+#include <errno.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Command line settings for drawing diagrams.
+struct DrawSettings
+{
+  enum Image { Svg, Png, Ppm };
+
+  DrawSettings()
+    : symbols_(false), paths_(false), decimals_(-1), relative_(false), compression_(-1), image_(Svg),
+      raster_scale_(1), cache_(NULL), stats_(NULL)
+  {}
+  // Draw repeated glyphs once and place them with <use>
+  // (Robot::draw_symbols_at).
+  bool symbols_;
+  // Write runs of same-stroke lines as one <path> (Document line batching).
+  bool paths_;
+  // Decimal places to round coordinates to, or -1 for the default of six
+  // significant digits (Document::setPrecision).
+  int decimals_;
+  // Write paths with relative commands (Document::setRelativePaths).
+  bool relative_;
+  // Gzip level (0 to 9) for .svgz output, or -1 for plain .svg.
+  int compression_;
+  // Draw a PNG or PPM image (with raster.hpp) instead of SVG.
+  Image image_;
+  // Pixels per SVG pixel in PNG and PPM images.
+  double raster_scale_;
+  // Where to keep rendered diagrams, if anywhere.
+  rob_diag::RenderCache* cache_;
+  // Where to record each file's stats (--stats), if anywhere.
+  rob_diag::StatsLog* stats_;
+};
+
+// ".svgz", ".svg", ".png" or ".ppm".
+const char* output_extension(const DrawSettings& settings)
+{
+  if (settings.image_ == DrawSettings::Png)
+    return ".png";
+  if (settings.image_ == DrawSettings::Ppm)
+    return ".ppm";
+  return settings.compression_ >= 0 ? ".svgz" : ".svg";
+}
+
+// Space around a robot's bounds on its canvas.
+const double canvas_margin = 10;
+
+// A picture on a canvas of its own: the canvas size (in SVG pixels), and
+// how to draw on a Document of that size with a bottom-left origin.
+class Figure
+{
+public:
+  virtual ~Figure() {}
+  virtual svg::Dimensions size() const = 0;
+  // 'symbols' draws robots with Robot::draw_symbols_at.
+  virtual void draw(Document& doc, bool symbols) const = 0;
+};
+
+// An already measured robot on a canvas covering 'bounds' (plus a margin),
+// with its workspace (if any) behind it.  Big robots are drawn in parts, on
+// 'pool' if it is given.
+class RobotFigure : public Figure
+{
+public:
+  RobotFigure(rob_diag::Robot& robot, const rob_diag::Rect& bounds, const rob_diag::Workspace* workspace,
+              rob_diag::WorkPool* pool = NULL)
+    : robot_(robot), bounds_(bounds), workspace_(workspace), pool_(pool)
+  {}
+  svg::Dimensions size() const
+  {
+    return svg::Dimensions(bounds_.right_ - bounds_.left_ + canvas_margin * 2.0,
+                           bounds_.top_ - bounds_.bottom_ + canvas_margin * 2.0);
+  }
+  void draw(Document& doc, bool symbols) const
+  {
+    draw_at(doc, svg::Point(0, 0), symbols, NULL);
+  }
+  // Draws it with the bottom left of its canvas at 'corner'.  Glyphs in
+  // 'defined' are taken as drawn already (see Robot::draw_symbols_at).
+  void draw_at(Document& doc, const svg::Point& corner, bool symbols, std::set<std::string>* defined) const
+  {
+    rob_diag::Pose origin(corner.x - bounds_.left_ + canvas_margin, corner.y - bounds_.bottom_ + canvas_margin, 0);
+    if (workspace_)
+      workspace_->draw_at(doc, origin);
+    if (symbols)
+      robot_.draw_symbols_at(doc, origin, defined);
+    else
+      rob_diag::parallel_draw_at(robot_, doc, origin, pool_);
+  }
+private:
+  rob_diag::Robot& robot_;
+  rob_diag::Rect bounds_;
+  const rob_diag::Workspace* workspace_;
+  rob_diag::WorkPool* pool_;
+};
+
+bool draw_svg(const Figure& figure, svg::Sink& sink, const DrawSettings& settings)
+{
+  // Shapes are streamed out as they are drawn.
+  Document doc(sink, svg::Layout(figure.size(), svg::Layout::BottomLeft));
+  doc.setLineBatching(settings.paths_);
+  doc.setPrecision(settings.decimals_);
+  doc.setRelativePaths(settings.relative_);
+  figure.draw(doc, settings.symbols_);
+
+  // Save and quit
+  return doc.save();
+}
+
+// Draws the same picture as draw_svg, scaled by settings.raster_scale_, and
+// writes it to 'sink' as a PNG (with a transparent background) or a PPM
+// (with a white one).  Text is left out.
+bool draw_image(const Figure& figure, svg::Sink& sink, const DrawSettings& settings)
+{
+  double scale = settings.raster_scale_;
+  svg::Dimensions dimensions = figure.size();
+  dimensions.width *= scale;
+  dimensions.height *= scale;
+  bool png = settings.image_ == DrawSettings::Png;
+  rob_diag::Raster raster((int)std::ceil(dimensions.width), (int)std::ceil(dimensions.height),
+                          png ? svg::Color(svg::Color::Transparent) : svg::Color(svg::Color::White));
+  // The canvas is whole pixels, so the bottom-left origin sits on its
+  // bottom edge.
+  dimensions.height = raster.height();
+
+  Document doc(raster, svg::Layout(dimensions, svg::Layout::BottomLeft, scale));
+  figure.draw(doc, false);
+  return png ? raster.write_png(sink) : raster.write_ppm(sink);
+}
+
+// Draws 'figure' to 'sink' in the format 'settings' ask for: SVG, gzipped on
+// its way to 'sink' for .svgz output, or an image.
+bool draw_figure(const Figure& figure, svg::Sink& sink, const DrawSettings& settings)
+{
+  if (settings.image_ != DrawSettings::Svg)
+    return draw_image(figure, sink, settings);
+  if (settings.compression_ < 0)
+    return draw_svg(figure, sink, settings);
+  rob_diag::GzipSink gzip(sink, settings.compression_);
+  bool drawn = draw_svg(figure, gzip, settings);
+  return gzip.finish() && drawn;
+}
+
+// Draws an already measured robot onto a canvas covering 'bounds' (plus a
+// margin), with its workspace (if any) behind it.  'pool', if given, is used
+// to draw big robots.
+bool draw_robot(rob_diag::Robot& robot, svg::Sink& sink, const rob_diag::Rect& bounds,
+                const rob_diag::Workspace* workspace = NULL, const DrawSettings& settings = DrawSettings(),
+                rob_diag::WorkPool* pool = NULL)
+{
+  return draw_figure(RobotFigure(robot, bounds, workspace, pool), sink, settings);
+}
+
+bool draw_robot(rob_diag::Robot& robot, std::string filename, const rob_diag::Rect& bounds,
+                const rob_diag::Workspace* workspace = NULL, const DrawSettings& settings = DrawSettings(),
+                rob_diag::WorkPool* pool = NULL)
+{
+  rob_diag::PhaseTimer timer(rob_diag::DrawPhase);
+  rob_diag::PhaseTimer opening(rob_diag::WritePhase);
+  svg::FileSink file(filename);
+  opening.stop();
+  if (!file.good())
+    return false;
+  rob_diag::StatsSink sink(file);
+  bool good = draw_robot(robot, sink, bounds, workspace, settings, pool);
+  rob_diag::PhaseTimer closing(rob_diag::WritePhase);
+  return file.close(good);
+}
+
+// Measures and draws a robot; 'pool', if given, is used for big trees.
+bool draw_robot(rob_diag::Robot& robot, std::string filename, const rob_diag::Workspace* workspace = NULL,
+                const DrawSettings& settings = DrawSettings(), rob_diag::WorkPool* pool = NULL)
+{
+  // Compute dimensions
+  rob_diag::PhaseTimer timer(rob_diag::MeasurePhase);
+  rob_diag::Rect bounds = rob_diag::parallel_compute_dimensions(robot, pool);
+  if (workspace)
+    bounds.extend(workspace->bounds());
+  timer.stop();
+  return draw_robot(robot, filename, bounds, workspace, settings, pool);
+}
+
+// Part of every output cache key.  Change it whenever the SVG drawn for a
+// given .robot file changes, so that diagrams cached by older versions are
+// re-rendered rather than reused.
+static const char* const render_version = "generate_robots svg 2";
+
+// Samples the robot's workspace if the file asked for one, spreading the
+// work over 'pool' if it is given.
+void compute_workspace(const rob_diag::Robot& robot, const rob_diag::DiagramOptions& options,
+                       rob_diag::Workspace& workspace, rob_diag::WorkPool* pool)
 {
-  std::stringstream ss(s);
-  std::istream_iterator<std::string> begin(ss);
-  std::istream_iterator<std::string> end;
-  std::vector<std::string> vstrings(begin, end);
-  return vstrings;
+  rob_diag::PhaseTimer timer(rob_diag::WorkspacePhase);
+  if (options.workspace_samples_ > 0)
+    workspace.compute(robot, options.workspace_samples_, options.workspace_cell_, pool);
 }
 
-// TODO: delete copy constructor of robot!
-bool add_element(rob_diag::Robot& robot, std::string line)
+// Puts a robot in the pose its file asks for: solves for the joints that
+// reach its targets (see IkSolver), then closes the loops of a closed chain
+// (see LoopSolver).  If either can't be done, warns and returns false; the
+// robot is left as close as it got, so it can still be drawn.
+bool pose_robot(rob_diag::Robot& robot, const char* filename, std::ostream& err)
 {
-  // TODO: do float parsing better...std::stof is only C++11...std::strtod sucks for error conditions.
-  try
+  if (robot.targets_.empty() && robot.closures_.empty())
+    return true;
+  rob_diag::PhaseTimer timer(rob_diag::MeasurePhase);
+  bool posed = true;
+  if (!robot.targets_.empty())
   {
-    std::vector<std::string> words = split(line);
-    if (words.size() == 0)
+    rob_diag::IkSolver solver;
+    solver.assign(robot);
+    if (!solver.solve(robot))
     {
-      std::cerr << "No arguments on line!" << std::endl;
-      return false;
+      err << filename << ": the target is out of reach (missed by " << solver.position_error() << ", "
+          << solver.angle_error() << " rad)" << std::endl;
+      posed = false;
     }
-    if (words[0] == "base" || words[0] == "invisible_base")
+  }
+  if (!robot.closures_.empty())
+  {
+    rob_diag::LoopSolver solver;
+    solver.assign(robot);
+    if (!solver.solve(robot))
     {
-      if (words.size() == 1)
-      {
-        rob_diag::RobotElement* base = (rob_diag::RobotElement*)new rob_diag::Base();
-        if (words[0] == "invisible_base")
-          ((rob_diag::Base*)base)->visible_ = false;
-        robot.elements_.push_back(base);
-        return true;
-      }
-      else if (words.size() == 2)
-      {
-        double width = std::strtod (words[1].c_str(), NULL);
-        rob_diag::RobotElement* base = (rob_diag::RobotElement*)new rob_diag::Base(width);
-        if (words[0] == "invisible_base")
-          ((rob_diag::Base*)base)->visible_ = false;
-        robot.elements_.push_back(base);
-        return true;
-      }
-      std::cerr << "Invalid arguments for " << words[0] << std::endl;
-      return false;
+      err << filename << ": the loops don't close (they miss by " << solver.residual() << ")" << std::endl;
+      posed = false;
     }
-    else if (words[0] == "link")
+  }
+  return posed;
+}
+
+// A robot and the arena its elements live in.  Reusing one of these from
+// file to file keeps the element list, the measure cache and the arena's
+// blocks, so after the first few files loading allocates no new memory for
+// them.
+struct RobotStorage
+{
+  rob_diag::Robot robot_;
+  rob_diag::Arena arena_;
+};
+
+// Empties the robot, destroying its elements all at once.
+void delete_robot(RobotStorage& storage)
+{
+  storage.robot_.elements_.clear();
+  storage.robot_.closures_.clear();
+  storage.robot_.targets_.clear();
+  storage.robot_.invalidate();
+  storage.arena_.reset();
+  // TODO! NOTE: ensure this is called on any failure, even after a bad 'add element'
+}
+
+// True for "<name>.robotc", a .robot file compiled with --compile.
+bool is_compiled_robot(const std::string& filename)
+{
+  return filename.size() >= 7 && filename.compare(filename.size() - 7, 7, ".robotc") == 0;
+}
+
+// Reads a .robot (or compiled .robotc) file into 'storage' and 'options'.  On
+// failure the robot is left empty.
+bool load_robot(RobotStorage& storage, rob_diag::DiagramOptions& options, const char* filename,
+                std::ostream& out, std::ostream& err)
+{
+  if (is_compiled_robot(filename))
+  {
+    // No parsing; the elements are built straight from the mapped records.
+    rob_diag::MappedRobot mapped;
+    std::string error;
+    rob_diag::PhaseTimer reading(rob_diag::ReadPhase);
+    if (!mapped.open(filename, error))
     {
-      if (words.size() == 2)
-      {
-        double length = std::strtod (words[1].c_str(), NULL);
-        rob_diag::RobotElement* link = (rob_diag::RobotElement*)new rob_diag::Link(length);
-        robot.elements_.push_back(link);
-        return true;
-      }
-      else if (words.size() == 3 || words.size() == 5)
-      {
-        double length = std::strtod (words[1].c_str(), NULL);
-        rob_diag::RobotElement* link = (rob_diag::RobotElement*)new rob_diag::Link(length, words[2]);
-        if (words.size() == 5)
-        {
-          ((rob_diag::Link*)link)->text_x_offset_ = std::strtod(words[3].c_str(), NULL);
-          ((rob_diag::Link*)link)->text_y_offset_ = std::strtod(words[4].c_str(), NULL);
-        }
-        robot.elements_.push_back(link);
-        return true;
-      }
-      std::cerr << "Invalid arguments for " << words[0] << std::endl;
+      err << error << std::endl;
       return false;
     }
-    else if (words[0] == "invisible_link")
+    reading.stop();
+    rob_diag::PhaseTimer building(rob_diag::ParsePhase);
+    mapped.build(storage.robot_, storage.arena_);
+    options.workspace_samples_ = mapped.header().workspace_samples_;
+    options.workspace_cell_ = mapped.header().workspace_cell_;
+    building.stop();
+    if (rob_diag::current_stats())
+      rob_diag::current_stats()->count_elements(storage.robot_);
+    return true;
+  }
+
+  rob_diag::MappedFile file;
+  rob_diag::PhaseTimer reading(rob_diag::ReadPhase);
+  if (!file.open(filename))
+  {
+    out << "Unable to open " << filename << std::endl; 
+    return false;
+  }
+  reading.stop();
+  rob_diag::PhaseTimer parsing(rob_diag::ParsePhase);
+  rob_diag::RobotParser parser(filename, err);
+  if (!parser.parse(file.data(), file.size(), storage.robot_, storage.arena_, options))
+  {
+    delete_robot(storage);
+    return false;
+  }
+  parsing.stop();
+  if (rob_diag::current_stats())
+    rob_diag::current_stats()->count_elements(storage.robot_);
+  return true;
+}
+
+// Splits "<name>.robot" (or "<name>.robotc") into its base name; false for
+// any other extension.
+bool robot_file_base(const char* filename, std::string& file_base, std::ostream& err)
+{
+  std::string file_string(filename);
+  if (is_compiled_robot(file_string))
+  {
+    file_base = file_string.substr(0, file_string.size() - 7);
+    return true;
+  }
+  if (file_string.size() < 6 || file_string.substr(file_string.size() - 6, 6) != ".robot")
+  {
+    err << filename << " is not a valid .robot filename." << std::endl;
+    return false;
+  }
+  file_base = file_string.substr(0, file_string.size() - 6);
+  return true;
+}
+
+// The output cache key for a .robot (or .robotc) file: a hash of the
+// renderer version, the settings that change the output, and the file's
+// normalized text (so that whitespace and line ending changes don't count as
+// changes).
+bool cache_key(const char* filename, const DrawSettings& settings, std::string& key)
+{
+  rob_diag::MappedFile file;
+  if (!file.open(filename))
+    return false;
+  rob_diag::ContentHash hash;
+  hash(render_version);
+  if (settings.symbols_)
+    hash(" symbols");
+  if (settings.paths_)
+    hash(" paths");
+  if (settings.decimals_ >= 0)
+  {
+    char precision[32];
+    std::snprintf(precision, sizeof(precision), " decimals %d", settings.decimals_);
+    hash(precision);
+  }
+  if (settings.relative_)
+    hash(" relative");
+  if (settings.compression_ >= 0)
+  {
+    char compression[32];
+    std::snprintf(compression, sizeof(compression), " svgz %d", settings.compression_);
+    hash(compression);
+  }
+  if (settings.image_ != DrawSettings::Svg)
+  {
+    char image[64];
+    std::snprintf(image, sizeof(image), " %s %.17g", output_extension(settings), settings.raster_scale_);
+    hash(image);
+  }
+  if (is_compiled_robot(filename))
+  {
+    hash("\nrobotc\n");
+    hash(file.data(), file.size());
+  }
+  else
+  {
+    hash("\nrobot\n");
+    rob_diag::RobotParser::normalize(file.data(), file.size(), hash);
+  }
+  key = hash.hex();
+  return true;
+}
+
+// Converts one .robot file to an .svg next to it.  Progress and error
+// messages go to 'out' and 'err' rather than straight to the console, so that
+// batch mode can buffer them per file and print them in input order.  The
+// robot is loaded into 'storage', which is left empty again afterwards.
+// 'pool', if given, is used to sample the workspace, and to measure and draw
+// big robots.  With a cache in
+// 'settings', files that were rendered before are taken from it without
+// being loaded at all (setting 'cached'), and new renders are added to it.
+bool draw_robot_file(const char* filename, RobotStorage& storage, std::ostream& out, std::ostream& err,
+                     rob_diag::WorkPool* pool, const DrawSettings& settings, bool& cached)
+{
+  std::string file_base;
+  if (!robot_file_base(filename, file_base, err))
+    return false;
+  std::string svg_name = file_base + output_extension(settings);
+
+  rob_diag::RenderCache* cache = settings.cache_;
+  std::string key;
+  if (cache)
+  {
+    rob_diag::PhaseTimer timer(rob_diag::CachePhase);
+    if (!cache_key(filename, settings, key))
     {
-      if (words.size() == 2)
-      {
-        double length = std::strtod (words[1].c_str(), NULL);
-        rob_diag::Link* tmp = new rob_diag::Link(length);
-        tmp->visible_ = false;
-        rob_diag::RobotElement* link = (rob_diag::RobotElement*)tmp;
-        robot.elements_.push_back(link);
-        return true;
-      }
-      std::cerr << "Invalid arguments for " << words[0] << std::endl;
+      out << "Unable to open " << filename << std::endl;
       return false;
     }
-    else if (words[0] == "frames")
+    if (cache->fetch(key, svg_name))
     {
-      if (words.size() == 1)
-      {
-        rob_diag::RobotElement* link = (rob_diag::RobotElement*)new rob_diag::Frames();
-        robot.elements_.push_back(link);
-        return true;
-      }
-      std::cerr << "Invalid (or not yet supported) arguments for " << words[0] << std::endl;
-      return false;
+      cached = true;
+      return true;
     }
-    else if (words[0] == "rjoint" || words[0] == "invisible_rjoint")
+  }
+
+  rob_diag::Robot& robot = storage.robot_;
+  rob_diag::DiagramOptions options;
+  if (!load_robot(storage, options, filename, out, err))
+    return false;
+  bool posed = pose_robot(robot, filename, err);
+  rob_diag::Workspace workspace;
+  compute_workspace(robot, options, workspace, pool);
+  bool saved = draw_robot(robot, svg_name, options.workspace_samples_ > 0 ? &workspace : NULL, settings, pool);
+  delete_robot(storage);
+  if (!saved)
+    err << "Unable to write " << svg_name << std::endl;
+  // A robot that missed its pose is still drawn, but fails (and isn't
+  // cached, so the next run reports it again).
+  else if (cache && posed)
+  {
+    rob_diag::PhaseTimer timer(rob_diag::CachePhase);
+    if (!cache->store(key, svg_name))
+      err << "Unable to add " << svg_name << " to the cache in " << cache->directory() << std::endl;
+  }
+  return saved && posed;
+}
+
+// Converts one .robot file to an .svg next to it (see draw_robot_file), and
+// with --stats records where the time went.  Only what happens on this
+// thread is counted: a workspace sampled on 'pool' counts as the wall time
+// it took, not the CPU time or allocations of the other threads.
+bool draw_robot(const char* filename, RobotStorage& storage, std::ostream& out, std::ostream& err,
+                rob_diag::WorkPool* pool = NULL, const DrawSettings& settings = DrawSettings())
+{
+  bool cached = false;
+  if (!settings.stats_)
+    return draw_robot_file(filename, storage, out, err, pool, settings, cached);
+  rob_diag::FileStats stats;
+  rob_diag::current_stats() = &stats;
+  unsigned long long allocations = rob_diag::thread_allocations();
+  bool good = draw_robot_file(filename, storage, out, err, pool, settings, cached);
+  stats.allocations_ = rob_diag::thread_allocations() - allocations;
+  rob_diag::current_stats() = NULL;
+  settings.stats_->add(rob_diag::current_file_position(), filename, stats, good, cached);
+  return good;
+}
+
+bool draw_robot(const char* filename)
+{
+  RobotStorage storage;
+  return draw_robot(filename, storage, std::cout, std::cerr);
+}
+
+// The SVG that draw_robot writes for 'robot' (without a workspace).
+std::string robot_svg(rob_diag::Robot& robot)
+{
+  std::ostringstream svg;
+  svg::StreamSink sink(svg);
+  draw_robot(robot, sink, robot.compute_dimensions());
+  return svg.str();
+}
+
+// Compiles one .robot file to a .robotc next to it, then checks that the
+// result round-trips: it has to load back into a robot that compiles to the
+// same bytes and draws the same SVG as the text file.
+bool compile_robot(const char* filename, RobotStorage& storage, std::ostream& out, std::ostream& err,
+                   rob_diag::WorkPool* /* pool */ = NULL, const DrawSettings& /* settings */ = DrawSettings())
+{
+  std::string file_base;
+  if (!robot_file_base(filename, file_base, err))
+    return false;
+  if (is_compiled_robot(filename))
+  {
+    err << filename << " is already compiled." << std::endl;
+    return false;
+  }
+
+  rob_diag::DiagramOptions options;
+  if (!load_robot(storage, options, filename, out, err))
+    return false;
+  std::string binary;
+  rob_diag::encode_binary_robot(storage.robot_, options.workspace_samples_, options.workspace_cell_, binary);
+  std::string compiled = file_base + ".robotc";
+  svg::FileSink file(compiled);
+  if (!file.good() || !file.close(file.write(binary.data(), binary.size())))
+  {
+    err << "Unable to write " << compiled << std::endl;
+    delete_robot(storage);
+    return false;
+  }
+
+  RobotStorage copy;
+  rob_diag::DiagramOptions copy_options;
+  std::string copy_binary;
+  bool good = load_robot(copy, copy_options, compiled.c_str(), out, err);
+  if (good)
+  {
+    rob_diag::encode_binary_robot(copy.robot_, copy_options.workspace_samples_, copy_options.workspace_cell_,
+                                  copy_binary);
+    good = copy_binary == binary && robot_svg(copy.robot_) == robot_svg(storage.robot_);
+    if (!good)
+      err << compiled << " doesn't match " << filename << std::endl;
+  }
+  delete_robot(copy);
+  delete_robot(storage);
+  return good;
+}
+
+// Converts one file, reusing 'storage'; draw_robot or compile_robot.
+typedef bool (*ConvertFunction)(const char* filename, RobotStorage& storage, std::ostream& out,
+                                std::ostream& err, rob_diag::WorkPool* pool, const DrawSettings& settings);
+
+// Converts a list of files on a work-stealing pool.  Each file's messages are
+// buffered and flushed in input order as soon as every earlier file is done,
+// so the console output is the same as for a serial run.  'workspace_pool' is
+// handed on to draw_robot; it must not be the pool running this task.  Each
+// worker loads its files into its own element of 'storage' (one per worker).
+// 'settings' (and any cache in them) are shared by all of them.
+class ConvertTask : public rob_diag::WorkTask
+{
+public:
+  ConvertTask(const std::vector<const char*>& files, ConvertFunction convert, RobotStorage* storage,
+              rob_diag::WorkPool* workspace_pool, const DrawSettings& settings)
+    : files_(files), convert_(convert), results_(files.size()), storage_(storage),
+      workspace_pool_(workspace_pool), settings_(settings), next_to_print_(0), num_good_(0)
+  {
+    pthread_mutex_init(&print_mutex_, NULL);
+  }
+  virtual ~ConvertTask()
+  {
+    pthread_mutex_destroy(&print_mutex_);
+  }
+  virtual void run(size_t index, unsigned worker)
+  {
+    Result& result = results_[index];
+    std::ostringstream out, err;
+    rob_diag::current_file_position() = index;
+    result.good_ = convert_(files_[index], storage_[worker], out, err, workspace_pool_, settings_);
+    if (result.good_)
+      out << files_[index] << ": success" << std::endl;
+    result.out_ = out.str();
+    result.err_ = err.str();
+
+    pthread_mutex_lock(&print_mutex_);
+    result.done_ = true;
+    while (next_to_print_ < results_.size() && results_[next_to_print_].done_)
     {
-      if (words.size() == 2)
-      {
-        double theta = std::strtod (words[1].c_str(), NULL);
-        rob_diag::RobotElement* rjoint = (rob_diag::RobotElement*)new rob_diag::RJoint(theta);
-        if (words[0] == "invisible_rjoint")
-          ((rob_diag::RJoint*)rjoint)->visible_ = false;
-        robot.elements_.push_back(rjoint);
-        return true;
-      }
-      if (words.size() == 3 || words.size() == 5)
-      {
-        double theta = std::strtod (words[1].c_str(), NULL);
-        rob_diag::RobotElement* rjoint = (rob_diag::RobotElement*)new rob_diag::RJoint(theta, 4, words[2]);
-        if (words[0] == "invisible_rjoint")
-          ((rob_diag::RJoint*)rjoint)->visible_ = false;
-        if (words.size() == 5)
-        {
-          ((rob_diag::RJoint*)rjoint)->text_x_offset_ = std::strtod(words[3].c_str(), NULL);
-          ((rob_diag::RJoint*)rjoint)->text_y_offset_ = std::strtod(words[4].c_str(), NULL);
-        }
-        robot.elements_.push_back(rjoint);
-        return true;
-      }
-      std::cerr << "Invalid arguments for " << words[0] << std::endl;
-      return false;
+      Result& next = results_[next_to_print_];
+      std::cerr << next.err_ << std::flush;
+      std::cout << next.out_ << std::flush;
+      if (next.good_)
+        ++num_good_;
+      // Release the text; we don't need it again.
+      std::string().swap(next.out_);
+      std::string().swap(next.err_);
+      ++next_to_print_;
     }
-    else if (words[0] == "pjoint")
+    pthread_mutex_unlock(&print_mutex_);
+  }
+  int num_good() const { return num_good_; }
+private:
+  struct Result
+  {
+    Result() : done_(false), good_(false) {}
+    bool done_, good_;
+    std::string out_, err_;
+  };
+  const std::vector<const char*>& files_;
+  ConvertFunction convert_;
+  std::vector<Result> results_;
+  RobotStorage* storage_;
+  rob_diag::WorkPool* workspace_pool_;
+  const DrawSettings& settings_;
+  pthread_mutex_t print_mutex_;
+  size_t next_to_print_;
+  int num_good_;
+};
+
+// Orders file indices so the biggest files are scheduled first; ties (and
+// files we can't stat) keep their input order.
+struct BiggerFirst
+{
+  BiggerFirst(const std::vector<long long>& sizes) : sizes_(sizes) {}
+  bool operator()(size_t a, size_t b) const { return sizes_[a] > sizes_[b]; }
+  const std::vector<long long>& sizes_;
+};
+
+// Converts 'files' on 'pool', with one RobotStorage per worker in 'storage'.
+// Returns the number converted.
+int convert_files(const std::vector<const char*>& files, rob_diag::WorkPool& pool, RobotStorage* storage,
+                  ConvertFunction convert, const DrawSettings& settings)
+{
+  std::vector<long long> sizes(files.size(), 0);
+  std::vector<size_t> order(files.size());
+  for (size_t i = 0; i < files.size(); ++i)
+  {
+    struct stat st;
+    if (stat(files[i], &st) == 0)
+      sizes[i] = st.st_size;
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), BiggerFirst(sizes));
+
+  if (files.size() == 1)
+  {
+    // Nothing to spread out; let the file's workspace use the threads.
+    ConvertTask task(files, convert, storage, &pool, settings);
+    task.run(0, 0);
+    return task.num_good();
+  }
+  ConvertTask task(files, convert, storage, NULL, settings);
+  pool.run(task, order);
+  return task.num_good();
+}
+
+int convert_files(const std::vector<const char*>& files, unsigned num_threads,
+                  ConvertFunction convert = draw_robot, const DrawSettings& settings = DrawSettings())
+{
+  rob_diag::WorkPool pool(num_threads);
+  RobotStorage* storage = new RobotStorage[pool.size()];
+  int num_good = convert_files(files, pool, storage, convert, settings);
+  delete[] storage;
+  return num_good;
+}
+
+// Regenerates .robot and .robotc files in 'paths' (files, or directories
+// of them) whenever they are saved, until interrupted.  The pool, the
+// per-worker robot storage and the cache are kept from one change to the next,
+// so a save is usually drawn within milliseconds.
+int watch(const std::vector<const char*>& paths, unsigned num_threads, const DrawSettings& settings)
+{
+  rob_diag::FileWatcher watcher;
+  for (size_t i = 0; i < paths.size(); ++i)
+  {
+    std::string error;
+    if (!watcher.add(paths[i], error))
     {
-      if (words.size() == 1)
-      {
-        rob_diag::RobotElement* pjoint = (rob_diag::RobotElement*)new rob_diag::PJoint();
-        robot.elements_.push_back(pjoint);
-        return true;
-      }
-      std::cerr << "Invalid arguments for " << words[0] << std::endl;
-      return false;
+      std::cerr << error << std::endl;
+      return -1;
     }
-    else if (words[0] == "effector")
+  }
+  rob_diag::WorkPool pool(num_threads);
+  RobotStorage* storage = new RobotStorage[pool.size()];
+  std::cout << "Watching for changes (Ctrl-C to stop)..." << std::endl;
+
+  std::vector<std::string> changed;
+  std::vector<const char*> files;
+  // Editors tend to write a file in a few steps; wait for them to finish.
+  const int quiet_ms = 20;
+  while (watcher.wait(changed, quiet_ms))
+  {
+    files.clear();
+    for (size_t i = 0; i < changed.size(); ++i)
     {
-      if (words.size() == 1)
-      {
-        rob_diag::RobotElement* ee = (rob_diag::RobotElement*)new rob_diag::EndEffector();
-        robot.elements_.push_back(ee);
-        return true;
-      }
-      std::cerr << "Invalid (or not yet supported) arguments for " << words[0] << std::endl;
-      return false;
+      const std::string& name = changed[i];
+      if (is_compiled_robot(name) || (name.size() > 6 && name.compare(name.size() - 6, 6, ".robot") == 0))
+        files.push_back(name.c_str());
     }
-    else if (words[0] == "vector")
+    if (files.empty())
+      continue;
+    double start = rob_diag::monotonic_seconds();
+    int num_good = convert_files(files, pool, storage, draw_robot, settings);
+    std::printf("Regenerated %d/%lu files in %.1f ms.\n", num_good, (unsigned long)files.size(),
+                (rob_diag::monotonic_seconds() - start) * 1e3);
+    std::fflush(stdout);
+  }
+  delete[] storage;
+  std::cerr << "Stopped watching: " << std::strerror(errno) << std::endl;
+  return -1;
+}
+
+// Reads rows of joint values from a CSV file, one row at a time, reusing the
+// line buffer.  Blank lines are skipped, as is a header row (a first line
+// that doesn't start with a number).
+class JointCsv
+{
+public:
+  JointCsv(const char* filename)
+    : filename_(filename), file_(filename), line_number_(0), failed_(false)
+  {}
+  bool is_open() const { return file_.is_open(); }
+  // Reads the next row into 'values'.  Returns false at the end of the file,
+  // or on a malformed row (in which case 'failed()' is set).
+  bool next(std::vector<double>& values, std::ostream& err)
+  {
+    while (getline(file_, line_))
     {
-      if (words.size() == 2)
-      {
-        double length = std::strtod (words[1].c_str(), NULL);
-        rob_diag::RobotElement* vec = (rob_diag::RobotElement*)new rob_diag::Vector(length);
-        robot.elements_.push_back(vec);
+      ++line_number_;
+      if (line_.find_first_not_of(" \t\r") == std::string::npos)
+        continue;
+      if (parse_row(values))
         return true;
-      }
-      else if (words.size() == 3 || words.size() == 5)
-      {
-        double length = std::strtod (words[1].c_str(), NULL);
-        rob_diag::RobotElement* vec = (rob_diag::RobotElement*)new rob_diag::Vector(length, words[2]);
-        if (words.size() == 5)
-        {
-          ((rob_diag::Vector*)vec)->text_x_offset_ = std::strtod(words[3].c_str(), NULL);
-          ((rob_diag::Vector*)vec)->text_y_offset_ = std::strtod(words[4].c_str(), NULL);
-        }
-        robot.elements_.push_back(vec);
-        return true;
-      }
-      std::cerr << "Invalid arguments for " << words[0] << std::endl;
+      if (line_number_ == 1)
+        continue;
+      err << filename_ << ":" << line_number_ << ": expected a comma separated row of numbers:" << std::endl << line_ << std::endl;
+      failed_ = true;
       return false;
     }
-    else if (words[0] == "point")
+    return false;
+  }
+  void rewind()
+  {
+    file_.clear();
+    file_.seekg(0);
+    line_number_ = 0;
+  }
+  bool failed() const { return failed_; }
+  int line_number() const { return line_number_; }
+private:
+  bool parse_row(std::vector<double>& values)
+  {
+    values.clear();
+    const char* pos = line_.c_str();
+    while (true)
     {
-      if (words.size() == 1)
-      {
-        rob_diag::RobotElement* pt = (rob_diag::RobotElement*)new rob_diag::RobPoint();
-        robot.elements_.push_back(pt);
-        return true;
-      }
-      else if (words.size() == 2)
-      {
-        rob_diag::RobotElement* pt = (rob_diag::RobotElement*)new rob_diag::RobPoint(2, words[1]);
-        robot.elements_.push_back(pt);
+      char* end;
+      double value = std::strtod(pos, &end);
+      if (end == pos)
+        return false;
+      values.push_back(value);
+      pos = end;
+      while (*pos == ' ' || *pos == '\t' || *pos == '\r')
+        ++pos;
+      if (*pos == '\0')
         return true;
-      }
-      std::cerr << "Invalid arguments for " << words[0] << std::endl;
-      return false;
+      if (*pos != ',')
+        return false;
+      ++pos;
     }
-    else
+  }
+  const char* filename_;
+  std::ifstream file_;
+  std::string line_;
+  int line_number_;
+  bool failed_;
+};
+
+// Renders one SVG frame per row of 'csv_filename', where column i sets the
+// angle of the i'th rjoint (visible or not) of the robot that isn't passive.
+// The robot is parsed once and reused for every frame.  The CSV is streamed
+// twice: first to find a canvas that fits every frame, so that the frames
+// line up, then to draw.  Frames are written to <prefix>_00000.svg,
+// <prefix>_00001.svg, ...
+// For a closed chain, each pass closes the loops of each frame, starting
+// from the last frame's passive joint values (so each takes a step or two,
+// and the linkage doesn't flip between assemblies).  Both passes start from
+// the same values, so they solve the same poses, and memory doesn't grow
+// with the number of frames.  If some frames' loops don't close, every
+// frame is still drawn, but the trajectory fails.
+// A workspace map, if the file asks for one, is sampled once (from the
+// file's joint values) on 'pool' and drawn behind every frame.
+bool draw_trajectory(const char* robot_filename, const char* csv_filename, std::string prefix,
+                     std::ostream& out, std::ostream& err, rob_diag::WorkPool* pool = NULL,
+                     const DrawSettings& settings = DrawSettings())
+{
+  std::string file_base;
+  if (!robot_file_base(robot_filename, file_base, err))
+    return false;
+  if (prefix.empty())
+    prefix = file_base;
+
+  RobotStorage storage;
+  rob_diag::Robot& robot = storage.robot_;
+  rob_diag::DiagramOptions options;
+  if (!load_robot(storage, options, robot_filename, out, err))
+    return false;
+  pose_robot(robot, robot_filename, err);
+  rob_diag::Workspace workspace;
+  compute_workspace(robot, options, workspace, pool);
+  const rob_diag::Workspace* background = options.workspace_samples_ > 0 ? &workspace : NULL;
+  std::vector<rob_diag::RJoint*> joints;
+  for (size_t i = 0; i < robot.elements_.size(); ++i)
+  {
+    rob_diag::RJoint* joint = dynamic_cast<rob_diag::RJoint*>(robot.elements_[i]);
+    if (joint && !joint->passive_)
+      joints.push_back(joint);
+  }
+  rob_diag::LoopSolver solver;
+  solver.assign(robot);
+  bool closed = !robot.closures_.empty();
+  // Where both passes start solving from.
+  std::vector<double> start_passive;
+  solver.get_values(robot, start_passive);
+  int num_open = 0;
+
+  JointCsv csv(csv_filename);
+  if (!csv.is_open())
+  {
+    out << "Unable to open " << csv_filename << std::endl;
+    delete_robot(storage);
+    return false;
+  }
+
+  // Pass 1: the union of every frame's bounds.
+  std::vector<double> values;
+  rob_diag::Rect bounds;
+  int num_frames = 0;
+  while (csv.next(values, err))
+  {
+    if (values.size() != joints.size())
     {
-      std::cerr << words[0] << " not recognized!" << std::endl;
+      err << csv_filename << ":" << csv.line_number() << ": expected " << joints.size()
+          << " joint values, found " << values.size() << std::endl;
+      delete_robot(storage);
       return false;
     }
+    for (size_t i = 0; i < joints.size(); ++i)
+      joints[i]->set_theta(values[i]);
+    if (closed && !solver.solve(robot))
+      ++num_open;
+    rob_diag::Rect frame_bounds = robot.update_dimensions();
+    if (num_frames == 0)
+      bounds = frame_bounds;
+    else
+      bounds.extend(frame_bounds);
+    if (background)
+      bounds.extend(background->bounds());
+    ++num_frames;
   }
-  catch (...)
+  if (csv.failed() || num_frames == 0)
   {
+    if (num_frames == 0)
+      err << csv_filename << " has no joint values." << std::endl;
+    delete_robot(storage);
     return false;
   }
-  
-  return false;
+  if (num_open > 0)
+    err << robot_filename << ": the loops don't close in " << num_open << " of " << num_frames << " frames"
+        << std::endl;
+
+  // Pass 2: draw every frame on the shared canvas.
+  csv.rewind();
+  solver.set_values(robot, start_passive);
+  int frame = 0;
+  char suffix[32];
+  while (csv.next(values, err))
+  {
+    // The file could have changed since the first pass.
+    if (values.size() != joints.size())
+    {
+      err << csv_filename << ":" << csv.line_number() << ": expected " << joints.size()
+          << " joint values, found " << values.size() << std::endl;
+      delete_robot(storage);
+      return false;
+    }
+    for (size_t i = 0; i < joints.size(); ++i)
+      joints[i]->set_theta(values[i]);
+    if (closed)
+      solver.solve(robot);
+    robot.update_dimensions();
+    std::snprintf(suffix, sizeof(suffix), "_%05d%s", frame, output_extension(settings));
+    if (!draw_robot(robot, prefix + suffix, bounds, background, settings))
+    {
+      err << "Unable to write " << prefix << suffix << std::endl;
+      delete_robot(storage);
+      return false;
+    }
+    ++frame;
+  }
+  delete_robot(storage);
+  out << "Rendered " << frame << " frames to " << prefix << "_*" << output_extension(settings) << std::endl;
+  return !csv.failed() && num_open == 0;
 }
 
-void draw_robot(rob_diag::Robot& robot, std::string filename)
+// Appends streamed SVG output to a std::string.
+bool append_to_string(void* user, const char* data, size_t size)
 {
-  // Compute dimensions
-  rob_diag::Rect bounds = robot.compute_dimensions();
-  double width = bounds.right_ - bounds.left_;
-  double height = bounds.top_ - bounds.bottom_;
-  double margin = 10;
-  svg::Dimensions dimensions(width + margin * 2.0, height + margin * 2.0);
+  ((std::string*)user)->append(data, size);
+  return true;
+}
 
-  // Draw to file:
-  Document doc(filename, svg::Layout(dimensions, svg::Layout::BottomLeft));
-  rob_diag::Pose origin(-bounds.left_ + margin, -bounds.bottom_ + margin, 0);
-  robot.draw_at(doc, origin);
+// Options for --atlas.
+struct AtlasSettings
+{
+  AtlasSettings()
+    : page_width_(2000), page_height_(0), captions_(false)
+  {}
+  // Page size in SVG pixels; with a height of 0, everything goes on one
+  // page, as tall as it needs to be.
+  double page_width_, page_height_;
+  // Write each file's name under its diagram.
+  bool captions_;
+};
 
-  // Save and quit
-  doc.save();
-}
+// Room under a diagram in an atlas for its caption.
+const double caption_height = 16;
 
-void delete_robot(rob_diag::Robot& robot)
+// A diagram in an atlas: the robot and workspace loaded from one file, and
+// where on which page it goes.
+struct AtlasEntry
 {
-  // TODO: move to a destructor? Don't store pointers?
-  for (int i = 0; i < robot.elements_.size(); ++i)
-    delete robot.elements_[i];
-  robot.elements_.clear();
-  // TODO! NOTE: ensure this is called on any failure, even after a bad 'add element'
+  AtlasEntry()
+    : figure_(NULL), good_(false), posed_(false)
+  {}
+  ~AtlasEntry()
+  {
+    delete figure_;
+    delete_robot(storage_);
+  }
+  RobotStorage storage_;
+  rob_diag::Workspace workspace_;
+  RobotFigure* figure_;
+  std::string caption_;
+  rob_diag::AtlasPacker::Placement placement_;
+  bool good_;
+  // Whether it reached its targets and closed its loops; it is drawn either
+  // way.
+  bool posed_;
+  // Messages from loading it.
+  std::string out_, err_;
+};
+
+// 'text' with the characters that are special in XML escaped.
+std::string xml_escape(const std::string& text)
+{
+  std::string escaped;
+  for (size_t i = 0; i < text.size(); ++i)
+  {
+    switch (text[i])
+    {
+      case '&': escaped += "&amp;"; break;
+      case '<': escaped += "&lt;"; break;
+      case '>': escaped += "&gt;"; break;
+      case '"': escaped += "&quot;"; break;
+      default: escaped += text[i]; break;
+    }
+  }
+  return escaped;
 }
 
-bool draw_robot(const char* filename)
+// Loads the files of an atlas, one per task, into their entries: each robot
+// is measured, with its workspace if the file asks for one.
+class AtlasLoadTask : public rob_diag::WorkTask
 {
-  std::string file_string(filename);
-  if (file_string.size() < 6 || file_string.substr(file_string.size() - 6, 6) != ".robot")
+public:
+  AtlasLoadTask(const std::vector<const char*>& files, AtlasEntry* entries)
+    : files_(files), entries_(entries)
+  {}
+  virtual void run(size_t index, unsigned /* worker */)
   {
-    std::cerr << filename << " is not a valid .robot filename." << std::endl;
+    AtlasEntry& entry = entries_[index];
+    std::ostringstream out, err;
+    std::string file_base;
+    rob_diag::DiagramOptions options;
+    rob_diag::Robot& robot = entry.storage_.robot_;
+    entry.good_ = robot_file_base(files_[index], file_base, err) &&
+                  load_robot(entry.storage_, options, files_[index], out, err);
+    if (entry.good_)
+    {
+      entry.posed_ = pose_robot(robot, files_[index], err);
+      compute_workspace(robot, options, entry.workspace_, NULL);
+      rob_diag::Rect bounds = robot.compute_dimensions();
+      bool has_workspace = options.workspace_samples_ > 0;
+      if (has_workspace)
+        bounds.extend(entry.workspace_.bounds());
+      entry.figure_ = new RobotFigure(robot, bounds, has_workspace ? &entry.workspace_ : NULL);
+      entry.caption_ = file_base.substr(file_base.rfind('/') + 1);
+    }
+    entry.out_ = out.str();
+    entry.err_ = err.str();
+  }
+private:
+  const std::vector<const char*>& files_;
+  AtlasEntry* entries_;
+};
+
+// One page of an atlas: the diagrams packed onto it, each drawn at its
+// placement, with its caption underneath if asked for.  With --symbols the
+// glyphs are shared by every diagram on the page.
+class AtlasPage : public Figure
+{
+public:
+  AtlasPage(const svg::Dimensions& size, bool captions)
+    : size_(size), captions_(captions)
+  {}
+  void add(const AtlasEntry* entry)
+  {
+    entries_.push_back(entry);
+  }
+  svg::Dimensions size() const
+  {
+    return size_;
+  }
+  void draw(Document& doc, bool symbols) const
+  {
+    std::set<std::string> defined;
+    double caption = captions_ ? caption_height : 0;
+    for (size_t i = 0; i < entries_.size(); ++i)
+    {
+      const AtlasEntry& entry = *entries_[i];
+      // Placements are from the top left of the page.
+      svg::Point corner(entry.placement_.x_,
+                        size_.height - entry.placement_.y_ - entry.figure_->size().height);
+      entry.figure_->draw_at(doc, corner, symbols, &defined);
+      if (captions_)
+        doc << Text(corner + svg::Point(canvas_margin, 4 - caption), xml_escape(entry.caption_),
+                    svg::Fill(svg::Color::Black));
+    }
+  }
+  size_t count() const { return entries_.size(); }
+private:
+  svg::Dimensions size_;
+  bool captions_;
+  std::vector<const AtlasEntry*> entries_;
+};
+
+// Draws 'figure' in memory and writes it to 'filename' in one go.
+bool write_figure(const Figure& figure, const std::string& filename, const DrawSettings& settings)
+{
+  std::string data;
+  svg::CallbackSink sink(&append_to_string, &data);
+  if (!draw_figure(figure, sink, settings))
     return false;
+  svg::FileSink file(filename);
+  return file.good() && file.close(file.write(data.data(), data.size()));
+}
+
+// Writes the pages of an atlas, one per task.
+class AtlasPageTask : public rob_diag::WorkTask
+{
+public:
+  AtlasPageTask(const std::vector<AtlasPage*>& pages, const std::vector<std::string>& filenames,
+                const DrawSettings& settings)
+    : pages_(pages), filenames_(filenames), settings_(settings), written_(pages.size(), false)
+  {}
+  virtual void run(size_t index, unsigned /* worker */)
+  {
+    written_[index] = write_figure(*pages_[index], filenames_[index], settings_);
+  }
+  bool written(size_t page) const { return written_[page]; }
+private:
+  const std::vector<AtlasPage*>& pages_;
+  const std::vector<std::string>& filenames_;
+  const DrawSettings& settings_;
+  // Not vector<bool>, which workers couldn't write to side by side.
+  std::vector<char> written_;
+};
+
+// Packs the diagrams of 'files' onto pages and writes each page as one
+// file: <prefix>.svg, or with a page height <prefix>_00000.svg,
+// <prefix>_00001.svg, ...  Files are loaded, and pages drawn, on a pool of
+// 'num_threads'; every diagram stays in memory until the pages are written.
+bool draw_atlas(const std::vector<const char*>& files, const std::string& prefix, unsigned num_threads,
+                const AtlasSettings& atlas, const DrawSettings& settings)
+{
+  rob_diag::WorkPool pool(num_threads);
+  AtlasEntry* entries = new AtlasEntry[files.size()];
+  AtlasLoadTask load(files, entries);
+  pool.run(load, files.size());
+
+  std::vector<size_t> loaded;
+  std::vector<svg::Dimensions> sizes;
+  size_t num_posed = 0;
+  for (size_t i = 0; i < files.size(); ++i)
+  {
+    std::cerr << entries[i].err_ << std::flush;
+    std::cout << entries[i].out_ << std::flush;
+    if (!entries[i].good_)
+      continue;
+    num_posed += entries[i].posed_;
+    svg::Dimensions size = entries[i].figure_->size();
+    if (atlas.captions_)
+      size.height += caption_height;
+    loaded.push_back(i);
+    sizes.push_back(size);
+  }
+
+  rob_diag::AtlasPacker packer(atlas.page_width_, atlas.page_height_);
+  std::vector<rob_diag::AtlasPacker::Placement> placements;
+  size_t num_pages = loaded.empty() ? 0 : packer.pack(sizes, placements);
+  std::vector<AtlasPage*> pages;
+  std::vector<std::string> filenames;
+  for (size_t p = 0; p < num_pages; ++p)
+  {
+    pages.push_back(new AtlasPage(packer.page_size(p), atlas.captions_));
+    char suffix[32] = "";
+    if (atlas.page_height_ > 0)
+      std::snprintf(suffix, sizeof(suffix), "_%05d", (int)p);
+    filenames.push_back(prefix + suffix + output_extension(settings));
+  }
+  for (size_t i = 0; i < loaded.size(); ++i)
+  {
+    AtlasEntry& entry = entries[loaded[i]];
+    entry.placement_ = placements[i];
+    pages[entry.placement_.page_]->add(&entry);
+  }
+  AtlasPageTask draw(pages, filenames, settings);
+  pool.run(draw, pages.size());
+
+  bool good = num_posed == files.size();
+  for (size_t p = 0; p < pages.size(); ++p)
+  {
+    svg::Dimensions size = pages[p]->size();
+    if (draw.written(p))
+      std::cout << filenames[p] << ": " << pages[p]->count() << " diagrams on " << size.width << " x "
+                << size.height << std::endl;
+    else
+      std::cerr << "Unable to write " << filenames[p] << std::endl;
+    good = good && draw.written(p);
+    delete pages[p];
   }
-  std::string file_base = file_string.substr(0, file_string.size() - 6);
-  std::string file_ext = file_string.substr(0, file_string.size() - 6);
+  std::cout << "Packed " << loaded.size() << "/" << files.size() << " files onto " << num_pages
+            << (num_pages == 1 ? " page." : " pages.") << std::endl;
+  delete[] entries;
+  return good;
+}
 
-  std::string line;
-  std::ifstream robot_config (filename);
-  if (robot_config.is_open())
+// Renders .robot text sent to --serve, the same way a .robot file would be
+// drawn.  Each server worker has its own RobotStorage and error stream, which
+// are reused from request to request.  A robot that misses its target or
+// can't close its loops is an error, as it fails a file conversion.
+class ServeRenderer : public rob_diag::RenderHandler
+{
+public:
+  ServeRenderer(unsigned num_workers, const DrawSettings& settings)
+    : workers_(new Worker[num_workers]), settings_(settings)
+  {}
+  virtual ~ServeRenderer()
   {
-    rob_diag::Robot robot;
-    while ( getline (robot_config,line) )
+    delete[] workers_;
+  }
+  virtual bool render(const char* text, size_t size, unsigned worker, std::string& svg, std::string& error)
+  {
+    Worker& w = workers_[worker];
+    w.errors_.str("");
+    w.errors_.clear();
+    rob_diag::Robot& robot = w.storage_.robot_;
+    rob_diag::DiagramOptions options;
+    rob_diag::RobotParser parser("request", w.errors_);
+    bool good = parser.parse(text, size, robot, w.storage_.arena_, options);
+    if (good)
+      good = pose_robot(robot, "request", w.errors_);
+    if (good)
     {
-      if (!add_element(robot, line))
-      {
-        std::cerr << "Bad configuration line for " << filename << ":" << std::endl << line << std::endl;
-        robot_config.close();
-        delete_robot(robot);
-        return false;
-      }
+      rob_diag::Workspace workspace;
+      compute_workspace(robot, options, workspace, NULL);
+      rob_diag::Rect bounds = robot.compute_dimensions();
+      if (options.workspace_samples_ > 0)
+        bounds.extend(workspace.bounds());
+      svg.clear();
+      svg::CallbackSink sink(&append_to_string, &svg);
+      good = draw_robot(robot, sink, bounds, options.workspace_samples_ > 0 ? &workspace : NULL, settings_);
+      if (!good)
+        error = "Unable to draw the robot\n";
     }
-    robot_config.close();
-    draw_robot(robot, file_base + ".svg");
-    delete_robot(robot);
-    return true;
+    else
+    {
+      error = w.errors_.str();
+    }
+    delete_robot(w.storage_);
+    return good;
+  }
+private:
+  struct Worker
+  {
+    RobotStorage storage_;
+    std::ostringstream errors_;
+  };
+  Worker* workers_;
+  DrawSettings settings_;
+};
+
+// Serves render requests on 'socket_path', or on stdin and stdout if it is
+// NULL; see render_server.hpp for the protocol.
+int serve(const char* socket_path, unsigned num_threads, const DrawSettings& settings)
+{
+  // A client that hangs up shouldn't take the server down with it.
+  signal(SIGPIPE, SIG_IGN);
+  ServeRenderer renderer(num_threads, settings);
+  rob_diag::RenderServer server(renderer, num_threads);
+  if (!socket_path)
+  {
+    server.serve_stream(0, 1);
   }
   else
   {
-    std::cout << "Unable to open " << filename << std::endl; 
-    return false;
+    std::cerr << "Serving on " << socket_path << " with " << num_threads << " threads" << std::endl;
+    std::string error;
+    if (!server.serve_socket(socket_path, error))
+    {
+      std::cerr << error << std::endl;
+      return -1;
+    }
   }
+  std::cerr << server.stats().report() << std::flush;
+  return 0;
+}
 
-  std::cout << "Unknown error with " << filename << std::endl;
-  return false;
+// Parses the thread count of -j: a whole number of at least 1.  Counts over
+// eight threads per processor are capped there; more would only contend, and
+// could run out of threads.  False if 'text' isn't such a number.
+bool parse_threads(const char* text, unsigned& num_threads)
+{
+  char* end = NULL;
+  errno = 0;
+  long value = std::strtol(text, &end, 10);
+  if (end == text || *end != '\0' || errno == ERANGE || value < 1)
+    return false;
+  long processors = sysconf(_SC_NPROCESSORS_ONLN);
+  long max_threads = 8 * (processors > 0 ? processors : 1);
+  num_threads = (unsigned)std::min(value, max_threads);
+  return true;
 }
 
 int main(int argc, char** argv)
 {
-  if (argc < 2)
+  unsigned num_threads = 1;
+  const char* cache_directory = NULL;
+  const char* stats_file = NULL;
+  double cache_megabytes = 1024;
+  DrawSettings settings;
+  AtlasSettings atlas;
+  double precision = 0;
+  std::vector<const char*> files;
+  bool bad_threads = false;
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg(argv[i]);
+    if (arg == "-j")
+      bad_threads = bad_threads || i + 1 == argc || !parse_threads(argv[++i], num_threads);
+    else if (arg.size() > 2 && arg.substr(0, 2) == "-j")
+      bad_threads = bad_threads || !parse_threads(arg.c_str() + 2, num_threads);
+    else if (arg == "--cache" && i + 1 < argc)
+      cache_directory = argv[++i];
+    else if (arg == "--cache-size" && i + 1 < argc)
+      cache_megabytes = std::atof(argv[++i]);
+    else if (arg == "--stats" && i + 1 < argc)
+      stats_file = argv[++i];
+    else if (arg == "--symbols")
+      settings.symbols_ = true;
+    else if (arg == "--paths")
+      settings.paths_ = true;
+    else if (arg == "--precision" && i + 1 < argc)
+      precision = std::atof(argv[++i]);
+    else if (arg == "--relative")
+      settings.relative_ = true;
+    else if (arg == "--svgz")
+    {
+      if (settings.compression_ < 0)
+        settings.compression_ = 6;
+    }
+    else if (arg == "--svgz-level" && i + 1 < argc)
+      settings.compression_ = std::atoi(argv[++i]);
+    else if (arg == "--png")
+      settings.image_ = DrawSettings::Png;
+    else if (arg == "--ppm")
+      settings.image_ = DrawSettings::Ppm;
+    else if (arg == "--raster-scale" && i + 1 < argc)
+      settings.raster_scale_ = std::atof(argv[++i]);
+    else if (arg == "--page-width" && i + 1 < argc)
+      atlas.page_width_ = std::atof(argv[++i]);
+    else if (arg == "--page-height" && i + 1 < argc)
+      atlas.page_height_ = std::atof(argv[++i]);
+    else if (arg == "--captions")
+      atlas.captions_ = true;
+    else
+      files.push_back(argv[i]);
+  }
+
+  bool trajectory = files.size() > 0 && std::string(files[0]) == "--trajectory";
+  bool compile = files.size() > 0 && std::string(files[0]) == "--compile";
+  bool server = files.size() > 0 && std::string(files[0]) == "--serve";
+  bool watching = files.size() > 0 && std::string(files[0]) == "--watch";
+  bool atlas_mode = files.size() > 0 && std::string(files[0]) == "--atlas";
+  // The precision is a power of ten, from 1 to 0.000001 px.
+  for (int places = 0; places <= 6 && precision > 0; ++places)
   {
-    std::cout << "Usage: ./generate_robots <list of .robot files>" << std::endl;
+    if (std::fabs(precision * std::pow(10.0, places) - 1) < 1e-9)
+      settings.decimals_ = places;
+  }
+  if (files.size() == 0 || bad_threads || (trajectory && (files.size() < 3 || files.size() > 4)) ||
+      (compile && files.size() < 2) || (server && files.size() > 2) || (watching && files.size() < 2) ||
+      (atlas_mode && files.size() < 3) ||
+      (stats_file && (trajectory || compile || server || watching || atlas_mode)) || !(atlas.page_width_ > 0) || atlas.page_height_ < 0 ||
+      cache_megabytes < 0 || (precision != 0 && settings.decimals_ < 0) ||
+      (settings.relative_ && settings.decimals_ < 0) || settings.compression_ < -1 || settings.compression_ > 9 ||
+      (settings.image_ != DrawSettings::Svg && settings.compression_ >= 0) || !(settings.raster_scale_ > 0) ||
+      settings.raster_scale_ > 100)
+  {
+    std::cout << "Usage: ./generate_robots [-j <threads>] [--cache <directory> [--cache-size <MB>]] [--stats <file.json>] <list of .robot or .robotc files>" << std::endl;
+    std::cout << "       ./generate_robots [-j <threads>] --trajectory <file.robot> <joints.csv> [<output prefix>]" << std::endl;
+    std::cout << "       ./generate_robots [-j <threads>] --compile <list of .robot files>" << std::endl;
+    std::cout << "       ./generate_robots [-j <threads>] --serve [<socket path>]" << std::endl;
+    std::cout << "       ./generate_robots [-j <threads>] [--cache <directory>] --watch <list of files or directories>" << std::endl;
+    std::cout << "       ./generate_robots [-j <threads>] --atlas <output prefix> [--page-width <px>] [--page-height <px>] [--captions] <list of files>" << std::endl;
+    std::cout << "Drawing options (for all but --compile):" << std::endl;
+    std::cout << "  --symbols  draw repeated glyphs once, in <defs>, and place them with <use>" << std::endl;
+    std::cout << "  --paths    write runs of lines with the same stroke as a single <path>" << std::endl;
+    std::cout << "  --precision <px>  round coordinates to 1, 0.1, ... or 0.000001 px" << std::endl;
+    std::cout << "  --relative write paths, polylines and polygons with relative commands (needs --precision)" << std::endl;
+    std::cout << "  --svgz     write gzipped .svgz files (or responses, with --serve)" << std::endl;
+    std::cout << "  --svgz-level <0-9>  the same, at the given level (default 6)" << std::endl;
+    std::cout << "  --png, --ppm  draw .png or .ppm images instead, without text labels" << std::endl;
+    std::cout << "  --raster-scale <s>  image pixels per SVG pixel (default 1)" << std::endl;
+    std::cout << "  --stats <file.json>  write each file's phase times, element counts, bytes written and allocations, and their totals" << std::endl;
     return -1;
   }
 
-  int num_good = 0;
-  std::cout << "Converting files..." << std::endl;
-  for (int i = 1; i < argc; i++)
+  if (server)
+    return serve(files.size() == 2 ? files[1] : NULL, num_threads, settings);
+
+  if (trajectory)
   {
-    if (draw_robot(argv[i]))
+    std::string prefix = files.size() >= 4 ? files[3] : "";
+    rob_diag::WorkPool pool(num_threads);
+    return draw_trajectory(files[1], files[2], prefix, std::cout, std::cerr, &pool, settings) ? 0 : -1;
+  }
+
+  if (atlas_mode)
+  {
+    std::string prefix = files[1];
+    files.erase(files.begin(), files.begin() + 2);
+    return draw_atlas(files, prefix, num_threads, atlas, settings) ? 0 : -1;
+  }
+
+  if (compile)
+  {
+    files.erase(files.begin());
+    std::cout << "Compiling files..." << std::endl;
+    int num_good = convert_files(files, num_threads, compile_robot);
+    std::cout << "Compiled " << num_good << "/" << files.size() << " files." << std::endl;
+    return num_good == (int)files.size() ? 0 : -1;
+  }
+
+  rob_diag::RenderCache cache;
+  if (cache_directory)
+  {
+    std::string error;
+    if (!cache.open(cache_directory, error))
     {
-      ++num_good;
-      std::cout << argv[i] << ": success" << std::endl;
+      std::cerr << error << std::endl;
+      return -1;
     }
-    // NOTE: error from failure will be displayed in the 'draw_robot' function.
+    settings.cache_ = &cache;
   }
 
-  std::cout << "Converted " << num_good << "/" << argc - 1 << " files." << std::endl; 
-  return 0; 
+  if (watching)
+  {
+    files.erase(files.begin());
+    return watch(files, num_threads, settings);
+  }
+
+  rob_diag::StatsLog stats_log;
+  if (stats_file)
+    settings.stats_ = &stats_log;
+  std::cout << "Converting files..." << std::endl;
+  // NOTE: error from failure will be displayed in the 'draw_robot' function.
+  int num_good = convert_files(files, num_threads, draw_robot, settings);
+
+  std::cout << "Converted " << num_good << "/" << files.size() << " files." << std::endl; 
+  if (cache_directory)
+  {
+    cache.evict((unsigned long long)(cache_megabytes * 1024 * 1024));
+    rob_diag::RenderCache::Stats stats = cache.stats();
+    std::printf("Cache: %lu hits, %lu misses, %lu stored, %lu evicted; %lu entries (%.1f MB) in %s\n",
+                stats.hits_, stats.misses_, stats.stored_, stats.evicted_, stats.entries_,
+                stats.bytes_ / (1024.0 * 1024.0), cache.directory().c_str());
+  }
+  if (stats_file && !stats_log.write_json(stats_file))
+  {
+    std::cerr << "Unable to write " << stats_file << std::endl;
+    return -1;
+  }
+  return num_good == (int)files.size() ? 0 : -1;
 }
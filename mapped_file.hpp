@@ -0,0 +1,105 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <cerrno>
+#include <cstddef>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace rob_diag
+{
+
+// A read-only view of a whole file.  Regular files are mapped with mmap, so
+// nothing is copied; anything else (a pipe, say) is read once into a buffer,
+// which is kept for reuse by the next 'open'.
+class MappedFile
+{
+public:
+  MappedFile()
+    : data_(NULL), size_(0), mapped_(false)
+  {}
+  ~MappedFile() { close(); }
+
+  // Returns false (with errno set) if the file can't be read.
+  bool open(const char* filename)
+  {
+    close();
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+      ::close(fd);
+      return false;
+    }
+    if (S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+      void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED)
+      {
+        ::close(fd);
+        data_ = (const char*)data;
+        size_ = st.st_size;
+        mapped_ = true;
+        return true;
+      }
+    }
+    bool good = read_all(fd);
+    ::close(fd);
+    return good;
+  }
+
+  void close()
+  {
+    if (mapped_)
+      munmap((void*)data_, size_);
+    data_ = NULL;
+    size_ = 0;
+    mapped_ = false;
+  }
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  // Non-copyable.
+  MappedFile(const MappedFile&);
+  MappedFile& operator=(const MappedFile&);
+
+  bool read_all(int fd)
+  {
+    size_t size = 0;
+    if (buffer_.size() < 4096)
+      buffer_.resize(4096);
+    while (true)
+    {
+      if (size == buffer_.size())
+        buffer_.resize(buffer_.size() * 2);
+      ssize_t got = ::read(fd, &buffer_[size], buffer_.size() - size);
+      if (got < 0 && errno == EINTR)
+        continue;
+      if (got < 0)
+        return false;
+      if (got == 0)
+        break;
+      size += got;
+    }
+    data_ = &buffer_[0];
+    size_ = size;
+    return true;
+  }
+
+  const char* data_;
+  size_t size_;
+  bool mapped_;
+  std::vector<char> buffer_;
+};
+
+}
+
+#endif
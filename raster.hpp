@@ -0,0 +1,434 @@
+#ifndef RASTER_HPP
+#define RASTER_HPP
+
+#include "deflate.hpp"
+#include "simple_svg_1.0.0.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+namespace rob_diag
+{
+
+// An anti-aliased software rasterizer, for drawing diagrams straight to
+// images (thumbnails) without going through SVG.  It is a Painter, so it
+// draws whatever is added to a Document in painting mode, e.g.
+//   Raster raster(width, height);
+//   svg::Document doc(raster, svg::Layout(svg::Dimensions(width, height)));
+//   robot.draw_at(doc, origin);
+//   raster.write_png(sink);
+//
+// Each outline is filled on its own: its edges add up signed area and
+// coverage into a row-major accumulation buffer (the method of font-rs),
+// and a running sum along each touched row then gives the exact fraction of
+// every pixel that the shape covers, for either fill rule.  That sum is
+// vectorized, eight pixels at a time.  Pixels are RGBA with premultiplied
+// alpha, so the background may be transparent.
+class Raster : public svg::Painter
+{
+public:
+  Raster(int width, int height, const svg::Color& background = svg::Color::White)
+  {
+    resize(width, height, background);
+  }
+
+  // Starts a new image, keeping the buffers where they are big enough.
+  void resize(int width, int height, const svg::Color& background = svg::Color::White)
+  {
+    width_ = std::max(width, 1);
+    height_ = std::max(height, 1);
+    // Room for the cell right of the last pixel, rounded up to whole vectors.
+    stride_ = (width_ + 2 + 7) & ~7;
+    cells_.assign((size_t)stride_ * height_, 0.0f);
+    coverage_.resize(stride_);
+    first_.assign(height_, INT_MAX);
+    last_.assign(height_, -1);
+    unsigned char pixel[4] = { 0, 0, 0, 0 };
+    if (!background.isTransparent())
+    {
+      pixel[0] = (unsigned char)background.getRed();
+      pixel[1] = (unsigned char)background.getGreen();
+      pixel[2] = (unsigned char)background.getBlue();
+      pixel[3] = 255;
+    }
+    pixels_.resize((size_t)width_ * height_ * 4);
+    for (size_t i = 0; i < pixels_.size(); i += 4)
+      std::memcpy(&pixels_[i], pixel, 4);
+  }
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+  // RGBA (premultiplied), rows from the top.
+  const unsigned char* pixels() const { return &pixels_[0]; }
+
+  void fill(const svg::Outline& outline, const svg::Color& color, bool even_odd)
+  {
+    if (color.isTransparent() || outline.points.empty())
+      return;
+    double top = outline.points[0].y, bottom = top;
+    size_t start = 0;
+    for (size_t c = 0; c < outline.ends.size(); ++c)
+    {
+      size_t end = outline.ends[c];
+      for (size_t i = start; i < end; ++i)
+      {
+        top = std::min(top, outline.points[i].y);
+        bottom = std::max(bottom, outline.points[i].y);
+        add_line(outline.points[i], outline.points[i + 1 < end ? i + 1 : start]);
+      }
+      start = end;
+    }
+    const unsigned char rgb[3] = { (unsigned char)color.getRed(), (unsigned char)color.getGreen(),
+                                   (unsigned char)color.getBlue() };
+    int first_row = std::max(0, (int)std::floor(top));
+    int end_row = std::min(height_, (int)std::ceil(bottom));
+    for (int y = first_row; y < end_row; ++y)
+      if (last_[y] >= 0)
+        sweep_row(y, rgb, even_odd);
+  }
+
+  // Binary PPM (P6).  Alpha is dropped: transparent pixels come out black.
+  bool write_ppm(svg::Sink& sink) const
+  {
+    char header[64];
+    int length = std::snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width_, height_);
+    std::string out(header, length);
+    out.resize(length + (size_t)width_ * height_ * 3);
+    char* rgb = &out[length];
+    for (size_t i = 0; i < pixels_.size(); i += 4, rgb += 3)
+      std::memcpy(rgb, &pixels_[i], 3);
+    return sink.write(out.data(), out.size());
+  }
+
+  // PNG, compressed at 'level' (0 to 9): RGB if every pixel is opaque,
+  // otherwise RGBA.  Each row gets whichever filter leaves the smallest
+  // bytes, the usual heuristic.
+  bool write_png(svg::Sink& sink, int level = 6) const
+  {
+    bool opaque = true;
+    for (size_t i = 3; i < pixels_.size() && opaque; i += 4)
+      opaque = pixels_[i] == 255;
+    int channels = opaque ? 3 : 4;
+    size_t row_size = (size_t)width_ * channels;
+
+    std::string png("\x89PNG\r\n\x1a\n", 8);
+    std::string chunk;
+    append_u32(chunk, width_);
+    append_u32(chunk, height_);
+    const char ihdr[5] = { 8, (char)(opaque ? 2 : 6), 0, 0, 0 };
+    chunk.append(ihdr, 5);
+    append_chunk(png, "IHDR", chunk);
+
+    // The image data is a zlib stream of the filtered rows.
+    chunk.clear();
+    int flevel = level <= 1 ? 0 : level <= 5 ? 1 : level == 6 ? 2 : 3;
+    int flags = flevel << 6;
+    flags += 31 - (0x78 * 256 + flags) % 31;
+    chunk.push_back(0x78);
+    chunk.push_back((char)flags);
+    Deflater deflater(level);
+    Adler32 adler;
+    std::vector<unsigned char> row(row_size), previous(row_size, 0);
+    std::vector<unsigned char> filtered(row_size + 1), best(row_size + 1);
+    for (int y = 0; y < height_; ++y)
+    {
+      const unsigned char* pixels = &pixels_[(size_t)y * width_ * 4];
+      for (int x = 0; x < width_; ++x)
+      {
+        const unsigned char* p = pixels + x * 4;
+        unsigned char* out = &row[x * channels];
+        if (opaque || p[3] == 255 || p[3] == 0)
+          std::memcpy(out, p, channels);
+        else
+        {
+          // Straight alpha, as PNG has it.
+          for (int c = 0; c < 3; ++c)
+            out[c] = (unsigned char)std::min(255, (p[c] * 255 + p[3] / 2) / p[3]);
+          out[3] = p[3];
+        }
+      }
+      unsigned long (*const filters[5])(const unsigned char*, const unsigned char*, size_t, int,
+                                        unsigned char*) = { filter_row<0>, filter_row<1>, filter_row<2>,
+                                                            filter_row<3>, filter_row<4> };
+      unsigned long best_cost = ULONG_MAX;
+      for (int type = 0; type < 5; ++type)
+      {
+        unsigned long cost = filters[type](&row[0], &previous[0], row_size, channels, &filtered[0]);
+        if (cost < best_cost)
+        {
+          best_cost = cost;
+          best.swap(filtered);
+        }
+      }
+      adler((const char*)&best[0], best.size());
+      deflater.compress((const char*)&best[0], best.size(), chunk);
+      row.swap(previous);
+    }
+    deflater.finish(chunk);
+    append_u32(chunk, adler.value());
+    append_chunk(png, "IDAT", chunk);
+    append_chunk(png, "IEND", std::string());
+    return sink.write(png.data(), png.size());
+  }
+
+private:
+  // Accumulates the edge from 'a' to 'b', split where it crosses the left
+  // and right of the image: the parts outside are moved onto the border
+  // (as vertical edges), which leaves the coverage of the pixels inside
+  // as it was.
+  void add_line(const svg::Point& a, const svg::Point& b)
+  {
+    if (a.y == b.y)
+      return;
+    double cuts[2] = { 0, 0 };
+    int count = 0;
+    for (int border = 0; border <= width_; border += width_)
+    {
+      double t = (border - a.x) / (b.x - a.x);
+      if (t > 0 && t < 1)
+        cuts[count++] = t;
+    }
+    if (count == 2 && cuts[0] > cuts[1])
+      std::swap(cuts[0], cuts[1]);
+    svg::Point from = a;
+    for (int i = 0; i < count; ++i)
+    {
+      svg::Point cut(a.x + (b.x - a.x) * cuts[i], a.y + (b.y - a.y) * cuts[i]);
+      add_clamped_line(from, cut);
+      from = cut;
+    }
+    add_clamped_line(from, b);
+  }
+
+  // For each row the edge from 'a' to 'b' crosses, the change in coverage
+  // it makes across the row (its height in the row, signed by direction),
+  // spread over the cells it passes through by the area to its right.
+  // The edge must not cross the left or right border.
+  void add_clamped_line(const svg::Point& a, const svg::Point& b)
+  {
+    float x0 = std::min(std::max((float)a.x, 0.0f), (float)width_);
+    float x1 = std::min(std::max((float)b.x, 0.0f), (float)width_);
+    float y0 = (float)a.y, y1 = (float)b.y;
+    if (y0 == y1)
+      return;
+    float direction = 1;
+    if (y0 > y1)
+    {
+      std::swap(x0, x1);
+      std::swap(y0, y1);
+      direction = -1;
+    }
+    float dxdy = (x1 - x0) / (y1 - y0);
+    float x = x0;
+    int y = (int)std::floor(y0);
+    if (y0 < 0)
+    {
+      x -= y0 * dxdy;
+      y = 0;
+    }
+    int end_row = std::min(height_, (int)std::ceil(y1));
+    for (; y < end_row; ++y)
+    {
+      float* cells = &cells_[(size_t)y * stride_];
+      float dy = std::min((float)(y + 1), y1) - std::max((float)y, y0);
+      float x_next = std::min(std::max(x + dxdy * dy, 0.0f), (float)width_);
+      float d = dy * direction;
+      float left = std::min(x, x_next), right = std::max(x, x_next);
+      float left_floor = std::floor(left), right_ceil = std::ceil(right);
+      int left_cell = (int)left_floor, right_cell = (int)right_ceil;
+      if (right_cell <= left_cell + 1)
+      {
+        // Within one pixel.
+        float middle = 0.5f * (x + x_next) - left_floor;
+        cells[left_cell] += d - d * middle;
+        cells[left_cell + 1] += d * middle;
+        right_cell = left_cell + 1;
+      }
+      else
+      {
+        float slope = 1 / (right - left);
+        float left_fraction = left - left_floor;
+        float first = 0.5f * slope * (1 - left_fraction) * (1 - left_fraction);
+        float right_fraction = right - right_ceil + 1;
+        float last = 0.5f * slope * right_fraction * right_fraction;
+        cells[left_cell] += d * first;
+        if (right_cell == left_cell + 2)
+          cells[left_cell + 1] += d * (1 - first - last);
+        else
+        {
+          float second = slope * (1.5f - left_fraction);
+          cells[left_cell + 1] += d * (second - first);
+          for (int c = left_cell + 2; c < right_cell - 1; ++c)
+            cells[c] += d * slope;
+          float before_last = second + (right_cell - left_cell - 3) * slope;
+          cells[right_cell - 1] += d * (1 - before_last - last);
+        }
+        cells[right_cell] += d * last;
+      }
+      first_[y] = std::min(first_[y], left_cell);
+      last_[y] = std::max(last_[y], right_cell);
+      x = x_next;
+    }
+  }
+
+  // Turns the cells of row 'y' into coverage (clearing them) and blends
+  // 'rgb' into the pixels by it.
+  void sweep_row(int y, const unsigned char* rgb, bool even_odd)
+  {
+    float* cells = &cells_[(size_t)y * stride_];
+    float* coverage = &coverage_[0];
+    // Whole vectors; the cells outside the touched span are all 0.
+    int first = first_[y] & ~7;
+    int end = (last_[y] + 8) & ~7;
+    first_[y] = INT_MAX;
+    last_[y] = -1;
+#if defined(__GNUC__)
+    typedef float vec __attribute__((vector_size(32)));
+    typedef int ivec __attribute__((vector_size(32)));
+    const vec zero = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    const vec one = zero + 1;
+    const vec two = zero + 2;
+    vec sum = zero;
+    for (int x = first; x < end; x += 8)
+    {
+      vec v;
+      std::memcpy(&v, cells + x, sizeof(v));
+      std::memcpy(cells + x, &zero, sizeof(v));
+      // Running sum within the vector, in three shifted adds.
+      v += __builtin_shuffle(zero, v, (ivec){ 0, 8, 9, 10, 11, 12, 13, 14 });
+      v += __builtin_shuffle(zero, v, (ivec){ 0, 1, 8, 9, 10, 11, 12, 13 });
+      v += __builtin_shuffle(zero, v, (ivec){ 0, 1, 2, 3, 8, 9, 10, 11 });
+      v += sum;
+      sum = __builtin_shuffle(v, (ivec){ 7, 7, 7, 7, 7, 7, 7, 7 });
+      vec a = v < 0 ? -v : v;
+      if (even_odd)
+      {
+        // Winding modulo 2, folded: 0.3 and 1.7 are both 0.3 covered.
+        a -= two * __builtin_convertvector(__builtin_convertvector(a * 0.5f, ivec), vec);
+        a = a > one ? two - a : a;
+      }
+      else
+        a = a > one ? one : a;
+      std::memcpy(coverage + x, &a, sizeof(a));
+    }
+#else
+    float sum = 0;
+    for (int x = first; x < end; ++x)
+    {
+      sum += cells[x];
+      cells[x] = 0;
+      float a = std::fabs(sum);
+      if (even_odd)
+      {
+        a -= 2 * (int)(a * 0.5f);
+        a = a > 1 ? 2 - a : a;
+      }
+      else
+        a = std::min(a, 1.0f);
+      coverage[x] = a;
+    }
+#endif
+    unsigned char* row = &pixels_[(size_t)y * width_ * 4];
+    end = std::min(end, width_);
+    for (int x = first; x < end; ++x)
+    {
+      int alpha = (int)(coverage[x] * 256 + 0.5f);
+      if (alpha == 0)
+        continue;
+      unsigned char* p = row + x * 4;
+      if (alpha >= 256)
+      {
+        p[0] = rgb[0];
+        p[1] = rgb[1];
+        p[2] = rgb[2];
+        p[3] = 255;
+        continue;
+      }
+      int keep = 256 - alpha;
+      p[0] = (unsigned char)((p[0] * keep + rgb[0] * alpha + 128) >> 8);
+      p[1] = (unsigned char)((p[1] * keep + rgb[1] * alpha + 128) >> 8);
+      p[2] = (unsigned char)((p[2] * keep + rgb[2] * alpha + 128) >> 8);
+      p[3] = (unsigned char)((p[3] * keep + 255 * alpha + 128) >> 8);
+    }
+  }
+
+  // The byte that PNG filter 'type' predicts from the ones to the left,
+  // above and above left.
+  template <int type>
+  static int predict(int left, int up, int up_left)
+  {
+    switch (type)
+    {
+      case 1: return left;
+      case 2: return up;
+      case 3: return (left + up) >> 1;
+      case 4:
+      {
+        int pa = std::abs(up - up_left), pb = std::abs(left - up_left), pc = std::abs(left + up - 2 * up_left);
+        return pa <= pb && pa <= pc ? left : pb <= pc ? up : up_left;
+      }
+    }
+    return 0;
+  }
+
+  // PNG filter 'type' applied to 'row' (with 'previous' above it), into
+  // 'out' after the type byte.  Returns the sum of the bytes as signed
+  // magnitudes, which is smaller the better the row will compress.
+  template <int type>
+  static unsigned long filter_row(const unsigned char* row, const unsigned char* previous, size_t size,
+                                  int bpp, unsigned char* out)
+  {
+    unsigned long cost = 0;
+    out[0] = type;
+    ++out;
+    // The first pixel has nothing to its left.
+    for (int i = 0; i < bpp; ++i)
+    {
+      out[i] = (unsigned char)(row[i] - predict<type>(0, previous[i], 0));
+      cost += out[i] < 128 ? out[i] : 256 - out[i];
+    }
+    for (size_t i = bpp; i < size; ++i)
+    {
+      out[i] = (unsigned char)(row[i] - predict<type>(row[i - bpp], previous[i], previous[i - bpp]));
+      cost += out[i] < 128 ? out[i] : 256 - out[i];
+    }
+    return cost;
+  }
+
+  static void append_u32(std::string& out, uint32_t value)
+  {
+    for (int shift = 24; shift >= 0; shift -= 8)
+      out.push_back((char)(value >> shift));
+  }
+  static void append_chunk(std::string& png, const char* type, const std::string& data)
+  {
+    append_u32(png, (uint32_t)data.size());
+    size_t start = png.size();
+    png.append(type, 4);
+    png.append(data);
+    Crc32 crc;
+    crc(png.data() + start, png.size() - start);
+    append_u32(png, crc.value());
+  }
+
+  int width_, height_, stride_;
+  // Accumulated coverage changes, stride_ cells per row; all 0 between fills.
+  std::vector<float> cells_;
+  // The span of cells touched in each row (first_ > last_ for none).
+  std::vector<int> first_, last_;
+  // One row of coverage, while sweeping.
+  std::vector<float> coverage_;
+  std::vector<unsigned char> pixels_;
+};
+
+}
+
+#endif
@@ -0,0 +1,298 @@
+#ifndef RENDER_CACHE_HPP
+#define RENDER_CACHE_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace rob_diag
+{
+
+// 128 bit FNV-1a, for naming cache entries.  Not cryptographic, but with 128
+// bits an accidental collision between two diagrams is out of the question.
+class ContentHash
+{
+public:
+  ContentHash()
+    : hash_(((unsigned __int128)0x6c62272e07bb0142ULL << 64) | 0x62b821756295c58dULL)
+  {}
+  void operator()(const char* data, size_t size)
+  {
+    const unsigned __int128 prime = ((unsigned __int128)1 << 88) | 0x13b;
+    for (size_t i = 0; i < size; ++i)
+    {
+      hash_ ^= (unsigned char)data[i];
+      hash_ *= prime;
+    }
+  }
+  void operator()(const char* text) { (*this)(text, std::strlen(text)); }
+  // 32 lowercase hex digits.
+  std::string hex() const
+  {
+    char digits[33];
+    std::snprintf(digits, sizeof(digits), "%016llx%016llx", (unsigned long long)(hash_ >> 64),
+                  (unsigned long long)hash_);
+    return digits;
+  }
+private:
+  unsigned __int128 hash_;
+};
+
+// A content-addressed store of rendered files, shared by runs (and by the
+// threads of one run).  Entries are named by a key, usually a ContentHash
+// of the input and of a stamp for the renderer version, and are kept as
+// <directory>/<first two digits of key>/<key>.
+//
+// A hit hard-links the entry into place (or copies it, if the cache is on
+// another file system), so nothing has to be rendered; an output that is
+// already a link to the right entry is left alone.  Because outputs can share
+// their inode with the cache, they mustn't be edited in place: write them
+// under a temporary name and rename that over the output (as svg::FileSink
+// does), and 'fetch' unlinks a stale linked output before it is rendered over.
+//
+// Entries are touched on every hit, and 'evict' removes the least recently
+// used ones until the cache fits in a given size.  Thread safe.
+class RenderCache
+{
+public:
+  struct Stats
+  {
+    Stats() : hits_(0), misses_(0), stored_(0), evicted_(0), entries_(0), bytes_(0) {}
+    unsigned long hits_, misses_, stored_, evicted_;
+    // Left after the last 'evict'.
+    unsigned long entries_;
+    unsigned long long bytes_;
+  };
+
+  RenderCache()
+    : temp_counter_(0)
+  {
+    pthread_mutex_init(&mutex_, NULL);
+  }
+  ~RenderCache() { pthread_mutex_destroy(&mutex_); }
+
+  // Uses (and if need be creates) 'directory'.
+  bool open(const std::string& directory, std::string& error)
+  {
+    directory_ = directory;
+    while (directory_.size() > 1 && directory_[directory_.size() - 1] == '/')
+      directory_.erase(directory_.size() - 1);
+    if (::mkdir(directory_.c_str(), 0777) != 0 && errno != EEXIST)
+    {
+      error = "Unable to create cache directory " + directory_ + ": " + std::strerror(errno);
+      return false;
+    }
+    struct stat st;
+    if (::stat(directory_.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+      error = directory_ + " is not a directory";
+      return false;
+    }
+    return true;
+  }
+
+  // Puts the entry for 'key', if there is one, at 'output' and returns true.
+  // Otherwise returns false, and makes sure that writing 'output' won't write
+  // through to any entry.
+  bool fetch(const std::string& key, const std::string& output)
+  {
+    std::string entry = entry_path(key);
+    struct stat entry_st, output_st;
+    bool have_output = ::stat(output.c_str(), &output_st) == 0;
+    if (::stat(entry.c_str(), &entry_st) != 0)
+    {
+      if (have_output && output_st.st_nlink > 1)
+        ::unlink(output.c_str());
+      count(&Stats::misses_);
+      return false;
+    }
+    // Touch it, for 'evict'.
+    ::utimensat(AT_FDCWD, entry.c_str(), NULL, 0);
+    if (!have_output || output_st.st_dev != entry_st.st_dev || output_st.st_ino != entry_st.st_ino)
+    {
+      if (have_output && output_st.st_nlink > 1)
+        ::unlink(output.c_str());
+      if (!place(entry, output))
+      {
+        count(&Stats::misses_);
+        return false;
+      }
+    }
+    count(&Stats::hits_);
+    return true;
+  }
+
+  // Adds a freshly rendered 'output' as the entry for 'key'.
+  bool store(const std::string& key, const std::string& output)
+  {
+    std::string entry = entry_path(key);
+    std::string dir = entry.substr(0, entry.rfind('/'));
+    if (::mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST)
+      return false;
+    if (!place(output, entry))
+      return false;
+    count(&Stats::stored_);
+    return true;
+  }
+
+  // Removes the least recently used entries until the rest add up to no more
+  // than 'max_bytes'.  Not to be run while other threads are using the cache.
+  void evict(unsigned long long max_bytes)
+  {
+    std::vector<Entry> entries;
+    unsigned long long total = 0;
+    DIR* top = ::opendir(directory_.c_str());
+    if (!top)
+      return;
+    while (dirent* d = ::readdir(top))
+    {
+      if (std::strlen(d->d_name) != 2)
+        continue;
+      std::string dir = directory_ + "/" + d->d_name;
+      DIR* sub = ::opendir(dir.c_str());
+      if (!sub)
+        continue;
+      while (dirent* f = ::readdir(sub))
+      {
+        Entry e;
+        e.path_ = dir + "/" + f->d_name;
+        struct stat st;
+        // Only entries; not temporary files, or anything else that is here.
+        if (std::strlen(f->d_name) != 32 || ::stat(e.path_.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+          continue;
+        e.used_ = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+        e.size_ = st.st_size;
+        total += e.size_;
+        entries.push_back(e);
+      }
+      ::closedir(sub);
+    }
+    ::closedir(top);
+
+    std::sort(entries.begin(), entries.end(), OlderFirst());
+    size_t removed = 0;
+    while (total > max_bytes && removed < entries.size())
+    {
+      if (::unlink(entries[removed].path_.c_str()) == 0)
+      {
+        total -= entries[removed].size_;
+        count(&Stats::evicted_);
+      }
+      ++removed;
+    }
+    pthread_mutex_lock(&mutex_);
+    stats_.entries_ = entries.size() - removed;
+    stats_.bytes_ = total;
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  Stats stats()
+  {
+    pthread_mutex_lock(&mutex_);
+    Stats stats = stats_;
+    pthread_mutex_unlock(&mutex_);
+    return stats;
+  }
+
+  const std::string& directory() const { return directory_; }
+
+private:
+  RenderCache(const RenderCache&);
+  RenderCache& operator=(const RenderCache&);
+
+  struct Entry
+  {
+    std::string path_;
+    long long used_;
+    unsigned long long size_;
+  };
+  struct OlderFirst
+  {
+    bool operator()(const Entry& a, const Entry& b) const { return a.used_ < b.used_; }
+  };
+
+  std::string entry_path(const std::string& key) const
+  {
+    return directory_ + "/" + key.substr(0, 2) + "/" + key;
+  }
+
+  void count(unsigned long Stats::* counter)
+  {
+    pthread_mutex_lock(&mutex_);
+    ++(stats_.*counter);
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  // Makes 'to' a hard link to (or failing that a copy of) 'from', replacing
+  // it atomically, so that readers never see a partial file.
+  bool place(const std::string& from, const std::string& to)
+  {
+    pthread_mutex_lock(&mutex_);
+    char suffix[48];
+    std::snprintf(suffix, sizeof(suffix), ".tmp%ld.%lu", (long)::getpid(), temp_counter_++);
+    pthread_mutex_unlock(&mutex_);
+    std::string temp = to + suffix;
+    if (::link(from.c_str(), temp.c_str()) != 0 && !copy(from, temp))
+    {
+      ::unlink(temp.c_str());
+      return false;
+    }
+    if (::rename(temp.c_str(), to.c_str()) != 0)
+    {
+      ::unlink(temp.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  static bool copy(const std::string& from, const std::string& to)
+  {
+    int in = ::open(from.c_str(), O_RDONLY);
+    if (in < 0)
+      return false;
+    int out = ::open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    bool good = out >= 0;
+    char buffer[64 * 1024];
+    while (good)
+    {
+      ssize_t got = ::read(in, buffer, sizeof(buffer));
+      if (got < 0 && errno == EINTR)
+        continue;
+      if (got <= 0)
+      {
+        good = got == 0;
+        break;
+      }
+      for (ssize_t done = 0; good && done < got;)
+      {
+        ssize_t written = ::write(out, buffer + done, got - done);
+        if (written < 0 && errno == EINTR)
+          continue;
+        good = written > 0;
+        done += written;
+      }
+    }
+    ::close(in);
+    if (out >= 0 && ::close(out) != 0)
+      good = false;
+    return good;
+  }
+
+  std::string directory_;
+  pthread_mutex_t mutex_;
+  unsigned long temp_counter_;
+  Stats stats_;
+};
+
+}
+
+#endif
@@ -0,0 +1,159 @@
+// A small client for 'generate_robots --serve <socket path>', for trying the
+// server out and measuring it.  Each .robot file is sent as a RENDER request
+// (repeatedly, with -n) and the SVG (or .svgz, .png or .ppm) is saved next to it.
+#include "mapped_file.hpp"
+#include "render_server.hpp"
+#include "simple_svg_1.0.0.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+int connect_to(const char* path)
+{
+  sockaddr_un address;
+  if (std::strlen(path) >= sizeof(address.sun_path))
+    return -1;
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  std::strcpy(address.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (sockaddr*)&address, sizeof(address)) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Reads one response, returning false if the connection broke.
+bool read_response(rob_diag::FrameReader& reader, bool& good, std::string& body)
+{
+  std::string line;
+  size_t size;
+  if (!reader.read_line(line))
+    return false;
+  if (rob_diag::parse_frame_header(line, "OK", size))
+    good = true;
+  else if (rob_diag::parse_frame_header(line, "ERROR", size))
+    good = false;
+  else
+    return false;
+  return reader.read_bytes(size, body);
+}
+
+// Sends a request without a body, e.g. "STATS".
+bool write_request(int fd, const char* request)
+{
+  std::string line = std::string(request) + "\n";
+  return write(fd, line.data(), line.size()) == (ssize_t)line.size();
+}
+
+int main(int argc, char** argv)
+{
+  const char* socket_path = NULL;
+  unsigned repeat = 1;
+  bool shutdown = false;
+  std::vector<const char*> files;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (std::string(argv[i]) == "-n" && i + 1 < argc)
+      repeat = std::max(1, std::atoi(argv[++i]));
+    else if (std::string(argv[i]) == "--shutdown")
+      shutdown = true;
+    else if (!socket_path)
+      socket_path = argv[i];
+    else
+      files.push_back(argv[i]);
+  }
+  if (!socket_path)
+  {
+    std::cout << "Usage: ./render_client <socket path> [-n <repeat>] [--shutdown] <list of .robot files>" << std::endl;
+    return -1;
+  }
+
+  int fd = connect_to(socket_path);
+  if (fd < 0)
+  {
+    std::cerr << "Unable to connect to " << socket_path << std::endl;
+    return -1;
+  }
+  rob_diag::FrameReader reader(fd);
+  rob_diag::MappedFile file;
+  std::string body;
+  unsigned failed = 0;
+  unsigned long requests = 0;
+  double total = 0, fastest = 0, slowest = 0;
+  for (size_t f = 0; f < files.size(); ++f)
+  {
+    if (!file.open(files[f]))
+    {
+      std::cerr << "Unable to open " << files[f] << std::endl;
+      ++failed;
+      continue;
+    }
+    bool good = false;
+    for (unsigned r = 0; r < repeat; ++r)
+    {
+      double start = rob_diag::monotonic_seconds();
+      if (!rob_diag::write_frame(fd, "RENDER", file.data(), file.size()) ||
+          !read_response(reader, good, body))
+      {
+        std::cerr << "Lost the connection to the server" << std::endl;
+        close(fd);
+        return -1;
+      }
+      double seconds = rob_diag::monotonic_seconds() - start;
+      fastest = requests == 0 ? seconds : std::min(fastest, seconds);
+      slowest = std::max(slowest, seconds);
+      total += seconds;
+      ++requests;
+    }
+    if (!good)
+    {
+      std::cerr << body;
+      ++failed;
+      continue;
+    }
+    std::string output(files[f]);
+    size_t dot = output.rfind(".robot");
+    if (dot != std::string::npos)
+      output.erase(dot);
+    // Gzipped with --svgz, or an image with --png or --ppm.
+    if (body.size() >= 2 && body[0] == '\x1f' && body[1] == '\x8b')
+      output += ".svgz";
+    else if (body.size() >= 4 && body.compare(0, 4, "\x89PNG") == 0)
+      output += ".png";
+    else if (body.size() >= 2 && body.compare(0, 2, "P6") == 0)
+      output += ".ppm";
+    else
+      output += ".svg";
+    // Replaced rather than rewritten, in case it is a link into a cache.
+    svg::FileSink out(output);
+    if (!out.good() || !out.close(out.write(body.data(), body.size())))
+    {
+      std::cerr << "Unable to write " << output << std::endl;
+      ++failed;
+    }
+  }
+
+  if (requests > 0)
+    std::printf("client: requests %lu min_us %.1f mean_us %.1f max_us %.1f\n", requests, fastest * 1e6,
+                total / requests * 1e6, slowest * 1e6);
+  bool good;
+  if (write_request(fd, "STATS") && read_response(reader, good, body))
+    std::printf("server: %s", body.c_str());
+  write_request(fd, shutdown ? "SHUTDOWN" : "QUIT");
+  close(fd);
+  return failed == 0 ? 0 : -1;
+}
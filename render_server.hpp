@@ -0,0 +1,496 @@
+#ifndef RENDER_SERVER_HPP
+#define RENDER_SERVER_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace rob_diag
+{
+
+// The render server protocol.  Requests and responses are frames: a text
+// header line, then (for some) a body of exactly the size given in the
+// header.  Requests:
+//   RENDER <size>\n<size bytes of .robot text>
+//   STATS\n             latency metrics for every request so far
+//   QUIT\n              ends this connection (or the stdin session)
+//   SHUTDOWN\n          stops the server
+// Every request but QUIT gets one response:
+//   OK <size>\n<size bytes: the SVG, or the metrics>
+//   ERROR <size>\n<size bytes: what went wrong>
+// A connection can send any number of requests, one after another.
+
+// Reads frames from a file descriptor through one buffer, which is reused
+// from frame to frame (and from descriptor to descriptor, with 'reset').
+class FrameReader
+{
+public:
+  explicit FrameReader(int fd = -1)
+    : fd_(fd), buffer_(64 * 1024), begin_(0), end_(0)
+  {}
+
+  // Switches to reading 'fd', dropping anything buffered.
+  void reset(int fd)
+  {
+    fd_ = fd;
+    begin_ = end_ = 0;
+  }
+
+  // Reads a header line (without its '\n').  Returns false at the end of
+  // the input, on errors, and for absurdly long lines.
+  bool read_line(std::string& line)
+  {
+    line.clear();
+    while (true)
+    {
+      const char* start = &buffer_[begin_];
+      const char* newline = (const char*)std::memchr(start, '\n', end_ - begin_);
+      if (newline)
+      {
+        line.append(start, newline - start);
+        begin_ += newline - start + 1;
+        return true;
+      }
+      line.append(start, end_ - begin_);
+      begin_ = end_;
+      if (line.size() > 1024 || !fill())
+        return false;
+    }
+  }
+
+  // Reads exactly 'size' bytes into 'out'.
+  bool read_bytes(size_t size, std::string& out)
+  {
+    out.clear();
+    while (out.size() < size)
+    {
+      if (begin_ == end_ && !fill())
+        return false;
+      size_t take = std::min(size - out.size(), end_ - begin_);
+      out.append(&buffer_[begin_], take);
+      begin_ += take;
+    }
+    return true;
+  }
+
+private:
+  bool fill()
+  {
+    begin_ = end_ = 0;
+    while (true)
+    {
+      ssize_t got = ::read(fd_, &buffer_[0], buffer_.size());
+      if (got < 0 && errno == EINTR)
+        continue;
+      if (got <= 0)
+        return false;
+      end_ = got;
+      return true;
+    }
+  }
+
+  int fd_;
+  std::vector<char> buffer_;
+  size_t begin_, end_;
+};
+
+// Writes "<status> <size>\n" followed by the body, with a single writev
+// where possible.
+inline bool write_frame(int fd, const char* status, const char* body, size_t size)
+{
+  char header[64];
+  int header_size = std::snprintf(header, sizeof(header), "%s %lu\n", status, (unsigned long)size);
+  iovec parts[2];
+  parts[0].iov_base = header;
+  parts[0].iov_len = header_size;
+  parts[1].iov_base = (void*)body;
+  parts[1].iov_len = size;
+  int first = 0;
+  while (first < 2)
+  {
+    ssize_t written = ::writev(fd, parts + first, 2 - first);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written < 0)
+      return false;
+    // Skip past whatever was written.
+    while (first < 2 && (size_t)written >= parts[first].iov_len)
+    {
+      written -= parts[first].iov_len;
+      ++first;
+    }
+    if (first < 2)
+    {
+      parts[first].iov_base = (char*)parts[first].iov_base + written;
+      parts[first].iov_len -= written;
+    }
+  }
+  return true;
+}
+
+// Parses a "<word> <size>" header, e.g. "RENDER 120".
+inline bool parse_frame_header(const std::string& line, const char* word, size_t& size)
+{
+  size_t length = std::strlen(word);
+  if (line.size() <= length + 1 || line.compare(0, length, word) != 0 || line[length] != ' ')
+    return false;
+  size = 0;
+  for (size_t i = length + 1; i < line.size(); ++i)
+  {
+    if (line[i] < '0' || line[i] > '9' || size > ((size_t)-1 - 9) / 10)
+      return false;
+    size = size * 10 + (line[i] - '0');
+  }
+  return true;
+}
+
+inline double monotonic_seconds()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Request latencies, kept as a histogram with four buckets per power of two
+// (so percentiles are within about 19%).  Thread safe.
+class LatencyStats
+{
+public:
+  LatencyStats()
+    : count_(0), errors_(0), total_(0), max_(0)
+  {
+    pthread_mutex_init(&mutex_, NULL);
+    std::memset(buckets_, 0, sizeof(buckets_));
+  }
+  ~LatencyStats() { pthread_mutex_destroy(&mutex_); }
+
+  void add(double seconds, bool good)
+  {
+    int bucket = bucket_of(seconds * 1e6);
+    pthread_mutex_lock(&mutex_);
+    ++count_;
+    if (!good)
+      ++errors_;
+    total_ += seconds;
+    max_ = std::max(max_, seconds);
+    ++buckets_[bucket];
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  // One line, e.g.
+  //   requests 12 errors 0 mean_us 310.2 p50_us 256 p90_us 431 p99_us 512 max_us 498.1
+  // where the percentiles are bucket upper bounds.
+  std::string report()
+  {
+    pthread_mutex_lock(&mutex_);
+    char line[256];
+    std::snprintf(line, sizeof(line),
+                  "requests %lu errors %lu mean_us %.1f p50_us %.0f p90_us %.0f p99_us %.0f max_us %.1f\n",
+                  count_, errors_, count_ ? total_ / count_ * 1e6 : 0.0,
+                  percentile(0.5), percentile(0.9), percentile(0.99), max_ * 1e6);
+    pthread_mutex_unlock(&mutex_);
+    return line;
+  }
+
+private:
+  LatencyStats(const LatencyStats&);
+  LatencyStats& operator=(const LatencyStats&);
+
+  static const int num_buckets = 128;
+
+  // Bucket b holds latencies up to 2^(b / 4) microseconds.
+  static int bucket_of(double micros)
+  {
+    if (micros <= 1)
+      return 0;
+    int bucket = (int)std::ceil(4 * std::log2(micros));
+    return std::min(bucket, num_buckets - 1);
+  }
+
+  double percentile(double fraction) const
+  {
+    if (count_ == 0)
+      return 0;
+    unsigned long rank = (unsigned long)std::ceil(fraction * count_);
+    unsigned long seen = 0;
+    for (int b = 0; b < num_buckets; ++b)
+    {
+      seen += buckets_[b];
+      if (seen >= rank)
+        return std::pow(2.0, b / 4.0);
+    }
+    return std::pow(2.0, (num_buckets - 1) / 4.0);
+  }
+
+  pthread_mutex_t mutex_;
+  unsigned long count_, errors_;
+  double total_, max_;
+  unsigned long buckets_[num_buckets];
+};
+
+// What the server does with a RENDER request.
+class RenderHandler
+{
+public:
+  // Renders 'size' bytes of .robot text into 'svg' (which should be reused
+  // rather than reallocated), or returns false and describes the problem in
+  // 'error'.  'worker' is in [0, number of workers), and can be used to index
+  // per-thread state.
+  virtual bool render(const char* text, size_t size, unsigned worker,
+                      std::string& svg, std::string& error) = 0;
+  virtual ~RenderHandler() {};
+};
+
+// Serves render requests, either on one stream (e.g. stdin and stdout) or on
+// a Unix domain socket, where connections are spread over a fixed set of
+// worker threads.  Latency is measured from the end of reading a request to
+// the end of writing its response.
+class RenderServer
+{
+public:
+  RenderServer(RenderHandler& handler, unsigned num_workers)
+    : handler_(handler), num_workers_(num_workers == 0 ? 1 : num_workers),
+      buffers_(num_workers_), listen_fd_(-1), stopping_(false)
+  {
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&cond_, NULL);
+  }
+  ~RenderServer()
+  {
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&mutex_);
+  }
+
+  // Serves requests read from 'in_fd' until the end of the input, QUIT or
+  // SHUTDOWN, as worker 0.
+  void serve_stream(int in_fd, int out_fd)
+  {
+    serve(in_fd, out_fd, 0);
+  }
+
+  // Listens on a Unix domain socket at 'path' and serves connections until a
+  // SHUTDOWN request.  Returns false (with 'error' set) if the socket can't
+  // be set up or no worker thread can be started; if only some can, the
+  // ones that started serve every connection.  A stale socket file left at
+  // 'path' is replaced.
+  bool serve_socket(const char* path, std::string& error)
+  {
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (std::strlen(path) >= sizeof(address.sun_path))
+    {
+      error = std::string("Socket path too long: ") + path;
+      return false;
+    }
+    std::strcpy(address.sun_path, path);
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+      unlink(path);
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd_ < 0 || bind(listen_fd_, (sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(listen_fd_, 64) != 0)
+    {
+      error = std::string("Unable to listen on ") + path + ": " + std::strerror(errno);
+      if (listen_fd_ >= 0)
+        close(listen_fd_);
+      listen_fd_ = -1;
+      return false;
+    }
+
+    std::vector<pthread_t> threads(num_workers_);
+    std::vector<ThreadArg> args(num_workers_);
+    unsigned started = 0;
+    int failure = 0;
+    for (; started < num_workers_; ++started)
+    {
+      args[started].server_ = this;
+      args[started].worker_ = started;
+      failure = pthread_create(&threads[started], NULL, &RenderServer::thread_main, &args[started]);
+      if (failure != 0)
+        break;
+    }
+    if (started == 0)
+    {
+      error = std::string("Unable to start a worker thread: ") + std::strerror(failure);
+      close(listen_fd_);
+      listen_fd_ = -1;
+      unlink(path);
+      return false;
+    }
+
+    while (true)
+    {
+      int fd = accept(listen_fd_, NULL, NULL);
+      pthread_mutex_lock(&mutex_);
+      bool stopping = stopping_;
+      if (fd >= 0 && !stopping)
+      {
+        pending_.push_back(fd);
+        open_.insert(fd);
+        pthread_cond_signal(&cond_);
+      }
+      pthread_mutex_unlock(&mutex_);
+      if (stopping)
+      {
+        if (fd >= 0)
+          close(fd);
+        break;
+      }
+      if (fd < 0 && errno != EINTR && errno != ECONNABORTED)
+      {
+        stop();
+        break;
+      }
+    }
+
+    for (unsigned i = 0; i < started; ++i)
+      pthread_join(threads[i], NULL);
+    close(listen_fd_);
+    listen_fd_ = -1;
+    unlink(path);
+    return true;
+  }
+
+  LatencyStats& stats() { return stats_; }
+
+private:
+  RenderServer(const RenderServer&);
+  RenderServer& operator=(const RenderServer&);
+
+  struct ThreadArg
+  {
+    RenderServer* server_;
+    unsigned worker_;
+  };
+  // Per-worker buffers, reused from request to request.
+  struct Buffers
+  {
+    FrameReader reader_;
+    std::string line_, request_, response_, error_;
+  };
+
+  static void* thread_main(void* arg)
+  {
+    ThreadArg* thread_arg = (ThreadArg*)arg;
+    RenderServer* server = thread_arg->server_;
+    while (true)
+    {
+      pthread_mutex_lock(&server->mutex_);
+      while (server->pending_.empty() && !server->stopping_)
+        pthread_cond_wait(&server->cond_, &server->mutex_);
+      if (server->pending_.empty())
+      {
+        pthread_mutex_unlock(&server->mutex_);
+        return NULL;
+      }
+      int fd = server->pending_.front();
+      server->pending_.pop_front();
+      pthread_mutex_unlock(&server->mutex_);
+
+      bool keep_running = server->serve(fd, fd, thread_arg->worker_);
+
+      pthread_mutex_lock(&server->mutex_);
+      server->open_.erase(fd);
+      close(fd);
+      pthread_mutex_unlock(&server->mutex_);
+      if (!keep_running)
+        server->stop();
+    }
+  }
+
+  // Stops accepting, and wakes up every worker and every idle connection.
+  void stop()
+  {
+    pthread_mutex_lock(&mutex_);
+    stopping_ = true;
+    if (listen_fd_ >= 0)
+      shutdown(listen_fd_, SHUT_RDWR);
+    for (std::set<int>::iterator i = open_.begin(); i != open_.end(); ++i)
+      shutdown(*i, SHUT_RD);
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  // Handles requests until the input ends or QUIT.  Returns false for
+  // SHUTDOWN.
+  bool serve(int in_fd, int out_fd, unsigned worker)
+  {
+    // Requests bigger than this are refused rather than buffered.
+    static const size_t max_request = 256 << 20;
+    Buffers& b = buffers_[worker];
+    FrameReader& reader = b.reader_;
+    reader.reset(in_fd);
+    size_t size;
+    while (reader.read_line(b.line_))
+    {
+      if (b.line_ == "QUIT")
+        return true;
+      if (b.line_ == "SHUTDOWN")
+      {
+        write_frame(out_fd, "OK", "", 0);
+        return false;
+      }
+      if (b.line_ == "STATS")
+      {
+        std::string report = stats_.report();
+        if (!write_frame(out_fd, "OK", report.data(), report.size()))
+          return true;
+        continue;
+      }
+      if (!parse_frame_header(b.line_, "RENDER", size) || size > max_request)
+      {
+        // We can't tell where the next request starts, so give up on the
+        // connection.
+        b.error_ = "Bad request: " + b.line_.substr(0, 64) + "\n";
+        write_frame(out_fd, "ERROR", b.error_.data(), b.error_.size());
+        return true;
+      }
+      if (!reader.read_bytes(size, b.request_))
+        return true;
+
+      double start = monotonic_seconds();
+      b.error_.clear();
+      bool good = handler_.render(b.request_.data(), b.request_.size(), worker, b.response_, b.error_);
+      bool written = good ? write_frame(out_fd, "OK", b.response_.data(), b.response_.size())
+                          : write_frame(out_fd, "ERROR", b.error_.data(), b.error_.size());
+      stats_.add(monotonic_seconds() - start, good);
+      if (!written)
+        return true;
+    }
+    return true;
+  }
+
+  RenderHandler& handler_;
+  unsigned num_workers_;
+  std::vector<Buffers> buffers_;
+  LatencyStats stats_;
+  int listen_fd_;
+
+  // Guards the fields below.  Accepted connections wait in 'pending_' for a
+  // worker; 'open_' is every connection not yet closed.
+  pthread_mutex_t mutex_;
+  pthread_cond_t cond_;
+  std::deque<int> pending_;
+  std::set<int> open_;
+  bool stopping_;
+};
+
+}
+
+#endif
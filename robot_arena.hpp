@@ -0,0 +1,160 @@
+#ifndef ROBOT_ARENA_HPP
+#define ROBOT_ARENA_HPP
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+namespace rob_diag
+{
+
+// A monotonic allocator for the elements of one robot.  Objects are carved
+// out of large blocks one after another and are never freed individually;
+// 'reset' destroys everything at once (in reverse order of creation) and
+// rewinds to the first block, keeping all of the blocks for reuse.  So once
+// an arena has held the biggest robot of a batch, loading the rest of the
+// batch into it allocates nothing from the heap.
+//
+// For example:
+//   Arena arena;
+//   robot.elements_.push_back(arena.create<Link>(10.0));
+//   ...
+//   robot.elements_.clear();
+//   arena.reset();
+class Arena
+{
+public:
+  explicit Arena(size_t block_size = 16 * 1024)
+    : block_size_(block_size), current_(0), used_(0), cleanups_(NULL)
+  {}
+  ~Arena()
+  {
+    reset();
+    for (size_t i = 0; i < blocks_.size(); ++i)
+      std::free(blocks_[i].data_);
+  }
+
+  // Returns 'size' bytes aligned for any built-in type.
+  void* allocate(size_t size)
+  {
+    size = (size + alignment - 1) & ~(alignment - 1);
+    while (current_ < blocks_.size())
+    {
+      Block& block = blocks_[current_];
+      if (used_ + size <= block.size_)
+      {
+        void* memory = block.data_ + used_;
+        used_ += size;
+        return memory;
+      }
+      ++current_;
+      used_ = 0;
+    }
+    Block block;
+    block.size_ = size > block_size_ ? size : block_size_;
+    block.data_ = (char*)std::malloc(block.size_);
+    if (!block.data_)
+      throw std::bad_alloc();
+    blocks_.push_back(block);
+    used_ = size;
+    return block.data_;
+  }
+
+  // Constructs a T in the arena; it is destroyed by the next 'reset'.
+  template <typename T>
+  T* create()
+  {
+    void* memory = allocate(sizeof(T));
+    return add_cleanup(new (memory) T());
+  }
+  template <typename T, typename A0>
+  T* create(const A0& a0)
+  {
+    void* memory = allocate(sizeof(T));
+    return add_cleanup(new (memory) T(a0));
+  }
+  template <typename T, typename A0, typename A1>
+  T* create(const A0& a0, const A1& a1)
+  {
+    void* memory = allocate(sizeof(T));
+    return add_cleanup(new (memory) T(a0, a1));
+  }
+  template <typename T, typename A0, typename A1, typename A2>
+  T* create(const A0& a0, const A1& a1, const A2& a2)
+  {
+    void* memory = allocate(sizeof(T));
+    return add_cleanup(new (memory) T(a0, a1, a2));
+  }
+
+  // Destroys every object created since the last reset, and makes all of the
+  // memory available again.
+  void reset()
+  {
+    while (cleanups_)
+    {
+      Cleanup* cleanup = cleanups_;
+      cleanups_ = cleanup->next_;
+      cleanup->destroy_(cleanup->object_);
+    }
+    current_ = 0;
+    used_ = 0;
+  }
+
+  // Total size of the blocks held, in bytes.
+  size_t capacity() const
+  {
+    size_t total = 0;
+    for (size_t i = 0; i < blocks_.size(); ++i)
+      total += blocks_[i].size_;
+    return total;
+  }
+
+private:
+  // Non-copyable.
+  Arena(const Arena&);
+  Arena& operator=(const Arena&);
+
+  static const size_t alignment = 16;
+
+  struct Block
+  {
+    char* data_;
+    size_t size_;
+  };
+  // Destructor calls are kept in a list threaded through the arena itself.
+  struct Cleanup
+  {
+    void (*destroy_)(void*);
+    void* object_;
+    Cleanup* next_;
+  };
+
+  template <typename T>
+  static void destroy(void* object)
+  {
+    ((T*)object)->~T();
+  }
+
+  template <typename T>
+  T* add_cleanup(T* object)
+  {
+    Cleanup* cleanup = (Cleanup*)allocate(sizeof(Cleanup));
+    cleanup->destroy_ = &destroy<T>;
+    cleanup->object_ = object;
+    cleanup->next_ = cleanups_;
+    cleanups_ = cleanup;
+    return object;
+  }
+
+  size_t block_size_;
+  std::vector<Block> blocks_;
+  // The block being allocated from, and how much of it is used.
+  size_t current_;
+  size_t used_;
+  Cleanup* cleanups_;
+};
+
+}
+
+#endif
@@ -0,0 +1,211 @@
+#ifndef ROBOT_ATLAS_HPP
+#define ROBOT_ATLAS_HPP
+
+#include <algorithm>
+#include <vector>
+
+#include "simple_svg_1.0.0.hpp"
+
+namespace rob_diag
+{
+
+// Slack for rounding when boxes are fitted edge to edge.
+static const double atlas_epsilon = 1e-9;
+
+// Packs boxes (a diagram's canvas, say) onto pages, for contact sheets of
+// many diagrams.  Pages are 'page_width' wide and 'page_height' tall; with
+// a page height of 0 there is a single page that grows as tall as it needs
+// to.  For example:
+//   AtlasPacker packer(2000, 0);
+//   std::vector<AtlasPacker::Placement> placements;
+//   packer.pack(sizes, placements);
+//   // Box i goes at (placements[i].x_, placements[i].y_) from the top left
+//   // of page placements[i].page_, which is packer.page_size(page) in size.
+//
+// Boxes are placed tallest first, each at the lowest point of a page's
+// skyline (the top edge of what has been placed so far, from the top of the
+// page down) where it fits, preferring the leftmost of those; the first page
+// it fits on is used, and a new page is started if there's none.  That
+// packs typical figures tightly and takes time in proportion to the number
+// of boxes and the length of the skylines.  A box bigger than a page gets a
+// page of its own, of its own size.
+class AtlasPacker
+{
+public:
+  struct Placement
+  {
+    Placement()
+      : page_(0), x_(0), y_(0)
+    {}
+    size_t page_;
+    double x_, y_;
+  };
+
+  AtlasPacker(double page_width, double page_height = 0)
+    : page_width_(page_width), page_height_(page_height)
+  {}
+
+  // Packs boxes of 'sizes' (in any units, the same as the page's) into
+  // 'placements', in the same order.  Returns the number of pages.
+  size_t pack(const std::vector<svg::Dimensions>& sizes, std::vector<Placement>& placements)
+  {
+    pages_.clear();
+    placements.assign(sizes.size(), Placement());
+    std::vector<size_t> order(sizes.size());
+    for (size_t i = 0; i < order.size(); ++i)
+      order[i] = i;
+    std::stable_sort(order.begin(), order.end(), TallerFirst(sizes));
+
+    if (page_height_ <= 0)
+    {
+      // A single page, as wide as the widest box if that's wider.
+      double width = page_width_;
+      for (size_t i = 0; i < sizes.size(); ++i)
+        width = std::max(width, sizes[i].width);
+      pages_.push_back(Page(width, 0));
+    }
+    for (size_t n = 0; n < order.size(); ++n)
+    {
+      const svg::Dimensions& size = sizes[order[n]];
+      Placement& placement = placements[order[n]];
+      if (page_height_ > 0 && (size.width > page_width_ || size.height > page_height_))
+      {
+        placement.page_ = pages_.size();
+        pages_.push_back(Page(size.width, size.height));
+        pages_.back().place(0, 0, 0, size.width, size.height);
+        continue;
+      }
+      bool placed = false;
+      for (size_t p = 0; p < pages_.size() && !placed; ++p)
+      {
+        placed = pages_[p].insert(size.width, size.height, placement);
+        placement.page_ = p;
+      }
+      if (!placed)
+      {
+        placement.page_ = pages_.size();
+        pages_.push_back(Page(page_width_, page_height_));
+        pages_.back().insert(size.width, size.height, placement);
+      }
+    }
+    return pages_.size();
+  }
+
+  size_t num_pages() const { return pages_.size(); }
+  // The size of a page: the page size given, or for a growing page just
+  // big enough for what's on it.
+  svg::Dimensions page_size(size_t page) const
+  {
+    const Page& p = pages_[page];
+    if (p.height_ > 0)
+      return svg::Dimensions(p.width_, p.height_);
+    return svg::Dimensions(p.used_width_, p.used_height_);
+  }
+
+private:
+  // A run of the skyline: from x_, width_ wide, everything above y_ taken.
+  struct Segment
+  {
+    Segment(double x, double y, double width)
+      : x_(x), y_(y), width_(width)
+    {}
+    double x_, y_, width_;
+  };
+
+  struct Page
+  {
+    Page(double width, double height)
+      : width_(width), height_(height), used_width_(0), used_height_(0)
+    {
+      skyline_.push_back(Segment(0, 0, width));
+    }
+
+    // The top of a box 'width' x 'height' with its left edge at segment
+    // 'first' of the skyline, in 'y'; false if it would stick out of the
+    // page.
+    bool fits(size_t first, double width, double height, double& y) const
+    {
+      double x = skyline_[first].x_;
+      if (x + width > width_ + atlas_epsilon)
+        return false;
+      y = 0;
+      for (size_t i = first; i < skyline_.size() && skyline_[i].x_ < x + width - atlas_epsilon; ++i)
+        y = std::max(y, skyline_[i].y_);
+      return height_ <= 0 || y + height <= height_ + atlas_epsilon;
+    }
+
+    bool insert(double width, double height, Placement& placement)
+    {
+      size_t best = skyline_.size();
+      double best_y = 0;
+      for (size_t i = 0; i < skyline_.size(); ++i)
+      {
+        double y;
+        if (fits(i, width, height, y) && (best == skyline_.size() || y < best_y))
+        {
+          best = i;
+          best_y = y;
+        }
+      }
+      if (best == skyline_.size())
+        return false;
+      placement.x_ = skyline_[best].x_;
+      placement.y_ = best_y;
+      place(best, placement.x_, best_y, width, height);
+      return true;
+    }
+
+    // Raises the skyline over the box placed at (x, y), whose left edge is
+    // at segment 'first'.
+    void place(size_t first, double x, double y, double width, double height)
+    {
+      used_width_ = std::max(used_width_, x + width);
+      used_height_ = std::max(used_height_, y + height);
+      double right = x + width;
+      size_t last = first;
+      while (last < skyline_.size() && skyline_[last].x_ + skyline_[last].width_ <= right + atlas_epsilon)
+        ++last;
+      // Segments entirely under the box go; one it partly covers is cut.
+      if (last < skyline_.size() && skyline_[last].x_ < right)
+      {
+        skyline_[last].width_ -= right - skyline_[last].x_;
+        skyline_[last].x_ = right;
+      }
+      skyline_.erase(skyline_.begin() + first, skyline_.begin() + last);
+      skyline_.insert(skyline_.begin() + first, Segment(x, y + height, width));
+      // Merge with level neighbors, to keep the skyline short.
+      if (first + 1 < skyline_.size() && skyline_[first + 1].y_ == skyline_[first].y_)
+      {
+        skyline_[first].width_ += skyline_[first + 1].width_;
+        skyline_.erase(skyline_.begin() + first + 1);
+      }
+      if (first > 0 && skyline_[first - 1].y_ == skyline_[first].y_)
+      {
+        skyline_[first - 1].width_ += skyline_[first].width_;
+        skyline_.erase(skyline_.begin() + first);
+      }
+    }
+
+    double width_, height_, used_width_, used_height_;
+    std::vector<Segment> skyline_;
+  };
+
+  struct TallerFirst
+  {
+    TallerFirst(const std::vector<svg::Dimensions>& sizes) : sizes_(sizes) {}
+    bool operator()(size_t a, size_t b) const
+    {
+      if (sizes_[a].height != sizes_[b].height)
+        return sizes_[a].height > sizes_[b].height;
+      return sizes_[a].width > sizes_[b].width;
+    }
+    const std::vector<svg::Dimensions>& sizes_;
+  };
+
+  double page_width_, page_height_;
+  std::vector<Page> pages_;
+};
+
+}
+
+#endif
@@ -0,0 +1,468 @@
+#ifndef ROBOT_BINARY_HPP
+#define ROBOT_BINARY_HPP
+
+#include "mapped_file.hpp"
+#include "robot_arena.hpp"
+#include "robot_diagrams_0.0.hpp"
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+namespace rob_diag
+{
+
+// A precompiled robot, for loading without any text parsing.  The layout
+// (in native byte order) is
+//   BinaryHeader
+//   BinaryElement[num_elements_]
+//   BinaryClosure[num_closures_]
+//   BinaryTarget[num_targets_]
+//   string table (labels, each followed by a '\0')
+// Everything is a fixed size and 8 byte aligned, so a mapped file can be read
+// in place.  The text .robot format stays the source of truth; bump
+// 'binary_version' whenever this layout or the meaning of a field changes, and
+// old files will be rejected (and have to be recompiled) rather than misread.
+static const uint32_t binary_version = 4;
+
+struct BinaryHeader
+{
+  // "ROBOTBIN"
+  char magic_[8];
+  uint32_t version_;
+  uint32_t num_elements_;
+  uint32_t strings_size_;
+  uint32_t num_closures_;
+  uint32_t num_targets_;
+  uint32_t reserved_;
+  // Workspace map settings (see generate_robots); 0 samples for none.
+  uint64_t workspace_samples_;
+  double workspace_cell_;
+};
+
+// One element.  'params_' has the same meaning as in FlatChain::Record.
+struct BinaryElement
+{
+  uint32_t type_;
+  uint32_t visible_;
+  // Offset of the label in the string table, and its length (0 for none).
+  uint32_t label_;
+  uint32_t label_size_;
+  // Where the element starts: 0 at the end of the element before it, 1 at
+  // the origin, or i + 2 at the end of element i.
+  uint32_t parent_;
+  // 1 for a passive joint of a closed chain.
+  uint32_t passive_;
+  double params_[2];
+  double text_x_offset_, text_y_offset_;
+  // Joint limits: angles for RJointType, lengths for PJointType.
+  double min_theta_, max_theta_;
+};
+
+// A LoopClosure: the ends of elements 'a_' and 'b_' meet.  0 is the origin,
+// and i + 1 element i.
+struct BinaryClosure
+{
+  uint32_t a_, b_;
+};
+
+// A PoseTarget, for element 'element_'.
+struct BinaryTarget
+{
+  uint32_t element_;
+  uint32_t has_theta_;
+  double x_, y_, theta_;
+};
+
+// Appends the binary form of 'robot' to 'out'.  Returns false if the robot
+// has custom elements, which can't be stored.
+inline bool encode_binary_robot(const Robot& robot, uint64_t workspace_samples, double workspace_cell,
+                                std::string& out)
+{
+  std::vector<BinaryElement> elements(robot.elements_.size());
+  std::string strings;
+  for (size_t i = 0; i < robot.elements_.size(); ++i)
+  {
+    const RobotElement& element = *robot.elements_[i];
+    BinaryElement& e = elements[i];
+    std::memset(&e, 0, sizeof(e));
+    e.type_ = element.type();
+    e.visible_ = 1;
+    if (element.parent_ == RobotElement::origin)
+      e.parent_ = 1;
+    else if (element.parent_ != RobotElement::previous)
+      e.parent_ = element.parent_ + 2;
+    const std::string* label = NULL;
+    switch (element.type())
+    {
+      case VectorType:
+      {
+        const Vector& v = (const Vector&)element;
+        e.params_[0] = v.length_;
+        e.params_[1] = v.arrow_len_;
+        e.text_x_offset_ = v.text_x_offset_;
+        e.text_y_offset_ = v.text_y_offset_;
+        label = &v.label_;
+        break;
+      }
+      case PointType:
+      {
+        const RobPoint& p = (const RobPoint&)element;
+        e.params_[0] = p.radius_;
+        e.text_x_offset_ = p.text_x_offset_;
+        e.text_y_offset_ = p.text_y_offset_;
+        label = &p.label_;
+        break;
+      }
+      case FramesType:
+      {
+        const Frames& f = (const Frames&)element;
+        e.params_[0] = f.frame_scale_;
+        e.params_[1] = f.arrow_len_;
+        break;
+      }
+      case LinkType:
+      {
+        const Link& l = (const Link&)element;
+        e.params_[0] = l.length_;
+        e.visible_ = l.visible_;
+        e.text_x_offset_ = l.text_x_offset_;
+        e.text_y_offset_ = l.text_y_offset_;
+        label = &l.label_;
+        break;
+      }
+      case RJointType:
+      {
+        const RJoint& r = (const RJoint&)element;
+        e.params_[0] = r.default_theta_;
+        e.params_[1] = r.radius_;
+        e.visible_ = r.visible_;
+        e.text_x_offset_ = r.text_x_offset_;
+        e.text_y_offset_ = r.text_y_offset_;
+        e.min_theta_ = r.min_theta_;
+        e.max_theta_ = r.max_theta_;
+        e.passive_ = r.passive_;
+        label = &r.label_;
+        break;
+      }
+      case PJointType:
+      {
+        const PJoint& p = (const PJoint&)element;
+        e.params_[0] = p.width_;
+        e.params_[1] = p.length_;
+        e.min_theta_ = p.min_length_;
+        e.max_theta_ = p.max_length_;
+        e.passive_ = p.passive_;
+        break;
+      }
+      case BaseType:
+      {
+        const Base& b = (const Base&)element;
+        e.params_[0] = b.width_;
+        e.params_[1] = b.default_theta_;
+        e.visible_ = b.visible_;
+        break;
+      }
+      case EndEffectorType:
+      {
+        const EndEffector& ee = (const EndEffector&)element;
+        e.params_[0] = ee.width_;
+        e.params_[1] = ee.default_theta_;
+        break;
+      }
+      default:
+        return false;
+    }
+    if (label && !label->empty())
+    {
+      e.label_ = strings.size();
+      e.label_size_ = label->size();
+      strings.append(*label);
+      strings.push_back('\0');
+    }
+  }
+  // Pad the string table, so that files can be concatenated or extended
+  // without breaking alignment.
+  while (strings.size() % 8 != 0)
+    strings.push_back('\0');
+  std::vector<BinaryClosure> closures(robot.closures_.size());
+  for (size_t i = 0; i < closures.size(); ++i)
+  {
+    const LoopClosure& c = robot.closures_[i];
+    closures[i].a_ = c.a_ == RobotElement::origin ? 0 : c.a_ + 1;
+    closures[i].b_ = c.b_ == RobotElement::origin ? 0 : c.b_ + 1;
+  }
+  std::vector<BinaryTarget> targets(robot.targets_.size());
+  for (size_t i = 0; i < targets.size(); ++i)
+  {
+    const PoseTarget& t = robot.targets_[i];
+    std::memset(&targets[i], 0, sizeof(BinaryTarget));
+    targets[i].element_ = t.element_;
+    targets[i].has_theta_ = t.has_theta_;
+    targets[i].x_ = t.x_;
+    targets[i].y_ = t.y_;
+    targets[i].theta_ = t.theta_;
+  }
+
+  BinaryHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic_, "ROBOTBIN", 8);
+  header.version_ = binary_version;
+  header.num_elements_ = elements.size();
+  header.strings_size_ = strings.size();
+  header.num_closures_ = closures.size();
+  header.num_targets_ = targets.size();
+  header.workspace_samples_ = workspace_samples;
+  header.workspace_cell_ = workspace_cell;
+  out.append((const char*)&header, sizeof(header));
+  if (!elements.empty())
+    out.append((const char*)&elements[0], elements.size() * sizeof(BinaryElement));
+  if (!closures.empty())
+    out.append((const char*)&closures[0], closures.size() * sizeof(BinaryClosure));
+  if (!targets.empty())
+    out.append((const char*)&targets[0], targets.size() * sizeof(BinaryTarget));
+  out.append(strings);
+  return true;
+}
+
+// A read-only mapping of a compiled robot file.
+class MappedRobot
+{
+public:
+  MappedRobot()
+    : data_(NULL), size_(0)
+  {}
+
+  // Maps and validates 'filename'.  On failure, returns false and sets
+  // 'error'.
+  bool open(const char* filename, std::string& error)
+  {
+    close();
+    if (!file_.open(filename))
+    {
+      error = std::string("Unable to open ") + filename;
+      return false;
+    }
+    data_ = file_.data();
+    size_ = file_.size();
+    if (size_ < sizeof(BinaryHeader))
+    {
+      close();
+      error = std::string(filename) + " is not a compiled robot file";
+      return false;
+    }
+    if (!validate(filename, error))
+    {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  void close()
+  {
+    file_.close();
+    data_ = NULL;
+    size_ = 0;
+  }
+
+  const BinaryHeader& header() const { return *(const BinaryHeader*)data_; }
+  size_t size() const { return header().num_elements_; }
+  const BinaryElement& element(size_t i) const
+  {
+    return ((const BinaryElement*)(data_ + sizeof(BinaryHeader)))[i];
+  }
+  size_t num_closures() const { return header().num_closures_; }
+  const BinaryClosure& closure(size_t i) const
+  {
+    return ((const BinaryClosure*)(data_ + sizeof(BinaryHeader) + size() * sizeof(BinaryElement)))[i];
+  }
+  size_t num_targets() const { return header().num_targets_; }
+  const BinaryTarget& target(size_t i) const
+  {
+    return ((const BinaryTarget*)(data_ + sizeof(BinaryHeader) + size() * sizeof(BinaryElement) +
+                                  num_closures() * sizeof(BinaryClosure)))[i];
+  }
+  // The element's label ('\0' terminated), or "" for none.
+  const char* label(const BinaryElement& e) const
+  {
+    return e.label_size_ == 0 ? "" : strings() + e.label_;
+  }
+
+  // Appends the elements to 'robot', allocated from 'arena'.
+  void build(Robot& robot, Arena& arena) const
+  {
+    size_t first = robot.elements_.size();
+    robot.elements_.reserve(first + size());
+    for (size_t i = 0; i < size(); ++i)
+    {
+      const BinaryElement& e = element(i);
+      switch ((ElementType)e.type_)
+      {
+        case VectorType:
+        {
+          Vector* v = arena.create<Vector>(e.params_[0]);
+          v->arrow_len_ = e.params_[1];
+          v->text_x_offset_ = e.text_x_offset_;
+          v->text_y_offset_ = e.text_y_offset_;
+          v->label_.assign(label(e), e.label_size_);
+          robot.elements_.push_back(v);
+          break;
+        }
+        case PointType:
+        {
+          RobPoint* p = arena.create<RobPoint>(e.params_[0]);
+          p->text_x_offset_ = e.text_x_offset_;
+          p->text_y_offset_ = e.text_y_offset_;
+          p->label_.assign(label(e), e.label_size_);
+          robot.elements_.push_back(p);
+          break;
+        }
+        case FramesType:
+        {
+          Frames* f = arena.create<Frames>();
+          f->frame_scale_ = e.params_[0];
+          f->arrow_len_ = e.params_[1];
+          robot.elements_.push_back(f);
+          break;
+        }
+        case LinkType:
+        {
+          Link* l = arena.create<Link>(e.params_[0]);
+          l->visible_ = e.visible_ != 0;
+          l->text_x_offset_ = e.text_x_offset_;
+          l->text_y_offset_ = e.text_y_offset_;
+          l->label_.assign(label(e), e.label_size_);
+          robot.elements_.push_back(l);
+          break;
+        }
+        case RJointType:
+        {
+          RJoint* r = arena.create<RJoint>(e.params_[0], e.params_[1]);
+          r->visible_ = e.visible_ != 0;
+          r->text_x_offset_ = e.text_x_offset_;
+          r->text_y_offset_ = e.text_y_offset_;
+          r->min_theta_ = e.min_theta_;
+          r->max_theta_ = e.max_theta_;
+          r->passive_ = e.passive_ != 0;
+          r->label_.assign(label(e), e.label_size_);
+          robot.elements_.push_back(r);
+          break;
+        }
+        case PJointType:
+        {
+          PJoint* p = arena.create<PJoint>();
+          p->width_ = e.params_[0];
+          p->length_ = e.params_[1];
+          p->min_length_ = e.min_theta_;
+          p->max_length_ = e.max_theta_;
+          p->passive_ = e.passive_ != 0;
+          robot.elements_.push_back(p);
+          break;
+        }
+        case BaseType:
+        {
+          Base* b = arena.create<Base>(e.params_[0], e.params_[1]);
+          b->visible_ = e.visible_ != 0;
+          robot.elements_.push_back(b);
+          break;
+        }
+        case EndEffectorType:
+          robot.elements_.push_back(arena.create<EndEffector>(e.params_[0], e.params_[1]));
+          break;
+        default:
+          // Rejected by validate.
+          break;
+      }
+      if (e.parent_ == 1)
+        robot.elements_.back()->parent_ = RobotElement::origin;
+      else if (e.parent_ != 0)
+        robot.elements_.back()->parent_ = first + e.parent_ - 2;
+    }
+    for (size_t i = 0; i < num_closures(); ++i)
+    {
+      const BinaryClosure& c = closure(i);
+      robot.closures_.push_back(LoopClosure(c.a_ == 0 ? (size_t)RobotElement::origin : first + c.a_ - 1,
+                                            c.b_ == 0 ? (size_t)RobotElement::origin : first + c.b_ - 1));
+    }
+    for (size_t i = 0; i < num_targets(); ++i)
+    {
+      const BinaryTarget& t = target(i);
+      robot.targets_.push_back(PoseTarget(first + t.element_, t.x_, t.y_, t.theta_, t.has_theta_ != 0));
+    }
+  }
+
+private:
+  // Non-copyable.
+  MappedRobot(const MappedRobot&);
+  MappedRobot& operator=(const MappedRobot&);
+
+  const char* strings() const
+  {
+    return data_ + sizeof(BinaryHeader) + size() * sizeof(BinaryElement) +
+           num_closures() * sizeof(BinaryClosure) + num_targets() * sizeof(BinaryTarget);
+  }
+
+  bool validate(const char* filename, std::string& error) const
+  {
+    const BinaryHeader& h = header();
+    if (std::memcmp(h.magic_, "ROBOTBIN", 8) != 0)
+    {
+      error = std::string(filename) + " is not a compiled robot file";
+      return false;
+    }
+    if (h.version_ != binary_version)
+    {
+      error = std::string(filename) + " was compiled by a different version; recompile it";
+      return false;
+    }
+    if ((size_ - sizeof(BinaryHeader)) / sizeof(BinaryElement) < h.num_elements_ ||
+        (size_ - sizeof(BinaryHeader)) / sizeof(BinaryClosure) < h.num_closures_ ||
+        (size_ - sizeof(BinaryHeader)) / sizeof(BinaryTarget) < h.num_targets_ ||
+        size_ != sizeof(BinaryHeader) + (uint64_t)h.num_elements_ * sizeof(BinaryElement) +
+                 (uint64_t)h.num_closures_ * sizeof(BinaryClosure) +
+                 (uint64_t)h.num_targets_ * sizeof(BinaryTarget) + h.strings_size_)
+    {
+      error = std::string(filename) + " is truncated or corrupt";
+      return false;
+    }
+    for (size_t i = 0; i < size(); ++i)
+    {
+      const BinaryElement& e = element(i);
+      if (e.type_ <= CustomType || e.type_ > EndEffectorType || e.parent_ >= i + 2 ||
+          (e.label_size_ != 0 && ((uint64_t)e.label_ + e.label_size_ >= h.strings_size_ ||
+                                  strings()[e.label_ + e.label_size_] != '\0')))
+      {
+        error = std::string(filename) + " is truncated or corrupt";
+        return false;
+      }
+    }
+    for (size_t i = 0; i < num_closures(); ++i)
+    {
+      if (closure(i).a_ > size() || closure(i).b_ > size())
+      {
+        error = std::string(filename) + " is truncated or corrupt";
+        return false;
+      }
+    }
+    for (size_t i = 0; i < num_targets(); ++i)
+    {
+      if (target(i).element_ >= size())
+      {
+        error = std::string(filename) + " is truncated or corrupt";
+        return false;
+      }
+    }
+    return true;
+  }
+
+  MappedFile file_;
+  const char* data_;
+  size_t size_;
+};
+
+}
+
+#endif
@@ -0,0 +1,300 @@
+#ifndef ROBOT_CHAIN_HPP
+#define ROBOT_CHAIN_HPP
+
+#include "robot_diagrams_0.0.hpp"
+
+#include <string>
+#include <vector>
+
+namespace rob_diag
+{
+
+// A compact alternative to Robot for very long chains (or trees).  Elements are stored
+// by value in one array of tagged records, and all of their points live in one
+// shared buffer, so measuring is a single switch-driven loop over contiguous
+// memory with no virtual calls and no per-element allocations.  The geometry
+// is the same code the RobotElement classes use (their static measure_points
+// and draw_points functions), so both produce identical output.
+//
+// Build one from an existing Robot with 'assign', or element by element with
+// the 'add_*' functions.
+class FlatChain
+{
+public:
+  // One element.  The meaning of 'params_' depends on 'type_':
+  //   VectorType:      length, arrow length
+  //   PointType:       radius
+  //   FramesType:      frame scale, arrow length
+  //   LinkType:        length
+  //   RJointType:      theta, radius
+  //   PJointType:      width, length
+  //   BaseType:        width, default theta
+  //   EndEffectorType: width, default theta
+  struct Record
+  {
+    ElementType type_;
+    bool visible_;
+    // Index into 'labels_', or -1 for no label.
+    int label_;
+    // Offset of the element's points in 'points_'.
+    size_t first_point_;
+    double params_[2];
+    double text_x_offset_, text_y_offset_;
+    // Set by measure, for RJoint label arcs.
+    double start_theta_, end_theta_;
+    // Where the element starts, as in RobotElement::parent_.
+    size_t parent_;
+  };
+
+  std::vector<Record> records_;
+  std::vector<Point> points_;
+  std::vector<std::string> labels_;
+
+  void clear()
+  {
+    records_.clear();
+    points_.clear();
+    labels_.clear();
+    ends_.clear();
+  }
+
+  // Appends a copy of 'element'.  Returns false for element types the flat
+  // chain doesn't know about (CustomType).
+  bool add(const RobotElement& element)
+  {
+    switch (element.type())
+    {
+      case VectorType:
+      {
+        const Vector& e = (const Vector&)element;
+        Record& r = add(VectorType, e.length_, e.arrow_len_);
+        set_label(r, e.label_, e.text_x_offset_, e.text_y_offset_);
+        return true;
+      }
+      case PointType:
+      {
+        const RobPoint& e = (const RobPoint&)element;
+        Record& r = add(PointType, e.radius_, 0);
+        set_label(r, e.label_, e.text_x_offset_, e.text_y_offset_);
+        return true;
+      }
+      case FramesType:
+      {
+        const Frames& e = (const Frames&)element;
+        add(FramesType, e.frame_scale_, e.arrow_len_);
+        return true;
+      }
+      case LinkType:
+      {
+        const Link& e = (const Link&)element;
+        Record& r = add(LinkType, e.length_, 0);
+        r.visible_ = e.visible_;
+        set_label(r, e.label_, e.text_x_offset_, e.text_y_offset_);
+        return true;
+      }
+      case RJointType:
+      {
+        const RJoint& e = (const RJoint&)element;
+        Record& r = add(RJointType, e.default_theta_, e.radius_);
+        r.visible_ = e.visible_;
+        set_label(r, e.label_, e.text_x_offset_, e.text_y_offset_);
+        return true;
+      }
+      case PJointType:
+      {
+        const PJoint& e = (const PJoint&)element;
+        add(PJointType, e.width_, e.length_);
+        return true;
+      }
+      case BaseType:
+      {
+        const Base& e = (const Base&)element;
+        Record& r = add(BaseType, e.width_, e.default_theta_);
+        r.visible_ = e.visible_;
+        return true;
+      }
+      case EndEffectorType:
+      {
+        const EndEffector& e = (const EndEffector&)element;
+        add(EndEffectorType, e.width_, e.default_theta_);
+        return true;
+      }
+      default:
+        return false;
+    }
+  }
+
+  // Replaces the contents with a copy of 'robot'.  Returns false (leaving
+  // the chain empty) if the robot has custom elements.
+  bool assign(const Robot& robot)
+  {
+    clear();
+    records_.reserve(robot.elements_.size());
+    for (size_t i = 0; i < robot.elements_.size(); ++i)
+    {
+      if (!add(*robot.elements_[i]))
+      {
+        clear();
+        return false;
+      }
+      records_.back().parent_ = robot.elements_[i]->parent_;
+    }
+    return true;
+  }
+
+  // Appends an element with default text offsets and no label, and makes
+  // room for its points.
+  Record& add(ElementType type, double param_0, double param_1)
+  {
+    Record r;
+    r.type_ = type;
+    r.visible_ = true;
+    r.label_ = -1;
+    r.first_point_ = points_.size();
+    r.params_[0] = param_0;
+    r.params_[1] = param_1;
+    r.text_x_offset_ = 0;
+    r.text_y_offset_ = type == RJointType ? 0 : -15;
+    r.start_theta_ = r.end_theta_ = 0;
+    r.parent_ = RobotElement::previous;
+    records_.push_back(r);
+    points_.resize(points_.size() + num_points(type));
+    return records_.back();
+  }
+
+  static size_t num_points(ElementType type)
+  {
+    switch (type)
+    {
+      case VectorType: return Vector::num_points_;
+      case PointType: return RobPoint::num_points_;
+      case FramesType: return Frames::num_points_;
+      case LinkType: return Link::num_points_;
+      case RJointType: return RJoint::num_points_;
+      case PJointType: return PJoint::num_points_;
+      case BaseType: return Base::num_points_;
+      case EndEffectorType: return EndEffector::num_points_;
+      default: return 0;
+    }
+  }
+
+  // Same as Robot::compute_dimensions.
+  Rect compute_dimensions()
+  {
+    Pose current(0,0,0);
+    Rect bounds;
+    Point* points = points_.empty() ? NULL : &points_[0];
+    // Every end pose is kept only if there are branches.
+    bool tree = false;
+    for (size_t i = 0; i < records_.size() && !tree; ++i)
+      tree = records_[i].parent_ != RobotElement::previous;
+    ends_.resize(tree ? records_.size() : 0, Pose(0,0,0));
+    for (size_t i = 0; i < records_.size(); ++i)
+    {
+      Record& r = records_[i];
+      Point* p = points + r.first_point_;
+      Pose out(0,0,0);
+      if (r.parent_ == RobotElement::origin)
+        current = Pose(0,0,0);
+      else if (r.parent_ != RobotElement::previous)
+        current = ends_[r.parent_];
+      switch (r.type_)
+      {
+        case VectorType:
+          bounds.extend(Vector::measure_points(r.params_[0], r.params_[1], current, out, p));
+          break;
+        case PointType:
+          bounds.extend(RobPoint::measure_points(r.params_[0], current, out, p));
+          break;
+        case FramesType:
+          bounds.extend(Frames::measure_points(r.params_[0], r.params_[1], current, out, p));
+          break;
+        case LinkType:
+          bounds.extend(Link::measure_points(r.params_[0], current, out, p));
+          break;
+        case RJointType:
+          bounds.extend(RJoint::measure_points(r.params_[0], r.params_[1], current, out, p,
+                                               r.start_theta_, r.end_theta_));
+          break;
+        case PJointType:
+          bounds.extend(PJoint::measure_points(r.params_[0], r.params_[1], current, out, p));
+          break;
+        case BaseType:
+          bounds.extend(Base::measure_points(r.params_[0], r.params_[1], current, out, p));
+          break;
+        case EndEffectorType:
+          bounds.extend(EndEffector::measure_points(r.params_[0], r.params_[1], current, out, p));
+          break;
+        default:
+          out = current;
+          break;
+      }
+      if (tree)
+        ends_[i] = out;
+      current = out;
+    }
+    return bounds;
+  }
+
+  // Same as Robot::draw_at.
+  void draw_at(Document& doc, const Pose& start) const
+  {
+    static const std::string no_label;
+    Point offset(start.x_, start.y_);
+    for (size_t i = 0; i < records_.size(); ++i)
+    {
+      const Record& r = records_[i];
+      const Point* p = &points_[r.first_point_];
+      const std::string& label = r.label_ < 0 ? no_label : labels_[r.label_];
+      switch (r.type_)
+      {
+        case VectorType:
+          Vector::draw_points(doc, p, offset, label, r.text_x_offset_, r.text_y_offset_);
+          break;
+        case PointType:
+          RobPoint::draw_points(doc, p, offset, r.params_[0], label, r.text_x_offset_, r.text_y_offset_);
+          break;
+        case FramesType:
+          Frames::draw_points(doc, p, offset);
+          break;
+        case LinkType:
+          Link::draw_points(doc, p, offset, r.visible_, label, r.text_x_offset_, r.text_y_offset_);
+          break;
+        case RJointType:
+          RJoint::draw_points(doc, p, offset, r.params_[1], r.visible_, r.start_theta_, r.end_theta_,
+                              label, r.text_x_offset_, r.text_y_offset_);
+          break;
+        case PJointType:
+          PJoint::draw_points(doc, p, offset);
+          break;
+        case BaseType:
+          if (r.visible_)
+            Base::draw_points(doc, p, offset);
+          break;
+        case EndEffectorType:
+          EndEffector::draw_points(doc, p, offset);
+          break;
+        default:
+          break;
+      }
+    }
+  }
+
+private:
+  // The end pose of every record, for trees.
+  std::vector<Pose> ends_;
+
+  void set_label(Record& r, const std::string& label, double text_x_offset, double text_y_offset)
+  {
+    r.text_x_offset_ = text_x_offset;
+    r.text_y_offset_ = text_y_offset;
+    if (label.empty())
+      return;
+    r.label_ = labels_.size();
+    labels_.push_back(label);
+  }
+};
+
+}
+
+#endif
@@ -1,6 +1,12 @@
+#ifndef ROBOT_DIAGRAMS_HPP
+#define ROBOT_DIAGRAMS_HPP
+
 #include <cmath>
 #include <algorithm>
 #include <memory>
+#include <set>
+#include <string>
+#include <vector>
 
 #include "simple_svg_1.0.0.hpp"
 
@@ -43,38 +49,98 @@ public:
   double left_, top_, right_, bottom_;
 };
 
+// The built-in element types; see RobotElement::type.
+enum ElementType { CustomType, VectorType, PointType, FramesType, LinkType,
+                   RJointType, PJointType, BaseType, EndEffectorType };
+
+// Bounds of a set of points.
+inline Rect point_bounds(const Point* points, size_t count)
+{
+  if (count == 0)
+  {
+    std::cerr << "Invalid use of point_bounds!" << std::endl;
+    return Rect();
+  }
+  Rect bounds(points[0].x, points[0].y, points[0].x, points[0].y);
+  for (size_t i = 1; i < count; ++i)
+  {
+    Point p = points[i];
+    bounds.left_   = std::min(p.x, bounds.left_);
+    bounds.right_  = std::max(p.x, bounds.right_);
+    bounds.top_    = std::max(p.y, bounds.top_);
+    bounds.bottom_ = std::min(p.y, bounds.bottom_);
+  }
+  return bounds;
+}
+
+// Names a glyph (see RobotElement::symbol) after its kind and the parameters
+// that shape it, e.g. "frames_25_4".
+inline std::string symbol_name(const char* kind, double a)
+{
+  char number[32];
+  std::string name(kind);
+  name += '_';
+  name.append(number, formatNumber(number, a));
+  // Keep it a valid XML name ("1e+07").
+  std::replace(name.begin(), name.end(), '+', 'p');
+  return name;
+}
+inline std::string symbol_name(const char* kind, double a, double b)
+{
+  return symbol_name(symbol_name(kind, a).c_str(), b);
+}
+
+// Each element below keeps its geometry in a pair of static functions:
+// 'measure_points' fills in a fixed number ('num_points_') of points and
+// returns the bounds, and 'draw_points' draws from those points.  The virtual
+// measure/draw just call them on the element's own parameters, and FlatChain
+// (robot_chain.hpp) calls them directly on its packed records.
 class RobotElement
 {
 public:
+  RobotElement()
+    : dirty_(true), parent_(previous)
+  {}
   // Computes the ending pose and a bounding box given a starting pose
   virtual Rect measure(const Pose& start, Pose& end) = 0;
   // Draws the element given an offset from the measure pass
   virtual void draw(Document& doc, const Point& offset) = 0;
+  // Which built-in element this is (CustomType for anything else).
+  virtual ElementType type() const { return CustomType; }
+  // For Robot::draw_symbols_at: an element that looks the same wherever it is
+  // (up to its position and direction) returns the id of its glyph, and sets
+  // 'placement' to where the glyph goes given the pose the element was
+  // measured from.  Elements with the same id must look the same.  Returns ""
+  // to be drawn with 'draw' instead.
+  virtual std::string symbol(const Pose& /* start */, Pose& /* placement */) const { return ""; }
+  // Draws the glyph at the origin, facing along x.
+  virtual void draw_symbol(Document& /* doc */) const {}
   virtual ~RobotElement() {};
+  // Flags the element for re-measuring by Robot::update_dimensions; call this
+  // after changing any of its parameters directly (the setters below do it
+  // for you).
+  void mark_dirty() { dirty_ = true; }
+  // Set until the element is next measured.
+  bool dirty_;
+  // Where the element starts: at the end of the element before it in the
+  // robot ('previous', the default, which makes a chain), at the robot's
+  // origin ('origin'), or at the end of the element with this index, which
+  // has to come before it.  See Robot::attach.
+  size_t parent_;
+  static const size_t previous = (size_t)-1;
+  static const size_t origin = (size_t)-2;
 protected:
   // A set of points that are used to draw the given element.  These are
   // computed during the 'measure' pass, and used for rendering during the
-  // 'draw' pass.
+  // 'draw' pass.  (The built-in elements have a fixed number of points, and
+  // keep them in a 'fixed_points_' array instead, so that an element is one
+  // allocation; this is left for custom elements.)
   std::vector<Point> points_;
   // Extend the current 'bounds' object to include the (x,y) values of each
   // point.
   virtual Rect point_bounds()
   {
-    if (points_.size() == 0)
-    {
-      std::cerr << "Invalid use of point_bounds!" << std::endl;
-      return Rect();
-    }
-    Rect bounds(points_[0].x, points_[0].y, points_[0].x, points_[0].y);
-    for (unsigned int i = 1; i < points_.size(); ++i)
-    {
-      Point p = points_[i];
-      bounds.left_   = std::min(p.x, bounds.left_);
-      bounds.right_  = std::max(p.x, bounds.right_);
-      bounds.top_    = std::max(p.y, bounds.top_);
-      bounds.bottom_ = std::min(p.y, bounds.bottom_);
-    }
-    return bounds;
+    return rob_diag::point_bounds(points_.empty() ? NULL : &points_[0], points_.size());
   }
 };
 
@@ -89,28 +155,38 @@ public:
     : length_(length), arrow_len_(4), text_x_offset_(0), text_y_offset_(-15), label_(label)
   {}
   virtual Rect measure(const Pose& start, Pose& end)
+  {
+    return measure_points(length_, arrow_len_, start, end, fixed_points_);
+  }
+  virtual void draw(Document& doc, const Point& offset)
+  {
+    draw_points(doc, fixed_points_, offset, label_, text_x_offset_, text_y_offset_);
+  }
+  virtual ElementType type() const { return VectorType; }
+  static const size_t num_points_ = 4;
+  static Rect measure_points(double length, double arrow_len, const Pose& start, Pose& end, Point* points)
   {
     // Note: the points for Vector are { start, end, arrowhead end 1,
     // arrowhead end 2 }
-    points_.clear();
     end = start;
     double c = std::cos(end.theta_);
     double s = std::sin(end.theta_);
-    end.x_ = start.x_ + c * length_;
-    end.y_ = start.y_ + s * length_;
-    points_.push_back(Point(start.x_, start.y_));
-    points_.push_back(Point(end.x_, end.y_));
-    points_.push_back(Point(end.x_ - c * arrow_len_ + s * arrow_len_, end.y_ - s * arrow_len_ - c * arrow_len_ ));
-    points_.push_back(Point(end.x_ - c * arrow_len_ - s * arrow_len_, end.y_ - s * arrow_len_ + c * arrow_len_ ));
-    return point_bounds();
+    end.x_ = start.x_ + c * length;
+    end.y_ = start.y_ + s * length;
+    points[0] = Point(start.x_, start.y_);
+    points[1] = Point(end.x_, end.y_);
+    points[2] = Point(end.x_ - c * arrow_len + s * arrow_len, end.y_ - s * arrow_len - c * arrow_len );
+    points[3] = Point(end.x_ - c * arrow_len - s * arrow_len, end.y_ - s * arrow_len + c * arrow_len );
+    return rob_diag::point_bounds(points, num_points_);
   }
-  virtual void draw(Document& doc, const Point& offset)
+  static void draw_points(Document& doc, const Point* points, const Point& offset,
+                          const std::string& label, double text_x_offset, double text_y_offset)
   {
-    doc << Line(points_[0] + offset, points_[1] + offset, Stroke(0.5, Color::Black));
-    doc << Line(points_[1] + offset, points_[2] + offset, Stroke(0.5, Color::Black));
-    doc << Line(points_[1] + offset, points_[3] + offset, Stroke(0.5, Color::Black));
-    if (label_.size() > 0)
-      doc << Text(points_[0] * 0.5 + points_[1] * 0.5 + offset + Point(text_x_offset_, text_y_offset_), label_, Fill(Color::Black));
+    doc << Line(points[0] + offset, points[1] + offset, Stroke(0.5, Color::Black));
+    doc << Line(points[1] + offset, points[2] + offset, Stroke(0.5, Color::Black));
+    doc << Line(points[1] + offset, points[3] + offset, Stroke(0.5, Color::Black));
+    if (label.size() > 0)
+      doc << Text(points[0] * 0.5 + points[1] * 0.5 + offset + Point(text_x_offset, text_y_offset), label, Fill(Color::Black));
   }
   virtual ~Vector() {};
   double length_;
@@ -118,6 +194,7 @@ public:
   double text_x_offset_;
   double text_y_offset_;
   std::string label_;
+  Point fixed_points_[num_points_];
 };
 
 // TODO: change this to 'point', and don't pull in svg namespace!
@@ -128,24 +205,48 @@ public:
     : radius_(radius), text_x_offset_(0), text_y_offset_(-15), label_(label)
   {}
   virtual Rect measure(const Pose& start, Pose& end)
+  {
+    return measure_points(radius_, start, end, fixed_points_);
+  }
+  virtual void draw(Document& doc, const Point& offset)
+  {
+    draw_points(doc, fixed_points_, offset, radius_, label_, text_x_offset_, text_y_offset_);
+  }
+  virtual ElementType type() const { return PointType; }
+  virtual std::string symbol(const Pose& start, Pose& placement) const
+  {
+    if (!label_.empty())
+      return "";
+    placement = Pose(start.x_, start.y_, 0);
+    return symbol_name("point", radius_);
+  }
+  virtual void draw_symbol(Document& doc) const
+  {
+    Point center;
+    draw_points(doc, &center, Point(), radius_, "", 0, 0);
+  }
+  static const size_t num_points_ = 1;
+  static Rect measure_points(double radius, const Pose& start, Pose& end, Point* points)
   {
     // Note: the points for Point are { center }
     end = start;
-    points_.push_back(Point(start.x_, start.y_));
-    return Rect(start.x_ - radius_, start.y_ + radius_,
-                start.x_ + radius_, start.y_ - radius_);
+    points[0] = Point(start.x_, start.y_);
+    return Rect(start.x_ - radius, start.y_ + radius,
+                start.x_ + radius, start.y_ - radius);
   }
-  virtual void draw(Document& doc, const Point& offset)
+  static void draw_points(Document& doc, const Point* points, const Point& offset, double radius,
+                          const std::string& label, double text_x_offset, double text_y_offset)
   {
-    doc << Circle(points_[0] + offset, radius_ * 2, Fill(Color::Black));
-    if (label_.size() > 0)
-      doc << Text(points_[0] + offset + Point(text_x_offset_, text_y_offset_), label_, Fill(Color::Black));
+    doc << Circle(points[0] + offset, radius * 2, Fill(Color::Black));
+    if (label.size() > 0)
+      doc << Text(points[0] + offset + Point(text_x_offset, text_y_offset), label, Fill(Color::Black));
   }
   virtual ~RobPoint() {};
   double radius_;
   double text_x_offset_;
   double text_y_offset_;
   std::string label_;
+  Point fixed_points_[num_points_];
 };
 
 
@@ -156,6 +257,28 @@ public:
     : frame_scale_(25), arrow_len_(4)
   {}
   virtual Rect measure(const Pose& start, Pose& end)
+  {
+    return measure_points(frame_scale_, arrow_len_, start, end, fixed_points_);
+  }
+  virtual void draw(Document& doc, const Point& offset)
+  {
+    draw_points(doc, fixed_points_, offset);
+  }
+  virtual ElementType type() const { return FramesType; }
+  virtual std::string symbol(const Pose& start, Pose& placement) const
+  {
+    placement = start;
+    return symbol_name("frames", frame_scale_, arrow_len_);
+  }
+  virtual void draw_symbol(Document& doc) const
+  {
+    Point points[num_points_];
+    Pose end(0,0,0);
+    measure_points(frame_scale_, arrow_len_, Pose(0,0,0), end, points);
+    draw_points(doc, points, Point());
+  }
+  static const size_t num_points_ = 7;
+  static Rect measure_points(double frame_scale, double arrow_len, const Pose& start, Pose& end, Point* points)
   {
     // Set end frame
     end = start;
@@ -164,31 +287,32 @@ public:
     double c = std::cos(end.theta_);
     double s = std::sin(end.theta_);
     // X axis:
-    points_.push_back(Point(start.x_, start.y_));
-    Point p_x(points_[0] + Point(c, s) * frame_scale_);
-    points_.push_back(p_x);
-    points_.push_back(p_x + (Point(-c, -s) + Point(-s, c)) * arrow_len_);
-    points_.push_back(p_x + (Point(-c, -s) - Point(-s, c)) * arrow_len_);
+    points[0] = Point(start.x_, start.y_);
+    Point p_x(points[0] + Point(c, s) * frame_scale);
+    points[1] = p_x;
+    points[2] = p_x + (Point(-c, -s) + Point(-s, c)) * arrow_len;
+    points[3] = p_x + (Point(-c, -s) - Point(-s, c)) * arrow_len;
     // Y axis:
-    Point p_y(points_[0] + Point(-s, c) * frame_scale_);
-    points_.push_back(p_y);
-    points_.push_back(p_y + (Point(s, -c) + Point(c, s)) * arrow_len_);
-    points_.push_back(p_y + (Point(s, -c) - Point(c, s)) * arrow_len_);
-    return point_bounds();
+    Point p_y(points[0] + Point(-s, c) * frame_scale);
+    points[4] = p_y;
+    points[5] = p_y + (Point(s, -c) + Point(c, s)) * arrow_len;
+    points[6] = p_y + (Point(s, -c) - Point(c, s)) * arrow_len;
+    return rob_diag::point_bounds(points, num_points_);
   }
-  virtual void draw(Document& doc, const Point& offset)
+  static void draw_points(Document& doc, const Point* points, const Point& offset)
   {
     Stroke s_r(1.35, Color::Red);
     Stroke s_b(1.35, Color::Blue);
-    doc << Line(points_[0] + offset, points_[1] + offset, s_r);
-    doc << Line(points_[1] + offset, points_[2] + offset, s_r);
-    doc << Line(points_[1] + offset, points_[3] + offset, s_r);
-    doc << Line(points_[0] + offset, points_[4] + offset, s_b);
-    doc << Line(points_[4] + offset, points_[5] + offset, s_b);
-    doc << Line(points_[4] + offset, points_[6] + offset, s_b);
+    doc << Line(points[0] + offset, points[1] + offset, s_r);
+    doc << Line(points[1] + offset, points[2] + offset, s_r);
+    doc << Line(points[1] + offset, points[3] + offset, s_r);
+    doc << Line(points[0] + offset, points[4] + offset, s_b);
+    doc << Line(points[4] + offset, points[5] + offset, s_b);
+    doc << Line(points[4] + offset, points[6] + offset, s_b);
   }
   double frame_scale_;
   double arrow_len_;
+  Point fixed_points_[num_points_];
 };
 
 class Link : public RobotElement
@@ -198,29 +322,41 @@ public:
     : length_(length), text_x_offset_(0), text_y_offset_(-15), label_(label), visible_(true)
   {}
   virtual Rect measure(const Pose& start, Pose& end)
+  {
+    return measure_points(length_, start, end, fixed_points_);
+  }
+  virtual void draw(Document& doc, const Point& offset)
+  {
+    draw_points(doc, fixed_points_, offset, visible_, label_, text_x_offset_, text_y_offset_);
+  }
+  virtual ElementType type() const { return LinkType; }
+  static const size_t num_points_ = 2;
+  static Rect measure_points(double length, const Pose& start, Pose& end, Point* points)
   {
     // Note: the points for Link are { start, end }
-    points_.clear();
     end = start;
-    end.x_ = start.x_ + std::cos(end.theta_) * length_;
-    end.y_ = start.y_ + std::sin(end.theta_) * length_;
-    points_.push_back(Point(start.x_, start.y_));
-    points_.push_back(Point(end.x_, end.y_));
-    return point_bounds();
+    end.x_ = start.x_ + std::cos(end.theta_) * length;
+    end.y_ = start.y_ + std::sin(end.theta_) * length;
+    points[0] = Point(start.x_, start.y_);
+    points[1] = Point(end.x_, end.y_);
+    return rob_diag::point_bounds(points, num_points_);
   }
-  virtual void draw(Document& doc, const Point& offset)
+  static void draw_points(Document& doc, const Point* points, const Point& offset, bool visible,
+                          const std::string& label, double text_x_offset, double text_y_offset)
   {
-    if (visible_)
-      doc << Line(points_[0] + offset, points_[1] + offset, Stroke(0.5, Color::Black));
-    if (label_.size() > 0)
-      doc << Text(points_[0] * 0.5 + points_[1] * 0.5 + offset + Point(text_x_offset_, text_y_offset_), label_, Fill(Color::Black));
+    if (visible)
+      doc << Line(points[0] + offset, points[1] + offset, Stroke(0.5, Color::Black));
+    if (label.size() > 0)
+      doc << Text(points[0] * 0.5 + points[1] * 0.5 + offset + Point(text_x_offset, text_y_offset), label, Fill(Color::Black));
   }
   virtual ~Link() {};
+  void set_length(double length) { length_ = length; mark_dirty(); }
   double length_;
   double text_x_offset_;
   double text_y_offset_;
   std::string label_;
   bool visible_;
+  Point fixed_points_[num_points_];
 };
 // TODO: add label!
 
@@ -231,38 +367,75 @@ public:
   RJoint(double default_theta = 0, double radius = 4, std::string label = "")
     : radius_(radius), default_theta_(default_theta),
       label_(label), text_x_offset_(0), text_y_offset_(0),
-      visible_(true)
+      visible_(true), min_theta_(-M_PI), max_theta_(M_PI), passive_(false)
   {}
   virtual Rect measure(const Pose& start, Pose& end)
+  {
+    return measure_points(default_theta_, radius_, start, end, fixed_points_, start_theta_, end_theta_);
+  }
+  virtual void draw(Document& doc, const Point& offset)
+  {
+    draw_points(doc, fixed_points_, offset, radius_, visible_, start_theta_, end_theta_,
+                label_, text_x_offset_, text_y_offset_);
+  }
+  virtual ElementType type() const { return RJointType; }
+  virtual std::string symbol(const Pose& start, Pose& placement) const
+  {
+    // Labels follow the joint angle; draw those joints in full.
+    if (!visible_ || !label_.empty())
+      return "";
+    placement = Pose(start.x_, start.y_, 0);
+    return symbol_name("rjoint", radius_);
+  }
+  virtual void draw_symbol(Document& doc) const
+  {
+    Point points[num_points_];
+    draw_points(doc, points, Point(), radius_, true, 0, 0, "", 0, 0);
+  }
+  static const size_t num_points_ = 2;
+  // Also returns the start and end angles, which draw_points needs for the
+  // label's arc.
+  static Rect measure_points(double theta, double radius, const Pose& start, Pose& end, Point* points,
+                             double& start_theta, double& end_theta)
   {
     // Note: the points for RJoint are { center, middle of text arc }
     end = start;
-    end.theta_ += default_theta_;
-    start_theta_ = start.theta_;
-    end_theta_ = end.theta_;
-    double mid_theta = (start_theta_ + end_theta_) * 0.5;
-    points_.push_back(Point(start.x_, start.y_));
-    points_.push_back(Point(start.x_ + radius_ * 2 * cos(mid_theta),
-                            start.y_ + radius_ * 2 * sin(mid_theta)));
-    return Rect(start.x_ - radius_, start.y_ + radius_,
-                start.x_ + radius_, start.y_ - radius_);
+    end.theta_ += theta;
+    start_theta = start.theta_;
+    end_theta = end.theta_;
+    double mid_theta = (start_theta + end_theta) * 0.5;
+    points[0] = Point(start.x_, start.y_);
+    points[1] = Point(start.x_ + radius * 2 * cos(mid_theta),
+                      start.y_ + radius * 2 * sin(mid_theta));
+    return Rect(start.x_ - radius, start.y_ + radius,
+                start.x_ + radius, start.y_ - radius);
   }
-  virtual void draw(Document& doc, const Point& offset)
+  static void draw_points(Document& doc, const Point* points, const Point& offset, double radius,
+                          bool visible, double start_theta, double end_theta,
+                          const std::string& label, double text_x_offset, double text_y_offset)
   {
-    if (visible_)
-      doc << Circle(points_[0] + offset, radius_ * 2, Fill(Color::Transparent), Stroke(0.5, Color::Black));
-    if (label_.size() > 0)
+    if (visible)
+      doc << Circle(points[0] + offset, radius * 2, Fill(Color::Transparent), Stroke(0.5, Color::Black));
+    if (label.size() > 0)
     {
-      doc << Arc(points_[0] + offset, start_theta_, end_theta_, 2 * radius_, Stroke(0.5, Color::Black));
-      doc << Text(points_[1] + offset + Point(text_x_offset_, text_y_offset_), label_, Fill(Color::Black));
+      doc << Arc(points[0] + offset, start_theta, end_theta, 2 * radius, Stroke(0.5, Color::Black));
+      doc << Text(points[1] + offset + Point(text_x_offset, text_y_offset), label, Fill(Color::Black));
     }
   }
   virtual ~RJoint() {};
+  void set_theta(double theta) { default_theta_ = theta; mark_dirty(); }
   double radius_, default_theta_;
   std::string label_;
   double text_x_offset_, text_y_offset_;
   double start_theta_, end_theta_;
   bool visible_;
+  // Joint limits; these don't affect drawing, only tools that explore the
+  // joint space (e.g. workspace maps).
+  double min_theta_, max_theta_;
+  // Set for a joint of a closed chain whose angle follows from the others
+  // (see LoopSolver); 'default_theta_' is then just the first guess.
+  bool passive_;
+  Point fixed_points_[num_points_];
 };
 
 // (x to the right, y up, origin halfway between pts. 1 and 2)
@@ -278,37 +451,64 @@ class PJoint : public RobotElement
 {
 public:
   PJoint()
-    : width_(10), length_(30)
+    : width_(10), length_(30), min_length_(0), max_length_(HUGE_VAL), passive_(false)
   {}
   virtual Rect measure(const Pose& start, Pose& end)
+  {
+    return measure_points(width_, length_, start, end, fixed_points_);
+  }
+  virtual void draw(Document& doc, const Point& offset)
+  {
+    draw_points(doc, fixed_points_, offset);
+  }
+  virtual ElementType type() const { return PJointType; }
+  virtual std::string symbol(const Pose& start, Pose& placement) const
+  {
+    placement = start;
+    return symbol_name("pjoint", width_, length_);
+  }
+  virtual void draw_symbol(Document& doc) const
+  {
+    Point points[num_points_];
+    Pose end(0,0,0);
+    measure_points(width_, length_, Pose(0,0,0), end, points);
+    draw_points(doc, points, Point());
+  }
+  static const size_t num_points_ = 6;
+  static Rect measure_points(double width, double length, const Pose& start, Pose& end, Point* points)
   {
     // Note: the points for PJoint are labeled in the above diagram
-    points_.clear();
     end.theta_ = start.theta_;
-    double l_x = std::cos(end.theta_) * length_;
-    double l_y = std::sin(end.theta_) * length_;
-    double w_x = std::sin(end.theta_) * width_ * 0.5;
-    double w_y = -std::cos(end.theta_) * width_ * 0.5;
+    double l_x = std::cos(end.theta_) * length;
+    double l_y = std::sin(end.theta_) * length;
+    double w_x = std::sin(end.theta_) * width * 0.5;
+    double w_y = -std::cos(end.theta_) * width * 0.5;
     end.x_ = start.x_ + l_x;
     end.y_ = start.y_ + l_y;
-    points_.push_back(Point(start.x_ - w_x + l_x, start.y_ - w_y + l_y));
-    points_.push_back(Point(start.x_ - w_x, start.y_ - w_y));
-    points_.push_back(Point(start.x_ + w_x, start.y_ + w_y));
-    points_.push_back(Point(start.x_ + w_x + l_x, start.y_ + w_y + l_y));
-    points_.push_back(Point(start.x_, start.y_));
-    points_.push_back(Point(start.x_, start.y_) * (1.0 / 3.0) + Point(end.x_, end.y_) * (2.0 / 3.0));
-    return point_bounds();
+    points[0] = Point(start.x_ - w_x + l_x, start.y_ - w_y + l_y);
+    points[1] = Point(start.x_ - w_x, start.y_ - w_y);
+    points[2] = Point(start.x_ + w_x, start.y_ + w_y);
+    points[3] = Point(start.x_ + w_x + l_x, start.y_ + w_y + l_y);
+    points[4] = Point(start.x_, start.y_);
+    points[5] = Point(start.x_, start.y_) * (1.0 / 3.0) + Point(end.x_, end.y_) * (2.0 / 3.0);
+    return rob_diag::point_bounds(points, num_points_);
   }
-  virtual void draw(Document& doc, const Point& offset)
+  static void draw_points(Document& doc, const Point* points, const Point& offset)
   {
     Stroke s(0.5, Color::Black);
-    doc << Line(points_[0] + offset, points_[1] + offset, s)
-        << Line(points_[2] + offset, points_[3] + offset, s)
-        << Line(points_[4] + offset, points_[5] + offset, s)
-        << Line(points_[0] + offset, points_[3] + offset, s);
+    doc << Line(points[0] + offset, points[1] + offset, s)
+        << Line(points[2] + offset, points[3] + offset, s)
+        << Line(points[4] + offset, points[5] + offset, s)
+        << Line(points[0] + offset, points[3] + offset, s);
   }
   virtual ~PJoint() {};
+  void set_length(double length) { length_ = length; mark_dirty(); }
   double width_, length_;
+  // Length limits, for tools that solve for the length (inverse kinematics).
+  double min_length_, max_length_;
+  // As for RJoint: the length follows from the rest of a closed chain.
+  bool passive_;
+  Point fixed_points_[num_points_];
 };
 
 class Base : public RobotElement
@@ -318,10 +518,36 @@ public:
     : width_(width), default_theta_(default_theta), visible_(true)
   {}
   virtual Rect measure(const Pose& start, Pose& end)
+  {
+    return measure_points(width_, default_theta_, start, end, fixed_points_);
+  }
+  virtual void draw(Document& doc, const Point& offset)
+  {
+    if (!visible_)
+      return;
+    draw_points(doc, fixed_points_, offset);
+  }
+  virtual ElementType type() const { return BaseType; }
+  virtual std::string symbol(const Pose& start, Pose& placement) const
+  {
+    if (!visible_)
+      return "";
+    placement = Pose(start.x_, start.y_, start.theta_ + default_theta_);
+    return symbol_name("base", width_);
+  }
+  virtual void draw_symbol(Document& doc) const
+  {
+    Point points[num_points_];
+    Pose end(0,0,0);
+    measure_points(width_, 0, Pose(0,0,0), end, points);
+    draw_points(doc, points, Point());
+  }
+  static const size_t num_points_ = 6;
+  static Rect measure_points(double width, double default_theta, const Pose& start, Pose& end, Point* points)
   {
     // Start/end at same point...almost.  Set 'end' at end :)
     end = start;
-    end.theta_ += default_theta_;
+    end.theta_ += default_theta;
 
     //    |
     //  -----
@@ -329,40 +555,33 @@ public:
     //
     // Points: { left of ground, right of ground, bottom left of "fixed" lines,
     // end of "fixed" lines, center, top }
-    points_.clear();
-    double theta = start.theta_ + default_theta_;
-    double w_x = std::cos(theta) * width_ * 0.5;
-    double w_y = std::sin(theta) * width_ * 0.5;
-    double h_x = std::sin(theta) * width_ * 0.3;
-    double h_y = -std::cos(theta) * width_ * 0.3;
-    double left = std::min(-w_x, h_x);
-    double right = std::max(w_x, h_x);
-    double top = std::max(w_y, h_y);
-    double bottom = std::min(-w_y, h_y);
+    double theta = start.theta_ + default_theta;
+    double w_x = std::cos(theta) * width * 0.5;
+    double w_y = std::sin(theta) * width * 0.5;
+    double h_x = std::sin(theta) * width * 0.3;
+    double h_y = -std::cos(theta) * width * 0.3;
 
     end.x_ -= h_x;
     end.y_ -= h_y;
 
     // Horizontal "ground"
-    points_.push_back(Point(start.x_ - w_x, start.y_ - w_y));
-    points_.push_back(Point(start.x_ + w_x, start.y_ + w_y));
+    points[0] = Point(start.x_ - w_x, start.y_ - w_y);
+    points[1] = Point(start.x_ + w_x, start.y_ + w_y);
     // Slanted "fixed" lines
-    points_.push_back(Point(start.x_ - w_x + h_x, start.y_ - w_y + h_y));
-    points_.push_back(Point(start.x_ + w_x + h_x, start.y_ + w_y + h_y));
+    points[2] = Point(start.x_ - w_x + h_x, start.y_ - w_y + h_y);
+    points[3] = Point(start.x_ + w_x + h_x, start.y_ + w_y + h_y);
     // Small "pole"/base link
-    points_.push_back(Point(start.x_, start.y_));
-    points_.push_back(Point(start.x_ - h_x, start.y_ - h_y));
+    points[4] = Point(start.x_, start.y_);
+    points[5] = Point(start.x_ - h_x, start.y_ - h_y);
 
     // Compute bounds
-    return point_bounds();
+    return rob_diag::point_bounds(points, num_points_);
   }
-  virtual void draw(Document& doc, const Point& offset)
+  static void draw_points(Document& doc, const Point* points, const Point& offset)
   {
-    if (!visible_)
-      return;
     Stroke s(0.5, Color::Black);
     // Horizontal "ground"
-    doc << Line(points_[0] + offset, points_[1] + offset, s);
+    doc << Line(points[0] + offset, points[1] + offset, s);
     // Slanted "fixed" lines
     int total_lines = 5;
     for (int i = 0; i < total_lines; ++i)
@@ -372,16 +591,17 @@ public:
       double frac_top = ((double)i + 1) / (((double)total_lines) + 0.5);
       double frac_bot = ((double)i) / (((double)total_lines) + 0.5);
       doc << Line(
-        points_[0] * frac_top + points_[1] * (1 - frac_top) + offset,
-        points_[2] * frac_bot + points_[3] * (1 - frac_bot) + offset,
+        points[0] * frac_top + points[1] * (1 - frac_top) + offset,
+        points[2] * frac_bot + points[3] * (1 - frac_bot) + offset,
         s);
     }
     // Small pole/base link
-    doc << Line(points_[4] + offset, points_[5] + offset, s);
+    doc << Line(points[4] + offset, points[5] + offset, s);
   }
   virtual ~Base() {};
   double width_, default_theta_;
   bool visible_;
+  Point fixed_points_[num_points_];
 };
 
 // (x to the right, y up, origin halfway between pts. 1 and 2)
@@ -400,54 +620,228 @@ public:
     : width_(width), default_theta_(default_theta)
   {}
   virtual Rect measure(const Pose& start, Pose& end)
+  {
+    return measure_points(width_, default_theta_, start, end, fixed_points_);
+  }
+  virtual void draw(Document& doc, const Point& offset)
+  {
+    draw_points(doc, fixed_points_, offset);
+  }
+  virtual ElementType type() const { return EndEffectorType; }
+  virtual std::string symbol(const Pose& start, Pose& placement) const
+  {
+    placement = Pose(start.x_, start.y_, start.theta_ + default_theta_);
+    return symbol_name("effector", width_);
+  }
+  virtual void draw_symbol(Document& doc) const
+  {
+    Point points[num_points_];
+    Pose end(0,0,0);
+    measure_points(width_, 0, Pose(0,0,0), end, points);
+    draw_points(doc, points, Point());
+  }
+  static const size_t num_points_ = 4;
+  static Rect measure_points(double width, double default_theta, const Pose& start, Pose& end, Point* points)
   {
     end = start;
-    end.theta_ += default_theta_;
+    end.theta_ += default_theta;
 
     // Note: the points for PJoint are labeled in the above diagram
-    points_.clear();
-    double theta = start.theta_ + default_theta_;
-    double w_x = std::sin(end.theta_) * width_ * 0.5;
-    double w_y = -std::cos(end.theta_) * width_ * 0.5;
-    double l_x = std::cos(end.theta_) * width_ * 0.5;
-    double l_y = std::sin(end.theta_) * width_ * 0.5;
-    points_.push_back(Point(start.x_ - w_x + l_x, start.y_ - w_y + l_y));
-    points_.push_back(Point(start.x_ - w_x, start.y_ - w_y));
-    points_.push_back(Point(start.x_ + w_x, start.y_ + w_y));
-    points_.push_back(Point(start.x_ + w_x + l_x, start.y_ + w_y + l_y));
-    return point_bounds();
+    double w_x = std::sin(end.theta_) * width * 0.5;
+    double w_y = -std::cos(end.theta_) * width * 0.5;
+    double l_x = std::cos(end.theta_) * width * 0.5;
+    double l_y = std::sin(end.theta_) * width * 0.5;
+    points[0] = Point(start.x_ - w_x + l_x, start.y_ - w_y + l_y);
+    points[1] = Point(start.x_ - w_x, start.y_ - w_y);
+    points[2] = Point(start.x_ + w_x, start.y_ + w_y);
+    points[3] = Point(start.x_ + w_x + l_x, start.y_ + w_y + l_y);
+    return rob_diag::point_bounds(points, num_points_);
   }
-  virtual void draw(Document& doc, const Point& offset)
+  static void draw_points(Document& doc, const Point* points, const Point& offset)
   {
     Stroke s(0.5, Color::Black);
-    doc << Line(points_[0] + offset, points_[1] + offset, s)
-        << Line(points_[1] + offset, points_[2] + offset, s)
-        << Line(points_[2] + offset, points_[3] + offset, s);
+    doc << Line(points[0] + offset, points[1] + offset, s)
+        << Line(points[1] + offset, points[2] + offset, s)
+        << Line(points[2] + offset, points[3] + offset, s);
   }
   virtual ~EndEffector() {};
   double width_, default_theta_;
+  Point fixed_points_[num_points_];
+};
+
+// Two points of a closed-chain mechanism (a four-bar linkage, say) that have
+// to meet: the ends of elements 'a_' and 'b_', either of which can be
+// RobotElement::origin.  LoopSolver (robot_loops.hpp) moves the robot's
+// passive joints to close them.
+struct LoopClosure
+{
+  LoopClosure(size_t a, size_t b)
+    : a_(a), b_(b)
+  {}
+  size_t a_, b_;
+};
+
+// A pose for the end of element 'element_' to reach, for inverse kinematics
+// (see IkSolver in robot_ik.hpp): the position ('x_', 'y_') and, if
+// 'has_theta_', the heading 'theta_'.
+struct PoseTarget
+{
+  PoseTarget(size_t element, double x, double y, double theta, bool has_theta)
+    : element_(element), x_(x), y_(y), theta_(theta), has_theta_(has_theta)
+  {}
+  size_t element_;
+  double x_, y_, theta_;
+  bool has_theta_;
 };
 
-// A "robot" (restricted to a simple kinematic chain)
+// A "robot": a kinematic chain, or a tree of them.
+// Elements pushed onto 'elements_' each start where the one before ends.  To
+// branch (for the fingers of a gripper, say), attach an element to the end of
+// an earlier one instead; 'elements_' is then the tree flattened in
+// topological order, parents before children.  For example:
+//   robot.elements_.push_back(new Base());
+//   robot.elements_.push_back(new Link(100));
+//   size_t palm = robot.elements_.size() - 1;
+//   robot.elements_.push_back(new RJoint(0.5));
+//   robot.elements_.push_back(new Link(30));
+//   robot.attach(new RJoint(-0.5), palm);
+//   robot.elements_.push_back(new Link(30));
+// A tree with loop closures in 'closures_' is a closed-chain mechanism, and
+// 'targets_' are poses for inverse kinematics to put it in.
 // TODO: different name?
 class Robot
 {
 public:
   std::vector<RobotElement*> elements_;
+  std::vector<LoopClosure> closures_;
+  std::vector<PoseTarget> targets_;
+
+  // Appends 'element', starting at the end of element 'parent' (or at the
+  // origin, for RobotElement::origin) rather than at the end of the last one.
+  void attach(RobotElement* element, size_t parent)
+  {
+    size_t count = elements_.size();
+    bool chained = count == 0 ? parent == RobotElement::origin : parent == count - 1;
+    element->parent_ = chained ? (size_t)RobotElement::previous : parent;
+    element->mark_dirty();
+    elements_.push_back(element);
+  }
+
+  // The index of the element that element 'i' starts at the end of, or
+  // RobotElement::origin.
+  size_t parent(size_t i) const
+  {
+    size_t parent = elements_[i]->parent_;
+    if (parent != RobotElement::previous)
+      return parent;
+    return i == 0 ? (size_t)RobotElement::origin : i - 1;
+  }
 
+  // Measures the robot and returns its bounds.  Every element is measured, so
+  // any change to them is seen, including parameters written directly
+  // (RJoint::default_theta_, Link::length_, ...).
   Rect compute_dimensions()
   {
-    Pose current(0,0,0);
-    Rect bounds;
-    for (int i = 0; i < elements_.size(); i++)
+    invalidate();
+    return update_dimensions();
+  }
+
+  // compute_dimensions, re-measuring only what changed since the last
+  // measure: the elements from the first dirty (or added/replaced) one
+  // onwards, with the cached bounds of the ones before it reused.  So
+  // changing one joint with RJoint::set_theta costs O(elements after it).
+  // Each element is measured from the cached end pose of its parent.  Only
+  // changes made through the setters, or followed by
+  // RobotElement::mark_dirty, are seen; for anything else, use
+  // compute_dimensions.
+  Rect update_dimensions()
+  {
+    size_t first = begin_measure();
+    size_t count = elements_.size();
+    Pose current = first == 0 ? Pose(0,0,0) : end_poses_[first - 1];
+    Rect bounds = first == 0 ? Rect() : bounds_[first - 1];
+    for (size_t i = first; i < count; i++)
     {
       Pose out(0,0,0);
+      if (elements_[i]->parent_ != RobotElement::previous)
+        current = start_pose(i);
       bounds.extend(elements_[i]->measure(current, out));
+      elements_[i]->dirty_ = false;
+      measured_[i] = elements_[i];
+      end_poses_[i] = out;
+      bounds_[i] = bounds;
       current = out;
     }
     return bounds;
   }
 
+  // update_dimensions in steps, for measuring the branches of a tree on
+  // several threads (see robot_tree.hpp).  begin_measure returns the first
+  // element that has to be measured; each element from there on is then
+  // measured with measure_element, after its parent, returning its own
+  // bounds; and end_measure takes those bounds ('own[i - first]' for element
+  // i) and returns the robot's.  measure_element can be called for different
+  // elements at once.
+  size_t begin_measure()
+  {
+    size_t count = elements_.size();
+    size_t first = 0;
+    while (first < count && first < measured_.size() &&
+           measured_[first] == elements_[first] && !elements_[first]->dirty_)
+      ++first;
+    measured_.resize(count);
+    end_poses_.resize(count, Pose(0,0,0));
+    bounds_.resize(count);
+    return first;
+  }
+  Rect measure_element(size_t i)
+  {
+    Pose out(0,0,0);
+    Rect bounds = elements_[i]->measure(start_pose(i), out);
+    elements_[i]->dirty_ = false;
+    measured_[i] = elements_[i];
+    end_poses_[i] = out;
+    return bounds;
+  }
+  Rect end_measure(size_t first, const std::vector<Rect>& own)
+  {
+    Rect bounds = first == 0 ? Rect() : bounds_[first - 1];
+    for (size_t i = first; i < elements_.size(); ++i)
+    {
+      bounds.extend(own[i - first]);
+      bounds_[i] = bounds;
+    }
+    return bounds;
+  }
+
+  // Forgets all cached measurements, so the next update_dimensions
+  // re-measures everything.
+  void invalidate()
+  {
+    measured_.clear();
+  }
+
+  // The pose at the end of the last element, as of the last
+  // compute_dimensions.
+  Pose end_pose() const
+  {
+    return end_poses_.empty() ? Pose(0,0,0) : end_poses_.back();
+  }
+
+  // The pose at the end of element 'i', as of the last compute_dimensions.
+  Pose end_pose(size_t i) const
+  {
+    return end_poses_[i];
+  }
+
+  // The pose element 'i' was measured from, as of the last
+  // compute_dimensions: its parent's end pose.
+  Pose start_pose(size_t i) const
+  {
+    size_t from = parent(i);
+    return from == RobotElement::origin ? Pose(0,0,0) : end_poses_[from];
+  }
+
   void draw_at(Document& doc, const Pose& start)
   {
     for (int i = 0; i < elements_.size(); i++)
@@ -455,6 +849,53 @@ public:
       elements_[i]->draw(doc, Point(start.x_, start.y_));
     }
   }
+
+  // Like draw_at, but every element with a glyph (see RobotElement::symbol)
+  // is placed with a <use>, and each distinct glyph is drawn just once, in
+  // <defs>.  Long chains of joints and frames come out much smaller.  Uses
+  // the poses from the last compute_dimensions.
+  // Several robots can share a document's glyphs: pass the same 'defined'
+  // set to each, and glyphs an earlier robot defined aren't defined again.
+  void draw_symbols_at(Document& doc, const Pose& start, std::set<std::string>* defined = NULL)
+  {
+    Point offset(start.x_, start.y_);
+    std::vector<std::string> ids(elements_.size());
+    std::vector<Pose> placements(elements_.size(), Pose(0,0,0));
+    std::set<std::string> own_defined;
+    if (!defined)
+      defined = &own_defined;
+    doc.beginGroup(xlinkNamespace());
+    doc.beginDefs();
+    for (size_t i = 0; i < elements_.size(); ++i)
+    {
+      ids[i] = elements_[i]->symbol(start_pose(i), placements[i]);
+      if (!ids[i].empty() && defined->insert(ids[i]).second)
+      {
+        doc.beginSymbol(ids[i]);
+        elements_[i]->draw_symbol(doc);
+        doc.endSymbol();
+      }
+    }
+    doc.endDefs();
+    for (size_t i = 0; i < elements_.size(); ++i)
+    {
+      if (ids[i].empty())
+        elements_[i]->draw(doc, offset);
+      else
+        doc << Use(ids[i], Point(placements[i].x_, placements[i].y_) + offset, placements[i].theta_);
+    }
+    doc.endGroup();
+  }
+
+private:
+  // Measure cache, indexed like 'elements_': which element was measured at
+  // each index, the pose it ended at, and the bounds of the elements up to
+  // and including it.
+  std::vector<RobotElement*> measured_;
+  std::vector<Pose> end_poses_;
+  std::vector<Rect> bounds_;
 };
 
 }
+
+#endif
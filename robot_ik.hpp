@@ -0,0 +1,474 @@
+#ifndef ROBOT_IK_HPP
+#define ROBOT_IK_HPP
+
+#include "robot_diagrams_0.0.hpp"
+#include "robot_loops.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace rob_diag
+{
+
+// 'angle' moved into (-pi, pi].
+inline double wrap_angle(double angle)
+{
+  angle = std::fmod(angle + M_PI, 2 * M_PI);
+  if (angle <= 0)
+    angle += 2 * M_PI;
+  return angle - M_PI;
+}
+
+// Inverse kinematics: sets the joints of a robot so that the ends of
+// elements reach target poses (PoseTarget; Robot::targets_ holds the ones
+// from a .robot file).  The joints solved for are the visible RJoints and
+// the PJoints on the way from the origin to a target, other than passive
+// ones, each kept within its limits.  For example:
+//   IkSolver solver;
+//   solver.assign(robot);
+//   if (!solver.solve(robot))
+//     // Out of reach; the robot is left as close as it got.
+//
+// A single target reached by two joints (a 2R chain, by position) or by
+// three (a 3R chain, by position and heading) is solved in closed form,
+// whatever the links between the joints: of the two assemblies (elbow up and
+// down), the one within the limits that is closest to the current pose is
+// taken.  Anything else (redundant chains, prismatic joints, a target out of
+// reach, or a closed form answer outside the limits) goes to a damped
+// Gauss-Newton (Levenberg-Marquardt) iteration like LoopSolver's, with the
+// joints clamped to their limits after each step.  A heading error counts as
+// the distance it moves a point at the chain's reach.
+//
+// Both start from the current joint values, so solving for a run of nearby
+// targets (solve_batch) takes a step or two each and the arm doesn't jump
+// between assemblies.
+class IkSolver
+{
+public:
+  IkSolver()
+    : tolerance_(1e-9), angle_tolerance_(1e-9), max_iterations_(100), closed_form_(true),
+      scale_(1), two_link_(false), iterations_(0), position_error_(0), angle_error_(0), used_closed_form_(false)
+  {}
+
+  // Finds the joints that move the robot's targets.  Call again if the
+  // robot's elements or targets change.
+  void assign(const Robot& robot)
+  {
+    assign(robot, robot.targets_);
+  }
+
+  void assign(const Robot& robot, const std::vector<PoseTarget>& targets)
+  {
+    targets_ = targets;
+    joints_.clear();
+    lower_.clear();
+    upper_.clear();
+    wraps_.clear();
+    std::vector<bool> on_path(robot.elements_.size(), false);
+    for (size_t t = 0; t < targets_.size(); ++t)
+      for (size_t e = targets_[t].element_; e != RobotElement::origin; e = robot.parent(e))
+        on_path[e] = true;
+    for (size_t i = 0; i < robot.elements_.size(); ++i)
+    {
+      if (!on_path[i])
+        continue;
+      const RobotElement* element = robot.elements_[i];
+      if (element->type() == RJointType)
+      {
+        const RJoint* rjoint = (const RJoint*)element;
+        if (!rjoint->visible_ || rjoint->passive_)
+          continue;
+        lower_.push_back(rjoint->min_theta_);
+        upper_.push_back(rjoint->max_theta_);
+        wraps_.push_back(rjoint->max_theta_ - rjoint->min_theta_ >= 2 * M_PI - 1e-9);
+      }
+      else if (element->type() == PJointType)
+      {
+        const PJoint* pjoint = (const PJoint*)element;
+        if (pjoint->passive_)
+          continue;
+        lower_.push_back(pjoint->min_length_);
+        upper_.push_back(pjoint->max_length_);
+        wraps_.push_back(false);
+      }
+      else
+        continue;
+      joints_.push_back(i);
+    }
+    // moves_[j * targets + t]: whether joint j is on the way to target t.
+    moves_.assign(joints_.size() * targets_.size(), false);
+    for (size_t t = 0; t < targets_.size(); ++t)
+    {
+      for (size_t e = targets_[t].element_; e != RobotElement::origin; e = robot.parent(e))
+        on_path[e] = false;
+      for (size_t j = 0; j < joints_.size(); ++j)
+        moves_[j * targets_.size() + t] = !on_path[joints_[j]];
+      for (size_t e = targets_[t].element_; e != RobotElement::origin; e = robot.parent(e))
+        on_path[e] = true;
+    }
+    two_link_ = targets_.size() == 1 && joints_.size() == (targets_[0].has_theta_ ? 3u : 2u);
+    for (size_t j = 0; j < joints_.size() && two_link_; ++j)
+      two_link_ = robot.elements_[joints_[j]]->type() == RJointType;
+  }
+
+  size_t num_joints() const { return joints_.size(); }
+  // The element index of each joint solved for.
+  const std::vector<size_t>& joints() const { return joints_; }
+  void get_values(const Robot& robot, std::vector<double>& q) const { get_joint_values(robot, joints_, q); }
+  void set_values(Robot& robot, const std::vector<double>& q) const { set_joint_values(robot, joints_, q); }
+
+  // Moves the joints to reach the targets, leaving the robot measured.
+  // Returns true if every target is reached to within 'tolerance_' (and
+  // 'angle_tolerance_'); otherwise the robot is left as close as it got.
+  bool solve(Robot& robot)
+  {
+    iterations_ = 0;
+    used_closed_form_ = false;
+    std::vector<double> q;
+    get_values(robot, q);
+    for (size_t j = 0; j < q.size(); ++j)
+      q[j] = clamp(j, q[j]);
+    set_values(robot, q);
+    robot.update_dimensions();
+    compute_scale(robot);
+    if (closed_form_ && two_link_ && solve_two_link(robot))
+    {
+      used_closed_form_ = true;
+      return true;
+    }
+    return solve_iterative(robot);
+  }
+
+  // Solves for each of 'poses' in turn, as the pose of the only target (the
+  // heading is ignored if the target has none).  Each starts from the
+  // answer to the one before, and if that fails, again from the joint values
+  // the robot had to begin with; so order the poses so that each is near the
+  // last (a grid row by row, alternating direction, say).  Fills 'values'
+  // with num_joints() values per pose and 'reached' with whether the pose was
+  // reached, and returns how many were.  The robot is left at the answer to
+  // the last pose.
+  size_t solve_batch(Robot& robot, const std::vector<Pose>& poses, std::vector<double>& values,
+                     std::vector<bool>& reached)
+  {
+    size_t n = joints_.size();
+    std::vector<double> start, q;
+    get_values(robot, start);
+    values.resize(poses.size() * n);
+    reached.assign(poses.size(), false);
+    size_t count = 0;
+    for (size_t k = 0; k < poses.size() && targets_.size() == 1; ++k)
+    {
+      targets_[0].x_ = poses[k].x_;
+      targets_[0].y_ = poses[k].y_;
+      targets_[0].theta_ = poses[k].theta_;
+      bool good = solve(robot);
+      if (!good)
+      {
+        set_values(robot, start);
+        good = solve(robot);
+      }
+      get_values(robot, q);
+      std::copy(q.begin(), q.end(), values.begin() + k * n);
+      reached[k] = good;
+      if (good)
+        ++count;
+    }
+    return count;
+  }
+
+  // Steps the iteration took in the last solve (0 for a closed form answer).
+  int iterations() const { return iterations_; }
+  // Whether the last solve was in closed form.
+  bool used_closed_form() const { return used_closed_form_; }
+  // How far from the worst target the last solve left its element, and by
+  // how much its heading missed.
+  double position_error() const { return position_error_; }
+  double angle_error() const { return angle_error_; }
+
+  // How close (in the robot's units, and radians) a target has to be.
+  double tolerance_, angle_tolerance_;
+  int max_iterations_;
+  // Whether to try the closed form solutions.
+  bool closed_form_;
+
+private:
+  bool converged() const
+  {
+    return position_error_ <= tolerance_ && angle_error_ <= angle_tolerance_;
+  }
+
+  // 'value' for joint j, within its limits.
+  double clamp(size_t j, double value) const
+  {
+    if (value >= lower_[j] && value <= upper_[j])
+      return value;
+    if (wraps_[j])
+    {
+      double turns = std::floor((value - lower_[j]) / (2 * M_PI));
+      return value - turns * 2 * M_PI;
+    }
+    return std::min(std::max(value, lower_[j]), upper_[j]);
+  }
+
+  // The chain's reach: the farthest any target is from a joint that moves it.
+  void compute_scale(const Robot& robot)
+  {
+    scale_ = 1;
+    for (size_t j = 0; j < joints_.size(); ++j)
+    {
+      Pose center = robot.start_pose(joints_[j]);
+      for (size_t t = 0; t < targets_.size(); ++t)
+      {
+        if (!moves_[j * targets_.size() + t])
+          continue;
+        Pose end = robot.end_pose(targets_[t].element_);
+        scale_ = std::max(scale_, std::sqrt((end.x_ - center.x_) * (end.x_ - center.x_) +
+                                            (end.y_ - center.y_) * (end.y_ - center.y_)));
+      }
+    }
+  }
+
+  // Measures the robot and fills 'r' with each target's miss: x, y and the
+  // scaled heading.  Returns the sum of their squares.
+  double evaluate(Robot& robot, std::vector<double>& r)
+  {
+    robot.update_dimensions();
+    r.resize(3 * targets_.size());
+    double cost = 0;
+    position_error_ = 0;
+    angle_error_ = 0;
+    for (size_t t = 0; t < targets_.size(); ++t)
+    {
+      const PoseTarget& target = targets_[t];
+      Pose end = robot.end_pose(target.element_);
+      double turn = target.has_theta_ ? wrap_angle(end.theta_ - target.theta_) : 0;
+      r[3 * t] = end.x_ - target.x_;
+      r[3 * t + 1] = end.y_ - target.y_;
+      r[3 * t + 2] = scale_ * turn;
+      cost += r[3 * t] * r[3 * t] + r[3 * t + 1] * r[3 * t + 1] + r[3 * t + 2] * r[3 * t + 2];
+      position_error_ = std::max(position_error_, std::sqrt(r[3 * t] * r[3 * t] + r[3 * t + 1] * r[3 * t + 1]));
+      angle_error_ = std::max(angle_error_, std::fabs(turn));
+    }
+    return cost;
+  }
+
+  // d r / d q, as a row-major (3 * targets) x joints matrix.
+  void compute_jacobian(const Robot& robot, std::vector<double>& jacobian) const
+  {
+    size_t n = joints_.size();
+    jacobian.assign(3 * targets_.size() * n, 0.0);
+    for (size_t j = 0; j < n; ++j)
+    {
+      Pose start = robot.start_pose(joints_[j]);
+      bool rotates = robot.elements_[joints_[j]]->type() == RJointType;
+      for (size_t t = 0; t < targets_.size(); ++t)
+      {
+        if (!moves_[j * targets_.size() + t])
+          continue;
+        Pose end = robot.end_pose(targets_[t].element_);
+        if (rotates)
+        {
+          jacobian[3 * t * n + j] = -(end.y_ - start.y_);
+          jacobian[(3 * t + 1) * n + j] = end.x_ - start.x_;
+          jacobian[(3 * t + 2) * n + j] = targets_[t].has_theta_ ? scale_ : 0;
+        }
+        else
+        {
+          jacobian[3 * t * n + j] = std::cos(start.theta_);
+          jacobian[(3 * t + 1) * n + j] = std::sin(start.theta_);
+        }
+      }
+    }
+  }
+
+  bool solve_iterative(Robot& robot)
+  {
+    size_t n = joints_.size();
+    std::vector<double> q, trial(n), r, trial_r, jacobian, a, g, step;
+    get_values(robot, q);
+    double cost = evaluate(robot, r);
+    double lambda = 1e-3;
+    while (!converged() && iterations_ < max_iterations_ && n > 0)
+    {
+      ++iterations_;
+      compute_jacobian(robot, jacobian);
+      normal_equations(jacobian, r, n, a, g);
+      // Hold joints that are at a limit and being pushed past it, so that
+      // the others still move.
+      for (size_t j = 0; j < n; ++j)
+      {
+        if (wraps_[j] || !((q[j] <= lower_[j] && g[j] > 0) || (q[j] >= upper_[j] && g[j] < 0)))
+          continue;
+        for (size_t k = 0; k < n; ++k)
+          a[j * n + k] = a[k * n + j] = 0;
+        a[j * n + j] = 1;
+        g[j] = 0;
+      }
+      double last_cost = cost;
+      bool improved = false;
+      while (!improved && lambda < 1e12)
+      {
+        if (damped_step(a, g, lambda, step))
+        {
+          for (size_t j = 0; j < n; ++j)
+            trial[j] = clamp(j, q[j] - step[j]);
+          set_values(robot, trial);
+          double trial_cost = evaluate(robot, trial_r);
+          improved = trial_cost < cost;
+          if (improved)
+          {
+            // Damp less the better the step did than the linear model said
+            // it would (Nielsen's rule); near a singular pose, such as an
+            // arm stretched toward a target out of reach, dropping the
+            // damping outright makes the steps zig-zag.
+            double predicted = 0;
+            for (size_t j = 0; j < n; ++j)
+            {
+              double as = 0;
+              for (size_t k = 0; k < n; ++k)
+                as += a[j * n + k] * step[k];
+              predicted += step[j] * (2 * g[j] - as);
+            }
+            double ratio = predicted > 0 ? (cost - trial_cost) / predicted : 1;
+            lambda *= std::max(1.0 / 3, 1 - std::pow(2 * ratio - 1, 3));
+            lambda = std::max(lambda, 1e-12);
+            q.swap(trial);
+            r.swap(trial_r);
+            cost = trial_cost;
+          }
+        }
+        if (!improved)
+          lambda *= 10;
+      }
+      if (!improved)
+      {
+        set_values(robot, q);
+        evaluate(robot, r);
+        break;
+      }
+      // Out of reach: the steps no longer get any closer.
+      if (cost > last_cost * (1 - 1e-6))
+        break;
+    }
+    return converged();
+  }
+
+  // The two ways (elbow up and down) of turning joint 'first' by 'delta1'
+  // and joint 'second' (after it) by 'delta2' to put 'end', which they both
+  // move, at 'target'.  False if it can't get there.
+  static bool two_link(const Robot& robot, size_t first, size_t second, const Pose& end, double target_x,
+                       double target_y, double delta1[2], double delta2[2])
+  {
+    Pose c1 = robot.start_pose(first);
+    Pose c2 = robot.start_pose(second);
+    double l1 = std::sqrt((c2.x_ - c1.x_) * (c2.x_ - c1.x_) + (c2.y_ - c1.y_) * (c2.y_ - c1.y_));
+    double l2 = std::sqrt((end.x_ - c2.x_) * (end.x_ - c2.x_) + (end.y_ - c2.y_) * (end.y_ - c2.y_));
+    double d = std::sqrt((target_x - c1.x_) * (target_x - c1.x_) + (target_y - c1.y_) * (target_y - c1.y_));
+    if (l1 < 1e-12 || l2 < 1e-12 || d < 1e-12)
+      return false;
+    // The angle at the first joint between the second joint and the target.
+    double cos_angle = (l1 * l1 + d * d - l2 * l2) / (2 * l1 * d);
+    if (std::fabs(cos_angle) > 1 + 1e-12)
+      return false;
+    double angle = std::acos(std::min(1.0, std::max(-1.0, cos_angle)));
+    double to_target = std::atan2(target_y - c1.y_, target_x - c1.x_);
+    double to_second = std::atan2(c2.y_ - c1.y_, c2.x_ - c1.x_);
+    for (int b = 0; b < 2; ++b)
+    {
+      double heading = to_target + (b == 0 ? angle : -angle);
+      delta1[b] = wrap_angle(heading - to_second);
+      // Where the second joint and the end go when the first turns.
+      double x2 = c1.x_ + l1 * std::cos(heading), y2 = c1.y_ + l1 * std::sin(heading);
+      double c = std::cos(delta1[b]), s = std::sin(delta1[b]);
+      double ex = c1.x_ + c * (end.x_ - c1.x_) - s * (end.y_ - c1.y_);
+      double ey = c1.y_ + s * (end.x_ - c1.x_) + c * (end.y_ - c1.y_);
+      delta2[b] = wrap_angle(std::atan2(target_y - y2, target_x - x2) - std::atan2(ey - y2, ex - x2));
+    }
+    return true;
+  }
+
+  // Turns joint j of 'q' by 'delta', a full turn either way if that keeps
+  // it within its limits.  False if neither does.
+  bool turn(std::vector<double>& q, size_t j, double delta) const
+  {
+    double candidates[3] = { q[j] + delta, q[j] + delta - 2 * M_PI, q[j] + delta + 2 * M_PI };
+    for (int c = 0; c < 3; ++c)
+    {
+      if (candidates[c] >= lower_[j] && candidates[c] <= upper_[j])
+      {
+        q[j] = candidates[c];
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // The 2R and 3R closed forms.  For 3R, the third joint (the wrist) is
+  // placed where it has to be for the end to reach the target with the
+  // target heading, then turned to that heading.
+  bool solve_two_link(Robot& robot)
+  {
+    const PoseTarget& target = targets_[0];
+    Pose end = robot.end_pose(target.element_);
+    Pose reach = end;
+    double target_x = target.x_, target_y = target.y_;
+    if (target.has_theta_)
+    {
+      reach = robot.start_pose(joints_[2]);
+      double turned = target.theta_ - end.theta_;
+      double dx = end.x_ - reach.x_, dy = end.y_ - reach.y_;
+      target_x -= std::cos(turned) * dx - std::sin(turned) * dy;
+      target_y -= std::sin(turned) * dx + std::cos(turned) * dy;
+    }
+    double delta1[2], delta2[2];
+    if (!two_link(robot, joints_[0], joints_[1], reach, target_x, target_y, delta1, delta2))
+      return false;
+
+    std::vector<double> q, best, candidate;
+    get_values(robot, q);
+    double best_change = 0;
+    for (int b = 0; b < 2; ++b)
+    {
+      candidate = q;
+      if (!turn(candidate, 0, delta1[b]) || !turn(candidate, 1, delta2[b]))
+        continue;
+      if (target.has_theta_ &&
+          !turn(candidate, 2, wrap_angle(target.theta_ - (end.theta_ + delta1[b] + delta2[b]))))
+        continue;
+      double change = 0;
+      for (size_t j = 0; j < q.size(); ++j)
+        change += std::fabs(candidate[j] - q[j]);
+      if (best.empty() || change < best_change)
+      {
+        best = candidate;
+        best_change = change;
+      }
+    }
+    if (best.empty())
+      return false;
+    set_values(robot, best);
+    std::vector<double> r;
+    evaluate(robot, r);
+    if (converged())
+      return true;
+    // Rounding; let the iteration finish it off.
+    return false;
+  }
+
+  std::vector<PoseTarget> targets_;
+  std::vector<size_t> joints_;
+  std::vector<double> lower_, upper_;
+  std::vector<bool> wraps_, moves_;
+  // A heading error's weight against a position error.
+  double scale_;
+  // Whether the closed forms apply.
+  bool two_link_;
+  int iterations_;
+  double position_error_, angle_error_;
+  bool used_closed_form_;
+};
+
+}
+
+#endif
@@ -0,0 +1,303 @@
+#ifndef ROBOT_LOOPS_HPP
+#define ROBOT_LOOPS_HPP
+
+#include "robot_diagrams_0.0.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace rob_diag
+{
+
+// The values of joints 'joints' of 'robot' (RJoint angles and PJoint
+// lengths), in that order.
+inline void get_joint_values(const Robot& robot, const std::vector<size_t>& joints, std::vector<double>& q)
+{
+  q.resize(joints.size());
+  for (size_t j = 0; j < joints.size(); ++j)
+  {
+    const RobotElement* element = robot.elements_[joints[j]];
+    if (element->type() == RJointType)
+      q[j] = ((const RJoint*)element)->default_theta_;
+    else
+      q[j] = ((const PJoint*)element)->length_;
+  }
+}
+
+inline void set_joint_values(Robot& robot, const std::vector<size_t>& joints, const std::vector<double>& q)
+{
+  for (size_t j = 0; j < joints.size(); ++j)
+  {
+    RobotElement* element = robot.elements_[joints[j]];
+    if (element->type() == RJointType)
+      ((RJoint*)element)->set_theta(q[j]);
+    else
+      ((PJoint*)element)->set_length(q[j]);
+  }
+}
+
+// The normal equations of a least squares step: a = J'J and g = J'r, for a
+// row-major r.size() x n Jacobian J.
+inline void normal_equations(const std::vector<double>& jacobian, const std::vector<double>& r, size_t n,
+                             std::vector<double>& a, std::vector<double>& g)
+{
+  size_t m = r.size();
+  a.resize(n * n);
+  g.resize(n);
+  for (size_t j = 0; j < n; ++j)
+  {
+    g[j] = 0;
+    for (size_t i = 0; i < m; ++i)
+      g[j] += jacobian[i * n + j] * r[i];
+    for (size_t k = 0; k < n; ++k)
+    {
+      double sum = 0;
+      for (size_t i = 0; i < m; ++i)
+        sum += jacobian[i * n + j] * jacobian[i * n + k];
+      a[j * n + k] = sum;
+    }
+  }
+}
+
+// Solves (a + lambda * diag(a)) step = g, the damped (Levenberg-Marquardt)
+// step, by Gaussian elimination with partial pivoting.  False if that is
+// singular.
+inline bool damped_step(const std::vector<double>& a, const std::vector<double>& g, double lambda,
+                        std::vector<double>& step)
+{
+  size_t n = g.size();
+  std::vector<double> m(a);
+  step = g;
+  for (size_t j = 0; j < n; ++j)
+    m[j * n + j] += lambda * (a[j * n + j] + 1e-9);
+  for (size_t col = 0; col < n; ++col)
+  {
+    size_t pivot = col;
+    for (size_t row = col + 1; row < n; ++row)
+      if (std::fabs(m[row * n + col]) > std::fabs(m[pivot * n + col]))
+        pivot = row;
+    if (m[pivot * n + col] == 0)
+      return false;
+    if (pivot != col)
+    {
+      for (size_t k = 0; k < n; ++k)
+        std::swap(m[col * n + k], m[pivot * n + k]);
+      std::swap(step[col], step[pivot]);
+    }
+    for (size_t row = col + 1; row < n; ++row)
+    {
+      double factor = m[row * n + col] / m[col * n + col];
+      for (size_t k = col; k < n; ++k)
+        m[row * n + k] -= factor * m[col * n + k];
+      step[row] -= factor * step[col];
+    }
+  }
+  for (size_t col = n; col-- > 0;)
+  {
+    for (size_t k = col + 1; k < n; ++k)
+      step[col] -= m[col * n + k] * step[k];
+    step[col] /= m[col * n + col];
+  }
+  return true;
+}
+
+// Closes the loops of a closed-chain mechanism: moves the robot's passive
+// joints (RJoint::passive_ angles and PJoint::passive_ lengths) until the
+// two ends of every LoopClosure in Robot::closures_ meet, leaving the robot
+// measured in that pose.  For example, for a four-bar linkage driven by its
+// first joint:
+//   LoopSolver solver;
+//   solver.assign(robot);
+//   for (...)
+//   {
+//     crank->set_theta(angle);
+//     if (!solver.solve(robot))
+//       // The linkage can't reach this angle; solver.residual() says by how
+//       // far it misses.
+//   }
+//
+// The solver is a damped Gauss-Newton (Levenberg-Marquardt) iteration over
+// the passive joints, with an exact Jacobian: turning a joint swings
+// everything after it about the joint, and sliding one moves everything
+// after it along its axis.  Each step re-measures the robot from the first
+// passive joint on (Robot::update_dimensions keeps the poses before it).
+// It starts from the joints' current values, so a sequence of nearby poses,
+// such as the frames of an animation, is solved in a couple of steps each,
+// and the mechanism stays in the same assembly (elbow up or down) throughout.
+class LoopSolver
+{
+public:
+  LoopSolver()
+    : tolerance_(1e-9), max_iterations_(100), iterations_(0), residual_(0)
+  {}
+
+  // Finds the passive joints of 'robot' and the closures each one moves.
+  // Call again if the robot's elements or closures change.
+  void assign(const Robot& robot)
+  {
+    joints_.clear();
+    closures_ = robot.closures_;
+    for (size_t i = 0; i < robot.elements_.size(); ++i)
+    {
+      const RobotElement* element = robot.elements_[i];
+      if ((element->type() == RJointType && ((const RJoint*)element)->passive_) ||
+          (element->type() == PJointType && ((const PJoint*)element)->passive_))
+        joints_.push_back(i);
+    }
+    // moves_[j * 2 * closures + 2 * c + side]: whether joint j is on the way
+    // from the origin to side 0 (a_) or 1 (b_) of closure c.
+    moves_.assign(joints_.size() * 2 * closures_.size(), false);
+    std::vector<bool> on_path(robot.elements_.size(), false);
+    for (size_t c = 0; c < closures_.size(); ++c)
+    {
+      for (int side = 0; side < 2; ++side)
+      {
+        size_t end = side == 0 ? closures_[c].a_ : closures_[c].b_;
+        for (size_t e = end; e != RobotElement::origin; e = robot.parent(e))
+          on_path[e] = true;
+        for (size_t j = 0; j < joints_.size(); ++j)
+          moves_[j * 2 * closures_.size() + 2 * c + side] = on_path[joints_[j]];
+        for (size_t e = end; e != RobotElement::origin; e = robot.parent(e))
+          on_path[e] = false;
+      }
+    }
+  }
+
+  size_t num_joints() const { return joints_.size(); }
+  // The element index of each passive joint.
+  const std::vector<size_t>& joints() const { return joints_; }
+
+  // The passive joints' values (RJoint angles and PJoint lengths), in the
+  // order of joints().
+  void get_values(const Robot& robot, std::vector<double>& q) const { get_joint_values(robot, joints_, q); }
+  void set_values(Robot& robot, const std::vector<double>& q) const { set_joint_values(robot, joints_, q); }
+
+  // Closes the loops, starting from the passive joints' current values.
+  // Returns true if every closure meets to within 'tolerance_'; otherwise
+  // the joints are left where the ends came closest.
+  bool solve(Robot& robot)
+  {
+    size_t n = joints_.size();
+    size_t m = 2 * closures_.size();
+    std::vector<double> q, trial(n), r(m), trial_r(m), jacobian(m * n), a, g, step;
+    get_values(robot, q);
+    double cost = evaluate(robot, r);
+    double lambda = 1e-3;
+    iterations_ = 0;
+    while (residual_ > tolerance_ && iterations_ < max_iterations_ && n > 0)
+    {
+      ++iterations_;
+      compute_jacobian(robot, jacobian);
+      normal_equations(jacobian, r, n, a, g);
+      // Damp until a step lowers the cost; failing that, the joints are at
+      // a (local) minimum that doesn't close the loops.
+      bool improved = false;
+      while (!improved && lambda < 1e12)
+      {
+        if (damped_step(a, g, lambda, step))
+        {
+          for (size_t j = 0; j < n; ++j)
+            trial[j] = q[j] - step[j];
+          set_values(robot, trial);
+          double trial_cost = evaluate(robot, trial_r);
+          improved = trial_cost < cost;
+          if (improved)
+          {
+            q.swap(trial);
+            r.swap(trial_r);
+            cost = trial_cost;
+          }
+        }
+        lambda = improved ? std::max(lambda * 0.1, 1e-12) : lambda * 10;
+      }
+      if (!improved)
+      {
+        set_values(robot, q);
+        evaluate(robot, r);
+        break;
+      }
+    }
+    return residual_ <= tolerance_;
+  }
+
+  // Steps taken by the last solve.
+  int iterations() const { return iterations_; }
+  // How far apart the ends of the worst closure were after the last solve.
+  double residual() const { return residual_; }
+
+  // How close (in the robot's units) the ends of a closure have to be.
+  double tolerance_;
+  int max_iterations_;
+
+private:
+  static Point position(const Robot& robot, size_t element)
+  {
+    if (element == RobotElement::origin)
+      return Point(0, 0);
+    Pose pose = robot.end_pose(element);
+    return Point(pose.x_, pose.y_);
+  }
+
+  // Measures the robot, and fills 'r' with how far the ends of each closure
+  // are apart (b_ to a_).  Returns the sum of their squares.
+  double evaluate(Robot& robot, std::vector<double>& r)
+  {
+    robot.update_dimensions();
+    double cost = 0;
+    residual_ = 0;
+    for (size_t c = 0; c < closures_.size(); ++c)
+    {
+      Point a = position(robot, closures_[c].a_);
+      Point b = position(robot, closures_[c].b_);
+      r[2 * c] = a.x - b.x;
+      r[2 * c + 1] = a.y - b.y;
+      double squared = r[2 * c] * r[2 * c] + r[2 * c + 1] * r[2 * c + 1];
+      cost += squared;
+      residual_ = std::max(residual_, std::sqrt(squared));
+    }
+    return cost;
+  }
+
+  // d r / d q, as a row-major (2 * closures) x joints matrix.
+  void compute_jacobian(const Robot& robot, std::vector<double>& jacobian) const
+  {
+    size_t n = joints_.size();
+    std::fill(jacobian.begin(), jacobian.end(), 0.0);
+    for (size_t j = 0; j < n; ++j)
+    {
+      Pose start = robot.start_pose(joints_[j]);
+      bool rotates = robot.elements_[joints_[j]]->type() == RJointType;
+      for (size_t c = 0; c < closures_.size(); ++c)
+      {
+        for (int side = 0; side < 2; ++side)
+        {
+          if (!moves_[j * 2 * closures_.size() + 2 * c + side])
+            continue;
+          Point end = position(robot, side == 0 ? closures_[c].a_ : closures_[c].b_);
+          double sign = side == 0 ? 1 : -1;
+          if (rotates)
+          {
+            jacobian[2 * c * n + j] -= sign * (end.y - start.y_);
+            jacobian[(2 * c + 1) * n + j] += sign * (end.x - start.x_);
+          }
+          else
+          {
+            jacobian[2 * c * n + j] += sign * std::cos(start.theta_);
+            jacobian[(2 * c + 1) * n + j] += sign * std::sin(start.theta_);
+          }
+        }
+      }
+    }
+  }
+
+  std::vector<size_t> joints_;
+  std::vector<LoopClosure> closures_;
+  std::vector<bool> moves_;
+  int iterations_;
+  double residual_;
+};
+
+}
+
+#endif
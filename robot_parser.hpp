@@ -0,0 +1,555 @@
+#ifndef ROBOT_PARSER_HPP
+#define ROBOT_PARSER_HPP
+
+#include "robot_arena.hpp"
+#include "robot_diagrams_0.0.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if __cplusplus >= 201703L
+#include <charconv>
+#endif
+#if !defined(__cpp_lib_to_chars) || __cpp_lib_to_chars < 201611L
+#include <clocale>
+#include <locale.h>
+#endif
+
+namespace rob_diag
+{
+
+// Settings from a .robot file that apply to the whole diagram rather than to
+// one element.
+struct DiagramOptions
+{
+  DiagramOptions()
+    : workspace_samples_(0), workspace_cell_(2)
+  {}
+  // Number of joint space samples for the workspace map; 0 for none.
+  size_t workspace_samples_;
+  // Size of a workspace grid cell.
+  double workspace_cell_;
+};
+
+// Parses the text .robot format (see the README) straight out of a buffer,
+// such as a MappedFile.
+// Tokens are pointers into the buffer, keywords are matched in place and
+// numbers are converted without copying, so nothing is allocated apart from
+// the elements themselves (which come from an Arena), any labels too long
+// for std::string's inline buffer, and the names and stack of branch points,
+// loop closures and targets in files that have them.
+//
+// Numbers are strict: a token has to be a complete decimal number ("12",
+// "-0.5", "1e-3"), always with a '.' decimal point whatever the locale.
+// Errors are reported as "<file>:<line>:<column>: <message>", followed by the
+// line and a caret under the offending spot.
+class RobotParser
+{
+public:
+  RobotParser(const char* filename, std::ostream& err)
+    : filename_(filename), err_(err), line_begin_(NULL), line_end_(NULL), line_number_(0),
+      num_tokens_(0), tip_(RobotElement::origin)
+  {}
+
+  // Parses 'size' bytes of text, appending elements (allocated from 'arena')
+  // to 'robot' and settings to 'options'.  Stops at the first error and
+  // returns false; elements from earlier lines are left in 'robot'.
+  bool parse(const char* text, size_t size, Robot& robot, Arena& arena, DiagramOptions& options)
+  {
+    const char* end = text + size;
+    const char* pos = text;
+    line_number_ = 0;
+    tip_ = robot.elements_.empty() ? (size_t)RobotElement::origin : robot.elements_.size() - 1;
+    stack_.clear();
+    names_.clear();
+    while (pos < end)
+    {
+      const char* newline = (const char*)std::memchr(pos, '\n', end - pos);
+      line_begin_ = pos;
+      line_end_ = newline ? newline : end;
+      pos = newline ? newline + 1 : end;
+      ++line_number_;
+      if (!tokenize() || !parse_line(robot, arena, options))
+        return false;
+    }
+    return true;
+  }
+
+  // Passes a canonical form of 'size' bytes of text to 'out(data, size)', in
+  // pieces: each line's tokens separated by single spaces, and each line
+  // (including the last) ended by '\n'.  Texts with the same canonical form
+  // parse to the same robot, so it is what output caches should be keyed on.
+  template <typename Output>
+  static void normalize(const char* text, size_t size, Output& out)
+  {
+    const char* end = text + size;
+    const char* pos = text;
+    while (pos < end)
+    {
+      const char* newline = (const char*)std::memchr(pos, '\n', end - pos);
+      const char* line_end = newline ? newline : end;
+      bool first = true;
+      while (true)
+      {
+        while (pos != line_end && is_space(*pos))
+          ++pos;
+        if (pos == line_end)
+          break;
+        const char* token = pos;
+        while (pos != line_end && !is_space(*pos))
+          ++pos;
+        if (!first)
+          out(" ", 1);
+        out(token, pos - token);
+        first = false;
+      }
+      out("\n", 1);
+      pos = newline ? newline + 1 : end;
+    }
+  }
+
+  // Strictly parses a whole token as a decimal number.
+  static bool parse_number(const char* begin, const char* end, double& value)
+  {
+    const char* p = begin;
+    if (p != end && (*p == '+' || *p == '-'))
+      ++p;
+    bool digits = false;
+    while (p != end && *p >= '0' && *p <= '9')
+      ++p, digits = true;
+    if (p != end && *p == '.')
+    {
+      ++p;
+      while (p != end && *p >= '0' && *p <= '9')
+        ++p, digits = true;
+    }
+    if (!digits)
+      return false;
+    if (p != end && (*p == 'e' || *p == 'E'))
+    {
+      ++p;
+      if (p != end && (*p == '+' || *p == '-'))
+        ++p;
+      if (p == end || *p < '0' || *p > '9')
+        return false;
+      while (p != end && *p >= '0' && *p <= '9')
+        ++p;
+    }
+    if (p != end)
+      return false;
+    // from_chars doesn't take a leading '+'.
+    if (*begin == '+')
+      ++begin;
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+    std::from_chars_result result = std::from_chars(begin, end, value);
+    if (result.ec != std::errc() || result.ptr != end)
+      return false;
+#else
+    // Older libraries: strtod in the "C" locale, on a terminated copy.
+    static locale_t c_locale = newlocale(LC_ALL_MASK, "C", (locale_t)0);
+    char buffer[64];
+    std::string long_token;
+    const char* terminated = buffer;
+    if ((size_t)(end - begin) < sizeof(buffer))
+    {
+      std::memcpy(buffer, begin, end - begin);
+      buffer[end - begin] = '\0';
+    }
+    else
+    {
+      long_token.assign(begin, end);
+      terminated = long_token.c_str();
+    }
+    value = strtod_l(terminated, NULL, c_locale);
+#endif
+    return std::isfinite(value);
+  }
+
+  // Strictly parses a whole token as a non-negative integer.
+  static bool parse_count(const char* begin, const char* end, size_t& value)
+  {
+    if (begin == end)
+      return false;
+    value = 0;
+    for (const char* p = begin; p != end; ++p)
+    {
+      if (*p < '0' || *p > '9' || value > ((size_t)-1 - 9) / 10)
+        return false;
+      value = value * 10 + (*p - '0');
+    }
+    return true;
+  }
+
+private:
+  struct Token
+  {
+    const char* begin_;
+    const char* end_;
+    bool is(const char* word) const
+    {
+      size_t size = std::strlen(word);
+      return (size_t)(end_ - begin_) == size && std::memcmp(begin_, word, size) == 0;
+    }
+    std::string str() const { return std::string(begin_, end_); }
+  };
+
+  // More than any line of the format needs; longer lines are an error.
+  static const size_t max_tokens = 8;
+
+  static bool is_space(char c)
+  {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+  }
+
+  bool tokenize()
+  {
+    num_tokens_ = 0;
+    const char* p = line_begin_;
+    while (true)
+    {
+      while (p != line_end_ && is_space(*p))
+        ++p;
+      if (p == line_end_)
+        return true;
+      if (num_tokens_ == max_tokens)
+        return error(p, "too many arguments");
+      Token& token = tokens_[num_tokens_++];
+      token.begin_ = p;
+      while (p != line_end_ && !is_space(*p))
+        ++p;
+      token.end_ = p;
+    }
+  }
+
+  // Checks the number of arguments (tokens after the keyword) is one of
+  // the 'allowed' counts (a -1 terminated list), and reports 'usage' if not.
+  bool arguments(const int* allowed, const char* usage)
+  {
+    int count = num_tokens_ - 1;
+    for (const int* a = allowed; *a >= 0; ++a)
+      if (*a == count)
+        return true;
+    // Point at the first extra argument, or at the end of the line if
+    // one is missing.
+    int max_allowed = 0;
+    for (const int* a = allowed; *a >= 0; ++a)
+      max_allowed = *a > max_allowed ? *a : max_allowed;
+    const char* at = count > max_allowed ? tokens_[max_allowed + 1].begin_
+                                         : tokens_[num_tokens_ - 1].end_;
+    std::string message = std::string("expected '") + usage + "'";
+    return error(at, message.c_str());
+  }
+
+  bool number(size_t index, double& value)
+  {
+    const Token& t = tokens_[index];
+    if (parse_number(t.begin_, t.end_, value))
+      return true;
+    std::string message = "expected a number, found '" + t.str() + "'";
+    return error(t.begin_, message.c_str());
+  }
+
+  bool count(size_t index, size_t& value)
+  {
+    const Token& t = tokens_[index];
+    if (parse_count(t.begin_, t.end_, value) && value > 0)
+      return true;
+    std::string message = "expected a positive whole number, found '" + t.str() + "'";
+    return error(t.begin_, message.c_str());
+  }
+
+  // Reads the optional "<label> [<text x> <text y>]" from token 'first' on.
+  bool label(size_t first, std::string& label, double& text_x_offset, double& text_y_offset)
+  {
+    if (num_tokens_ <= first)
+      return true;
+    label.assign(tokens_[first].begin_, tokens_[first].end_);
+    if (num_tokens_ <= first + 1)
+      return true;
+    return number(first + 1, text_x_offset) && number(first + 2, text_y_offset);
+  }
+
+  // Appends 'element' at the current branch point, and moves the branch
+  // point to its end.
+  void add(Robot& robot, RobotElement* element)
+  {
+    robot.attach(element, tip_);
+    tip_ = robot.elements_.size() - 1;
+  }
+
+  bool parse_line(Robot& robot, Arena& arena, DiagramOptions& options)
+  {
+    static const int none[] = { 0, -1 };
+    static const int zero_or_one[] = { 0, 1, -1 };
+    static const int one[] = { 1, -1 };
+    static const int labeled[] = { 1, 2, 4, -1 };
+    static const int two[] = { 2, -1 };
+    static const int two_or_three[] = { 2, 3, -1 };
+    static const int up_to_two[] = { 0, 1, 2, -1 };
+    if (num_tokens_ == 0)
+      return error(line_begin_, "empty line");
+    const Token& keyword = tokens_[0];
+    if (keyword.is("base") || keyword.is("invisible_base"))
+    {
+      if (!arguments(zero_or_one, "base [<width>]"))
+        return false;
+      Base* base = arena.create<Base>();
+      if (num_tokens_ == 2 && !number(1, base->width_))
+        return false;
+      base->visible_ = keyword.is("base");
+      add(robot, base);
+    }
+    else if (keyword.is("link"))
+    {
+      double length;
+      if (!arguments(labeled, "link <length> [<label> [<text x> <text y>]]") || !number(1, length))
+        return false;
+      Link* link = arena.create<Link>(length);
+      if (!label(2, link->label_, link->text_x_offset_, link->text_y_offset_))
+        return false;
+      add(robot, link);
+    }
+    else if (keyword.is("invisible_link"))
+    {
+      double length;
+      if (!arguments(one, "invisible_link <length>") || !number(1, length))
+        return false;
+      Link* link = arena.create<Link>(length);
+      link->visible_ = false;
+      add(robot, link);
+    }
+    else if (keyword.is("frames"))
+    {
+      if (!arguments(none, "frames"))
+        return false;
+      add(robot, arena.create<Frames>());
+    }
+    else if (keyword.is("rjoint") || keyword.is("invisible_rjoint"))
+    {
+      double theta;
+      if (!arguments(labeled, "rjoint <theta> [<label> [<text x> <text y>]]") || !number(1, theta))
+        return false;
+      RJoint* rjoint = arena.create<RJoint>(theta);
+      rjoint->visible_ = keyword.is("rjoint");
+      if (!label(2, rjoint->label_, rjoint->text_x_offset_, rjoint->text_y_offset_))
+        return false;
+      add(robot, rjoint);
+    }
+    else if (keyword.is("limits"))
+    {
+      // Applies to the most recent rjoint (angles) or pjoint (lengths).
+      RJoint* rjoint = NULL;
+      PJoint* pjoint = NULL;
+      for (size_t i = robot.elements_.size(); i > 0 && !rjoint && !pjoint; --i)
+      {
+        rjoint = dynamic_cast<RJoint*>(robot.elements_[i - 1]);
+        pjoint = dynamic_cast<PJoint*>(robot.elements_[i - 1]);
+      }
+      if (!rjoint && !pjoint)
+        return error(keyword.begin_, "limits must follow an rjoint or a pjoint");
+      double min_value, max_value;
+      if (!arguments(two, "limits <min> <max>") || !number(1, min_value) || !number(2, max_value))
+        return false;
+      if (min_value > max_value)
+        return error(tokens_[2].begin_, "the maximum is less than the minimum");
+      if (rjoint)
+      {
+        rjoint->min_theta_ = min_value;
+        rjoint->max_theta_ = max_value;
+      }
+      else
+      {
+        pjoint->min_length_ = min_value;
+        pjoint->max_length_ = max_value;
+      }
+    }
+    else if (keyword.is("passive"))
+    {
+      // Applies to the most recent rjoint or pjoint.
+      RJoint* rjoint = NULL;
+      PJoint* pjoint = NULL;
+      for (size_t i = robot.elements_.size(); i > 0 && !rjoint && !pjoint; --i)
+      {
+        rjoint = dynamic_cast<RJoint*>(robot.elements_[i - 1]);
+        pjoint = dynamic_cast<PJoint*>(robot.elements_[i - 1]);
+      }
+      if (!rjoint && !pjoint)
+        return error(keyword.begin_, "passive must follow an rjoint or a pjoint");
+      if (!arguments(none, "passive"))
+        return false;
+      if (rjoint)
+        rjoint->passive_ = true;
+      else
+        pjoint->passive_ = true;
+    }
+    else if (keyword.is("close"))
+    {
+      if (!arguments(one, "close <frame>"))
+        return false;
+      const Token& name = tokens_[1];
+      std::vector<std::pair<std::string, size_t> >::const_iterator found = find_name(name);
+      size_t frame;
+      if (name.is("origin"))
+        frame = RobotElement::origin;
+      else if (found != names_.end())
+        frame = found->second;
+      else
+      {
+        std::string message = "unknown frame '" + name.str() + "'";
+        return error(name.begin_, message.c_str());
+      }
+      if (frame == tip_)
+        return error(name.begin_, "a loop can't close on itself");
+      robot.closures_.push_back(LoopClosure(tip_, frame));
+    }
+    else if (keyword.is("target"))
+    {
+      if (tip_ == RobotElement::origin)
+        return error(keyword.begin_, "target must follow an element");
+      double x, y, theta = 0;
+      if (!arguments(two_or_three, "target <x> <y> [<theta>]") || !number(1, x) || !number(2, y) ||
+          (num_tokens_ == 4 && !number(3, theta)))
+        return false;
+      robot.targets_.push_back(PoseTarget(tip_, x, y, theta, num_tokens_ == 4));
+    }
+    else if (keyword.is("workspace"))
+    {
+      if (!arguments(up_to_two, "workspace [<samples> [<cell size>]]"))
+        return false;
+      options.workspace_samples_ = 1000000;
+      if (num_tokens_ >= 2 && !count(1, options.workspace_samples_))
+        return false;
+      if (num_tokens_ >= 3 && !number(2, options.workspace_cell_))
+        return false;
+      if (options.workspace_cell_ <= 0)
+        return error(tokens_[2].begin_, "the cell size must be positive");
+    }
+    else if (keyword.is("pjoint"))
+    {
+      if (!arguments(none, "pjoint"))
+        return false;
+      add(robot, arena.create<PJoint>());
+    }
+    else if (keyword.is("effector"))
+    {
+      if (!arguments(none, "effector"))
+        return false;
+      add(robot, arena.create<EndEffector>());
+    }
+    else if (keyword.is("vector"))
+    {
+      double length;
+      if (!arguments(labeled, "vector <length> [<label> [<text x> <text y>]]") || !number(1, length))
+        return false;
+      Vector* vector = arena.create<Vector>(length);
+      if (!label(2, vector->label_, vector->text_x_offset_, vector->text_y_offset_))
+        return false;
+      add(robot, vector);
+    }
+    else if (keyword.is("push"))
+    {
+      if (!arguments(none, "push"))
+        return false;
+      stack_.push_back(tip_);
+    }
+    else if (keyword.is("pop"))
+    {
+      if (!arguments(none, "pop"))
+        return false;
+      if (stack_.empty())
+        return error(keyword.begin_, "pop without a push");
+      tip_ = stack_.back();
+      stack_.pop_back();
+    }
+    else if (keyword.is("name"))
+    {
+      if (!arguments(one, "name <frame>"))
+        return false;
+      const Token& name = tokens_[1];
+      if (name.is("origin") || find_name(name) != names_.end())
+      {
+        std::string message = "'" + name.str() + "' is already a frame";
+        return error(name.begin_, message.c_str());
+      }
+      names_.push_back(std::make_pair(name.str(), tip_));
+    }
+    else if (keyword.is("from"))
+    {
+      if (!arguments(one, "from <frame>"))
+        return false;
+      const Token& name = tokens_[1];
+      std::vector<std::pair<std::string, size_t> >::const_iterator found = find_name(name);
+      if (name.is("origin"))
+        tip_ = RobotElement::origin;
+      else if (found != names_.end())
+        tip_ = found->second;
+      else
+      {
+        std::string message = "unknown frame '" + name.str() + "'";
+        return error(name.begin_, message.c_str());
+      }
+    }
+    else if (keyword.is("point"))
+    {
+      if (!arguments(zero_or_one, "point [<label>]"))
+        return false;
+      RobPoint* point = arena.create<RobPoint>();
+      if (num_tokens_ == 2)
+        point->label_.assign(tokens_[1].begin_, tokens_[1].end_);
+      add(robot, point);
+    }
+    else
+    {
+      std::string message = "unknown element '" + keyword.str() + "'";
+      return error(keyword.begin_, message.c_str());
+    }
+    return true;
+  }
+
+  std::vector<std::pair<std::string, size_t> >::const_iterator find_name(const Token& name) const
+  {
+    std::vector<std::pair<std::string, size_t> >::const_iterator i = names_.begin();
+    while (i != names_.end() && !name.is(i->first.c_str()))
+      ++i;
+    return i;
+  }
+
+  bool error(const char* at, const char* message)
+  {
+    size_t column = at - line_begin_;
+    err_ << filename_ << ":" << line_number_ << ":" << column + 1 << ": " << message << std::endl;
+    const char* end = line_end_;
+    if (end != line_begin_ && end[-1] == '\r')
+      --end;
+    err_.write(line_begin_, end - line_begin_);
+    err_ << std::endl;
+    for (size_t i = 0; i < column; ++i)
+      err_ << (line_begin_[i] == '\t' ? '\t' : ' ');
+    err_ << "^" << std::endl;
+    return false;
+  }
+
+  const char* filename_;
+  std::ostream& err_;
+  // The current line, without its '\n'.
+  const char* line_begin_;
+  const char* line_end_;
+  int line_number_;
+  Token tokens_[max_tokens];
+  size_t num_tokens_;
+  // Where the next element goes: the index of the element it starts at the
+  // end of, or RobotElement::origin.  'push' saves it on 'stack_', and 'pop'
+  // goes back to it; 'name' names it, and 'from' goes back to a name.
+  size_t tip_;
+  std::vector<size_t> stack_;
+  std::vector<std::pair<std::string, size_t> > names_;
+};
+
+}
+
+#endif
@@ -0,0 +1,328 @@
+#ifndef ROBOT_STATS_HPP
+#define ROBOT_STATS_HPP
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <time.h>
+
+#include "robot_diagrams_0.0.hpp"
+#include "simple_svg_1.0.0.hpp"
+
+namespace rob_diag
+{
+
+// Instrumentation for converting files (generate_robots --stats): where
+// the time goes for each file, phase by phase, and what it held and wrote.
+// A thread converting a file points current_stats() at that file's
+// FileStats while it works; the code it calls times its phases with a
+// PhaseTimer, which does nothing when no stats are being kept.  For
+// example:
+//   FileStats stats;
+//   current_stats() = &stats;
+//   {
+//     PhaseTimer timer(ParsePhase);
+//     parser.parse(...);
+//   }
+//   current_stats() = NULL;
+//   log.add(position, filename, stats, good, false);
+//
+// A phase costs four clock readings per file (or per write, for the write
+// phase), so it can be left on for big batches.
+
+enum Phase { CachePhase, ReadPhase, ParsePhase, WorkspacePhase, MeasurePhase, DrawPhase, WritePhase,
+             NumPhases };
+
+inline const char* phase_name(Phase phase)
+{
+  static const char* const names[NumPhases] = { "cache", "read", "parse", "workspace", "measure", "draw",
+                                                "write" };
+  return names[phase];
+}
+
+inline const char* element_type_name(ElementType type)
+{
+  static const char* const names[EndEffectorType + 1] = { "custom", "vector", "point", "frames", "link",
+                                                          "rjoint", "pjoint", "base", "effector" };
+  return names[type];
+}
+
+// Wall and CPU (this thread's) time, in seconds.
+struct Times
+{
+  Times()
+    : wall_(0), cpu_(0)
+  {}
+  static Times now()
+  {
+    timespec wall, cpu;
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    Times times;
+    times.wall_ = wall.tv_sec + wall.tv_nsec * 1e-9;
+    times.cpu_ = cpu.tv_sec + cpu.tv_nsec * 1e-9;
+    return times;
+  }
+  Times& operator+=(const Times& other)
+  {
+    wall_ += other.wall_;
+    cpu_ += other.cpu_;
+    return *this;
+  }
+  Times operator-(const Times& other) const
+  {
+    Times times;
+    times.wall_ = wall_ - other.wall_;
+    times.cpu_ = cpu_ - other.cpu_;
+    return times;
+  }
+  double wall_, cpu_;
+};
+
+struct FileStats
+{
+  FileStats()
+    : bytes_written_(0), allocations_(0)
+  {
+    for (int i = 0; i <= EndEffectorType; ++i)
+      elements_[i] = 0;
+  }
+  void add(const FileStats& other)
+  {
+    for (int i = 0; i < NumPhases; ++i)
+      phases_[i] += other.phases_[i];
+    for (int i = 0; i <= EndEffectorType; ++i)
+      elements_[i] += other.elements_[i];
+    bytes_written_ += other.bytes_written_;
+    allocations_ += other.allocations_;
+  }
+  void count_elements(const Robot& robot)
+  {
+    for (size_t i = 0; i < robot.elements_.size(); ++i)
+      ++elements_[robot.elements_[i]->type()];
+  }
+  Times phases_[NumPhases];
+  unsigned long long elements_[EndEffectorType + 1];
+  unsigned long long bytes_written_, allocations_;
+};
+
+// The stats of the file this thread is converting, if any.
+inline FileStats*& current_stats()
+{
+  static __thread FileStats* stats = NULL;
+  return stats;
+}
+
+// Where the file this thread is converting comes in the run's list of
+// files, for StatsLog::add.
+inline size_t& current_file_position()
+{
+  static __thread size_t position = 0;
+  return position;
+}
+
+// Adds the time until it is destroyed (or stopped) to a phase of the
+// current file's stats.  Timers nest: time spent under an inner timer
+// counts for its phase only.
+class PhaseTimer
+{
+public:
+  explicit PhaseTimer(Phase phase)
+    : stats_(current_stats()), phase_(phase), outer_(NULL)
+  {
+    if (!stats_)
+      return;
+    outer_ = innermost();
+    innermost() = this;
+    start_ = Times::now();
+  }
+  ~PhaseTimer()
+  {
+    stop();
+  }
+  void stop()
+  {
+    if (!stats_)
+      return;
+    Times time = Times::now() - start_;
+    Times own = time - inner_;
+    stats_->phases_[phase_] += own;
+    if (outer_)
+      outer_->inner_ += time;
+    innermost() = outer_;
+    stats_ = NULL;
+  }
+private:
+  PhaseTimer(const PhaseTimer&);
+  PhaseTimer& operator=(const PhaseTimer&);
+
+  static PhaseTimer*& innermost()
+  {
+    static __thread PhaseTimer* timer = NULL;
+    return timer;
+  }
+
+  FileStats* stats_;
+  Phase phase_;
+  PhaseTimer* outer_;
+  Times start_, inner_;
+};
+
+// Passes writes on to 'next', counting the bytes and timing the writes as
+// the current file's write phase.
+class StatsSink : public svg::Sink
+{
+public:
+  StatsSink(svg::Sink& next)
+    : next_(next)
+  {}
+  bool write(const char* data, size_t size)
+  {
+    PhaseTimer timer(WritePhase);
+    FileStats* stats = current_stats();
+    if (stats)
+      stats->bytes_written_ += size;
+    return next_.write(data, size);
+  }
+private:
+  svg::Sink& next_;
+};
+
+// The stats of every file of a run, added from any thread, and written out
+// as JSON at the end.
+class StatsLog
+{
+public:
+  StatsLog()
+    : start_(Times::now()), num_files_(0), num_good_(0)
+  {
+    pthread_mutex_init(&mutex_, NULL);
+  }
+  ~StatsLog()
+  {
+    pthread_mutex_destroy(&mutex_);
+  }
+
+  // Files are kept by 'position' in the run's input, whichever order they
+  // finish in.
+  void add(size_t position, const std::string& filename, const FileStats& stats, bool good, bool cached)
+  {
+    pthread_mutex_lock(&mutex_);
+    if (entries_.size() <= position)
+      entries_.resize(position + 1);
+    Entry& entry = entries_[position];
+    entry.filename_ = filename;
+    entry.stats_ = stats;
+    entry.added_ = true;
+    entry.good_ = good;
+    entry.cached_ = cached;
+    ++num_files_;
+    total_.add(stats);
+    if (good)
+      ++num_good_;
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  // The run so far: "total" sums every file (with the run's wall and CPU
+  // time as "run"), and "files" has each file, in input order.
+  bool write_json(const char* filename)
+  {
+    FILE* out = std::fopen(filename, "w");
+    if (!out)
+      return false;
+    pthread_mutex_lock(&mutex_);
+    Times run = Times::now() - start_;
+    std::fprintf(out, "{\n  \"run\": {\"wall_s\": %.6f, \"cpu_s\": %.6f, \"files\": %lu, \"good\": %lu},\n",
+                 run.wall_, process_cpu_seconds(), num_files_, num_good_);
+    std::fprintf(out, "  \"total\": ");
+    write_stats(out, total_);
+    std::fprintf(out, ",\n  \"files\": [");
+    const char* separator = "\n";
+    for (size_t i = 0; i < entries_.size(); ++i)
+    {
+      const Entry& entry = entries_[i];
+      if (!entry.added_)
+        continue;
+      std::fprintf(out, "%s    {\"file\": \"%s\", \"good\": %s, \"cached\": %s, \"stats\": ", separator,
+                   json_escape(entry.filename_).c_str(), entry.good_ ? "true" : "false",
+                   entry.cached_ ? "true" : "false");
+      write_stats(out, entry.stats_);
+      std::fprintf(out, "}");
+      separator = ",\n";
+    }
+    std::fprintf(out, "\n  ]\n}\n");
+    pthread_mutex_unlock(&mutex_);
+    return std::fclose(out) == 0;
+  }
+
+private:
+  struct Entry
+  {
+    Entry() : added_(false), good_(false), cached_(false) {}
+    std::string filename_;
+    FileStats stats_;
+    bool added_, good_, cached_;
+  };
+
+  StatsLog(const StatsLog&);
+  StatsLog& operator=(const StatsLog&);
+
+  static double process_cpu_seconds()
+  {
+    timespec cpu;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    return cpu.tv_sec + cpu.tv_nsec * 1e-9;
+  }
+
+  static std::string json_escape(const std::string& text)
+  {
+    std::string escaped;
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+      unsigned char c = text[i];
+      if (c == '"' || c == '\\')
+      {
+        escaped += '\\';
+        escaped += c;
+      }
+      else if (c < 0x20)
+      {
+        char code[8];
+        std::snprintf(code, sizeof(code), "\\u%04x", c);
+        escaped += code;
+      }
+      else
+        escaped += c;
+    }
+    return escaped;
+  }
+
+  static void write_stats(FILE* out, const FileStats& stats)
+  {
+    std::fprintf(out, "{\"phases\": {");
+    for (int i = 0; i < NumPhases; ++i)
+      std::fprintf(out, "%s\"%s\": {\"wall_s\": %.6f, \"cpu_s\": %.6f}", i ? ", " : "", phase_name((Phase)i),
+                   stats.phases_[i].wall_, stats.phases_[i].cpu_);
+    std::fprintf(out, "}, \"elements\": {");
+    unsigned long long total = 0;
+    for (int i = 0; i <= EndEffectorType; ++i)
+    {
+      std::fprintf(out, "\"%s\": %llu, ", element_type_name((ElementType)i), stats.elements_[i]);
+      total += stats.elements_[i];
+    }
+    std::fprintf(out, "\"total\": %llu}, \"bytes_written\": %llu, \"allocations\": %llu}", total,
+                 stats.bytes_written_, stats.allocations_);
+  }
+
+  pthread_mutex_t mutex_;
+  Times start_;
+  std::vector<Entry> entries_;
+  FileStats total_;
+  unsigned long num_files_, num_good_;
+};
+
+}
+
+#endif
@@ -0,0 +1,247 @@
+#ifndef ROBOT_TREE_HPP
+#define ROBOT_TREE_HPP
+
+#include "robot_diagrams_0.0.hpp"
+#include "work_pool.hpp"
+
+#include <algorithm>
+#include <vector>
+
+namespace rob_diag
+{
+
+// About how many elements each task of parallel_update_dimensions and
+// parallel_draw_at gets; robots much smaller than this are done on the
+// calling thread.
+static const size_t tree_grain = 4096;
+
+// Splits the elements of a tree-shaped Robot that need measuring into a
+// trunk, measured first, and tasks that can then be measured at the same
+// time: each task is a set of whole branches hanging off the trunk (or off
+// elements that are already measured).  For example:
+//   size_t first = robot.begin_measure();
+//   TreeSplit split;
+//   split.assign(robot, first, tree_grain);
+//   // Measure the elements of split.trunk() with robot.measure_element,
+//   // then those of each task (task_begin(t) to task_end(t)) on a thread.
+//
+// Going down from the roots, a branch of fewer than 2 * 'grain' elements
+// becomes (part of) a task, and the element at the top of a bigger one goes
+// into the trunk; small branches are grouped into tasks of about 'grain'
+// elements.  So a chain is all trunk, and a tree's trunk is what its big
+// branches share (the torso of a humanoid, the palm of a gripper).
+// Everything takes time in proportion to the number of elements.
+class TreeSplit
+{
+public:
+  // Splits elements 'first' on of 'robot'; the ones before it are taken as
+  // measured.
+  void assign(const Robot& robot, size_t first, size_t grain)
+  {
+    trunk_.clear();
+    task_begin_.assign(1, 0);
+    task_elements_.clear();
+    size_t count = robot.elements_.size() - first;
+
+    // Subtree sizes, and each element's children, in order.
+    std::vector<size_t> sizes(count, 1);
+    std::vector<size_t> child_begin(count + 1, 0);
+    std::vector<size_t> roots;
+    for (size_t i = count; i-- > 0;)
+    {
+      size_t parent = robot.parent(first + i);
+      if (parent != RobotElement::origin && parent >= first)
+      {
+        sizes[parent - first] += sizes[i];
+        ++child_begin[parent - first + 1];
+      }
+    }
+    for (size_t i = 0; i < count; ++i)
+      child_begin[i + 1] += child_begin[i];
+    std::vector<size_t> children(child_begin[count]);
+    std::vector<size_t> next_child(child_begin.begin(), child_begin.end() - 1);
+    for (size_t i = 0; i < count; ++i)
+    {
+      size_t parent = robot.parent(first + i);
+      if (parent != RobotElement::origin && parent >= first)
+        children[next_child[parent - first]++] = i;
+      else
+        roots.push_back(i);
+    }
+
+    // Walk down from the roots to the branches small enough to be tasks,
+    // grouping them as they come.  'task_of' is -1 for the trunk.
+    std::vector<int> task_of(count, -1);
+    std::vector<size_t> pending(roots.rbegin(), roots.rend());
+    int num_tasks = 0;
+    size_t task_size = 0;
+    while (!pending.empty())
+    {
+      size_t i = pending.back();
+      pending.pop_back();
+      if (sizes[i] < 2 * grain)
+      {
+        if (task_size == 0 || task_size >= grain)
+        {
+          ++num_tasks;
+          task_size = 0;
+        }
+        task_of[i] = num_tasks - 1;
+        task_size += sizes[i];
+        continue;
+      }
+      trunk_.push_back(first + i);
+      for (size_t c = child_begin[i + 1]; c-- > child_begin[i];)
+        pending.push_back(children[c]);
+    }
+    std::sort(trunk_.begin(), trunk_.end());
+
+    // Everything below a task's branches is in that task, in order.
+    task_begin_.assign(num_tasks + 1, 0);
+    for (size_t i = 0; i < count; ++i)
+    {
+      size_t parent = robot.parent(first + i);
+      if (task_of[i] < 0 && parent != RobotElement::origin && parent >= first)
+        task_of[i] = task_of[parent - first];
+      if (task_of[i] >= 0)
+        ++task_begin_[task_of[i] + 1];
+    }
+    for (int t = 0; t < num_tasks; ++t)
+      task_begin_[t + 1] += task_begin_[t];
+    task_elements_.resize(task_begin_[num_tasks]);
+    std::vector<size_t> next(task_begin_.begin(), task_begin_.end() - 1);
+    for (size_t i = 0; i < count; ++i)
+      if (task_of[i] >= 0)
+        task_elements_[next[task_of[i]]++] = first + i;
+  }
+
+  // Elements to measure first, in order.
+  const std::vector<size_t>& trunk() const { return trunk_; }
+  size_t num_tasks() const { return task_begin_.size() - 1; }
+  // The elements of task 't', in order, as [begin, end).
+  const size_t* task_begin(size_t t) const
+  {
+    return task_elements_.empty() ? NULL : &task_elements_[task_begin_[t]];
+  }
+  const size_t* task_end(size_t t) const { return task_begin(t) + task_size(t); }
+  size_t task_size(size_t t) const { return task_begin_[t + 1] - task_begin_[t]; }
+
+private:
+  std::vector<size_t> trunk_;
+  // Task t's elements are task_elements_[task_begin_[t], task_begin_[t + 1]).
+  std::vector<size_t> task_begin_;
+  std::vector<size_t> task_elements_;
+};
+
+class MeasureTreeTask : public WorkTask
+{
+public:
+  MeasureTreeTask(Robot& robot, const TreeSplit& split, size_t first, std::vector<Rect>& own)
+    : robot_(robot), split_(split), first_(first), own_(own)
+  {}
+  void run(size_t index, unsigned /* worker */)
+  {
+    for (const size_t* i = split_.task_begin(index); i != split_.task_end(index); ++i)
+      own_[*i - first_] = robot_.measure_element(*i);
+  }
+private:
+  Robot& robot_;
+  const TreeSplit& split_;
+  size_t first_;
+  std::vector<Rect>& own_;
+};
+
+struct BiggerTaskFirst
+{
+  BiggerTaskFirst(const TreeSplit& split) : split_(split) {}
+  bool operator()(size_t a, size_t b) const { return split_.task_size(a) > split_.task_size(b); }
+  const TreeSplit& split_;
+};
+
+// Robot::update_dimensions, with the branches of a big tree measured on
+// 'pool' (see TreeSplit).  The result, and the robot's measure cache, are
+// the same as update_dimensions would leave.
+inline Rect parallel_update_dimensions(Robot& robot, WorkPool* pool, size_t grain = tree_grain)
+{
+  size_t first = robot.begin_measure();
+  size_t count = robot.elements_.size();
+  if (!pool || pool->size() < 2 || count - first < 2 * grain)
+    return robot.update_dimensions();
+  TreeSplit split;
+  split.assign(robot, first, grain);
+  if (split.num_tasks() < 2)
+    return robot.update_dimensions();
+
+  std::vector<Rect> own(count - first);
+  for (size_t t = 0; t < split.trunk().size(); ++t)
+    own[split.trunk()[t] - first] = robot.measure_element(split.trunk()[t]);
+  std::vector<size_t> order(split.num_tasks());
+  for (size_t t = 0; t < order.size(); ++t)
+    order[t] = t;
+  std::stable_sort(order.begin(), order.end(), BiggerTaskFirst(split));
+  MeasureTreeTask task(robot, split, first, own);
+  pool->run(task, order);
+  return robot.end_measure(first, own);
+}
+
+// Robot::compute_dimensions on 'pool': every element is measured.
+inline Rect parallel_compute_dimensions(Robot& robot, WorkPool* pool, size_t grain = tree_grain)
+{
+  robot.invalidate();
+  return parallel_update_dimensions(robot, pool, grain);
+}
+
+class DrawPartTask : public WorkTask
+{
+public:
+  DrawPartTask(Robot& robot, std::vector<Document>& parts, const Point& offset, size_t first, size_t grain)
+    : robot_(robot), parts_(parts), offset_(offset), first_(first), grain_(grain)
+  {}
+  void run(size_t index, unsigned /* worker */)
+  {
+    size_t begin = first_ + index * grain_;
+    size_t end = std::min(begin + grain_, robot_.elements_.size());
+    for (size_t i = begin; i < end; ++i)
+      robot_.elements_[i]->draw(parts_[index], offset_);
+  }
+private:
+  Robot& robot_;
+  std::vector<Document>& parts_;
+  Point offset_;
+  size_t first_, grain_;
+};
+
+// Robot::draw_at, with a big robot drawn in parts of 'grain' elements on
+// 'pool', each into a Document::part that is then added to 'doc' in order.
+// The output doesn't depend on the number of workers, and is the same as
+// draw_at's but for runs of batched lines being split between parts.
+// Without a pool of at least two workers, or for a painting document, this
+// is just draw_at, with no parts to copy.
+inline void parallel_draw_at(Robot& robot, Document& doc, const Pose& start, WorkPool* pool,
+                             size_t grain = tree_grain)
+{
+  size_t count = robot.elements_.size();
+  if (!pool || pool->size() < 2 || doc.painting() || count <= grain)
+  {
+    robot.draw_at(doc, start);
+    return;
+  }
+  // A few parts per worker at a time, so that the output isn't all held at
+  // once.
+  size_t num_parts = (count + grain - 1) / grain;
+  size_t round = pool->size() * 2;
+  Point offset(start.x_, start.y_);
+  for (size_t part = 0; part < num_parts; part += round)
+  {
+    size_t n = std::min(round, num_parts - part);
+    std::vector<Document> parts(n, doc.part());
+    DrawPartTask task(robot, parts, offset, part * grain, grain);
+    pool->run(task, n);
+    for (size_t p = 0; p < n; ++p)
+      doc.append(parts[p]);
+  }
+}
+
+}
+
+#endif
@@ -0,0 +1,330 @@
+#ifndef ROBOT_WORKSPACE_HPP
+#define ROBOT_WORKSPACE_HPP
+
+#include "robot_diagrams_0.0.hpp"
+#include "robot_kinematics.hpp"
+#include "work_pool.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace rob_diag
+{
+
+// The region a chain's end can reach, found by sampling its joint space.
+//
+// Every visible RJoint is sampled uniformly over [min_theta_, max_theta_];
+// invisible rjoints (which only set up fixed angles) and all lengths keep
+// their current values.  In a tree the chain's end is the end of the last
+// element, and only the joints on the way to it are sampled.  End positions
+// are binned into a grid of square cells, small gaps are closed, and the
+// outline of the occupied cells is traced into polygons (outer boundaries
+// and holes).
+//
+// Sampling is done in fixed-size chunks, each with its own random sequence
+// and (per worker) its own grid, so the result is the same for any number of
+// threads.
+class Workspace
+{
+public:
+  Workspace()
+    : cell_(1), origin_(0, 0), width_(0), height_(0)
+  {}
+
+  // Samples 'samples' configurations of 'robot' into cells of size 'cell'.
+  // If 'pool' is given the sampling is spread over its workers.
+  void compute(const Robot& robot, size_t samples, double cell, WorkPool* pool = NULL)
+  {
+    loops_.clear();
+    Kinematics kinematics(robot);
+    cell_ = cell > 0 ? cell : 1;
+
+    // Everything before the first sampled joint is fixed, so the reachable
+    // set lies in a disc around the pose there, with a radius of the total
+    // length after it.
+    std::vector<double> low, high;
+    bool sampling = false;
+    Pose center(0,0,0);
+    double reach = 0;
+    std::vector<double> defaults(kinematics.num_joints());
+    kinematics.default_joints(defaults.empty() ? NULL : &defaults[0]);
+    // The elements from the origin to the end.
+    std::vector<bool> moves_end(robot.elements_.size(), false);
+    size_t e = robot.elements_.empty() ? (size_t)RobotElement::origin : robot.elements_.size() - 1;
+    for (; e != RobotElement::origin; e = robot.parent(e))
+      moves_end[e] = true;
+    for (size_t j = 0; j < kinematics.num_joints(); ++j)
+    {
+      const Kinematics::Joint& joint = kinematics.joints()[j];
+      const RobotElement* element = robot.elements_[joint.element_];
+      low.push_back(joint.default_);
+      high.push_back(joint.default_);
+      if (joint.type_ == RJointType && ((const RJoint*)element)->visible_ && moves_end[joint.element_])
+      {
+        const RJoint* rjoint = (const RJoint*)element;
+        low.back() = rjoint->min_theta_;
+        high.back() = rjoint->max_theta_;
+        if (!sampling)
+        {
+          std::vector<Pose> frames(kinematics.num_elements(), Pose(0,0,0));
+          Pose end(0,0,0);
+          kinematics.forward(defaults.empty() ? NULL : &defaults[0], 1, &end, &frames[0]);
+          size_t parent = robot.parent(joint.element_);
+          center = parent == RobotElement::origin ? Pose(0,0,0) : frames[parent];
+          sampling = true;
+        }
+      }
+    }
+    // Bound the reach generously by the length of every element; it's only
+    // used to size the grid.
+    for (size_t i = 0; i < robot.elements_.size(); ++i)
+      reach += element_reach(*robot.elements_[i]);
+
+    // Size the grid (with a one cell border) and cap it at 4096 x 4096.
+    double span = 2 * reach + 2 * cell_;
+    if (span / cell_ > 4096)
+      cell_ = span / 4096;
+    width_ = height_ = (int)(span / cell_) + 3;
+    origin_ = Point(center.x_ - reach - 2 * cell_, center.y_ - reach - 2 * cell_);
+
+    // Sample, one private grid per worker, then merge.
+    size_t num_workers = pool ? pool->size() : 1;
+    std::vector<std::vector<unsigned char> > grids(num_workers);
+    SampleTask task(*this, kinematics, low, high, samples, grids);
+    size_t num_chunks = (samples + chunk_size - 1) / chunk_size;
+    if (pool)
+      pool->run(task, num_chunks);
+    else
+      for (size_t c = 0; c < num_chunks; ++c)
+        task.run(c, 0);
+    std::vector<unsigned char> grid(width_ * height_, 0);
+    for (size_t w = 0; w < grids.size(); ++w)
+      for (size_t i = 0; i < grids[w].size(); ++i)
+        grid[i] |= grids[w][i];
+
+    close_gaps(grid);
+    trace(grid);
+  }
+
+  // Bounds of the reachable region (all zero if nothing was reached).
+  Rect bounds() const
+  {
+    Rect bounds;
+    bool first = true;
+    for (size_t l = 0; l < loops_.size(); ++l)
+    {
+      for (size_t i = 0; i < loops_[l].size(); ++i)
+      {
+        const Point& p = loops_[l][i];
+        if (first)
+          bounds = Rect(p.x, p.y, p.x, p.y);
+        bounds.extend(Rect(p.x, p.y, p.x, p.y));
+        first = false;
+      }
+    }
+    return bounds;
+  }
+
+  // Draws the region as one filled path (holes cut out), offset like
+  // Robot::draw_at.  Draw this before the robot so it sits behind it.
+  void draw_at(Document& doc, const Pose& start) const
+  {
+    if (loops_.empty())
+      return;
+    Point offset(start.x_, start.y_);
+    svg::Path path(Fill(Color(225, 225, 225)), Stroke(0.5, Color(160, 160, 160)));
+    for (size_t l = 0; l < loops_.size(); ++l)
+    {
+      path.startNewSubPath();
+      for (size_t i = 0; i < loops_[l].size(); ++i)
+        path << loops_[l][i] + offset;
+    }
+    doc << path;
+  }
+
+  // Closed outlines of the region: counter-clockwise for outer boundaries,
+  // clockwise for holes.
+  std::vector<std::vector<Point> > loops_;
+
+private:
+  static const size_t chunk_size = 16384;
+
+  static double element_reach(const RobotElement& element)
+  {
+    switch (element.type())
+    {
+      case VectorType: return std::fabs(((const Vector&)element).length_);
+      case LinkType: return std::fabs(((const Link&)element).length_);
+      case PJointType: return std::fabs(((const PJoint&)element).length_);
+      case BaseType: return std::fabs(((const Base&)element).width_) * 0.3;
+      default: return 0;
+    }
+  }
+
+  class SampleTask : public WorkTask
+  {
+  public:
+    SampleTask(const Workspace& workspace, const Kinematics& kinematics,
+               const std::vector<double>& low, const std::vector<double>& high,
+               size_t samples, std::vector<std::vector<unsigned char> >& grids)
+      : workspace_(workspace), kinematics_(kinematics), low_(low), high_(high),
+        samples_(samples), grids_(grids)
+    {}
+    virtual void run(size_t chunk, unsigned worker)
+    {
+      std::vector<unsigned char>& grid = grids_[worker];
+      if (grid.empty())
+        grid.assign(workspace_.width_ * workspace_.height_, 0);
+
+      size_t first = chunk * chunk_size;
+      size_t count = std::min(chunk_size, samples_ - first);
+      size_t num_joints = low_.size();
+      std::vector<float> joints(count * num_joints);
+      std::vector<Pose> ends(count, Pose(0,0,0));
+
+      // xorshift64*, seeded by the chunk number.
+      unsigned long long state = (chunk + 1) * 0x9E3779B97F4A7C15ULL;
+      for (size_t i = 0; i < count; ++i)
+      {
+        for (size_t j = 0; j < num_joints; ++j)
+        {
+          state ^= state >> 12;
+          state ^= state << 25;
+          state ^= state >> 27;
+          double unit = ((state * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+          joints[i * num_joints + j] = (float)(low_[j] + (high_[j] - low_[j]) * unit);
+        }
+      }
+      if (count > 0)
+        kinematics_.forward(num_joints ? &joints[0] : NULL, count, &ends[0]);
+
+      double scale = 1.0 / workspace_.cell_;
+      for (size_t i = 0; i < count; ++i)
+      {
+        int x = (int)((ends[i].x_ - workspace_.origin_.x) * scale);
+        int y = (int)((ends[i].y_ - workspace_.origin_.y) * scale);
+        if (x >= 0 && y >= 0 && x < workspace_.width_ && y < workspace_.height_)
+          grid[y * workspace_.width_ + x] = 1;
+      }
+    }
+  private:
+    const Workspace& workspace_;
+    const Kinematics& kinematics_;
+    const std::vector<double>& low_;
+    const std::vector<double>& high_;
+    size_t samples_;
+    std::vector<std::vector<unsigned char> >& grids_;
+  };
+
+  // Morphological closing (3x3 dilate, then erode), which fills in cells the
+  // sampling happened to miss without growing the region.
+  void close_gaps(std::vector<unsigned char>& grid) const
+  {
+    std::vector<unsigned char> dilated(grid.size(), 0);
+    for (int y = 1; y < height_ - 1; ++y)
+      for (int x = 1; x < width_ - 1; ++x)
+      {
+        unsigned char any = 0;
+        for (int dy = -1; dy <= 1; ++dy)
+          for (int dx = -1; dx <= 1; ++dx)
+            any |= grid[(y + dy) * width_ + x + dx];
+        dilated[y * width_ + x] = any;
+      }
+    for (int y = 1; y < height_ - 1; ++y)
+      for (int x = 1; x < width_ - 1; ++x)
+      {
+        unsigned char all = 1;
+        for (int dy = -1; dy <= 1; ++dy)
+          for (int dx = -1; dx <= 1; ++dx)
+            all &= dilated[(y + dy) * width_ + x + dx];
+        grid[y * width_ + x] |= all;
+      }
+  }
+
+  // Traces the boundary between occupied and empty cells into loops.  Each
+  // boundary edge runs along a cell side with the occupied cell on its left;
+  // edges are chained at grid vertices, and only corners are kept.
+  void trace(const std::vector<unsigned char>& grid)
+  {
+    // Directions: 0 = +x, 1 = +y, 2 = -x, 3 = -y.
+    static const int step_x[4] = { 1, 0, -1, 0 };
+    static const int step_y[4] = { 0, 1, 0, -1 };
+    int vertex_width = width_ + 1;
+    std::vector<unsigned char> out((width_ + 1) * (height_ + 1), 0);
+    for (int y = 0; y < height_; ++y)
+      for (int x = 0; x < width_; ++x)
+      {
+        if (!occupied(grid, x, y))
+          continue;
+        if (!occupied(grid, x, y - 1))
+          out[y * vertex_width + x] |= 1 << 0;
+        if (!occupied(grid, x + 1, y))
+          out[y * vertex_width + x + 1] |= 1 << 1;
+        if (!occupied(grid, x, y + 1))
+          out[(y + 1) * vertex_width + x + 1] |= 1 << 2;
+        if (!occupied(grid, x - 1, y))
+          out[(y + 1) * vertex_width + x] |= 1 << 3;
+      }
+
+    // Start loops at vertices with a single outgoing edge first, so a loop
+    // can't pass back through its start; pinch points (two outgoing edges,
+    // where cells touch diagonally) can only be left over afterwards.
+    for (int pass = 0; pass < 2; ++pass)
+    {
+      for (size_t start = 0; start < out.size(); ++start)
+      {
+        while (out[start] != 0)
+        {
+          if (pass == 0 && (out[start] & (out[start] - 1)) != 0)
+            break;
+          std::vector<Point> loop;
+          size_t v = start;
+          int dir = -1, first_dir = -1;
+          do
+          {
+            // At a pinch, turn left, keeping diagonal neighbours separate.
+            int next = -1;
+            for (int turn = 1; turn >= -2 && dir >= 0; --turn)
+            {
+              int d = (dir + turn + 4) % 4;
+              if (out[v] & (1 << d))
+              {
+                next = d;
+                break;
+              }
+            }
+            if (next < 0)
+              for (next = 0; !(out[v] & (1 << next)); ++next) {}
+            out[v] &= ~(1 << next);
+            if (next != dir)
+              loop.push_back(Point(origin_.x + (v % vertex_width) * cell_,
+                                   origin_.y + (v / vertex_width) * cell_));
+            if (dir < 0)
+              first_dir = next;
+            dir = next;
+            v = (v / vertex_width + step_y[dir]) * vertex_width + v % vertex_width + step_x[dir];
+          } while (v != start && out[v] != 0);
+          // The start is only a corner if the loop turns there.
+          if (dir == first_dir && loop.size() > 1)
+            loop.erase(loop.begin());
+          loops_.push_back(loop);
+        }
+      }
+    }
+  }
+
+  bool occupied(const std::vector<unsigned char>& grid, int x, int y) const
+  {
+    return x >= 0 && y >= 0 && x < width_ && y < height_ && grid[y * width_ + x];
+  }
+
+  double cell_;
+  // Lower left corner of the grid.
+  Point origin_;
+  int width_, height_;
+};
+
+}
+
+#endif
@@ -34,6 +34,16 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  * - changed 'transparent' to 'none' to work better with SVG viewers.
  * - added '+=' and '*=' to simple Point class
  * - added a 'arc' command.
+ * - marked the free functions 'inline' and kept all state per-call, so the
+ *   header can be used from several threads (and translation units) at once.
+ * - added streaming output to a Sink (file descriptor, ostream or callback).
+ * - serialize through a reusable Writer buffer with a locale independent
+ *   number formatter, instead of a stringstream per attribute.
+ * - added a 'Path' shape (closed subpaths, even-odd fill).
+ * - added groups, <defs> symbols and a 'Use' shape to place them.
+ * - optional batching of consecutive same-stroke Lines into one <path>.
+ * - optional fixed output precision, and relative path commands.
+ * - a Painter interface, so that shapes can be drawn other than as SVG.
  **/
 
 #ifndef SIMPLE_SVG_HPP
@@ -43,9 +53,20 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <string>
 #include <sstream>
 #include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#if __cplusplus >= 201703L
+#include <charconv>
+#endif
 
 #include <iostream>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 namespace svg
 {
     // Utility XML/String Functions.
@@ -57,15 +78,15 @@ namespace svg
         ss << attribute_name << "=\"" << value << unit << "\" ";
         return ss.str();
     }
-    std::string elemStart(std::string const & element_name)
+    inline std::string elemStart(std::string const & element_name)
     {
         return "\t<" + element_name + " ";
     }
-    std::string elemEnd(std::string const & element_name)
+    inline std::string elemEnd(std::string const & element_name)
     {
         return "</" + element_name + ">\n";
     }
-    std::string emptyElemEnd()
+    inline std::string emptyElemEnd()
     {
         return "/>\n";
     }
@@ -121,7 +142,7 @@ namespace svg
             return Point(x * rhs, y * rhs);
         }
     };
-    optional<Point> getMinPoint(std::vector<Point> const & points)
+    inline optional<Point> getMinPoint(std::vector<Point> const & points)
     {
         if (points.empty())
             return optional<Point>();
@@ -135,7 +156,7 @@ namespace svg
         }
         return optional<Point>(min);
     }
-    optional<Point> getMaxPoint(std::vector<Point> const & points)
+    inline optional<Point> getMaxPoint(std::vector<Point> const & points)
     {
         if (points.empty())
             return optional<Point>();
@@ -165,7 +186,7 @@ namespace svg
     };
 
     // Convert coordinates in user space to SVG native space.
-    double translateX(double x, Layout const & layout)
+    inline double translateX(double x, Layout const & layout)
     {
         if (layout.origin == Layout::BottomRight || layout.origin == Layout::TopRight)
             return layout.dimensions.width - ((x + layout.origin_offset.x) * layout.scale);
@@ -173,24 +194,448 @@ namespace svg
             return (layout.origin_offset.x + x) * layout.scale;
     }
 
-    double translateY(double y, Layout const & layout)
+    inline double translateY(double y, Layout const & layout)
     {
         if (layout.origin == Layout::BottomLeft || layout.origin == Layout::BottomRight)
             return layout.dimensions.height - ((y + layout.origin_offset.y) * layout.scale);
         else
             return (layout.origin_offset.y + y) * layout.scale;
     }
-    double translateScale(double dimension, Layout const & layout)
+    inline double translateScale(double dimension, Layout const & layout)
     {
         return dimension * layout.scale;
     }
 
+    // Destinations for a streaming Document.  A Document normally keeps its
+    //  body in memory and writes the whole file on save(); given a Sink, it
+    //  instead writes each shape out (through a fixed-size buffer) as soon as
+    //  it is added.
+    class Sink
+    {
+    public:
+        virtual ~Sink() { }
+        // Returns false on error.
+        virtual bool write(char const * data, size_t size) = 0;
+    };
+
+    // Writes to a POSIX file descriptor.  A named file is written under a
+    //  temporary name next to it and renamed into place when the sink is
+    //  closed (or destroyed), if every write succeeded; so a reader never sees
+    //  a partial file, and a file that is a hard link (a RenderCache entry,
+    //  say) is replaced rather than rewritten through the link.
+    class FileSink : public Sink
+    {
+    public:
+        // Creates (or replaces) the given file.
+        FileSink(std::string const & file_name)
+            : file_name(file_name), fd(-1), owns_fd(true), failed(false)
+        {
+            static unsigned long counter = 0;
+            char suffix[48];
+            std::snprintf(suffix, sizeof(suffix), ".tmp%ld.%lu", (long)::getpid(),
+                          __sync_fetch_and_add(&counter, 1));
+            temp_name = file_name + suffix;
+            fd = ::open(temp_name.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+        }
+        // Writes to an already open descriptor, which is not closed.
+        FileSink(int fd) : fd(fd), owns_fd(false), failed(false) { }
+        ~FileSink()
+        {
+            close();
+        }
+        bool good() const { return fd >= 0; }
+        bool write(char const * data, size_t size)
+        {
+            while (size > 0) {
+                ssize_t written = ::write(fd, data, size);
+                if (written < 0 && errno == EINTR)
+                    continue;
+                if (written <= 0) {
+                    failed = true;
+                    return false;
+                }
+                data += written;
+                size -= written;
+            }
+            return true;
+        }
+        // Closes a named file, moving it into place if 'keep' is set and
+        //  every write succeeded, and deleting it otherwise.  Returns true if
+        //  the file was put in place.
+        bool close(bool keep = true)
+        {
+            if (!owns_fd || fd < 0)
+                return false;
+            bool good = ::close(fd) == 0 && keep && !failed;
+            fd = -1;
+            if (good && ::rename(temp_name.c_str(), file_name.c_str()) == 0)
+                return true;
+            ::unlink(temp_name.c_str());
+            return false;
+        }
+    private:
+        FileSink(FileSink const &);
+        FileSink & operator=(FileSink const &);
+        std::string file_name, temp_name;
+        int fd;
+        bool owns_fd;
+        bool failed;
+    };
+
+    class StreamSink : public Sink
+    {
+    public:
+        StreamSink(std::ostream & stream) : stream(stream) { }
+        bool write(char const * data, size_t size)
+        {
+            stream.write(data, size);
+            return stream.good();
+        }
+    private:
+        std::ostream & stream;
+    };
+
+    // Hands each chunk to a user function, along with a user pointer.
+    class CallbackSink : public Sink
+    {
+    public:
+        typedef bool (*Callback)(void * user, char const * data, size_t size);
+        CallbackSink(Callback callback, void * user = 0) : callback(callback), user(user) { }
+        bool write(char const * data, size_t size)
+        {
+            return callback(user, data, size);
+        }
+    private:
+        Callback callback;
+        void * user;
+    };
+
+    // Formats 'value' the way an ostream with default flags does ("%.6g"),
+    //  but always with a '.' decimal point and without touching a stream or
+    //  the heap.  Writes at most 32 characters, and returns the end.
+    inline char * formatNumber(char * out, double value)
+    {
+        if (value < 0 || (value == 0 && 1 / value < 0)) {
+            *out++ = '-';
+            value = -value;
+        }
+        if (value == 0) {
+            *out++ = '0';
+            return out;
+        }
+
+        // Fast path: plain decimal notation, which covers anything we would
+        //  reasonably draw.  Scale to a six digit integer and round it; if the
+        //  scaled value is too close to a rounding tie for double arithmetic
+        //  to call, fall through to the exact path below.
+        static const double powers[] = { 1e-4, 1e-3, 1e-2, 1e-1, 1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6 };
+        static const double scales[] = { 1e9, 1e8, 1e7, 1e6, 1e5, 1e4, 1e3, 1e2, 1e1, 1 };
+        if (value >= powers[0] && value < powers[10]) {
+            int exponent = 9;
+            while (value < powers[exponent])
+                --exponent;
+            double scaled = value * scales[exponent];
+            double whole = std::floor(scaled);
+            double fraction = scaled - whole;
+            if (std::fabs(fraction - 0.5) > 1e-6) {
+                long digits = (long)whole + (fraction > 0.5 ? 1 : 0);
+                // Rounding up can carry into a seventh digit.
+                if (digits == 1000000) {
+                    digits = 100000;
+                    ++exponent;
+                }
+                exponent -= 4;
+                if (exponent <= 5) {
+                    char text[6];
+                    for (int i = 5; i >= 0; --i, digits /= 10)
+                        text[i] = (char)('0' + digits % 10);
+                    int last = 5;
+                    int point = exponent + 1;
+                    while (last >= point && last > 0 && text[last] == '0')
+                        --last;
+                    if (point <= 0) {
+                        *out++ = '0';
+                        *out++ = '.';
+                        for (int i = point; i < 0; ++i)
+                            *out++ = '0';
+                        return std::copy(text, text + last + 1, out);
+                    }
+                    for (int i = 0; i <= last; ++i) {
+                        if (i == point)
+                            *out++ = '.';
+                        *out++ = text[i];
+                    }
+                    return out;
+                }
+            }
+        }
+
+        // Exact (and locale independent) fallback.
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+        return std::to_chars(out, out + 31, value, std::chars_format::general, 6).ptr;
+#else
+        int length = std::snprintf(out, 32, "%.6g", value);
+        // Undo any locale specific decimal point.
+        for (int i = 0; i < length; ++i)
+            if (out[i] != '-' && out[i] != '+' && (out[i] < '0' || out[i] > '9') &&
+                (out[i] < 'a' || out[i] > 'z'))
+                out[i] = '.';
+        return out + length;
+#endif
+    }
+
+    // Formats 'value' rounded to 'decimals' (0 to 6) decimal places, without
+    //  trailing zeros (or a trailing '.') and without a "-0".  Writes at most
+    //  32 characters, and returns the end.
+    inline char * formatFixed(char * out, double value, int decimals)
+    {
+        static const long long scales[] = { 1, 10, 100, 1000, 10000, 100000, 1000000 };
+        decimals = std::min(std::max(decimals, 0), 6);
+        long long scale = scales[decimals];
+        double scaled = value * scale;
+        // Beyond what fits in a long long exactly; these aren't coordinates.
+        if (!(std::fabs(scaled) < 9e15))
+            return formatNumber(out, value);
+        long long digits = (long long)std::floor(std::fabs(scaled) + 0.5);
+        if (digits == 0) {
+            *out++ = '0';
+            return out;
+        }
+        if (scaled < 0)
+            *out++ = '-';
+        long long whole = digits / scale;
+        long long fraction = digits % scale;
+        char text[24];
+        int length = 0;
+        do {
+            text[length++] = (char)('0' + whole % 10);
+            whole /= 10;
+        } while (whole > 0);
+        while (length > 0)
+            *out++ = text[--length];
+        if (fraction == 0)
+            return out;
+        *out++ = '.';
+        int places = decimals;
+        while (fraction % 10 == 0) {
+            fraction /= 10;
+            --places;
+        }
+        for (int i = places - 1; i >= 0; --i, fraction /= 10)
+            text[i] = (char)('0' + fraction % 10);
+        return std::copy(text, text + places, out);
+    }
+
+    // A number that isn't a position (a stroke width, radius, font size or
+    //  angle): written to six significant digits even when the Writer rounds
+    //  coordinates to fixed decimal places, so a 0.5px stroke stays 0.5px.
+    struct Exact
+    {
+        explicit Exact(double value) : value(value) { }
+        double value;
+    };
+
+    // The output buffer used to serialize shapes.  Text is appended to a
+    //  single reusable buffer; with a Sink attached the buffer has a fixed
+    //  size and is written out whenever it fills up, otherwise it grows to
+    //  hold everything written.
+    class Writer
+    {
+    public:
+        Writer(Sink * sink = 0, size_t capacity = 4096)
+            : sink(sink), buffer(capacity > 64 ? capacity : 64), used(0), good(true), decimals(-1),
+              relative_paths(false) { }
+
+        // Output precision: with 'places' >= 0, coordinates are written
+        //  rounded to that many decimal places (see formatFixed) rather than
+        //  to six significant digits.  Sizes written as Exact are not.
+        void setDecimals(int places) { decimals = places; }
+        int getDecimals() const { return decimals; }
+        // 'value' as it will be written (for decimal places; otherwise as is).
+        double quantize(double value) const
+        {
+            if (decimals < 0)
+                return value;
+            double scale = std::pow(10.0, std::min(decimals, 6));
+            double scaled = value * scale;
+            return std::fabs(scaled) < 9e15 ? std::floor(scaled + 0.5) / scale : value;
+        }
+        // Whether shapes should write relative path commands where they can
+        //  (see PathPen).
+        void setRelativePaths(bool on) { relative_paths = on; }
+        bool relativePaths() const { return relative_paths; }
+
+        Writer & operator<<(char c)
+        {
+            reserve(1);
+            buffer[used++] = c;
+            return *this;
+        }
+        Writer & operator<<(char const * str)
+        {
+            return append(str, std::strlen(str));
+        }
+        Writer & operator<<(std::string const & str)
+        {
+            return append(str.data(), str.size());
+        }
+        Writer & operator<<(double value)
+        {
+            reserve(32);
+            char * end = decimals < 0 ? formatNumber(&buffer[used], value)
+                : formatFixed(&buffer[used], value, decimals);
+            used = end - &buffer[0];
+            return *this;
+        }
+        Writer & operator<<(Exact number)
+        {
+            reserve(32);
+            used = formatNumber(&buffer[used], number.value) - &buffer[0];
+            return *this;
+        }
+        Writer & operator<<(int value)
+        {
+            reserve(16);
+            unsigned magnitude = value < 0 ? 0u - (unsigned)value : (unsigned)value;
+            char text[16];
+            int length = 0;
+            do {
+                text[length++] = (char)('0' + magnitude % 10);
+                magnitude /= 10;
+            } while (magnitude > 0);
+            if (value < 0)
+                buffer[used++] = '-';
+            while (length > 0)
+                buffer[used++] = text[--length];
+            return *this;
+        }
+        Writer & append(char const * data, size_t size)
+        {
+            if (used + size > buffer.size()) {
+                if (sink && size >= buffer.size()) {
+                    flush();
+                    good = sink->write(data, size) && good;
+                    return *this;
+                }
+                reserve(size);
+            }
+            std::copy(data, data + size, buffer.begin() + used);
+            used += size;
+            return *this;
+        }
+
+        // name="value" pairs, in the same format as attribute() below.
+        template <typename T>
+        Writer & attribute(char const * name, T const & value, char const * unit = "")
+        {
+            return *this << name << "=\"" << value << unit << "\" ";
+        }
+
+        // Pushes buffered text to the sink (if any).  Returns false if any
+        //  write so far has failed.
+        bool flush()
+        {
+            if (sink && used > 0) {
+                good = sink->write(&buffer[0], used) && good;
+                used = 0;
+            }
+            return good;
+        }
+        // Buffered text not yet handed to a sink.
+        std::string str() const { return std::string(buffer.begin(), buffer.begin() + used); }
+        char const * data() const { return &buffer[0]; }
+        size_t size() const { return used; }
+        void clear() { used = 0; }
+    private:
+        // Makes room for 'size' more bytes.
+        void reserve(size_t size)
+        {
+            if (used + size <= buffer.size())
+                return;
+            if (sink)
+                flush();
+            if (used + size > buffer.size())
+                buffer.resize(std::max(buffer.size() * 2, used + size));
+        }
+
+        Sink * sink;
+        std::vector<char> buffer;
+        size_t used;
+        bool good;
+        int decimals;
+        bool relative_paths;
+    };
+
+    // Writes the commands of a path's "d" attribute, in SVG coordinates.  If
+    //  the Writer asks for relative paths, each point after the first is
+    //  written as an offset from the one before ("l3,-4" instead of
+    //  "L103,96", or "h3" for a horizontal line), which is shorter for the
+    //  small steps drawings take.
+    //  Offsets are taken between rounded points, so with a fixed precision
+    //  (Writer::setDecimals) rounding errors don't add up along the path.
+    class PathPen
+    {
+    public:
+        PathPen() : started(false), x(0), y(0), start_x(0), start_y(0) { }
+        void moveTo(Writer & out, double to_x, double to_y)
+        {
+            command(out, 'M', to_x, to_y);
+            start_x = x;
+            start_y = y;
+        }
+        void lineTo(Writer & out, double to_x, double to_y)
+        {
+            command(out, 'L', to_x, to_y);
+        }
+        void close(Writer & out)
+        {
+            out << (out.relativePaths() ? 'z' : 'Z');
+            x = start_x;
+            y = start_y;
+        }
+    private:
+        void command(Writer & out, char name, double to_x, double to_y)
+        {
+            to_x = out.quantize(to_x);
+            to_y = out.quantize(to_y);
+            if (out.relativePaths() && started) {
+                // Horizontal and vertical lines need only one number.
+                if (name == 'L' && to_y == y)
+                    out << 'h' << to_x - x;
+                else if (name == 'L' && to_x == x)
+                    out << 'v' << to_y - y;
+                else
+                    out << (char)(name - 'A' + 'a') << to_x - x << ',' << to_y - y;
+            }
+            else
+                out << name << to_x << ',' << to_y;
+            started = true;
+            x = to_x;
+            y = to_y;
+        }
+        bool started;
+        double x, y;
+        double start_x, start_y;
+    };
+
     class Serializeable
     {
     public:
         Serializeable() { }
         virtual ~Serializeable() { };
-        virtual std::string toString(Layout const & layout) const = 0;
+        // Subclasses override at least one of these two; each is implemented
+        //  in terms of the other.  'write' is the fast path, and is what
+        //  Document uses.
+        virtual std::string toString(Layout const & layout) const
+        {
+            Writer out;
+            write(out, layout);
+            return out.str();
+        }
+        virtual void write(Writer & out, Layout const & layout) const
+        {
+            out << toString(layout);
+        }
     };
 
     class Color : public Serializeable
@@ -224,14 +669,21 @@ namespace svg
             }
         }
         virtual ~Color() { }
-        std::string toString(Layout const &) const
+        bool operator==(Color const & rhs) const
+        {
+            return transparent == rhs.transparent && red == rhs.red && green == rhs.green &&
+                blue == rhs.blue;
+        }
+        bool isTransparent() const { return transparent; }
+        int getRed() const { return red; }
+        int getGreen() const { return green; }
+        int getBlue() const { return blue; }
+        void write(Writer & out, Layout const &) const
         {
-            std::stringstream ss;
             if (transparent)
-                ss << "none";
+                out << "none";
             else
-                ss << "rgb(" << red << "," << green << "," << blue << ")";
-            return ss.str();
+                out << "rgb(" << red << ',' << green << ',' << blue << ')';
         }
     private:
             bool transparent;
@@ -253,11 +705,12 @@ namespace svg
         Fill(Color::Defaults color) : color(color) { }
         Fill(Color color = Color::Transparent)
             : color(color) { }
-        std::string toString(Layout const & layout) const
+        Color const & getColor() const { return color; }
+        void write(Writer & out, Layout const & layout) const
         {
-            std::stringstream ss;
-            ss << attribute("fill", color.toString(layout));
-            return ss.str();
+            out << "fill=\"";
+            color.write(out, layout);
+            out << "\" ";
         }
     private:
         Color color;
@@ -268,15 +721,24 @@ namespace svg
     public:
         Stroke(double width = -1, Color color = Color::Transparent)
             : width(width), color(color) { }
-        std::string toString(Layout const & layout) const
+        bool operator==(Stroke const & rhs) const
+        {
+            return width == rhs.width && color == rhs.color;
+        }
+        // Whether it draws anything.
+        bool visible() const { return width >= 0 && !color.isTransparent(); }
+        double getWidth() const { return width; }
+        Color const & getColor() const { return color; }
+        void write(Writer & out, Layout const & layout) const
         {
             // If stroke width is invalid.
             if (width < 0)
-                return std::string();
+                return;
 
-            std::stringstream ss;
-            ss << attribute("stroke-width", translateScale(width, layout)) << attribute("stroke", color.toString(layout));
-            return ss.str();
+            out.attribute("stroke-width", Exact(translateScale(width, layout)));
+            out << "stroke=\"";
+            color.write(out, layout);
+            out << "\" ";
         }
     private:
         double width;
@@ -287,25 +749,138 @@ namespace svg
     {
     public:
         Font(double size = 12, std::string const & family = "Verdana") : size(size), family(family) { }
-        std::string toString(Layout const & layout) const
+        void write(Writer & out, Layout const & layout) const
         {
-            std::stringstream ss;
-            ss << attribute("font-size", translateScale(size, layout)) << attribute("font-family", family);
-            return ss.str();
+            out.attribute("font-size", Exact(translateScale(size, layout))).attribute("font-family", family);
         }
     private:
         double size;
         std::string family;
     };
 
+    // Closed contours in SVG native (pixel) coordinates, to be filled.
+    struct Outline
+    {
+        std::vector<Point> points;
+        // One past the last point of each contour.
+        std::vector<size_t> ends;
+        void clear()
+        {
+            points.clear();
+            ends.clear();
+        }
+        void add(Point const & point) { points.push_back(point); }
+        // Ends the current contour.
+        void close()
+        {
+            if (points.size() > (ends.empty() ? 0 : ends.back()))
+                ends.push_back(points.size());
+        }
+    };
+
+    // Draws shapes as filled outlines instead of writing them as SVG; see
+    //  Document(Painter &, Layout).  Strokes become outlines too: a line is
+    //  the rectangle its stroke covers (with butt ends), a stroked circle a
+    //  ring.  Text isn't painted.
+    class Painter
+    {
+    public:
+        virtual ~Painter() { }
+        // Fills 'outline' with the nonzero or even-odd rule.
+        virtual void fill(Outline const & outline, Color const & color, bool even_odd) = 0;
+        // A cleared outline for a shape to build, reused from shape to shape.
+        Outline & outline()
+        {
+            scratch.clear();
+            return scratch;
+        }
+    private:
+        Outline scratch;
+    };
+
+    // Number of segments to approximate a circle of 'radius' pixels by, so
+    //  that it is off by no more than 0.05 pixels.
+    inline int circleSegments(double radius)
+    {
+        if (radius <= 0.05)
+            return 8;
+        int segments = (int)std::ceil(M_PI / std::acos(1 - 0.05 / radius));
+        return std::min(std::max(segments, 8), 2048);
+    }
+    // Adds the area that stroking 'a' to 'b' (SVG coordinates) with 'width'
+    //  pixels covers.
+    inline void addStrokedSegment(Outline & outline, Point const & a, Point const & b, double width)
+    {
+        double dx = b.x - a.x, dy = b.y - a.y;
+        double length = std::sqrt(dx * dx + dy * dy);
+        if (length == 0)
+            return;
+        Point normal(-dy / length * width / 2, dx / length * width / 2);
+        outline.add(a + normal);
+        outline.add(b + normal);
+        outline.add(b - normal);
+        outline.add(a - normal);
+        outline.close();
+    }
+    // Adds an arc of 'radius' around 'center' (user coordinates) from angle
+    //  'start' to 'end', as a contour; with 'width', the ring segment its
+    //  stroke covers.
+    inline void addArc(Outline & outline, Point const & center, double radius, double start, double end,
+                       Layout const & layout, double width = 0)
+    {
+        double sweep = end - start;
+        int segments = std::max(1, (int)std::ceil(circleSegments(translateScale(radius + width / 2, layout))
+                                                  * std::fabs(sweep) / (2 * M_PI)));
+        for (int side = 0; side < (width > 0 ? 2 : 1); ++side) {
+            double r = width > 0 ? radius + (side == 0 ? width : -width) / 2 : radius;
+            for (int i = 0; i <= segments; ++i) {
+                double angle = side == 0 ? start + sweep * i / segments : end - sweep * i / segments;
+                outline.add(Point(translateX(center.x + r * std::cos(angle), layout),
+                                  translateY(center.y + r * std::sin(angle), layout)));
+            }
+        }
+        outline.close();
+    }
+
+    // 'points' in SVG native coordinates.
+    inline std::vector<Point> translatePoints(std::vector<Point> const & points, Layout const & layout)
+    {
+        std::vector<Point> translated(points.size());
+        for (size_t i = 0; i < points.size(); ++i)
+            translated[i] = Point(translateX(points[i].x, layout), translateY(points[i].y, layout));
+        return translated;
+    }
+    // Fills the polygon 'points' (SVG coordinates) if 'closed', then strokes
+    //  the lines between them ('scale' times as wide as the stroke says).
+    inline void paintPoints(Painter & painter, std::vector<Point> const & points, bool closed,
+                            Fill const & fill, Stroke const & stroke, double scale)
+    {
+        if (points.empty())
+            return;
+        if (closed && !fill.getColor().isTransparent()) {
+            Outline & outline = painter.outline();
+            outline.points = points;
+            outline.close();
+            painter.fill(outline, fill.getColor(), false);
+        }
+        if (stroke.visible()) {
+            Outline & outline = painter.outline();
+            size_t segments = closed ? points.size() : points.size() - 1;
+            for (size_t i = 0; i < segments; ++i)
+                addStrokedSegment(outline, points[i], points[(i + 1) % points.size()], stroke.getWidth() * scale);
+            painter.fill(outline, stroke.getColor(), false);
+        }
+    }
+
     class Shape : public Serializeable
     {
     public:
         Shape(Fill const & fill = Fill(), Stroke const & stroke = Stroke())
             : fill(fill), stroke(stroke) { }
         virtual ~Shape() { }
-        virtual std::string toString(Layout const & layout) const = 0;
         virtual void offset(Point const & offset) = 0;
+        // Draws the shape with 'painter'; by default, nothing.
+        virtual void paint(Painter &, Layout const &) const { }
     protected:
         Fill fill;
         Stroke stroke;
@@ -326,14 +901,32 @@ namespace svg
         Circle(Point const & center, double diameter, Fill const & fill,
             Stroke const & stroke = Stroke())
             : Shape(fill, stroke), center(center), radius(diameter / 2) { }
-        std::string toString(Layout const & layout) const
+        void write(Writer & out, Layout const & layout) const
         {
-            std::stringstream ss;
-            ss << elemStart("circle") << attribute("cx", translateX(center.x, layout))
-                << attribute("cy", translateY(center.y, layout))
-                << attribute("r", translateScale(radius, layout)) << fill.toString(layout)
-                << stroke.toString(layout) << emptyElemEnd();
-            return ss.str();
+            out << "\t<circle ";
+            out.attribute("cx", translateX(center.x, layout))
+                .attribute("cy", translateY(center.y, layout))
+                .attribute("r", Exact(translateScale(radius, layout)));
+            fill.write(out, layout);
+            stroke.write(out, layout);
+            out << "/>\n";
+        }
+        void paint(Painter & painter, Layout const & layout) const
+        {
+            if (!fill.getColor().isTransparent()) {
+                Outline & outline = painter.outline();
+                addArc(outline, center, radius, 0, 2 * M_PI, layout);
+                painter.fill(outline, fill.getColor(), false);
+            }
+            if (stroke.visible()) {
+                // A ring: the inner circle, the other way round, cancels out.
+                Outline & outline = painter.outline();
+                double width = stroke.getWidth();
+                addArc(outline, center, radius + width / 2, 0, 2 * M_PI, layout);
+                if (radius > width / 2)
+                    addArc(outline, center, radius - width / 2, 2 * M_PI, 0, layout);
+                painter.fill(outline, stroke.getColor(), false);
+            }
         }
         void offset(Point const & offset)
         {
@@ -353,11 +946,10 @@ namespace svg
             Stroke const & stroke = Stroke())
             : Shape(Fill(), stroke), center(center), start_angle(start_angle),
               end_angle(end_angle), radius(radius) { }
-        std::string toString(Layout const & layout) const
+        void write(Writer & out, Layout const & layout) const
         {
         //<path d="M275,175 v-150 a150,150 0 0,0 -150,150 z"
         //        fill="yellow" stroke="blue" stroke-width="5" />
-            std::stringstream path;
             // Calculate start and end points:
             double scale_radius = translateScale(radius, layout);
             Point arc_start(center.x + scale_radius * cos(start_angle),
@@ -366,18 +958,22 @@ namespace svg
                           center.y + scale_radius * sin(end_angle));
             bool large_angle = (end_angle - start_angle) > M_PI;
             bool sweep = (end_angle - start_angle) > 0;
-            path << "M" << translateX(arc_start.x, layout) << "," <<
-                           translateY(arc_start.y, layout) << " " <<
-                           "A" << scale_radius << "," << scale_radius << " 0 " <<
-                           (large_angle ? "1" : "0") << "," <<
-                           (sweep ? "0" : "1") << " " <<
-                           translateX(arc_end.x, layout) << "," <<
-                           translateY(arc_end.y, layout);
-            // Entire element
-            std::stringstream ss;
-            ss << elemStart("path") << attribute("d", path.str())
-                << fill.toString(layout) << stroke.toString(layout) << emptyElemEnd();
-            return ss.str();
+            out << "\t<path d=\"M" << translateX(arc_start.x, layout) << ','
+                << translateY(arc_start.y, layout) << " A" << Exact(scale_radius) << ','
+                << Exact(scale_radius) << " 0 " << (large_angle ? "1" : "0") << ','
+                << (sweep ? "0" : "1") << ' ' << translateX(arc_end.x, layout) << ','
+                << translateY(arc_end.y, layout) << "\" ";
+            fill.write(out, layout);
+            stroke.write(out, layout);
+            out << "/>\n";
+        }
+        void paint(Painter & painter, Layout const & layout) const
+        {
+            if (!stroke.visible())
+                return;
+            Outline & outline = painter.outline();
+            addArc(outline, center, radius, start_angle, end_angle, layout, stroke.getWidth());
+            painter.fill(outline, stroke.getColor(), false);
         }
         void offset(Point const & offset)
         {
@@ -398,15 +994,25 @@ namespace svg
             Fill const & fill = Fill(), Stroke const & stroke = Stroke())
             : Shape(fill, stroke), center(center), radius_width(width / 2),
             radius_height(height / 2) { }
-        std::string toString(Layout const & layout) const
+        void write(Writer & out, Layout const & layout) const
         {
-            std::stringstream ss;
-            ss << elemStart("ellipse") << attribute("cx", translateX(center.x, layout))
-                << attribute("cy", translateY(center.y, layout))
-                << attribute("rx", translateScale(radius_width, layout))
-                << attribute("ry", translateScale(radius_height, layout))
-                << fill.toString(layout) << stroke.toString(layout) << emptyElemEnd();
-            return ss.str();
+            out << "\t<ellipse ";
+            out.attribute("cx", translateX(center.x, layout))
+                .attribute("cy", translateY(center.y, layout))
+                .attribute("rx", Exact(translateScale(radius_width, layout)))
+                .attribute("ry", Exact(translateScale(radius_height, layout)));
+            fill.write(out, layout);
+            stroke.write(out, layout);
+            out << "/>\n";
+        }
+        void paint(Painter & painter, Layout const & layout) const
+        {
+            int segments = circleSegments(translateScale(std::max(radius_width, radius_height), layout));
+            std::vector<Point> points(segments);
+            for (int i = 0; i < segments; ++i)
+                points[i] = Point(center.x + radius_width * std::cos(2 * M_PI * i / segments),
+                                  center.y + radius_height * std::sin(2 * M_PI * i / segments));
+            paintPoints(painter, translatePoints(points, layout), true, fill, stroke, layout.scale);
         }
         void offset(Point const & offset)
         {
@@ -426,15 +1032,28 @@ namespace svg
             Fill const & fill = Fill(), Stroke const & stroke = Stroke())
             : Shape(fill, stroke), edge(edge), width(width),
             height(height) { }
-        std::string toString(Layout const & layout) const
+        void write(Writer & out, Layout const & layout) const
+        {
+            out << "\t<rect ";
+            out.attribute("x", translateX(edge.x, layout))
+                .attribute("y", translateY(edge.y, layout))
+                .attribute("width", Exact(translateScale(width, layout)))
+                .attribute("height", Exact(translateScale(height, layout)));
+            fill.write(out, layout);
+            stroke.write(out, layout);
+            out << "/>\n";
+        }
+        void paint(Painter & painter, Layout const & layout) const
         {
-            std::stringstream ss;
-            ss << elemStart("rect") << attribute("x", translateX(edge.x, layout))
-                << attribute("y", translateY(edge.y, layout))
-                << attribute("width", translateScale(width, layout))
-                << attribute("height", translateScale(height, layout))
-                << fill.toString(layout) << stroke.toString(layout) << emptyElemEnd();
-            return ss.str();
+            // As written: 'edge' is the top left corner on the page.
+            double x = translateX(edge.x, layout), y = translateY(edge.y, layout);
+            double w = translateScale(width, layout), h = translateScale(height, layout);
+            std::vector<Point> points;
+            points.push_back(Point(x, y));
+            points.push_back(Point(x + w, y));
+            points.push_back(Point(x + w, y + h));
+            points.push_back(Point(x, y + h));
+            paintPoints(painter, points, true, fill, stroke, layout.scale);
         }
         void offset(Point const & offset)
         {
@@ -454,15 +1073,25 @@ namespace svg
             Stroke const & stroke = Stroke())
             : Shape(Fill(), stroke), start_point(start_point),
             end_point(end_point) { }
-        std::string toString(Layout const & layout) const
+        void write(Writer & out, Layout const & layout) const
+        {
+            out << "\t<line ";
+            out.attribute("x1", translateX(start_point.x, layout))
+                .attribute("y1", translateY(start_point.y, layout))
+                .attribute("x2", translateX(end_point.x, layout))
+                .attribute("y2", translateY(end_point.y, layout));
+            stroke.write(out, layout);
+            out << "/>\n";
+        }
+        void paint(Painter & painter, Layout const & layout) const
         {
-            std::stringstream ss;
-            ss << elemStart("line") << attribute("x1", translateX(start_point.x, layout))
-                << attribute("y1", translateY(start_point.y, layout))
-                << attribute("x2", translateX(end_point.x, layout))
-                << attribute("y2", translateY(end_point.y, layout))
-                << stroke.toString(layout) << emptyElemEnd();
-            return ss.str();
+            if (!stroke.visible())
+                return;
+            Outline & outline = painter.outline();
+            addStrokedSegment(outline, Point(translateX(start_point.x, layout), translateY(start_point.y, layout)),
+                              Point(translateX(end_point.x, layout), translateY(end_point.y, layout)),
+                              translateScale(stroke.getWidth(), layout));
+            painter.fill(outline, stroke.getColor(), false);
         }
         void offset(Point const & offset)
         {
@@ -472,11 +1101,23 @@ namespace svg
             end_point.x += offset.x;
             end_point.y += offset.y;
         }
+        Point const & startPoint() const { return start_point; }
+        Point const & endPoint() const { return end_point; }
+        Stroke const & getStroke() const { return stroke; }
     private:
         Point start_point;
         Point end_point;
     };
 
+    // The points of a Polyline or Polygon as path commands (see PathPen).
+    inline void writeRelative(Writer & out, std::vector<Point> const & points, Layout const & layout)
+    {
+        PathPen pen;
+        pen.moveTo(out, translateX(points[0].x, layout), translateY(points[0].y, layout));
+        for (unsigned i = 1; i < points.size(); ++i)
+            pen.lineTo(out, translateX(points[i].x, layout), translateY(points[i].y, layout));
+    }
+
     class Polygon : public Shape
     {
     public:
@@ -488,18 +1129,28 @@ namespace svg
             points.push_back(point);
             return *this;
         }
-        std::string toString(Layout const & layout) const
+        void write(Writer & out, Layout const & layout) const
         {
-            std::stringstream ss;
-            ss << elemStart("polygon");
-
-            ss << "points=\"";
-            for (unsigned i = 0; i < points.size(); ++i)
-                ss << translateX(points[i].x, layout) << "," << translateY(points[i].y, layout) << " ";
-            ss << "\" ";
-
-            ss << fill.toString(layout) << stroke.toString(layout) << emptyElemEnd();
-            return ss.str();
+            if (out.relativePaths() && !points.empty()) {
+                // The same shape, as a closed relative path.
+                out << "\t<path d=\"";
+                writeRelative(out, points, layout);
+                PathPen().close(out);
+                out << "\" ";
+            }
+            else {
+                out << "\t<polygon points=\"";
+                for (unsigned i = 0; i < points.size(); ++i)
+                    out << translateX(points[i].x, layout) << ',' << translateY(points[i].y, layout) << ' ';
+                out << "\" ";
+            }
+            fill.write(out, layout);
+            stroke.write(out, layout);
+            out << "/>\n";
+        }
+        void paint(Painter & painter, Layout const & layout) const
+        {
+            paintPoints(painter, translatePoints(points, layout), true, fill, stroke, layout.scale);
         }
         void offset(Point const & offset)
         {
@@ -526,18 +1177,30 @@ namespace svg
             points.push_back(point);
             return *this;
         }
-        std::string toString(Layout const & layout) const
+        void write(Writer & out, Layout const & layout) const
         {
-            std::stringstream ss;
-            ss << elemStart("polyline");
-
-            ss << "points=\"";
-            for (unsigned i = 0; i < points.size(); ++i)
-                ss << translateX(points[i].x, layout) << "," << translateY(points[i].y, layout) << " ";
-            ss << "\" ";
-
-            ss << fill.toString(layout) << stroke.toString(layout) << emptyElemEnd();
-            return ss.str();
+            if (out.relativePaths() && !points.empty()) {
+                // The same shape, as a relative path.
+                out << "\t<path d=\"";
+                writeRelative(out, points, layout);
+                out << "\" ";
+            }
+            else {
+                out << "\t<polyline points=\"";
+                for (unsigned i = 0; i < points.size(); ++i)
+                    out << translateX(points[i].x, layout) << ',' << translateY(points[i].y, layout) << ' ';
+                out << "\" ";
+            }
+            fill.write(out, layout);
+            stroke.write(out, layout);
+            out << "/>\n";
+        }
+        void paint(Painter & painter, Layout const & layout) const
+        {
+            // Like SVG, a polyline is filled as if closed, but not stroked so.
+            std::vector<Point> translated = translatePoints(points, layout);
+            paintPoints(painter, translated, true, fill, Stroke(), layout.scale);
+            paintPoints(painter, translated, false, Fill(), stroke, layout.scale);
         }
         void offset(Point const & offset)
         {
@@ -549,20 +1212,127 @@ namespace svg
         std::vector<Point> points;
     };
 
+    // A path of one or more closed subpaths, filled with the even-odd rule so
+    //  that subpaths inside others become holes.
+    class Path : public Shape
+    {
+    public:
+        Path(Fill const & fill = Fill(), Stroke const & stroke = Stroke())
+            : Shape(fill, stroke), paths(1) { }
+        Path(Stroke const & stroke = Stroke()) : Shape(Color::Transparent, stroke), paths(1) { }
+        Path & operator<<(Point const & point)
+        {
+            paths.back().push_back(point);
+            return *this;
+        }
+        void startNewSubPath()
+        {
+            if (!paths.back().empty())
+                paths.push_back(std::vector<Point>());
+        }
+        void write(Writer & out, Layout const & layout) const
+        {
+            out << "\t<path d=\"";
+            PathPen pen;
+            for (unsigned i = 0; i < paths.size(); ++i) {
+                if (paths[i].empty())
+                    continue;
+                if (out.relativePaths()) {
+                    pen.moveTo(out, translateX(paths[i][0].x, layout), translateY(paths[i][0].y, layout));
+                    for (unsigned j = 1; j < paths[i].size(); ++j)
+                        pen.lineTo(out, translateX(paths[i][j].x, layout), translateY(paths[i][j].y, layout));
+                    pen.close(out);
+                    continue;
+                }
+                out << 'M';
+                for (unsigned j = 0; j < paths[i].size(); ++j)
+                    out << translateX(paths[i][j].x, layout) << ',' << translateY(paths[i][j].y, layout) << ' ';
+                out << "z ";
+            }
+            out << "\" fill-rule=\"evenodd\" ";
+            fill.write(out, layout);
+            stroke.write(out, layout);
+            out << "/>\n";
+        }
+        void paint(Painter & painter, Layout const & layout) const
+        {
+            if (!fill.getColor().isTransparent()) {
+                Outline & outline = painter.outline();
+                for (unsigned i = 0; i < paths.size(); ++i) {
+                    for (unsigned j = 0; j < paths[i].size(); ++j)
+                        outline.add(Point(translateX(paths[i][j].x, layout), translateY(paths[i][j].y, layout)));
+                    outline.close();
+                }
+                painter.fill(outline, fill.getColor(), true);
+            }
+            if (stroke.visible())
+                for (unsigned i = 0; i < paths.size(); ++i)
+                    paintPoints(painter, translatePoints(paths[i], layout), true, Fill(), stroke, layout.scale);
+        }
+        void offset(Point const & offset)
+        {
+            for (unsigned i = 0; i < paths.size(); ++i)
+                for (unsigned j = 0; j < paths[i].size(); ++j) {
+                    paths[i][j].x += offset.x;
+                    paths[i][j].y += offset.y;
+                }
+        }
+    private:
+        std::vector<std::vector<Point> > paths;
+    };
+
+    // Places a symbol (see Document::beginSymbol) with its origin at
+    //  'position', turned by 'rotation' radians (counterclockwise in user
+    //  space, whichever way the layout's axes point).  The document has to
+    //  declare the xlink namespace; see xlinkNamespace.
+    class Use : public Shape
+    {
+    public:
+        Use(std::string const & id, Point const & position, double rotation = 0)
+            : id(id), position(position), rotation(rotation) { }
+        void write(Writer & out, Layout const & layout) const
+        {
+            out << "\t<use xlink:href=\"#" << id << "\" transform=\"translate("
+                << translateX(position.x, layout) << ',' << translateY(position.y, layout) << ')';
+            if (rotation != 0) {
+                // Mirroring one axis reverses the sense of rotation.
+                bool mirrored = layout.origin == Layout::BottomLeft || layout.origin == Layout::TopRight;
+                out << " rotate(" << Exact((mirrored ? -rotation : rotation) * (180 / M_PI)) << ')';
+            }
+            out << "\"/>\n";
+        }
+        void offset(Point const & offset)
+        {
+            position.x += offset.x;
+            position.y += offset.y;
+        }
+    private:
+        std::string id;
+        Point position;
+        double rotation;
+    };
+
+    // Attribute declaring the xlink namespace, for a group around Use shapes.
+    inline char const * xlinkNamespace()
+    {
+        return "xmlns:xlink=\"http://www.w3.org/1999/xlink\"";
+    }
+
     class Text : public Shape
     {
     public:
         Text(Point const & origin, std::string const & content, Fill const & fill = Fill(),
              Font const & font = Font(), Stroke const & stroke = Stroke())
             : Shape(fill, stroke), origin(origin), content(content), font(font) { }
-        std::string toString(Layout const & layout) const
+        void write(Writer & out, Layout const & layout) const
         {
-            std::stringstream ss;
-            ss << elemStart("text") << attribute("x", translateX(origin.x, layout))
-                << attribute("y", translateY(origin.y, layout))
-                << fill.toString(layout) << stroke.toString(layout) << font.toString(layout)
-                << ">" << content << elemEnd("text");
-            return ss.str();
+            out << "\t<text ";
+            out.attribute("x", translateX(origin.x, layout))
+                .attribute("y", translateY(origin.y, layout));
+            fill.write(out, layout);
+            stroke.write(out, layout);
+            font.write(out, layout);
+            out << '>' << content << "</text>\n";
         }
         void offset(Point const & offset)
         {
@@ -666,40 +1436,254 @@ namespace svg
     {
     public:
         Document(std::string const & file_name, Layout layout = Layout())
-            : file_name(file_name), layout(layout) { }
+            : file_name(file_name), layout(layout), body(0), streaming(false), closed(false),
+              painter(0), in_defs(false), symbol(false), batch_lines(false), batching(false) { }
+        // Streaming mode: the header is written now, each shape as it is
+        //  added, and the closing tag on save().  Only 'buffer_size' bytes of
+        //  output are held at any time.
+        Document(Sink & sink, Layout layout = Layout(), size_t buffer_size = 64 * 1024)
+            : layout(layout), body(&sink, buffer_size), streaming(true), closed(false), painter(0),
+              in_defs(false), symbol(false), batch_lines(false), batching(false)
+        {
+            writeHeader(body);
+        }
+        // Painting mode: every shape is drawn with 'painter' as it is added,
+        //  and nothing is written.  Definitions (see beginDefs) aren't drawn,
+        //  and neither is Use, so draw glyphs in full.
+        Document(Painter & painter, Layout layout = Layout())
+            : layout(layout), body(0, 64), streaming(false), closed(false), painter(&painter),
+              in_defs(false), symbol(false), batch_lines(false), batching(false) { }
 
         Document & operator<<(Shape const & shape)
         {
-            body_nodes_str += shape.toString(layout);
+            if (painter) {
+                if (!in_defs)
+                    shape.paint(*painter, layout);
+                return *this;
+            }
+            endLines();
+            shape.write(body, symbol ? symbol_layout : layout);
             return *this;
         }
+        // With line batching on, a run of Lines with the same stroke is
+        //  written as a single <path>, and a line that starts where the one
+        //  before it ended continues the same subpath.  (So such corners get
+        //  the stroke's line join, rather than two butt ends.)  Off by default.
+        Document & operator<<(Line const & line)
+        {
+            if (!batch_lines || painter)
+                return *this << static_cast<Shape const &>(line);
+            Layout const & current = symbol ? symbol_layout : layout;
+            Point const & start = line.startPoint();
+            Point const & end = line.endPoint();
+            if (batching && !(line.getStroke() == batch_stroke))
+                endLines();
+            if (!batching) {
+                body << "\t<path d=\"";
+                batching = true;
+                batch_stroke = line.getStroke();
+                batch_pen = PathPen();
+            }
+            else if (start.x == batch_end.x && start.y == batch_end.y) {
+                batch_pen.lineTo(body, translateX(end.x, current), translateY(end.y, current));
+                batch_end = end;
+                return *this;
+            }
+            batch_pen.moveTo(body, translateX(start.x, current), translateY(start.y, current));
+            batch_pen.lineTo(body, translateX(end.x, current), translateY(end.y, current));
+            batch_end = end;
+            return *this;
+        }
+        void setLineBatching(bool on)
+        {
+            endLines();
+            batch_lines = on;
+        }
+        // Numbers are written rounded to 'decimals' places (or, with -1, the
+        //  default, to six significant digits).  See Writer::setDecimals.
+        void setPrecision(int decimals)
+        {
+            endLines();
+            body.setDecimals(decimals);
+        }
+        // Paths, and Polylines and Polygons as paths, are written with
+        //  relative commands.  Off by default.
+        void setRelativePaths(bool on)
+        {
+            endLines();
+            body.setRelativePaths(on);
+        }
+
+        // A <g> element around the shapes added until endGroup();
+        //  'attributes' are written as is.
+        Document & beginGroup(std::string const & attributes = "")
+        {
+            if (painter)
+                return *this;
+            endLines();
+            body << "\t<g";
+            if (!attributes.empty())
+                body << ' ' << attributes;
+            body << ">\n";
+            return *this;
+        }
+        Document & endGroup()
+        {
+            if (painter)
+                return *this;
+            endLines();
+            body << "\t</g>\n";
+            return *this;
+        }
+        // Shapes between these are only definitions, which aren't drawn.
+        Document & beginDefs()
+        {
+            in_defs = true;
+            if (painter)
+                return *this;
+            endLines();
+            body << "\t<defs>\n";
+            return *this;
+        }
+        Document & endDefs()
+        {
+            in_defs = false;
+            if (painter)
+                return *this;
+            endLines();
+            body << "\t</defs>\n";
+            return *this;
+        }
+        // A named glyph, to be drawn wherever it is placed with Use; it has to
+        //  be inside <defs>.  Shapes added until endSymbol() are in the
+        //  glyph's own coordinates: scaled and oriented like the document, but
+        //  with (0, 0) at the glyph's origin.
+        Document & beginSymbol(std::string const & id)
+        {
+            if (painter)
+                return *this;
+            endLines();
+            body << "\t<g id=\"" << id << "\">\n";
+            symbol = true;
+            symbol_layout = Layout(Dimensions(0, 0), layout.origin, layout.scale);
+            return *this;
+        }
+        Document & endSymbol()
+        {
+            if (painter)
+                return *this;
+            endLines();
+            symbol = false;
+            return endGroup();
+        }
+        // An empty in-memory document with the same layout and settings, for
+        //  drawing a part of this one separately (on another thread, say) and
+        //  adding it back in place with append().  With line batching, runs
+        //  of lines are split where parts meet.
+        Document part() const
+        {
+            Document part(file_name, layout);
+            part.body.setDecimals(body.getDecimals());
+            part.body.setRelativePaths(body.relativePaths());
+            part.in_defs = in_defs;
+            part.symbol = symbol;
+            part.symbol_layout = symbol_layout;
+            part.batch_lines = batch_lines;
+            return part;
+        }
+        // Adds the shapes drawn on 'part' (see above).
+        Document & append(Document const & part)
+        {
+            if (painter)
+                return *this;
+            endLines();
+            part.endLines();
+            body.append(part.body.data(), part.body.size());
+            return *this;
+        }
+        // Whether shapes are painted (see the painting constructor) rather
+        //  than written, in which case parts can't be used.
+        bool painting() const { return painter != 0; }
+
+        // Not available in streaming mode, as the body is never kept; returns
+        //  whatever is still buffered there.
         std::string toString() const
         {
-            std::stringstream ss;
-            ss << "<?xml " << attribute("version", "1.0") << attribute("standalone", "no")
-                << "?>\n<!DOCTYPE svg PUBLIC \"-//W3C//DTD SVG 1.1//EN\" "
-                << "\"http://www.w3.org/Graphics/SVG/1.1/DTD/svg11.dtd\">\n<svg "
-                << attribute("width", layout.dimensions.width, "px")
-                << attribute("height", layout.dimensions.height, "px")
-                << attribute("xmlns", "http://www.w3.org/2000/svg")
-                << attribute("version", "1.1") << ">\n" << body_nodes_str << elemEnd("svg");
-            return ss.str();
+            endLines();
+            Writer out(0, body.size() + 512);
+            writeHeader(out);
+            out.append(body.data(), body.size());
+            out << "</svg>\n";
+            return out.str();
         }
+        // In painting mode there is nothing to save, and this returns true.
         bool save() const
         {
-            std::ofstream ofs(file_name.c_str());
-            if (!ofs.good())
-                return false;
+            if (painter)
+                return true;
+            endLines();
+            if (!streaming) {
+                FileSink sink(file_name);
+                if (!sink.good())
+                    return false;
+                Writer out(&sink, 64 * 1024);
+                writeHeader(out);
+                out.append(body.data(), body.size());
+                out << "</svg>\n";
+                return sink.close(out.flush());
+            }
 
-            ofs << toString();
-            ofs.close();
-            return true;
+            if (!closed) {
+                body << "</svg>\n";
+                closed = true;
+            }
+            return body.flush();
         }
     private:
+        // Finishes the <path> of any batched lines.
+        void endLines() const
+        {
+            if (!batching)
+                return;
+            body << "\" fill=\"none\" ";
+            batch_stroke.write(body, symbol ? symbol_layout : layout);
+            body << "/>\n";
+            batching = false;
+        }
+
+        void writeHeader(Writer & out) const
+        {
+            out << "<?xml version=\"1.0\" standalone=\"no\" ?>\n"
+                << "<!DOCTYPE svg PUBLIC \"-//W3C//DTD SVG 1.1//EN\" "
+                << "\"http://www.w3.org/Graphics/SVG/1.1/DTD/svg11.dtd\">\n<svg ";
+            out.attribute("width", Exact(layout.dimensions.width), "px")
+                .attribute("height", Exact(layout.dimensions.height), "px")
+                .attribute("xmlns", "http://www.w3.org/2000/svg")
+                .attribute("version", "1.1") << ">\n";
+        }
+
         std::string file_name;
         Layout layout;
 
-        std::string body_nodes_str;
+        // In memory mode this holds the whole body; in streaming mode it is
+        //  the fixed-size output buffer.  Closing a stream is a side effect
+        //  rather than part of the document's value, so save() can stay const.
+        mutable Writer body;
+        bool streaming;
+        mutable bool closed;
+        Painter * painter;
+        // Set between beginDefs and endDefs.
+        bool in_defs;
+        // Set between beginSymbol and endSymbol.
+        bool symbol;
+        Layout symbol_layout;
+        // Line batching: whether it is on, whether a <path> is open, and its
+        //  stroke, current end point and pen.
+        bool batch_lines;
+        mutable bool batching;
+        Stroke batch_stroke;
+        Point batch_end;
+        PathPen batch_pen;
     };
 }
 
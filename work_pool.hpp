@@ -0,0 +1,217 @@
+#ifndef WORK_POOL_HPP
+#define WORK_POOL_HPP
+
+#include <deque>
+#include <vector>
+#include <cstddef>
+
+#include <pthread.h>
+
+namespace rob_diag
+{
+
+// A unit of work for the pool; 'run' is called once for each index handed to
+// WorkPool::run.  'worker' is in [0, pool.size()) and can be used to index
+// per-thread scratch state.
+class WorkTask
+{
+public:
+  virtual void run(size_t index, unsigned worker) = 0;
+  virtual ~WorkTask() {};
+};
+
+// A small work-stealing thread pool.  Each worker owns a deque of task
+// indices; it takes work from the front of its own deque, and when that runs
+// dry it steals from the back of the other workers' deques.  The calling
+// thread acts as worker 0, so a pool of size 1 runs everything inline and
+// creates no threads.
+//
+// Threads are created once and reused across calls to 'run'.  If the system
+// won't start as many as asked for, the pool is as big as the threads it got
+// (see size()).
+class WorkPool
+{
+public:
+  explicit WorkPool(unsigned num_workers = 1)
+    : num_workers_(num_workers == 0 ? 1 : num_workers), queues_(num_workers_),
+      task_(NULL), generation_(0), busy_(0), shutdown_(false)
+  {
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&start_cond_, NULL);
+    pthread_cond_init(&done_cond_, NULL);
+    for (unsigned i = 0; i < num_workers_; ++i)
+      pthread_mutex_init(&queues_[i].mutex_, NULL);
+    thread_args_.resize(num_workers_);
+    threads_.resize(num_workers_);
+    unsigned started = 1;
+    for (; started < num_workers_; ++started)
+    {
+      thread_args_[started].pool_ = this;
+      thread_args_[started].worker_ = started;
+      if (pthread_create(&threads_[started], NULL, &WorkPool::thread_main, &thread_args_[started]) != 0)
+        break;
+    }
+    // The started threads only look at the size once 'run' wakes them.
+    pthread_mutex_lock(&mutex_);
+    num_workers_ = started;
+    pthread_mutex_unlock(&mutex_);
+  }
+  ~WorkPool()
+  {
+    pthread_mutex_lock(&mutex_);
+    shutdown_ = true;
+    pthread_cond_broadcast(&start_cond_);
+    pthread_mutex_unlock(&mutex_);
+    for (unsigned i = 1; i < num_workers_; ++i)
+      pthread_join(threads_[i], NULL);
+    for (unsigned i = 0; i < queues_.size(); ++i)
+      pthread_mutex_destroy(&queues_[i].mutex_);
+    pthread_cond_destroy(&done_cond_);
+    pthread_cond_destroy(&start_cond_);
+    pthread_mutex_destroy(&mutex_);
+  }
+
+  unsigned size() const { return num_workers_; }
+
+  // Runs 'task' once for each index in 'order' and blocks until all of them
+  // have finished.  Indices earlier in 'order' are started first (modulo
+  // stealing), so callers should put the most expensive work first.
+  void run(WorkTask& task, const std::vector<size_t>& order)
+  {
+    // Deal the work out round-robin, so the front of every deque holds the
+    // most expensive of its remaining work.
+    for (size_t i = 0; i < order.size(); ++i)
+      queues_[i % num_workers_].items_.push_back(order[i]);
+
+    pthread_mutex_lock(&mutex_);
+    task_ = &task;
+    busy_ = num_workers_ - 1;
+    ++generation_;
+    pthread_cond_broadcast(&start_cond_);
+    pthread_mutex_unlock(&mutex_);
+
+    work(0);
+
+    pthread_mutex_lock(&mutex_);
+    while (busy_ > 0)
+      pthread_cond_wait(&done_cond_, &mutex_);
+    task_ = NULL;
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  // Runs 'task' for indices 0 .. count - 1, in that order.
+  void run(WorkTask& task, size_t count)
+  {
+    std::vector<size_t> order(count);
+    for (size_t i = 0; i < count; ++i)
+      order[i] = i;
+    run(task, order);
+  }
+
+private:
+  // Non-copyable.
+  WorkPool(const WorkPool&);
+  WorkPool& operator=(const WorkPool&);
+
+  struct Queue
+  {
+    pthread_mutex_t mutex_;
+    std::deque<size_t> items_;
+  };
+  struct ThreadArg
+  {
+    WorkPool* pool_;
+    unsigned worker_;
+  };
+
+  static void* thread_main(void* arg)
+  {
+    ThreadArg* thread_arg = (ThreadArg*)arg;
+    WorkPool* pool = thread_arg->pool_;
+    unsigned long seen = 0;
+    while (true)
+    {
+      pthread_mutex_lock(&pool->mutex_);
+      while (!pool->shutdown_ && pool->generation_ == seen)
+        pthread_cond_wait(&pool->start_cond_, &pool->mutex_);
+      if (pool->shutdown_)
+      {
+        pthread_mutex_unlock(&pool->mutex_);
+        return NULL;
+      }
+      seen = pool->generation_;
+      pthread_mutex_unlock(&pool->mutex_);
+
+      pool->work(thread_arg->worker_);
+
+      pthread_mutex_lock(&pool->mutex_);
+      if (--pool->busy_ == 0)
+        pthread_cond_signal(&pool->done_cond_);
+      pthread_mutex_unlock(&pool->mutex_);
+    }
+  }
+
+  void work(unsigned worker)
+  {
+    size_t index;
+    while (take(worker, index))
+      task_->run(index, worker);
+  }
+
+  // Takes the next index for 'worker': first from the front of its own
+  // deque, then by stealing from the back of the others.  Returns false once
+  // every deque is empty; no work is added while a run is in progress, so
+  // that means we are done.
+  bool take(unsigned worker, size_t& index)
+  {
+    if (pop(queues_[worker], true, index))
+      return true;
+    for (unsigned i = 1; i < num_workers_; ++i)
+    {
+      if (pop(queues_[(worker + i) % num_workers_], false, index))
+        return true;
+    }
+    return false;
+  }
+
+  static bool pop(Queue& queue, bool front, size_t& index)
+  {
+    bool found = false;
+    pthread_mutex_lock(&queue.mutex_);
+    if (!queue.items_.empty())
+    {
+      found = true;
+      if (front)
+      {
+        index = queue.items_.front();
+        queue.items_.pop_front();
+      }
+      else
+      {
+        index = queue.items_.back();
+        queue.items_.pop_back();
+      }
+    }
+    pthread_mutex_unlock(&queue.mutex_);
+    return found;
+  }
+
+  unsigned num_workers_;
+  std::vector<Queue> queues_;
+  std::vector<ThreadArg> thread_args_;
+  std::vector<pthread_t> threads_;
+
+  // Guards the fields below; workers wait on 'start_cond_' for a new
+  // generation, and 'run' waits on 'done_cond_' for 'busy_' to hit zero.
+  pthread_mutex_t mutex_;
+  pthread_cond_t start_cond_;
+  pthread_cond_t done_cond_;
+  WorkTask* task_;
+  unsigned long generation_;
+  unsigned busy_;
+  bool shutdown_;
+};
+
+}
+
+#endif